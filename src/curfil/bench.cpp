@@ -0,0 +1,678 @@
+#include "bench.h"
+
+#include <algorithm>
+#include <cassert>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/random.hpp>
+#include <cmath>
+#include <cuda_runtime_api.h>
+#include <set>
+#include <stdexcept>
+#include <unistd.h>
+
+#include "export.h"
+#include "import.h"
+#include "random_forest_image.h"
+#include "random_tree_image.h"
+#include "random_tree_image_gpu.h"
+#include "trace.h"
+#include "utils.h"
+#include "version.h"
+
+namespace curfil {
+namespace bench {
+
+namespace {
+
+typedef RandomTree<PixelInstance, ImageFeatureFunction> Node;
+
+typedef std::vector<std::pair<boost::shared_ptr<Node>, std::vector<const PixelInstance*> > > SamplesPerNode;
+
+const int WIDTH = 640;
+const int HEIGHT = 480;
+
+// the quick sweep takes the first value only
+size_t sweep(const Options& options, size_t numValues) {
+    return options.quick ? 1 : numValues;
+}
+
+boost::property_tree::ptree getStatistics(std::vector<double> values) {
+    boost::property_tree::ptree pt;
+    if (values.empty()) {
+        return pt;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    double sum = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        sum += values[i];
+    }
+    const double mean = sum / values.size();
+
+    double squaredDeviations = 0;
+    for (size_t i = 0; i < values.size(); i++) {
+        squaredDeviations += (values[i] - mean) * (values[i] - mean);
+    }
+
+    const size_t middle = values.size() / 2;
+    const double median = (values.size() % 2 == 1) ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+
+    pt.put("mean", mean);
+    pt.put("median", median);
+    pt.put("min", values.front());
+    pt.put("max", values.back());
+    pt.put("stddev", std::sqrt(squaredDeviations / values.size()));
+    return pt;
+}
+
+/**
+ * Rectangles of random size and label on a background of label 0. Every label has its own color and depth
+ * with some noise, such that the trees can learn them.
+ */
+std::vector<LabeledRGBDImage> createImages(size_t numImages, int width, int height, LabelType numLabels, int seed) {
+
+    boost::mt19937 rng(seed);
+    boost::uniform_int<int> noise(-10, 10);
+
+    // the labels need colors for the subsampling, the ignored labels and the export
+    std::vector<RGBColor> palette;
+    for (int label = 0; label < numLabels; label++) {
+        palette.push_back(RGBColor(label, 255 - label, (label * 37) % 256));
+    }
+    const std::vector<LabelType> labelIds = LabelImage::encodeColors(palette);
+
+    std::vector<LabeledRGBDImage> images;
+    for (size_t imageNr = 0; imageNr < numImages; imageNr++) {
+        std::vector<LabelType> labels(width * height, 0);
+        for (int rectangle = 0; rectangle < 10; rectangle++) {
+            const int x = boost::uniform_int<int>(0, width - 1)(rng);
+            const int y = boost::uniform_int<int>(0, height - 1)(rng);
+            const int w = boost::uniform_int<int>(width / 10, width / 2)(rng);
+            const int h = boost::uniform_int<int>(height / 10, height / 2)(rng);
+            const LabelType label = boost::uniform_int<int>(0, numLabels - 1)(rng);
+            for (int py = y; py < std::min(y + h, height); py++) {
+                for (int px = x; px < std::min(x + w, width); px++) {
+                    labels[py * width + px] = label;
+                }
+            }
+        }
+
+        std::vector<uint8_t> colors(3 * width * height);
+        std::vector<uint16_t> depths(width * height);
+        boost::shared_ptr<LabelImage> labelImage = boost::make_shared<LabelImage>(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                const LabelType label = labels[y * width + x];
+                for (int c = 0; c < 3; c++) {
+                    const int color = (label * (37 + 61 * c) + 50 * c) % 200 + 28 + noise(rng);
+                    colors[3 * (y * width + x) + c] = static_cast<uint8_t>(color);
+                }
+                depths[y * width + x] = static_cast<uint16_t>(1000 + 250 * (label % 8) + 5 * noise(rng));
+                labelImage->setLabel(x, y, labelIds[label]);
+            }
+        }
+
+        const boost::shared_ptr<RGBDImage> rgbdImage = boost::make_shared<RGBDImage>(width, height, &colors[0],
+                &depths[0]);
+        images.push_back(LabeledRGBDImage(rgbdImage, labelImage));
+    }
+
+    return images;
+}
+
+std::vector<PixelInstance> createSamples(const std::vector<LabeledRGBDImage>& images, size_t numSamples, int seed) {
+
+    boost::mt19937 rng(seed);
+
+    std::vector<PixelInstance> samples;
+    samples.reserve(numSamples);
+    for (size_t sampleNr = 0; sampleNr < numSamples; sampleNr++) {
+        const LabeledRGBDImage& image = images[sampleNr % images.size()];
+        const int x = boost::uniform_int<int>(0, image.getWidth() - 1)(rng);
+        const int y = boost::uniform_int<int>(0, image.getHeight() - 1)(rng);
+        // the depth is taken from the integral image, as in the training
+        samples.push_back(PixelInstance(&image.getRGBDImage(), image.getLabelImage().getLabel(x, y), x, y));
+        assert(samples.back().getDepth().isValid());
+    }
+    return samples;
+}
+
+std::vector<const PixelInstance*> getPointers(const std::vector<PixelInstance>& samples) {
+    std::vector<const PixelInstance*> pointers(samples.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        pointers[i] = &samples[i];
+    }
+    return pointers;
+}
+
+TrainingConfiguration createConfiguration(const Options& options, unsigned int samplesPerImage,
+        unsigned int featureCount, uint16_t thresholds, int maxDepth, int imageCacheSize,
+        unsigned int maxSamplesPerBatch, AccelerationMode accelerationMode) {
+    const unsigned int minSampleCount = 32;
+    const uint16_t boxRadius = 127;
+    const uint16_t regionSize = 16;
+    const int maxImages = 0;
+    return TrainingConfiguration(options.seed, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, options.numThreads, maxImages, imageCacheSize, maxSamplesPerBatch,
+            accelerationMode, true, false, std::vector<int>(1, options.deviceId));
+}
+
+boost::shared_ptr<RandomForestImage> trainForest(const Options& options, const std::vector<LabeledRGBDImage>& images,
+        size_t trees, int maxDepth) {
+    const TrainingConfiguration configuration = createConfiguration(options, 2000, 500, 20, maxDepth, images.size(),
+            50000, GPU_ONLY);
+    boost::shared_ptr<RandomForestImage> forest = boost::make_shared<RandomForestImage>(trees, configuration);
+    forest->train(images);
+    return forest;
+}
+
+void noSetup() {
+}
+
+/**
+ * Runs 'setup' and 'run' once to warm up and then for every repetition. Only 'run' and the GPU work it queued
+ * are measured.
+ * The trace spans are assigned to the repetition in which they began.
+ */
+template<class Setup, class Run>
+void measure(const Options& options, Result& result, Setup setup, Run run) {
+
+    setup();
+    run();
+    cudaSafeCall(cudaDeviceSynchronize());
+
+    std::vector<std::pair<int64_t, int64_t> > repetitions;
+    std::vector<double> wallTimes;
+
+    trace::enable();
+    for (size_t repetition = 0; repetition < options.repetitions; repetition++) {
+        setup();
+        const int64_t begin = trace::now();
+        utils::Timer timer;
+        run();
+        cudaSafeCall(cudaDeviceSynchronize());
+        wallTimes.push_back(timer.getMilliseconds());
+        repetitions.push_back(std::make_pair(begin, trace::now()));
+    }
+    trace::disable();
+
+    const std::vector<trace::Event> events = trace::collect();
+    for (size_t repetition = 0; repetition < repetitions.size(); repetition++) {
+        std::map<std::string, int64_t> spans;
+        for (size_t i = 0; i < events.size(); i++) {
+            const trace::Event& event = events[i];
+            if (event.begin >= repetitions[repetition].first && event.begin < repetitions[repetition].second) {
+                spans[event.name] += event.end - event.begin;
+            }
+        }
+        result.addRepetition(wallTimes[repetition], spans);
+    }
+    result.setDroppedTraceEvents(trace::getNumDroppedEvents());
+}
+
+template<class Run>
+void measure(const Options& options, Result& result, Run run) {
+    measure(options, result, noSetup, run);
+}
+
+// generateRandomFeaturesKernel
+void benchmarkGenerateRandomFeatures(const Options& options, std::vector<Result>& results) {
+    const unsigned int featureCounts[] = { 500, 2000, 8000 };
+    const uint16_t thresholdCounts[] = { 10, 50 };
+    const size_t numSamples = 10000;
+    const LabelType numLabels = 10;
+
+    const std::vector<LabeledRGBDImage> images = createImages(10, WIDTH, HEIGHT, numLabels, options.seed);
+    const std::vector<PixelInstance> samples = createSamples(images, numSamples, options.seed);
+
+    for (size_t f = 0; f < sweep(options, 3); f++) {
+        const unsigned int featureCount = featureCounts[f];
+        for (size_t t = 0; t < sweep(options, 2); t++) {
+            const uint16_t thresholds = thresholdCounts[t];
+            const TrainingConfiguration configuration = createConfiguration(options, 0, featureCount, thresholds,
+                    15, images.size(), numSamples, GPU_ONLY);
+            ImageFeatureEvaluation evaluation(0, configuration);
+            Node node(0, 1, getPointers(samples), numLabels);
+            const std::vector<std::vector<const PixelInstance*> > batches = evaluation.prepare(getPointers(samples),
+                    node, cuv::dev_memory_space(), false);
+
+            Result result("generateRandomFeatures");
+            result.setParameter("features", featureCount);
+            result.setParameter("thresholds", thresholds);
+            result.setParameter("samples", numSamples);
+            measure(options, result, [&]() {
+                evaluation.generateRandomFeatures(batches[0], options.seed, true, cuv::dev_memory_space());
+            });
+            results.push_back(result);
+        }
+    }
+}
+
+// featureResponseKernel and aggregateHistogramsKernel, or featureResponseHistogramsKernel if fused.
+// scoreKernel on the resulting histograms
+void benchmarkHistograms(const Options& options, std::vector<Result>& results, bool scores) {
+    const unsigned int featureCounts[] = { 500, 2000 };
+    const uint16_t thresholdCounts[] = { 10, 50 };
+    const LabelType labelCounts[] = { 10, 3, 30 };
+    const size_t batchSizes[] = { 5000, 20000 };
+    const bool fusedModes[] = { true, false };
+    const bool precisions[] = { false, true };
+
+    for (size_t l = 0; l < sweep(options, 3); l++) {
+        const LabelType numLabels = labelCounts[l];
+        const std::vector<LabeledRGBDImage> images = createImages(10, WIDTH, HEIGHT, numLabels, options.seed);
+
+        for (size_t b = 0; b < sweep(options, 2); b++) {
+            const size_t batchSize = batchSizes[b];
+            const std::vector<PixelInstance> samples = createSamples(images, batchSize, options.seed);
+
+            for (size_t f = 0; f < sweep(options, 2); f++) {
+                const unsigned int featureCount = featureCounts[f];
+                for (size_t t = 0; t < sweep(options, 2); t++) {
+                    const uint16_t thresholds = thresholdCounts[t];
+                    for (size_t u = 0; u < sweep(options, 2); u++) {
+                        const bool fused = fusedModes[u];
+                        for (size_t p = 0; p < sweep(options, 2); p++) {
+                            const bool singlePrecision = precisions[p];
+                            if (scores && (!fused || singlePrecision)) {
+                                // the scores do not depend on how the histograms were calculated
+                                continue;
+                            }
+
+                            // the compare mode calculates the histograms with the separate kernels
+                            TrainingConfiguration configuration = createConfiguration(options, 0, featureCount,
+                                    thresholds, 15, images.size(), batchSize,
+                                    fused ? GPU_ONLY : GPU_AND_CPU_COMPARE);
+                            configuration.setSinglePrecisionFeatures(singlePrecision);
+
+                            ImageFeatureEvaluation evaluation(0, configuration);
+                            Node node(0, 1, getPointers(samples), numLabels);
+                            const std::vector<std::vector<const PixelInstance*> > batches = evaluation.prepare(
+                                    getPointers(samples), node, cuv::dev_memory_space(), false);
+                            const ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+                                    evaluation.generateRandomFeatures(batches[0], options.seed, true,
+                                            cuv::dev_memory_space());
+
+                            Result result(scores ? "scores" : "featureResponses");
+                            result.setParameter("features", featureCount);
+                            result.setParameter("thresholds", thresholds);
+                            result.setParameter("labels", static_cast<int>(numLabels));
+                            result.setParameter("batchSize", batchSize);
+                            if (!scores) {
+                                result.setParameter("fused", fused);
+                                result.setParameter("singlePrecision", singlePrecision);
+                                measure(options, result, [&]() {
+                                    evaluation.calculateFeatureResponsesAndHistograms(node, batches,
+                                            featuresAndThresholds);
+                                });
+                            } else {
+                                const cuv::ndarray<WeightType, cuv::dev_memory_space> counters =
+                                        evaluation.calculateFeatureResponsesAndHistograms(node, batches,
+                                                featuresAndThresholds);
+                                const cuv::ndarray<WeightType, cuv::dev_memory_space> histogram =
+                                        node.getHistogram();
+                                measure(options, result, [&]() {
+                                    evaluation.calculateScores(counters, featuresAndThresholds, histogram);
+                                });
+                            }
+                            results.push_back(result);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+void benchmarkFeatureResponses(const Options& options, std::vector<Result>& results) {
+    benchmarkHistograms(options, results, false);
+}
+
+void benchmarkScores(const Options& options, std::vector<Result>& results) {
+    benchmarkHistograms(options, results, true);
+}
+
+// FeatureEvaluationCPU, see the span 'feature evaluation CPU'
+void benchmarkFeatureEvaluationCPU(const Options& options, std::vector<Result>& results) {
+    const unsigned int featureCounts[] = { 100, 500 };
+    const uint16_t thresholdCounts[] = { 10, 50 };
+    const LabelType labelCounts[] = { 10, 3 };
+    const size_t sampleCounts[] = { 2000, 10000 };
+
+    for (size_t l = 0; l < sweep(options, 2); l++) {
+        const LabelType numLabels = labelCounts[l];
+        const std::vector<LabeledRGBDImage> images = createImages(10, WIDTH, HEIGHT, numLabels, options.seed);
+
+        for (size_t s = 0; s < sweep(options, 2); s++) {
+            const size_t numSamples = sampleCounts[s];
+            const std::vector<PixelInstance> samples = createSamples(images, numSamples, options.seed);
+
+            for (size_t f = 0; f < sweep(options, 2); f++) {
+                const unsigned int featureCount = featureCounts[f];
+                for (size_t t = 0; t < sweep(options, 2); t++) {
+                    const uint16_t thresholds = thresholdCounts[t];
+                    const TrainingConfiguration configuration = createConfiguration(options, 0, featureCount,
+                            thresholds, 15, images.size(), numSamples, CPU_ONLY);
+                    ImageFeatureEvaluation evaluation(0, configuration);
+
+                    SamplesPerNode samplesPerNode(1, std::make_pair(
+                            boost::make_shared<Node>(0, 1, getPointers(samples), numLabels), getPointers(samples)));
+
+                    Result result("featureEvaluationCPU");
+                    result.setParameter("features", featureCount);
+                    result.setParameter("thresholds", thresholds);
+                    result.setParameter("labels", static_cast<int>(numLabels));
+                    result.setParameter("samples", numSamples);
+                    result.setParameter("threads", options.numThreads);
+                    measure(options, result, [&]() {
+                        RandomSource randomSource(options.seed);
+                        evaluation.evaluateBestSplits(randomSource, samplesPerNode);
+                    });
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+}
+
+// the transfer of the images to the image cache on the device
+void benchmarkImageTransfer(const Options& options, std::vector<Result>& results) {
+    const int widths[] = { 640, 320 };
+    const size_t imageCounts[] = { 10, 50 };
+
+    for (size_t w = 0; w < sweep(options, 2); w++) {
+        const int width = widths[w];
+        const int height = width * 3 / 4;
+        for (size_t n = 0; n < sweep(options, 2); n++) {
+            const size_t numImages = imageCounts[n];
+            const std::vector<LabeledRGBDImage> images = createImages(numImages, width, height, 2, options.seed);
+
+            std::set<const RGBDImage*> imageSet;
+            for (size_t i = 0; i < images.size(); i++) {
+                imageSet.insert(&images[i].getRGBDImage());
+            }
+
+            ImageCache& imageCache = DeviceContext::getCurrent().getImageCache();
+
+            Result result("imageTransfer");
+            result.setParameter("width", width);
+            result.setParameter("height", height);
+            result.setParameter("images", numImages);
+            result.setParameter("bytes", numImages * images[0].getRGBDImage().getSizeInMemory());
+            measure(options, result, clearImageCache, [&]() {
+                imageCache.copyImages(numImages, imageSet);
+                cudaSafeCall(cudaDeviceSynchronize());
+            });
+            results.push_back(result);
+
+            clearImageCache();
+        }
+    }
+}
+
+// classifyKernel with a single tree
+void benchmarkClassifyKernel(const Options& options, std::vector<Result>& results) {
+    const int depths[] = { 10, 15, 20 };
+    const bool precisions[] = { false, true };
+    const LabelType numLabels = 10;
+
+    const std::vector<LabeledRGBDImage> images = createImages(10, WIDTH, HEIGHT, numLabels, options.seed);
+
+    for (size_t d = 0; d < sweep(options, 3); d++) {
+        const int depth = depths[d];
+        const boost::shared_ptr<RandomForestImage> forest = trainForest(options, images, 1, depth);
+        const boost::shared_ptr<const TreeNodes> treeData = convertTree(forest->getTree(0));
+
+        for (size_t p = 0; p < sweep(options, 2); p++) {
+            const bool singlePrecision = precisions[p];
+            cuv::ndarray<float, cuv::dev_memory_space> output(forest->getNumClasses(), HEIGHT, WIDTH);
+
+            Result result("classifyKernel");
+            result.setParameter("depth", depth);
+            result.setParameter("nodes", forest->getTree(0)->getTree()->countNodes());
+            result.setParameter("width", WIDTH);
+            result.setParameter("height", HEIGHT);
+            result.setParameter("singlePrecision", singlePrecision);
+            measure(options, result, [&]() {
+                classifyImage(1, output, images[0].getRGBDImage(), forest->getNumClasses(), treeData,
+                        singlePrecision);
+            });
+            results.push_back(result);
+        }
+    }
+}
+
+// RandomTreeImport::readJSON()
+void benchmarkReadJSON(const Options& options, std::vector<Result>& results) {
+    const int depths[] = { 10, 15, 20 };
+
+    const std::vector<LabeledRGBDImage> images = createImages(10, WIDTH, HEIGHT, 10, options.seed);
+
+    const boost::filesystem::path folder = boost::filesystem::temp_directory_path()
+            / boost::filesystem::unique_path("curfil_bench_%%%%-%%%%-%%%%-%%%%");
+    boost::filesystem::create_directories(folder);
+
+    try {
+        for (size_t d = 0; d < sweep(options, 3); d++) {
+            const int depth = depths[d];
+            const boost::shared_ptr<RandomForestImage> forest = trainForest(options, images, 1, depth);
+
+            RandomTreeExport treeExport(forest->getConfiguration(), folder.string(), "", false);
+            treeExport.writeJSON(*forest->getTree(0), 0);
+            const std::string filename = (folder / "tree0.json.gz").string();
+
+            Result result("readJSON");
+            result.setParameter("depth", depth);
+            result.setParameter("nodes", forest->getTree(0)->getTree()->countNodes());
+            result.setParameter("bytes", boost::filesystem::file_size(filename));
+            measure(options, result, [&]() {
+                boost::shared_ptr<RandomTreeImage> tree;
+                std::string hostname;
+                boost::filesystem::path trainingFolder;
+                boost::posix_time::ptime date;
+                RandomTreeImport::readJSON(filename, tree, hostname, trainingFolder, date);
+            });
+            results.push_back(result);
+        }
+    } catch (...) {
+        boost::filesystem::remove_all(folder);
+        throw;
+    }
+    boost::filesystem::remove_all(folder);
+}
+
+// end-to-end training of a forest
+void benchmarkTrain(const Options& options, std::vector<Result>& results) {
+    const char* modes[] = { "gpu", "cpu", "hybrid" };
+    const size_t treeCounts[] = { 1, 3 };
+    const unsigned int samplesPerImageCounts[] = { 1000, 5000 };
+    const int maxDepth = 15;
+
+    const std::vector<LabeledRGBDImage> images = createImages(20, WIDTH, HEIGHT, 10, options.seed);
+
+    for (size_t m = 0; m < sweep(options, 3); m++) {
+        const char* mode = modes[m];
+        for (size_t t = 0; t < sweep(options, 2); t++) {
+            const size_t trees = treeCounts[t];
+            for (size_t s = 0; s < sweep(options, 2); s++) {
+                const unsigned int samplesPerImage = samplesPerImageCounts[s];
+                const TrainingConfiguration configuration = createConfiguration(options, samplesPerImage, 500, 20,
+                        maxDepth, images.size(), 50000, TrainingConfiguration::parseAccelerationModeString(mode));
+
+                boost::shared_ptr<RandomForestImage> forest;
+
+                Result result("train");
+                result.setParameter("mode", mode);
+                result.setParameter("trees", trees);
+                result.setParameter("images", images.size());
+                result.setParameter("samplesPerImage", samplesPerImage);
+                result.setParameter("features", configuration.getFeatureCount());
+                result.setParameter("thresholds", configuration.getThresholds());
+                result.setParameter("maxDepth", maxDepth);
+                result.setParameter("threads", options.numThreads);
+                measure(options, result, [&]() {
+                    clearImageCache();
+                    forest = boost::make_shared<RandomForestImage>(trees, configuration);
+                }, [&]() {
+                    forest->train(images);
+                });
+                results.push_back(result);
+            }
+        }
+    }
+}
+
+// end-to-end prediction of images of the training size
+void benchmarkPredict(const Options& options, std::vector<Result>& results) {
+    const bool devices[] = { true, false };
+    const size_t treeCounts[] = { 1, 3 };
+    const size_t numImages = 10;
+
+    const std::vector<LabeledRGBDImage> images = createImages(numImages, WIDTH, HEIGHT, 10, options.seed);
+
+    for (size_t t = 0; t < sweep(options, 2); t++) {
+        const size_t trees = treeCounts[t];
+        const boost::shared_ptr<RandomForestImage> forest = trainForest(options, images, trees, 15);
+
+        for (size_t g = 0; g < sweep(options, 2); g++) {
+            const bool onGPU = devices[g];
+            Result result("predict");
+            result.setParameter("trees", trees);
+            result.setParameter("gpu", onGPU);
+            result.setParameter("images", numImages);
+            result.setParameter("width", WIDTH);
+            result.setParameter("height", HEIGHT);
+            measure(options, result, [&]() {
+                for (size_t i = 0; i < images.size(); i++) {
+                    forest->predict(images[i].getRGBDImage(), 0, onGPU);
+                }
+            });
+            results.push_back(result);
+        }
+    }
+}
+
+boost::property_tree::ptree getDeviceDescription(int deviceId) {
+    cudaDeviceProp prop;
+    cudaSafeCall(cudaGetDeviceProperties(&prop, deviceId));
+
+    boost::property_tree::ptree pt;
+    pt.put("id", deviceId);
+    pt.put("name", prop.name);
+    pt.put("computeCapability", (boost::format("%d.%d") % prop.major % prop.minor).str());
+    pt.put("memoryMB", prop.totalGlobalMem / (1024 * 1024));
+    pt.put("multiProcessors", prop.multiProcessorCount);
+    return pt;
+}
+
+}
+
+void Result::addRepetition(double wallTimeMilliseconds, const std::map<std::string, int64_t>& spanMicroseconds) {
+
+    // spans that did not occur in a repetition count as zero
+    std::map<std::string, int64_t>::const_iterator it;
+    for (it = spanMicroseconds.begin(); it != spanMicroseconds.end(); it++) {
+        spanTimes[it->first].resize(wallTimes.size(), 0.0);
+    }
+
+    std::map<std::string, std::vector<double> >::iterator span;
+    for (span = spanTimes.begin(); span != spanTimes.end(); span++) {
+        it = spanMicroseconds.find(span->first);
+        span->second.push_back(it == spanMicroseconds.end() ? 0.0 : it->second / 1000.0);
+    }
+
+    wallTimes.push_back(wallTimeMilliseconds);
+}
+
+boost::property_tree::ptree Result::toPropertyTree() const {
+    boost::property_tree::ptree pt;
+    pt.put("benchmark", benchmark);
+    pt.add_child("parameters", parameters);
+    pt.put("repetitions", wallTimes.size());
+    pt.add_child("wallTimeMilliseconds", getStatistics(wallTimes));
+
+    // keys are not parsed as paths since the names of the spans might contain dots
+    boost::property_tree::ptree spans;
+    std::map<std::string, std::vector<double> >::const_iterator it;
+    for (it = spanTimes.begin(); it != spanTimes.end(); it++) {
+        spans.push_back(std::make_pair(it->first, getStatistics(it->second)));
+    }
+    pt.add_child("spanMilliseconds", spans);
+    pt.put("droppedTraceEvents", droppedTraceEvents);
+    return pt;
+}
+
+const std::map<std::string, Benchmark>& getBenchmarks() {
+    static std::map<std::string, Benchmark> benchmarks;
+    if (benchmarks.empty()) {
+        benchmarks["generateRandomFeatures"] = benchmarkGenerateRandomFeatures;
+        benchmarks["featureResponses"] = benchmarkFeatureResponses;
+        benchmarks["scores"] = benchmarkScores;
+        benchmarks["featureEvaluationCPU"] = benchmarkFeatureEvaluationCPU;
+        benchmarks["imageTransfer"] = benchmarkImageTransfer;
+        benchmarks["classifyKernel"] = benchmarkClassifyKernel;
+        benchmarks["readJSON"] = benchmarkReadJSON;
+        benchmarks["train"] = benchmarkTrain;
+        benchmarks["predict"] = benchmarkPredict;
+    }
+    return benchmarks;
+}
+
+boost::property_tree::ptree run(const std::vector<std::string>& names, const Options& options) {
+
+    const std::map<std::string, Benchmark>& benchmarks = getBenchmarks();
+
+    std::vector<std::string> selected = names;
+    if (selected.empty()) {
+        std::map<std::string, Benchmark>::const_iterator it;
+        for (it = benchmarks.begin(); it != benchmarks.end(); it++) {
+            selected.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < selected.size(); i++) {
+        if (benchmarks.find(selected[i]) == benchmarks.end()) {
+            throw std::runtime_error(std::string("unknown benchmark: ") + selected[i]);
+        }
+    }
+
+    cudaSafeCall(cudaSetDevice(options.deviceId));
+
+    char hostname[1024];
+    hostname[1023] = '\0';
+    gethostname(hostname, 1023);
+
+    boost::property_tree::ptree pt;
+    pt.put("version", getVersion());
+    pt.put("hostname", hostname);
+    pt.put("date", boost::posix_time::to_iso_extended_string(boost::posix_time::second_clock::local_time()));
+    pt.put("options.repetitions", options.repetitions);
+    pt.put("options.quick", options.quick);
+    pt.put("options.threads", options.numThreads);
+    pt.put("options.seed", options.seed);
+    pt.add_child("gpu", getDeviceDescription(options.deviceId));
+    pt.add_child("cpu", RandomTreeExport::getProcessorModelNames());
+
+    boost::property_tree::ptree resultsTree;
+    for (size_t i = 0; i < selected.size(); i++) {
+        CURFIL_INFO("running benchmark " << selected[i]);
+        utils::Timer timer;
+
+        std::vector<Result> results;
+        benchmarks.find(selected[i])->second(options, results);
+        for (size_t r = 0; r < results.size(); r++) {
+            resultsTree.push_back(std::make_pair("", results[r].toPropertyTree()));
+        }
+
+        CURFIL_INFO("benchmark " << selected[i] << ": " << results.size() << " results in " << timer.format(2));
+    }
+    pt.add_child("results", resultsTree);
+
+    return pt;
+}
+
+}
+}
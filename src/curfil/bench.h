@@ -0,0 +1,88 @@
+#ifndef CURFIL_BENCH_H
+#define CURFIL_BENCH_H
+
+#include <boost/property_tree/ptree.hpp>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace curfil {
+
+/**
+ * Benchmarks of the kernels and of the end-to-end training and prediction on synthetic images.
+ *
+ * Every benchmark sweeps its parameters and repeats each measurement. Besides the wall time of a repetition,
+ * the spans of the kernels, transfers and host scopes that were recorded by the trace (see trace.h) are
+ * reported per repetition.
+ */
+namespace bench {
+
+struct Options {
+
+    Options() :
+            repetitions(5), quick(false), deviceId(0), numThreads(1), seed(4711) {
+    }
+
+    size_t repetitions;
+    // a single, small parameter set per benchmark
+    bool quick;
+    int deviceId;
+    int numThreads;
+    int seed;
+};
+
+class Result {
+
+public:
+
+    Result(const std::string& benchmark) :
+            benchmark(benchmark), parameters(), wallTimes(), spanTimes(), droppedTraceEvents(0) {
+    }
+
+    const std::string& getBenchmark() const {
+        return benchmark;
+    }
+
+    template<class V>
+    void setParameter(const std::string& key, const V& value) {
+        parameters.put(key, value);
+    }
+
+    /**
+     * @param spanMicroseconds the summed duration of the trace spans of the repetition per name
+     */
+    void addRepetition(double wallTimeMilliseconds, const std::map<std::string, int64_t>& spanMicroseconds);
+
+    void setDroppedTraceEvents(size_t droppedTraceEvents) {
+        this->droppedTraceEvents = droppedTraceEvents;
+    }
+
+    boost::property_tree::ptree toPropertyTree() const;
+
+private:
+    std::string benchmark;
+    boost::property_tree::ptree parameters;
+    std::vector<double> wallTimes;
+    std::map<std::string, std::vector<double> > spanTimes;
+    size_t droppedTraceEvents;
+};
+
+typedef void (*Benchmark)(const Options& options, std::vector<Result>& results);
+
+/**
+ * @return the benchmarks by name
+ */
+const std::map<std::string, Benchmark>& getBenchmarks();
+
+/**
+ * Runs the given benchmarks. All benchmarks are run if 'names' is empty.
+ *
+ * @return the results together with a description of the host and the GPU
+ */
+boost::property_tree::ptree run(const std::vector<std::string>& names, const Options& options);
+
+}
+}
+
+#endif
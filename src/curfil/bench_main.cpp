@@ -0,0 +1,90 @@
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <tbb/task_scheduler_init.h>
+
+#include "bench.h"
+#include "utils.h"
+#include "version.h"
+
+namespace po = boost::program_options;
+
+using namespace curfil;
+
+int main(int argc, char **argv) {
+
+    std::vector<std::string> benchmarks;
+    std::string outputFile;
+    bench::Options benchOptions;
+
+    po::options_description options("options");
+    options.add_options()
+    ("help", "produce help message")
+    ("version", "show version and exit")
+    ("list", "list the benchmarks and exit")
+    ("benchmark", po::value<std::vector<std::string> >(&benchmarks)->multitoken(),
+            "the benchmark(s) to run. default: all")
+    ("repetitions", po::value<size_t>(&benchOptions.repetitions)->default_value(benchOptions.repetitions),
+            "measured repetitions of every parameter set after one warm-up run")
+    ("quick", po::value<bool>(&benchOptions.quick)->implicit_value(true)->default_value(benchOptions.quick),
+            "run a single, small parameter set per benchmark")
+    ("deviceId", po::value<int>(&benchOptions.deviceId)->default_value(benchOptions.deviceId), "GPU device id")
+    ("numThreads", po::value<int>(&benchOptions.numThreads)->default_value(benchOptions.numThreads),
+            "number of threads")
+    ("randomSeed", po::value<int>(&benchOptions.seed)->default_value(benchOptions.seed),
+            "random seed of the synthetic images and the training")
+    ("output", po::value<std::string>(&outputFile)->default_value(outputFile),
+            "write the results as JSON to this file instead of stdout");
+
+    po::variables_map vm;
+    try {
+        po::store(po::command_line_parser(argc, argv).options(options).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("help")) {
+        std::cout << options << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("version")) {
+        std::cout << argv[0] << " version " << getVersion() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (vm.count("list")) {
+        const std::map<std::string, bench::Benchmark>& all = bench::getBenchmarks();
+        std::map<std::string, bench::Benchmark>::const_iterator it;
+        for (it = all.begin(); it != all.end(); it++) {
+            std::cout << it->first << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (benchOptions.repetitions == 0) {
+        std::cerr << "repetitions must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    logVersionInfo();
+
+    tbb::task_scheduler_init init(benchOptions.numThreads);
+
+    const boost::property_tree::ptree results = bench::run(benchmarks, benchOptions);
+
+    if (outputFile.empty()) {
+        boost::property_tree::write_json(std::cout, results);
+    } else {
+        std::ofstream out(outputFile.c_str());
+        if (!out) {
+            throw std::runtime_error(std::string("failed to open ") + outputFile);
+        }
+        boost::property_tree::write_json(out, results);
+        CURFIL_INFO("wrote results to " << outputFile);
+    }
+
+    return EXIT_SUCCESS;
+}
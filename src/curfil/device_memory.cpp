@@ -0,0 +1,268 @@
+#include "device_memory.h"
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <cuda_runtime_api.h>
+#include <limits>
+#include <stdexcept>
+#include <tbb/mutex.h>
+
+#include "image_dataset.h"
+#include "random_tree_image.h"
+#include "random_tree_image_gpu.h"
+#include "utils.h"
+
+namespace curfil {
+
+struct DeviceMemoryUsage::Pools {
+    tbb::mutex mutex;
+    std::map<std::string, size_t> budgets;
+    // per pool and device
+    std::map<std::string, std::map<int, size_t> > usage;
+    std::map<std::string, size_t> peaks;
+};
+
+DeviceMemoryUsage::Pools& DeviceMemoryUsage::getPools() {
+    static Pools* pools = new Pools();
+    return *pools;
+}
+
+static double toMB(size_t bytes) {
+    return bytes / 1024.0 / 1024.0;
+}
+
+DeviceMemoryUsage::Scope::Scope(const std::string& pool, size_t bytes) :
+        pool(pool), deviceId(0), bytes(0) {
+    cudaSafeCall(cudaGetDevice(&deviceId));
+    add(bytes);
+}
+
+DeviceMemoryUsage::Scope::~Scope() {
+    release(pool, deviceId, bytes);
+}
+
+void DeviceMemoryUsage::Scope::add(size_t bytes) {
+    allocate(pool, deviceId, bytes);
+    this->bytes += bytes;
+}
+
+void DeviceMemoryUsage::setBudget(const std::string& pool, size_t bytes) {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    pools.budgets[pool] = bytes;
+}
+
+size_t DeviceMemoryUsage::getBudget(const std::string& pool) {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    std::map<std::string, size_t>::const_iterator it = pools.budgets.find(pool);
+    return (it == pools.budgets.end()) ? 0 : it->second;
+}
+
+void DeviceMemoryUsage::allocate(const std::string& pool, int deviceId, size_t bytes) {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    size_t& used = pools.usage[pool][deviceId];
+    used += bytes;
+    size_t& peak = pools.peaks[pool];
+    peak = std::max(peak, used);
+}
+
+void DeviceMemoryUsage::release(const std::string& pool, int deviceId, size_t bytes) {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    // reset() might have dropped the usage of buffers that are still allocated
+    size_t& used = pools.usage[pool][deviceId];
+    used -= std::min(used, bytes);
+}
+
+std::map<std::string, size_t> DeviceMemoryUsage::getUsage() {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    std::map<std::string, size_t> maxUsage;
+    for (const auto& pool : pools.usage) {
+        size_t& used = maxUsage[pool.first];
+        for (const auto& device : pool.second) {
+            used = std::max(used, device.second);
+        }
+    }
+    return maxUsage;
+}
+
+std::map<std::string, size_t> DeviceMemoryUsage::getPeakUsage() {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    return pools.peaks;
+}
+
+std::map<std::string, size_t> DeviceMemoryUsage::getBudgets() {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    return pools.budgets;
+}
+
+void DeviceMemoryUsage::log() {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+
+    for (const auto& peak : pools.peaks) {
+        std::map<std::string, size_t>::const_iterator budget = pools.budgets.find(peak.first);
+        if (budget == pools.budgets.end()) {
+            CURFIL_INFO((boost::format("device memory of %s: peak %.1f MB") % peak.first % toMB(peak.second)).str());
+        } else if (peak.second > budget->second) {
+            CURFIL_WARNING((boost::format("device memory of %s: peak %.1f MB exceeds the budget of %.1f MB")
+                    % peak.first % toMB(peak.second) % toMB(budget->second)).str());
+        } else {
+            CURFIL_INFO((boost::format("device memory of %s: peak %.1f MB of %.1f MB")
+                    % peak.first % toMB(peak.second) % toMB(budget->second)).str());
+        }
+    }
+}
+
+void DeviceMemoryUsage::reset() {
+    Pools& pools = getPools();
+    tbb::mutex::scoped_lock lock(pools.mutex);
+    pools.budgets.clear();
+    pools.usage.clear();
+    pools.peaks.clear();
+}
+
+DeviceMemoryPlan::DeviceMemoryPlan(const ImageDataset& images, const std::vector<int>& deviceIds,
+        size_t featureCount, size_t numThresholds, size_t imageCacheSizeMB, bool singlePrecisionFeatures,
+        size_t numLabels, size_t numTrees) :
+        freeMemory(0), reservedMemory(0), imageCacheSize(0), imageCacheMemory(0), maxSamplesPerBatch(0),
+                featureResponsesMemory(0), countersMemory(0), scoresMemory(0), treeCacheMemory(0),
+                predictionMemory(0) {
+
+    if (deviceIds.empty()) {
+        throw std::runtime_error("got no device IDs");
+    }
+
+    if (images.empty()) {
+        throw std::runtime_error("got no images");
+    }
+
+    // every device holds its own image cache. use the device with the least free memory for the estimate
+    freeMemory = utils::getFreeMemoryOnGPU(deviceIds[0]);
+    for (size_t i = 1; i < deviceIds.size(); i++) {
+        freeMemory = std::min(freeMemory, utils::getFreeMemoryOnGPU(deviceIds[i]));
+    }
+
+    // kernels, the CUDA context of other threads, staging buffers and the fragmentation of the pools
+    reservedMemory = std::max(static_cast<size_t>(64lu * 1024lu * 1024lu), freeMemory / 10);
+    if (reservedMemory >= freeMemory) {
+        throw std::runtime_error((boost::format("only %.1f MB free on the GPU") % toMB(freeMemory)).str());
+    }
+    size_t availableMemory = freeMemory - reservedMemory;
+
+    // the label count is only known when the samples are drawn
+    const size_t maxLabels = (numLabels > 0) ? numLabels : std::numeric_limits<LabelType>::max() + 1lu;
+
+    if (numTrees > 0) {
+        const size_t treeSize = LAYERS_PER_TREE * NODES_PER_TREE_LAYER * TreeNodes::getNodeSize()
+                + LEAF_LAYERS_PER_TREE * NODES_PER_TREE_LAYER * maxLabels * sizeof(float);
+        treeCacheMemory = std::min(numTrees, static_cast<size_t>(MAX_FOREST_TREES)) * treeSize;
+
+        // the probabilities and labels of an image, see RandomForestImage::predict()
+        const size_t pixels = static_cast<size_t>(images.getWidth()) * images.getHeight();
+        predictionMemory = pixels * (maxLabels * sizeof(float) + sizeof(LabelType));
+    }
+
+    if (featureCount > 0) {
+        // the nodes of a level are evaluated together as long as their counters fit into the budget.
+        // a single node is always evaluated. the fewer labels, the more nodes and scores
+        const size_t countersPerLabel = sizeof(WeightType) * featureCount * numThresholds * 2;
+        const size_t scoresPerNode = sizeof(ScoreType) * featureCount * numThresholds;
+        countersMemory = std::min(LevelFeatureEvaluation::MAX_COUNTERS_MEMORY, availableMemory / 8);
+        if (numLabels > 0) {
+            countersMemory = std::max(countersMemory, countersPerLabel * numLabels);
+        }
+        const size_t minLabels = (numLabels > 0) ? numLabels : 2;
+        scoresMemory = std::max(static_cast<size_t>(1),
+                countersMemory / std::max(countersPerLabel * minLabels, 1lu)) * scoresPerNode;
+    }
+
+    const size_t fixedMemory = treeCacheMemory + predictionMemory + countersMemory + scoresMemory;
+    if (fixedMemory >= availableMemory) {
+        throw std::runtime_error((boost::format("%.1f MB for the tree cache, prediction, counters and scores exceed "
+                "the %.1f MB that are available on the GPU") % toMB(fixedMemory) % toMB(availableMemory)).str());
+    }
+    availableMemory -= fixedMemory;
+
+    const size_t imageSize = images.getImageSizeInMemory();
+
+    if (featureCount == 0) {
+        // the prediction transfers one image at a time
+        imageCacheSize = 1;
+        imageCacheMemory = imageSize;
+        if (imageCacheMemory >= availableMemory) {
+            throw std::runtime_error("not enough memory on the GPU for the image cache");
+        }
+        return;
+    }
+
+    // every buffer of the batch pipeline holds the feature responses and the samples of a batch
+    const size_t featureResponsesPerSample = (singlePrecisionFeatures ? sizeof(float) : sizeof(FeatureResponseType))
+            * featureCount;
+    const size_t sampleDataPerSample = 5 * sizeof(int);
+    const size_t sizePerSample = ImageFeatureEvaluation::NUM_BATCH_BUFFERS
+            * (featureResponsesPerSample + sampleDataPerSample);
+    const size_t datasetMemory = images.size() * imageSize;
+
+    if (imageCacheSizeMB > 0) {
+        imageCacheMemory = std::min(datasetMemory, imageCacheSizeMB * 1024lu * 1024lu);
+        if (imageCacheSizeMB * 1024lu * 1024lu >= availableMemory) {
+            throw std::runtime_error("image cache size too large");
+        }
+    } else {
+        const size_t batchMemory = std::min(availableMemory / 3, MAX_SAMPLES_PER_BATCH * sizePerSample);
+        imageCacheMemory = std::min(datasetMemory, availableMemory - batchMemory);
+    }
+
+    // the image cache holds at least one image
+    imageCacheSize = std::max(static_cast<size_t>(1), std::min(images.size(), imageCacheMemory / imageSize));
+    imageCacheMemory = imageCacheSize * imageSize;
+    if (imageCacheMemory >= availableMemory) {
+        throw std::runtime_error("not enough memory on the GPU for the image cache");
+    }
+
+    const size_t samples = (availableMemory - imageCacheMemory) / sizePerSample;
+    maxSamplesPerBatch = std::min(samples, static_cast<size_t>(MAX_SAMPLES_PER_BATCH));
+    featureResponsesMemory = maxSamplesPerBatch * sizePerSample;
+
+    if (maxSamplesPerBatch < MIN_SAMPLES_PER_BATCH) {
+        throw std::runtime_error("memory headroom on GPU too low. try to decrease image cache size manually");
+    }
+}
+
+void DeviceMemoryPlan::apply() const {
+    DeviceMemoryUsage::setBudget("imageCache", imageCacheMemory);
+    if (maxSamplesPerBatch > 0) {
+        DeviceMemoryUsage::setBudget("featureResponses", featureResponsesMemory);
+        DeviceMemoryUsage::setBudget("counters", countersMemory);
+        DeviceMemoryUsage::setBudget("scores", scoresMemory);
+    }
+    if (treeCacheMemory > 0) {
+        DeviceMemoryUsage::setBudget("treeCache", treeCacheMemory);
+        DeviceMemoryUsage::setBudget("prediction", predictionMemory);
+    }
+}
+
+std::ostream& operator<<(std::ostream& os, const DeviceMemoryPlan& plan) {
+    os << boost::format("free: %.1f MB, reserved: %.1f MB, image cache: %d images (%.1f MB), "
+            "max samples per batch: %d (%.1f MB), counters: %.1f MB, scores: %.1f MB, tree cache: %.1f MB, "
+            "prediction: %.1f MB")
+            % toMB(plan.getFreeMemory())
+            % toMB(plan.getReservedMemory())
+            % plan.getImageCacheSize()
+            % toMB(plan.getImageCacheMemory())
+            % plan.getMaxSamplesPerBatch()
+            % toMB(plan.getFeatureResponsesMemory())
+            % toMB(plan.getCountersMemory())
+            % toMB(plan.getScoresMemory())
+            % toMB(plan.getTreeCacheMemory())
+            % toMB(plan.getPredictionMemory());
+    return os;
+}
+
+}
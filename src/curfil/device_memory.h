@@ -0,0 +1,174 @@
+#ifndef CURFIL_DEVICE_MEMORY_H
+#define CURFIL_DEVICE_MEMORY_H
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace curfil {
+
+class ImageDataset;
+
+/**
+ * The budget and the peak usage of the device memory pools of the process, for example "imageCache" or "counters".
+ *
+ * The usage of a pool is the sum of its buffers that are currently allocated on a device, from all threads.
+ * The peak of a pool is the largest usage on any device.
+ * The pooled allocators keep freed memory, so the peak is also the memory the pool holds after the training.
+ */
+class DeviceMemoryUsage {
+
+public:
+
+    /**
+     * Accounts the buffers of a pool on the current device as long as the scope lives.
+     */
+    class Scope {
+
+    public:
+
+        explicit Scope(const std::string& pool, size_t bytes = 0);
+
+        ~Scope();
+
+        // a further buffer of the pool
+        void add(size_t bytes);
+
+        size_t getBytes() const {
+            return bytes;
+        }
+
+    private:
+
+        Scope(const Scope& other);
+        Scope& operator=(const Scope& other);
+
+        const std::string pool;
+        int deviceId;
+        size_t bytes;
+    };
+
+    static void setBudget(const std::string& pool, size_t bytes);
+
+    // 0 if the pool has no budget
+    static size_t getBudget(const std::string& pool);
+
+    /**
+     * Adds 'bytes' to the usage of the pool on the device. Must be followed by release() when the buffer is freed.
+     */
+    static void allocate(const std::string& pool, int deviceId, size_t bytes);
+
+    static void release(const std::string& pool, int deviceId, size_t bytes);
+
+    static std::map<std::string, size_t> getBudgets();
+
+    // the usage of every pool on the device with the largest usage
+    static std::map<std::string, size_t> getUsage();
+
+    static std::map<std::string, size_t> getPeakUsage();
+
+    // logs the peak usage per pool and warns about pools that exceeded their budget
+    static void log();
+
+    static void reset();
+
+private:
+
+    struct Pools;
+
+    // never destroyed, such that the caches of the device contexts can release their memory at exit
+    static Pools& getPools();
+};
+
+/**
+ * Divides the free memory of the devices between the buffers of the training and the prediction.
+ *
+ * A reserve for the CUDA context and the fragmentation of the pools is kept free. The tree cache and the buffers of
+ * a predicted image, and the histogram counters and scores of the nodes that are evaluated together get their
+ * share first. The rest is divided between
+ * the image cache and the feature response buffers of the batches. Unless the size of the image cache is given,
+ * it holds as many images as fit next to the batch buffers of a third of the rest, up to the whole dataset.
+ * The batches then get all the remaining memory.
+ */
+class DeviceMemoryPlan {
+
+public:
+
+    static const unsigned int MAX_SAMPLES_PER_BATCH = 50000;
+    static const unsigned int MIN_SAMPLES_PER_BATCH = 1000;
+
+    /**
+     * @param deviceIds the plan fits the device with the least free memory
+     * @param featureCount 0 if the plan is only for the prediction. the image cache then holds a single image
+     * @param imageCacheSizeMB 0 for automatic adjustment
+     * @param numLabels 0 if not known yet, for example before the training images are loaded
+     * @param numTrees the number of trees that are kept in the tree cache for the prediction. 0 for no prediction
+     * @throws std::runtime_error if the buffers do not fit into the device memory
+     */
+    DeviceMemoryPlan(const ImageDataset& images, const std::vector<int>& deviceIds, size_t featureCount,
+            size_t numThresholds, size_t imageCacheSizeMB = 0, bool singlePrecisionFeatures = false,
+            size_t numLabels = 0, size_t numTrees = 0);
+
+    // sets the budgets of the pools, see DeviceMemoryUsage
+    void apply() const;
+
+    size_t getFreeMemory() const {
+        return freeMemory;
+    }
+
+    size_t getReservedMemory() const {
+        return reservedMemory;
+    }
+
+    unsigned int getImageCacheSize() const {
+        return imageCacheSize;
+    }
+
+    size_t getImageCacheMemory() const {
+        return imageCacheMemory;
+    }
+
+    unsigned int getMaxSamplesPerBatch() const {
+        return maxSamplesPerBatch;
+    }
+
+    size_t getFeatureResponsesMemory() const {
+        return featureResponsesMemory;
+    }
+
+    size_t getCountersMemory() const {
+        return countersMemory;
+    }
+
+    size_t getScoresMemory() const {
+        return scoresMemory;
+    }
+
+    size_t getTreeCacheMemory() const {
+        return treeCacheMemory;
+    }
+
+    size_t getPredictionMemory() const {
+        return predictionMemory;
+    }
+
+private:
+
+    size_t freeMemory;
+    size_t reservedMemory;
+    unsigned int imageCacheSize;
+    size_t imageCacheMemory;
+    unsigned int maxSamplesPerBatch;
+    size_t featureResponsesMemory;
+    size_t countersMemory;
+    size_t scoresMemory;
+    size_t treeCacheMemory;
+    size_t predictionMemory;
+};
+
+std::ostream& operator<<(std::ostream& os, const DeviceMemoryPlan& plan);
+
+}
+
+#endif
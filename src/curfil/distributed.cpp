@@ -0,0 +1,212 @@
+#include "distributed.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <signal.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace curfil {
+
+static const char JOB_FILENAME[] = "job.json";
+
+TreeQueue::TreeQueue(const std::string& folder, size_t numTrees) :
+        folder(folder), numTrees(numTrees) {
+    if (folder.empty()) {
+        throw std::runtime_error("no folder for the distributed training");
+    }
+    if (numTrees == 0) {
+        throw std::runtime_error("cannot train empty forest");
+    }
+    boost::filesystem::create_directories(folder);
+}
+
+std::string TreeQueue::getOwner() {
+    char hostname[1024];
+    hostname[1023] = '\0';
+    gethostname(hostname, 1023);
+    return (boost::format("%s:%d") % hostname % getpid()).str();
+}
+
+std::string TreeQueue::readFile(const std::string& filename) {
+    std::ifstream istream(filename.c_str());
+    std::ostringstream content;
+    content << istream.rdbuf();
+    return content.str();
+}
+
+void TreeQueue::join(const boost::property_tree::ptree& job) const {
+
+    std::ostringstream description;
+    boost::property_tree::write_json(description, job);
+
+    const std::string jobFile = folder + "/" + JOB_FILENAME;
+    const std::string temporaryFilename = (boost::format("%s.%s.tmp") % jobFile % getOwner()).str();
+
+    {
+        std::ofstream ostream(temporaryFilename.c_str());
+        ostream << description.str();
+        ostream.flush();
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to write ") + temporaryFilename);
+        }
+    }
+
+    // in contrast to rename, link does not replace the job description of another process
+    const bool created = (link(temporaryFilename.c_str(), jobFile.c_str()) == 0);
+    const int error = errno;
+    unlink(temporaryFilename.c_str());
+
+    if (created) {
+        CURFIL_INFO("started distributed training of " << numTrees << " trees in " << folder);
+        return;
+    }
+
+    if (error != EEXIST) {
+        throw std::runtime_error((boost::format("failed to create %s: %s") % jobFile % strerror(error)).str());
+    }
+
+    if (readFile(jobFile) != description.str()) {
+        CURFIL_ERROR("job description in " << jobFile << ":\n" << readFile(jobFile));
+        CURFIL_ERROR("job description of this process:\n" << description.str());
+        throw std::runtime_error(std::string("the forest in ") + folder + " is trained with different parameters");
+    }
+
+    CURFIL_INFO("joined distributed training of " << numTrees << " trees in " << folder);
+}
+
+std::string TreeQueue::getTreeFile(size_t treeId) const {
+    return (boost::format("%s/tree%d.json.gz") % folder % treeId).str();
+}
+
+std::vector<std::string> TreeQueue::getTreeFiles() const {
+    std::vector<std::string> treeFiles;
+    for (size_t treeId = 0; treeId < numTrees; treeId++) {
+        treeFiles.push_back(boost::filesystem::path(getTreeFile(treeId)).filename().string());
+    }
+    return treeFiles;
+}
+
+std::string TreeQueue::getLockFile(size_t treeId) const {
+    return (boost::format("%s/tree%d.lock") % folder % treeId).str();
+}
+
+bool TreeQueue::claim(size_t& treeId) const {
+
+    for (size_t id = 0; id < numTrees; id++) {
+        if (boost::filesystem::exists(getTreeFile(id)) || !lock(id)) {
+            continue;
+        }
+
+        // the tree might have been written and released by another process after the first check
+        if (boost::filesystem::exists(getTreeFile(id))) {
+            release(id);
+            continue;
+        }
+
+        CURFIL_INFO("claimed tree " << id << " of " << numTrees);
+        treeId = id;
+        return true;
+    }
+
+    return false;
+}
+
+bool TreeQueue::lock(size_t treeId) const {
+
+    const std::string lockFile = getLockFile(treeId);
+
+    // a second attempt after a stale lock was removed
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const int fd = open(lockFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            const std::string owner = getOwner();
+            const bool written = (write(fd, owner.c_str(), owner.size()) == static_cast<ssize_t>(owner.size()));
+            close(fd);
+            if (!written) {
+                unlink(lockFile.c_str());
+                throw std::runtime_error(std::string("failed to write ") + lockFile);
+            }
+            return true;
+        }
+
+        if (errno != EEXIST) {
+            throw std::runtime_error((boost::format("failed to create %s: %s") % lockFile % strerror(errno)).str());
+        }
+
+        if (!removeStaleLock(lockFile)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+bool TreeQueue::removeStaleLock(const std::string& lockFile) const {
+
+    const std::string owner = readFile(lockFile);
+
+    // the owner is written right after the lock was created
+    const size_t separator = owner.rfind(':');
+    if (separator == std::string::npos) {
+        return false;
+    }
+
+    const std::string thisOwner = getOwner();
+    if (owner.substr(0, separator) != thisOwner.substr(0, thisOwner.rfind(':'))) {
+        return false;
+    }
+
+    const pid_t pid = boost::lexical_cast<pid_t>(owner.substr(separator + 1));
+    if (kill(pid, 0) == 0 || errno != ESRCH) {
+        return false;
+    }
+
+    // only one process succeeds to rename the stale lock
+    const std::string staleFile = (boost::format("%s.%s.stale") % lockFile % thisOwner).str();
+    if (rename(lockFile.c_str(), staleFile.c_str()) != 0) {
+        return errno == ENOENT;
+    }
+
+    if (readFile(staleFile) != owner) {
+        // another process took over the stale lock before. restore its lock
+        if (link(staleFile.c_str(), lockFile.c_str()) != 0) {
+            CURFIL_WARNING("failed to restore lock " << lockFile << ": " << strerror(errno));
+        }
+        unlink(staleFile.c_str());
+        return false;
+    }
+
+    unlink(staleFile.c_str());
+
+    CURFIL_WARNING("removed stale lock " << lockFile << " of " << owner);
+    return true;
+}
+
+void TreeQueue::release(size_t treeId) const {
+    const std::string lockFile = getLockFile(treeId);
+    if (unlink(lockFile.c_str()) != 0) {
+        CURFIL_WARNING("failed to remove lock " << lockFile << ": " << strerror(errno));
+    }
+}
+
+bool TreeQueue::isComplete() const {
+    for (size_t treeId = 0; treeId < numTrees; treeId++) {
+        if (!boost::filesystem::exists(getTreeFile(treeId))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,87 @@
+#ifndef CURFIL_DISTRIBUTED_H
+#define CURFIL_DISTRIBUTED_H
+
+#include <boost/property_tree/ptree.hpp>
+#include <string>
+#include <vector>
+
+namespace curfil {
+
+/**
+ * Hands out the trees of a forest to the processes that train it together in a shared folder,
+ * for example on a network file system.
+ *
+ * A process claims a tree by exclusively creating the lock file 'tree<id>.lock' in the folder
+ * and removes it after it wrote the tree file 'tree<id>.json.gz' (see RandomTreeExport::writeJSON()).
+ * The lock file names the host and the process. Locks of processes on the same host that no longer run are
+ * taken over. Locks of crashed processes on other hosts must be deleted manually.
+ */
+class TreeQueue {
+
+public:
+
+    /**
+     * @param folder the shared folder which is created if it does not exist
+     * @param numTrees the number of trees of the forest
+     */
+    TreeQueue(const std::string& folder, size_t numTrees);
+
+    /**
+     * Stores the job description in the folder if it is the first process, otherwise compares it with the stored one.
+     *
+     * @param job the parameters that must be equal in all processes to yield the trees of one forest
+     * @throws std::runtime_error if the forest in the folder is trained with a different job description
+     */
+    void join(const boost::property_tree::ptree& job) const;
+
+    /**
+     * @param treeId the id of the claimed tree
+     * @return false if every tree of the forest is either written or claimed by another process
+     */
+    bool claim(size_t& treeId) const;
+
+    /**
+     * Removes the lock of the tree. The tree can be claimed again if its tree file was not written.
+     */
+    void release(size_t treeId) const;
+
+    /**
+     * @return true if the files of all trees are written
+     */
+    bool isComplete() const;
+
+    std::string getTreeFile(size_t treeId) const;
+
+    /**
+     * @return the filenames of all trees relative to the folder
+     */
+    std::vector<std::string> getTreeFiles() const;
+
+    const std::string& getFolder() const {
+        return folder;
+    }
+
+    size_t getNumTrees() const {
+        return numTrees;
+    }
+
+private:
+
+    std::string getLockFile(size_t treeId) const;
+
+    bool lock(size_t treeId) const;
+
+    // removes the lock of a process on this host that does not run anymore. true if the lock was removed
+    bool removeStaleLock(const std::string& lockFile) const;
+
+    static std::string getOwner();
+
+    static std::string readFile(const std::string& filename);
+
+    const std::string folder;
+    const size_t numTrees;
+};
+
+}
+
+#endif
@@ -7,18 +7,178 @@
 #include <boost/iostreams/device/file.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/stream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/stream_translator.hpp>
+#include <cstring>
 #include <fstream>
 #include <set>
+#include <sstream>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <vector>
 
+#include "device_memory.h"
+#include "random_tree_image_gpu.h"
 #include "version.h"
 
 namespace curfil {
 
+/**
+ * Writes compact JSON text in the format of boost::property_tree::write_json() without building the property tree in
+ * memory. As in property trees, all values are written as strings.
+ */
+class JSONStreamWriter {
+
+public:
+
+    explicit JSONStreamWriter(std::ostream& ostream) :
+            ostream(ostream), firstElement() {
+    }
+
+    void beginObject() {
+        writeSeparator();
+        begin('{');
+    }
+
+    void beginObject(const std::string& key) {
+        writeKey(key);
+        begin('{');
+    }
+
+    void endObject() {
+        end('}');
+    }
+
+    template<class V>
+    void put(const std::string& key, const V& value) {
+        // the conversion of property trees, e.g. floats are written with full precision
+        typedef typename boost::property_tree::translator_between<std::string, V>::type Translator;
+        const boost::optional<std::string> text = Translator().put_value(value);
+        if (!text) {
+            throw std::runtime_error(std::string("failed to convert the value of ") + key);
+        }
+        writeKey(key);
+        writeString(*text);
+    }
+
+    void putChild(const std::string& key, const boost::property_tree::ptree& pt) {
+        writeKey(key);
+        writeTree(pt);
+    }
+
+private:
+
+    std::ostream& ostream;
+
+    // per open object or array: true until its first element is written
+    std::vector<bool> firstElement;
+
+    void begin(char bracket) {
+        ostream.put(bracket);
+        firstElement.push_back(true);
+    }
+
+    void end(char bracket) {
+        assert(!firstElement.empty());
+        firstElement.pop_back();
+        ostream.put(bracket);
+    }
+
+    void writeSeparator() {
+        if (firstElement.empty()) {
+            return;
+        }
+        if (!firstElement.back()) {
+            ostream.put(',');
+        }
+        firstElement.back() = false;
+    }
+
+    void writeKey(const std::string& key) {
+        writeSeparator();
+        writeString(key);
+        ostream.put(':');
+    }
+
+    void writeString(const std::string& value) {
+        ostream.put('"');
+        for (const char c : value) {
+            switch (c) {
+                case '"':
+                    ostream << "\\\"";
+                    break;
+                case '\\':
+                    ostream << "\\\\";
+                    break;
+                case '\n':
+                    ostream << "\\n";
+                    break;
+                case '\r':
+                    ostream << "\\r";
+                    break;
+                case '\t':
+                    ostream << "\\t";
+                    break;
+                default:
+                    if (static_cast<unsigned char>(c) < 0x20) {
+                        ostream << boost::format("\\u%04x") % static_cast<int>(c);
+                    } else {
+                        ostream.put(c);
+                    }
+                    break;
+            }
+        }
+        ostream.put('"');
+    }
+
+    // same structure as in write_json(): leaves are strings and children with empty keys form an array
+    void writeTree(const boost::property_tree::ptree& pt) {
+        if (pt.empty()) {
+            writeString(pt.data());
+            return;
+        }
+
+        const bool isArray = (pt.count(std::string()) == pt.size());
+        begin(isArray ? '[' : '{');
+        for (const auto& child : pt) {
+            if (isArray) {
+                writeSeparator();
+            } else {
+                writeKey(child.first);
+            }
+            writeTree(child.second);
+        }
+        end(isArray ? ']' : '}');
+    }
+};
+
+namespace {
+
+// boost::iostreams device of a ParallelGzipWriter
+class ParallelGzipSink {
+
+public:
+
+    typedef char char_type;
+    typedef boost::iostreams::sink_tag category;
+
+    explicit ParallelGzipSink(utils::ParallelGzipWriter& writer) :
+            writer(&writer) {
+    }
+
+    std::streamsize write(const char* data, std::streamsize size) {
+        writer->write(data, size);
+        return size;
+    }
+
+private:
+    utils::ParallelGzipWriter* writer;
+};
+
+}
+
 RandomTreeExport::RandomTreeExport(const TrainingConfiguration& configuration, const std::string& outputFolder,
         const std::string& trainingFolder, bool verbose) :
         date(boost::posix_time::microsec_clock::local_time()), configuration(configuration),
@@ -145,7 +305,7 @@ boost::property_tree::ptree RandomTreeExport::getProcessorModelNames() {
     return processorModels;
 }
 
-void RandomTreeExport::writeTree(boost::property_tree::ptree& pt, const RandomTreeImage& tree) const {
+void RandomTreeExport::writeHeader(boost::property_tree::ptree& pt, const RandomTreeImage& tree) const {
 
     char hostname[1024];
     hostname[1023] = '\0';
@@ -161,28 +321,16 @@ void RandomTreeExport::writeTree(boost::property_tree::ptree& pt, const RandomTr
 
     pt.put("version", getVersion());
     pt.put("date", date);
-    pt.put("randomSeed", configuration.getRandomSeed());
     pt.put("folderTraining", boost::filesystem::absolute(boost::filesystem::path(trainingFolder)).string());
     pt.put("numCores", get_nprocs());
     pt.put("numPhysicalCPUs", getPhysicalCpus());
     pt.put_child("processorModels", getProcessorModelNames());
-    pt.put("accelerationMode", configuration.getAccelerationModeString());
-    pt.put_child("deviceId", toPropertyTree(configuration.getDeviceIds()));
-    pt.put("samplesPerImage", configuration.getSamplesPerImage());
-    pt.put("featureCount", configuration.getFeatureCount());
-    pt.put("thresholds", configuration.getThresholds());
-    pt.put("boxRadius", configuration.getBoxRadius());
-    pt.put("regionSize", configuration.getRegionSize());
-    pt.put("maxDepth", configuration.getMaxDepth());
-    pt.put("numThreads", configuration.getNumThreads());
-    pt.put("minSampleCount", configuration.getMinSampleCount());
-    pt.put("maxSamplesPerBatch", configuration.getMaxSamplesPerBatch());
-    pt.put("maxImages", configuration.getMaxImages());
-    pt.put("imageCacheSize", configuration.getImageCacheSize());
-    pt.put("subsamplingType", configuration.getSubsamplingType());
-    pt.put("useCIELab", configuration.isUseCIELab());
-    pt.put("useDepthFilling", configuration.isUseDepthFilling());
-    pt.put_child("ignoredColors", toPropertyTree(configuration.getIgnoredColors()));
+
+    const boost::property_tree::ptree configurationTree = getConfiguration(configuration);
+    boost::property_tree::ptree::const_iterator it;
+    for (it = configurationTree.begin(); it != configurationTree.end(); it++) {
+        pt.put_child(it->first, it->second);
+    }
 
     const cuv::ndarray<WeightType, cuv::host_memory_space>& priorDistribution = tree.getClassLabelPriorDistribution();
     for (LabelType label = 0; label < priorDistribution.size(); label++) {
@@ -190,92 +338,372 @@ void RandomTreeExport::writeTree(boost::property_tree::ptree& pt, const RandomTr
         pt.put(key, static_cast<size_t>(priorDistribution[label]));
     }
 
-    boost::property_tree::ptree ptSub;
-    writeTree(ptSub, *(tree.getTree()));
-    pt.put_child("tree", ptSub);
+    // the device memory pools of the process that trained the tree, in bytes
+    for (const auto& budget : DeviceMemoryUsage::getBudgets()) {
+        pt.put("deviceMemory." + budget.first + ".budget", budget.second);
+    }
+    for (const auto& peak : DeviceMemoryUsage::getPeakUsage()) {
+        pt.put("deviceMemory." + peak.first + ".peak", peak.second);
+    }
 }
 
-void RandomTreeExport::writeTree(boost::property_tree::ptree& pt,
+void RandomTreeExport::writeTree(JSONStreamWriter& writer,
         const RandomTree<PixelInstance, ImageFeatureFunction>& tree) const {
 
-    pt.put("id", tree.getNodeId());
-    pt.put("level", tree.getLevel());
-    pt.put("samples", tree.getNumTrainSamples());
-    pt.put("leaf", tree.isLeaf());
+    writer.put("id", tree.getNodeId());
+    writer.put("level", tree.getLevel());
+    writer.put("samples", tree.getNumTrainSamples());
+    writer.put("leaf", tree.isLeaf());
 
-    if (verbose) {
-        std::map<std::string, double>::const_iterator it;
+    if (verbose && (!tree.getTimerValues().empty() || !tree.getTimerAnnotations().empty())) {
+        writer.beginObject("timers");
         for (const auto& it : tree.getTimerValues()) {
-            pt.put(std::string("timers.") + it.first, it.second);
+            // an annotation replaces the timer value of the same name
+            if (tree.getTimerAnnotations().find(it.first) == tree.getTimerAnnotations().end()) {
+                writer.put(it.first, it.second);
+            }
         }
-
         for (const auto& it : tree.getTimerAnnotations()) {
-            pt.put(std::string("timers.") + it.first, it.second);
+            writer.put(it.first, it.second);
         }
+        writer.endObject();
     }
 
+    writer.beginObject("histogram");
     for (size_t i = 0; i < tree.getHistogram().size(); i++) {
         auto color = LabelImage::decodeLabel(i);
-        const std::string key = boost::str(
-                boost::format("histogram.%s (%d)") % color.toString() % i);
-        pt.put(key, static_cast<size_t>(tree.getHistogram()[i]));
+        const std::string key = boost::str(boost::format("%s (%d)") % color.toString() % i);
+        writer.put(key, static_cast<size_t>(tree.getHistogram()[i]));
     }
+    writer.endObject();
 
-    std::map<const RGBDImage*, size_t> countsPerImage;
-    for (const auto& sample : tree.getTrainSamples()) {
-        countsPerImage[sample.getRGBDImage()]++;
-    }
+    if (verbose && !tree.getTrainSamples().empty()) {
+        // the samples are only kept in debug mode
+        std::map<const RGBDImage*, size_t> countsPerImage;
+        for (const auto& sample : tree.getTrainSamples()) {
+            countsPerImage[sample.getRGBDImage()]++;
+        }
 
-    if (verbose) {
+        writer.beginObject("countsPerImage");
         for (const auto& c : countsPerImage) {
-            const std::string key = boost::str(boost::format("countsPerImage.%1%") % c.first);
-            pt.put(key, c.second);
+            writer.put(boost::lexical_cast<std::string>(c.first), c.second);
         }
+        writer.endObject();
     }
 
     if (!tree.isLeaf()) {
         auto split = tree.getSplit();
-        pt.put("split.threshold", split.getThreshold());
-        pt.put("split.score", split.getScore());
-        pt.put("split.featureId", split.getFeatureId());
+        writer.beginObject("split");
+        writer.put("threshold", split.getThreshold());
+        writer.put("score", split.getScore());
+        writer.put("featureId", split.getFeatureId());
 
         boost::property_tree::ptree featureTree;
         writeFeatureDetails(featureTree, split.getFeature());
-        pt.put_child("split.feature", featureTree);
+        writer.putChild("feature", featureTree);
+        writer.endObject();
     }
 
     if (tree.getLeft()) {
-        boost::property_tree::ptree childTree;
-        writeTree(childTree, *tree.getLeft());
-        pt.put_child("left", childTree);
+        writer.beginObject("left");
+        writeTree(writer, *tree.getLeft());
+        writer.endObject();
     }
     if (tree.getRight()) {
-        boost::property_tree::ptree childTree;
-        writeTree(childTree, *tree.getRight());
-        pt.put_child("right", childTree);
+        writer.beginObject("right");
+        writeTree(writer, *tree.getRight());
+        writer.endObject();
+    }
+}
+
+void RandomTreeExport::writeManifest(const std::string& filename, const std::vector<std::string>& treeFiles) {
+
+    if (treeFiles.empty()) {
+        throw std::runtime_error("cannot write manifest of empty forest");
+    }
+
+    boost::property_tree::ptree pt;
+    pt.put("manifestVersion", FOREST_MANIFEST_VERSION);
+    pt.put("version", getVersion());
+    pt.put_child("trees", toPropertyTree(treeFiles));
+
+    const std::string temporaryFilename = boost::str(boost::format("%s.%d.tmp") % filename % getpid());
+
+    {
+        std::ofstream ostream(temporaryFilename.c_str());
+        boost::property_tree::write_json(ostream, pt);
+        ostream.flush();
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to write ") + temporaryFilename);
+        }
     }
+
+    boost::filesystem::rename(temporaryFilename, filename);
+
+    CURFIL_INFO("wrote manifest of " << treeFiles.size() << " trees to " << filename);
+}
+
+boost::property_tree::ptree RandomTreeExport::getConfiguration(const TrainingConfiguration& configuration) {
+    boost::property_tree::ptree pt;
+    pt.put("randomSeed", configuration.getRandomSeed());
+    pt.put("accelerationMode", configuration.getAccelerationModeString());
+    pt.put_child("deviceId", toPropertyTree(configuration.getDeviceIds()));
+    pt.put("samplesPerImage", configuration.getSamplesPerImage());
+    pt.put("featureCount", configuration.getFeatureCount());
+    pt.put("thresholds", configuration.getThresholds());
+    pt.put("boxRadius", configuration.getBoxRadius());
+    pt.put("regionSize", configuration.getRegionSize());
+    pt.put("maxDepth", configuration.getMaxDepth());
+    pt.put("numThreads", configuration.getNumThreads());
+    pt.put("minSampleCount", configuration.getMinSampleCount());
+    pt.put("maxSamplesPerBatch", configuration.getMaxSamplesPerBatch());
+    pt.put("maxImages", configuration.getMaxImages());
+    pt.put("imageCacheSize", configuration.getImageCacheSize());
+    pt.put("subsamplingType", configuration.getSubsamplingType());
+    pt.put("useCIELab", configuration.isUseCIELab());
+    pt.put("useDepthFilling", configuration.isUseDepthFilling());
+    pt.put("singlePrecisionFeatures", configuration.isSinglePrecisionFeatures());
+    pt.put("binnedSplits", configuration.isBinnedSplits());
+    pt.put_child("ignoredColors", toPropertyTree(configuration.getIgnoredColors()));
+    return pt;
+}
+
+boost::property_tree::ptree RandomTreeExport::getCheckpointConfiguration(const TrainingConfiguration& configuration) {
+    // the maximal depth may change. a resumed training with a different depth yields the same tree as a
+    // training that was started with that depth
+    boost::property_tree::ptree pt;
+    pt.put("randomSeed", configuration.getRandomSeed());
+    pt.put("samplesPerImage", configuration.getSamplesPerImage());
+    pt.put("featureCount", configuration.getFeatureCount());
+    pt.put("minSampleCount", configuration.getMinSampleCount());
+    pt.put("boxRadius", configuration.getBoxRadius());
+    pt.put("regionSize", configuration.getRegionSize());
+    pt.put("thresholds", configuration.getThresholds());
+    pt.put("maxImages", configuration.getMaxImages());
+    pt.put("subsamplingType", configuration.getSubsamplingType());
+    pt.put("useCIELab", configuration.isUseCIELab());
+    pt.put("useDepthFilling", configuration.isUseDepthFilling());
+    // only written if set, such that checkpoints of earlier versions can still be resumed
+    if (configuration.isSinglePrecisionFeatures()) {
+        pt.put("singlePrecisionFeatures", true);
+    }
+    if (configuration.isBinnedSplits()) {
+        pt.put("binnedSplits", true);
+    }
+    pt.put_child("ignoredColors", toPropertyTree(configuration.getIgnoredColors()));
+    return pt;
+}
+
+void RandomTreeExport::writeCheckpoint(const std::string& filename,
+        const RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction>& checkpoint,
+        const TrainingConfiguration& configuration) {
+
+    boost::property_tree::ptree pt;
+
+    pt.put("version", getVersion());
+    pt.put("level", checkpoint.getLevel());
+    pt.put("idNode", checkpoint.getIdNode());
+    pt.put("randomSource", checkpoint.getRandomSeed());
+    pt.put("samples", checkpoint.getNumSamples());
+    pt.put_child("configuration", getCheckpointConfiguration(configuration));
+
+    // thresholds and scores are written with full precision to restore bit-identical splits
+    boost::property_tree::ptree splits;
+    for (const auto& it : checkpoint.getSplits()) {
+        const SplitFunction<PixelInstance, ImageFeatureFunction>& split = it.second;
+
+        boost::property_tree::ptree splitTree;
+        splitTree.put("nodeId", it.first);
+        splitTree.put("threshold", boost::str(boost::format("%.9g") % split.getThreshold()));
+        splitTree.put("score", boost::str(boost::format("%.17g") % split.getScore()));
+        splitTree.put("featureId", split.getFeatureId());
+
+        boost::property_tree::ptree featureTree;
+        writeFeatureDetails(featureTree, split.getFeature());
+        splitTree.put_child("feature", featureTree);
+
+        splits.push_back(std::make_pair("", splitTree));
+    }
+    pt.put_child("splits", splits);
+
+    boost::property_tree::ptree frontier;
+    for (const auto& node : checkpoint.getFrontier()) {
+        boost::property_tree::ptree nodeTree;
+        nodeTree.put("nodeId", node.first);
+        nodeTree.put("samples", node.second);
+        frontier.push_back(std::make_pair("", nodeTree));
+    }
+    pt.put_child("frontier", frontier);
+
+    const std::string temporaryFilename = filename + ".tmp";
+
+    {
+        boost::iostreams::filtering_ostream ostream;
+        if (boost::algorithm::ends_with(filename, ".gz")) {
+            ostream.push(boost::iostreams::gzip_compressor());
+        }
+        ostream.push(boost::iostreams::file_sink(temporaryFilename));
+
+        boost::property_tree::write_json(ostream, pt, false);
+
+        ostream.strict_sync();
+    }
+
+    boost::filesystem::rename(temporaryFilename, filename);
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + BINARY_FOREST_ALIGNMENT - 1) / BINARY_FOREST_ALIGNMENT * BINARY_FOREST_ALIGNMENT;
+}
+
+static void writeAt(std::ofstream& ostream, uint64_t offset, const void* data, size_t size) {
+    ostream.seekp(offset);
+    ostream.write(reinterpret_cast<const char*>(data), size);
+}
+
+void RandomTreeExport::writeBinary(const std::string& filename, const RandomForestImage& forest,
+        double histogramBias) {
+
+    const std::vector<boost::shared_ptr<const TreeNodes> >& trees = forest.getTreeData();
+    if (forest.getTrees().empty()) {
+        throw std::runtime_error("cannot write binary forest: the forest was loaded from a binary file");
+    }
+    if (trees.size() != forest.getTrees().size()) {
+        throw std::runtime_error("cannot write binary forest: histograms are not normalized");
+    }
+
+    const LabelType numLabels = forest.getNumClasses();
+
+    std::ostringstream configurationStream;
+    boost::property_tree::write_json(configurationStream, getConfiguration(forest.getConfiguration()), false);
+    const std::string configurationText = configurationStream.str();
+
+    // a process that loads the forest has not necessarily seen the label images of the training
+    std::vector<uint8_t> palette;
+    for (LabelType label = 0; label < numLabels; label++) {
+        const RGBColor color = LabelImage::decodeLabel(label);
+        palette.insert(palette.end(), color.begin(), color.end());
+    }
+
+    BinaryForestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_FOREST_MAGIC, sizeof(header.magic));
+    header.version = BINARY_FOREST_VERSION;
+    header.numTrees = trees.size();
+    header.numLabels = numLabels;
+    header.nodeSize = TreeNodes::getNodeSize();
+    header.nodesPerLayer = NODES_PER_TREE_LAYER;
+    header.configurationSize = configurationText.size();
+    header.configurationOffset = alignOffset(sizeof(header));
+    header.paletteOffset = alignOffset(header.configurationOffset + header.configurationSize);
+    header.treesOffset = alignOffset(header.paletteOffset + 3 * numLabels);
+    header.histogramBias = histogramBias;
+
+    // the position of all sections is known before anything is written
+    std::vector<BinaryForestTree> treeHeaders(trees.size());
+    uint64_t offset = alignOffset(header.treesOffset + trees.size() * sizeof(BinaryForestTree));
+    uint64_t end = offset;
+    for (size_t treeNr = 0; treeNr < trees.size(); treeNr++) {
+        const TreeNodes& tree = *trees[treeNr];
+        BinaryForestTree& treeHeader = treeHeaders[treeNr];
+        memset(&treeHeader, 0, sizeof(treeHeader));
+        treeHeader.treeId = tree.getTreeId();
+        treeHeader.numNodes = tree.numNodes();
+        treeHeader.numLeaves = tree.numLeaves();
+        treeHeader.nodeLayers = tree.nodeLayers();
+        treeHeader.leafLayers = tree.histograms().shape(0) / NODES_PER_TREE_LAYER;
+        treeHeader.priorOffset = offset;
+        offset = alignOffset(offset + numLabels * sizeof(uint32_t));
+        treeHeader.nodesOffset = offset;
+        offset = alignOffset(offset + treeHeader.nodeLayers * NODES_PER_TREE_LAYER * header.nodeSize);
+        treeHeader.histogramsOffset = offset;
+        end = offset + tree.histograms().size() * sizeof(float);
+        offset = alignOffset(end);
+    }
+    header.fileSize = end;
+
+    const std::string temporaryFilename = filename + ".tmp";
+
+    {
+        std::ofstream ostream(temporaryFilename.c_str(), std::ios::binary | std::ios::trunc);
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to open ") + temporaryFilename + " for writing");
+        }
+
+        writeAt(ostream, 0, &header, sizeof(header));
+        writeAt(ostream, header.configurationOffset, configurationText.data(), configurationText.size());
+        writeAt(ostream, header.paletteOffset, &palette[0], palette.size());
+        writeAt(ostream, header.treesOffset, &treeHeaders[0], treeHeaders.size() * sizeof(BinaryForestTree));
+
+        for (size_t treeNr = 0; treeNr < trees.size(); treeNr++) {
+            const TreeNodes& tree = *trees[treeNr];
+            const BinaryForestTree& treeHeader = treeHeaders[treeNr];
+
+            const cuv::ndarray<WeightType, cuv::host_memory_space>& priorDistribution =
+                    forest.getTree(treeNr)->getClassLabelPriorDistribution();
+            std::vector<uint32_t> prior(numLabels, 0);
+            for (LabelType label = 0; label < numLabels && label < priorDistribution.size(); label++) {
+                prior[label] = priorDistribution[label];
+            }
+            writeAt(ostream, treeHeader.priorOffset, &prior[0], prior.size() * sizeof(uint32_t));
+
+            writeAt(ostream, treeHeader.nodesOffset, tree.data().ptr(),
+                    treeHeader.nodeLayers * NODES_PER_TREE_LAYER * header.nodeSize);
+            writeAt(ostream, treeHeader.histogramsOffset, tree.histograms().ptr(),
+                    tree.histograms().size() * sizeof(float));
+        }
+
+        ostream.flush();
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to write ") + temporaryFilename);
+        }
+    }
+
+    boost::filesystem::rename(temporaryFilename, filename);
+
+    CURFIL_INFO("wrote " << trees.size() << " trees to " << filename
+            << (boost::format(" (%.2f MB)") % (header.fileSize / static_cast<double>(1024 * 1024))).str());
 }
 
 void RandomTreeExport::writeJSON(const RandomTreeImage& tree, size_t treeNr) const {
 
     boost::property_tree::ptree pt;
 
-    writeTree(pt, tree);
+    writeHeader(pt, tree);
 
     assert(!outputFolder.empty());
     const std::string filename = boost::str(boost::format("%s/tree%d.json.gz") % outputFolder % treeNr);
+    const std::string temporaryFilename = boost::str(boost::format("%s.%d.tmp") % filename % getpid());
 
-    boost::iostreams::filtering_ostream ostream;
-    if (boost::algorithm::ends_with(filename, ".gz")) {
-        ostream.push(boost::iostreams::gzip_compressor());
-    }
-    ostream.push(boost::iostreams::file_sink(filename));
+    utils::Timer timer;
 
-    boost::property_tree::write_json(ostream, pt);
+    {
+        utils::ParallelGzipWriter gzipWriter(temporaryFilename);
+
+        ParallelGzipSink sink(gzipWriter);
+        boost::iostreams::stream<ParallelGzipSink> ostream(sink);
+
+        JSONStreamWriter writer(ostream);
+        writer.beginObject();
+        for (const auto& it : pt) {
+            writer.putChild(it.first, it.second);
+        }
+        writer.beginObject("tree");
+        writeTree(writer, *(tree.getTree()));
+        writer.endObject();
+        writer.endObject();
+
+        ostream.flush();
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to write ") + temporaryFilename);
+        }
+        ostream.close();
+        gzipWriter.close();
+    }
 
-    ostream.strict_sync();
+    boost::filesystem::rename(temporaryFilename, filename);
 
     double filesize = (boost::filesystem::file_size(filename)) / static_cast<double>(1024 * 1024);
-    CURFIL_INFO("wrote " << filename << (boost::format(" (%.2f MB)") % filesize).str());
+    CURFIL_INFO("wrote " << filename << (boost::format(" (%.2f MB) in ") % filesize).str() << timer.format(2));
 }
 }
@@ -2,12 +2,66 @@
 #define CURFIL_EXPORT_HPP
 
 #include <boost/property_tree/ptree.hpp>
+#include <stdint.h>
 #include <string>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 
 #include "random_forest_image.h"
 
 namespace curfil {
 
+class JSONStreamWriter;
+
+/**
+ * Header of a binary forest file. All values are stored in host byte order. The file consists of
+ *
+ *  - the header
+ *  - the training configuration as JSON text
+ *  - the RGB color of every label (numLabels × 3 × uint8) such that the labels decode to the colors of the training
+ *  - one BinaryForestTree per tree
+ *  - per tree: the class label prior distribution (numLabels × uint32), the node layers in the layout of
+ *    TreeNodes::data() and the leaf histograms in the layout of TreeNodes::histograms()
+ *
+ * Each section starts at a multiple of BINARY_FOREST_ALIGNMENT bytes such that the file can be memory-mapped and
+ * used without parsing.
+ *
+ * @see RandomTreeExport::writeBinary(), RandomTreeImport::readBinary()
+ */
+struct BinaryForestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numTrees;
+    uint32_t numLabels;
+    uint32_t nodeSize;
+    uint32_t nodesPerLayer;
+    uint32_t configurationSize;
+    uint64_t configurationOffset;
+    uint64_t paletteOffset;
+    uint64_t treesOffset;
+    uint64_t fileSize;
+    // the bias the leaf histograms were normalized with
+    double histogramBias;
+};
+
+struct BinaryForestTree {
+    uint64_t treeId;
+    uint64_t numNodes;
+    uint64_t numLeaves;
+    uint64_t nodeLayers;
+    uint64_t leafLayers;
+    uint64_t priorOffset;
+    uint64_t nodesOffset;
+    uint64_t histogramsOffset;
+};
+
+static const char BINARY_FOREST_MAGIC[8] = { 'C', 'U', 'R', 'F', 'I', 'L', 'F', 'B' };
+static const uint32_t BINARY_FOREST_VERSION = 2;
+static const uint64_t BINARY_FOREST_ALIGNMENT = 64;
+
+static const char FOREST_MANIFEST_EXTENSION[] = ".manifest";
+static const int FOREST_MANIFEST_VERSION = 1;
+
 /**
  * Helper class to export a random tree or random forest to disk in compressed (gzip) JSON format.
  *
@@ -31,6 +85,8 @@ public:
 
     /**
      * Export the given random tree to disk as compressed (gzip) JSON file.
+     * The nodes are streamed to the file, which is compressed in parallel (see utils::ParallelGzipWriter).
+     * The file is replaced atomically, such that other processes never read a partially written tree.
      *
      * @param tree the random tree which is usually part of a random forest
      * @param treeNr the number (id) of the tree in the random forest. Use 0 if the tree is not part of a forest.
@@ -39,7 +95,7 @@ public:
 
     /**
      * Export the given random forest to disk as compressed (gzip) JSON files.
-     * Each tree of the forest is stored in a separate file.
+     * Each tree of the forest is stored in a separate file. The trees are written concurrently.
      *
      * @param ensemble the random forest that contains several random trees
      */
@@ -48,13 +104,54 @@ public:
 
         CURFIL_INFO("writing tree files to " << outputFolder << " (verbose: " << verbose << ")");
 
-        for (size_t treeNr = 0; treeNr < ensemble.getTrees().size(); treeNr++) {
-            writeJSON(*(ensemble.getTree(treeNr)), treeNr);
-        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, ensemble.getTrees().size(), 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for(size_t treeNr = range.begin(); treeNr != range.end(); treeNr++) {
+                        writeJSON(*(ensemble.getTree(treeNr)), treeNr);
+                    }
+                });
 
         CURFIL_INFO("wrote JSON files to " << outputFolder);
     }
 
+    /**
+     * Export the random forest to disk as one binary file that can be memory-mapped for prediction.
+     * The histograms of the forest must be normalized. The file is replaced atomically.
+     *
+     * @param histogramBias the bias the histograms of the forest were normalized with
+     * @see BinaryForestHeader
+     */
+    static void writeBinary(const std::string& filename, const RandomForestImage& forest, double histogramBias);
+
+    /**
+     * Writes a manifest that lists the tree files of a forest. A forest is loaded from the manifest by passing it as
+     * the only tree file to RandomForestImage. The file is replaced atomically.
+     *
+     * @param treeFiles the tree files. relative paths are relative to the folder of the manifest
+     * @see RandomTreeImport::readManifest()
+     */
+    static void writeManifest(const std::string& filename, const std::vector<std::string>& treeFiles);
+
+    /**
+     * @return the configuration values that are stored in each tree file and in binary forest files
+     */
+    static boost::property_tree::ptree getConfiguration(const TrainingConfiguration& configuration);
+
+    /**
+     * Write the checkpoint of a partially trained tree to disk as compressed (gzip) JSON file.
+     * The file is replaced atomically such that an interruption never leaves a corrupt checkpoint behind.
+     *
+     * @see RandomTreeImport::readCheckpoint()
+     */
+    static void writeCheckpoint(const std::string& filename,
+            const RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction>& checkpoint,
+            const TrainingConfiguration& configuration);
+
+    /**
+     * @return the configuration values that must not change between a checkpoint and the resumed training
+     */
+    static boost::property_tree::ptree getCheckpointConfiguration(const TrainingConfiguration& configuration);
+
 private:
     static std::string spaces(int level);
 
@@ -79,9 +176,10 @@ private:
 
     static boost::property_tree::ptree getProcessorModelNames();
 
-    void writeTree(boost::property_tree::ptree& pt, const RandomTree<PixelInstance, ImageFeatureFunction>& tree) const;
+    void writeTree(JSONStreamWriter& writer, const RandomTree<PixelInstance, ImageFeatureFunction>& tree) const;
 
-    void writeTree(boost::property_tree::ptree& pt, const RandomTreeImage& tree) const;
+    // the values of a tree file except for the nodes
+    void writeHeader(boost::property_tree::ptree& pt, const RandomTreeImage& tree) const;
 
 private:
 
@@ -1,12 +1,15 @@
 #include "hyperopt.h"
 
+#include <algorithm>
 #include <boost/accumulators/accumulators.hpp>
 #include <boost/accumulators/statistics/max.hpp>
 #include <boost/accumulators/statistics/mean.hpp>
 #include <boost/accumulators/statistics/min.hpp>
 #include <boost/accumulators/statistics/variance.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/math/distributions/students_t.hpp>
 #include <cmath>
+#include <cuda_runtime_api.h>
 #include <tbb/mutex.h>
 #include <tbb/parallel_for_each.h>
 #include <tbb/parallel_for.h>
@@ -91,6 +94,18 @@ bool continueSearching(const std::vector<double>& currentBestLosses,
     return (q > alpha);
 }
 
+std::vector<double> getLosses(const mongo::BSONObj& task, const std::string& field) {
+
+    mongo::BSONElementSet values;
+    task.getFieldsDotted(field, values);
+
+    std::vector<double> losses;
+    for (const mongo::BSONElement& loss : values) {
+        losses.push_back(loss.Double());
+    }
+    return losses;
+}
+
 double Result::getLoss() const {
     double accuracy;
     switch (lossFunctionType) {
@@ -171,7 +186,13 @@ const Result HyperoptClient::test(const RandomForestImage& randomForest,
 
     ConfusionMatrix totalConfusionMatrix(numClasses);
 
+    // the forest is tested on the device it was trained on. see trainAndTest()
+    const int deviceId = randomForest.getConfiguration().getDeviceIds()[0];
+
     tbb::parallel_for_each(indices.begin(), indices.end(), [&](const int& i) {
+        // the TBB worker threads keep the device of their previous task
+        cudaSafeCall(cudaSetDevice(deviceId));
+
         const RGBDImage& image = testImages[i].getRGBDImage();
         const LabelImage& groundTruth = testImages[i].getLabelImage();
 
@@ -200,7 +221,8 @@ const Result HyperoptClient::test(const RandomForestImage& randomForest,
 
 RandomForestImage HyperoptClient::train(size_t trees,
         const TrainingConfiguration& configuration,
-        const std::vector<LabeledRGBDImage>& trainImages) {
+        const std::vector<LabeledRGBDImage>& trainImages,
+        const std::string& checkpointFolder) {
 
     CURFIL_INFO("trees: " << trees);
     CURFIL_INFO(configuration);
@@ -209,11 +231,11 @@ RandomForestImage HyperoptClient::train(size_t trees,
 
     RandomForestImage randomForest(trees, configuration);
 
-    // parallel training is not thoroughly tested yet
-    static const bool trainTreesSequentially = true;
+    // the trees are trained together and share the image transfers, see RandomTreeImage::train()
+    static const bool trainTreesSequentially = false;
 
     utils::Timer trainTimer;
-    randomForest.train(trainImages, trainTreesSequentially);
+    randomForest.train(ImageDataset(trainImages), trainingSetIndex, trainTreesSequentially, checkpointFolder);
     trainTimer.stop();
 
     CURFIL_INFO("training took " << trainTimer.format(2) <<
@@ -228,11 +250,85 @@ RandomForestImage HyperoptClient::train(size_t trees,
     builder.append("training_time_millis", trainTimer.getMilliseconds());
     builder.append("featureCounts", featureBuilder.obj());
 
+    tbb::mutex::scoped_lock lock(logMutex);
     log(1, builder.obj());
 
     return randomForest;
 }
 
+std::vector<Result> HyperoptClient::trainAndTest(size_t trees, const TrainingConfiguration& configuration,
+        const double histogramBias, const std::vector<Run>& runs) {
+
+    const std::vector<int>& deviceIds = configuration.getDeviceIds();
+    assert(!deviceIds.empty());
+
+    std::vector<boost::shared_ptr<Result> > results(runs.size());
+
+    // run i is trained and tested on device i % #devices. the runs of a device are trained one after the other
+    const size_t numDevices = std::min(deviceIds.size(), runs.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numDevices, 1),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t device = range.begin(); device != range.end(); device++) {
+                    for (size_t runNr = device; runNr < runs.size(); runNr += deviceIds.size()) {
+                        const Run& run = runs[runNr];
+
+                        TrainingConfiguration runConfiguration(configuration);
+                        runConfiguration.setRandomSeed(run.randomSeed);
+                        runConfiguration.setDeviceIds(std::vector<int>(1, deviceIds[device]));
+
+                        RandomForestImage forest = train(trees, runConfiguration, run.trainImages,
+                                run.checkpointFolder);
+                        forest.normalizeHistograms(histogramBias);
+
+                        results[runNr] = boost::make_shared<Result>(test(forest, run.testImages));
+                        results[runNr]->setRandomSeed(run.randomSeed);
+                    }
+                }
+            });
+
+    std::vector<Result> runResults;
+    for (size_t runNr = 0; runNr < runs.size(); runNr++) {
+        runResults.push_back(*results[runNr]);
+    }
+    return runResults;
+}
+
+size_t HyperoptClient::countLabels() {
+    std::vector<size_t> labelCounts;
+    for (const auto& index : trainingSetIndex.getIndices(allRGBDImages)) {
+        const std::vector<size_t>& imageLabelCounts = index->getLabelCounts();
+        labelCounts.resize(std::max(labelCounts.size(), imageLabelCounts.size()));
+        for (size_t label = 0; label < imageLabelCounts.size(); label++) {
+            labelCounts[label] += imageLabelCounts[label];
+        }
+    }
+    return std::count_if(labelCounts.begin(), labelCounts.end(), [](size_t count) {
+        return count > 0;
+    });
+}
+
+unsigned int HyperoptClient::determineMaxSamplesPerBatch(size_t featureCount, size_t numThresholds,
+        size_t numTrees) {
+
+    unsigned int maxSamplesPerBatch = 0;
+    const size_t numLabels = countLabels();
+
+    if (imageCacheSize == 0) {
+        curfil::determineImageCacheSizeAndSamplesPerBatch(ImageDataset(allRGBDImages), deviceIds, featureCount,
+                numThresholds, imageCacheSizeMB, imageCacheSize, maxSamplesPerBatch, false, numLabels, numTrees);
+    } else {
+        // a different size would clear the image caches. the memory of the allocated image caches is no longer
+        // part of the free memory on the devices
+        unsigned int unusedImageCacheSize = 0;
+        curfil::determineImageCacheSizeAndSamplesPerBatch(ImageDataset(allRGBDImages), deviceIds, featureCount,
+                numThresholds, 1, unusedImageCacheSize, maxSamplesPerBatch, false, numLabels, numTrees);
+        CURFIL_INFO("keeping the image cache size of " << imageCacheSize << " images");
+    }
+
+    return maxSamplesPerBatch;
+}
+
 double HyperoptClient::measureTrueLoss(unsigned int numTrees, TrainingConfiguration configuration,
         const double histogramBias, double& variance) {
 
@@ -242,24 +338,23 @@ double HyperoptClient::measureTrueLoss(unsigned int numTrees, TrainingConfigurat
 
     static const size_t TRUE_LOSS_RUNS = 2;
 
-    CURFIL_INFO("measuring true loss");
+    CURFIL_INFO("measuring true loss with " << TRUE_LOSS_RUNS << " runs");
 
     Sampler sampler(randomSeed, 1, 100000);
 
+    std::vector<Run> runs(TRUE_LOSS_RUNS);
     for (size_t run = 0; run < TRUE_LOSS_RUNS; run++) {
+        runs[run].randomSeed = sampler.getNext();
+        runs[run].trainImages = allRGBDImages;
+        runs[run].testImages = allTestImages;
+    }
 
-        CURFIL_INFO("true loss run " << (run + 1) << "/" << TRUE_LOSS_RUNS);
-
-        const int seedOfRun = sampler.getNext();
-
-        configuration.setRandomSeed(seedOfRun);
-
-        RandomForestImage forest = train(numTrees, configuration, allRGBDImages);
-        forest.normalizeHistograms(histogramBias);
-        Result result = test(forest, allTestImages);
+    const std::vector<Result> results = trainAndTest(numTrees, configuration, histogramBias, runs);
 
-        result.setRandomSeed(seedOfRun);
+    for (size_t run = 0; run < TRUE_LOSS_RUNS; run++) {
+        const Result& result = results[run];
 
+        CURFIL_INFO("true loss run " << (run + 1) << "/" << TRUE_LOSS_RUNS);
         CURFIL_INFO(result.getConfusionMatrix());
 
         log(2, BSON("trueLossRun" << static_cast<int>(run)
@@ -319,6 +414,11 @@ void HyperoptClient::randomSplit(const int randomSeed, const double testRatio,
 }
 
 void HyperoptClient::handle_task(const mongo::BSONObj& task) {
+
+    // the checkpoints of the screening forests
+    const boost::filesystem::path checkpointFolder = boost::filesystem::temp_directory_path()
+            / boost::filesystem::unique_path("curfil_hyperopt_%%%%%%%%");
+
     try {
         CURFIL_INFO("got task object: " << task.toString());
 
@@ -333,54 +433,96 @@ void HyperoptClient::handle_task(const mongo::BSONObj& task) {
         const double histogramBias = getParameterDouble(task, "histogramBias");
         const AccelerationMode accelerationMode = AccelerationMode::GPU_ONLY;
 
-        std::vector<Result> results;
+        const unsigned int maxSamplesPerBatch = determineMaxSamplesPerBatch(featureCount, thresholds, numTrees);
+
+        TrainingConfiguration configuration(randomSeed, samplesPerImage, featureCount, minSampleCount, maxDepth,
+                boxRadius, regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch,
+                accelerationMode, useCIELab, useDepthFilling, deviceIds, subsamplingType, ignoredColors);
 
         Sampler sampler(randomSeed, 1, 100000);
 
-        static const int RUNS = 5;
+        static const size_t RUNS = 5;
         const double testRatio = 1.0 / RUNS;
 
-        std::vector<double> currentRunLosses;
+        // the forests are first trained up to this depth in all runs. only the parameters that can compete with
+        // the best task at this depth are trained to their full depth
+        static const int SCREENING_DEPTH = 8;
+        const bool screening = (maxDepth > SCREENING_DEPTH);
+
+        std::vector<Run> runs(RUNS);
+        for (size_t run = 0; run < RUNS; run++) {
+            runs[run].randomSeed = sampler.getNext();
+            randomSplit(runs[run].randomSeed, testRatio, runs[run].trainImages, runs[run].testImages);
+            if (screening) {
+                // the full training resumes the screening forest
+                runs[run].checkpointFolder = (checkpointFolder / boost::str(boost::format("run%d") % run)).string();
+            }
+        }
 
-        for (int run = 0; run < RUNS; run++) {
+        std::vector<Result> screeningResults;
+        std::vector<Result> results;
+        bool stoppedEarly = false;
 
-            CURFIL_INFO("starting run " << (run + 1) << "/" << RUNS);
+        if (screening) {
+            TrainingConfiguration screeningConfiguration(configuration);
+            screeningConfiguration.setMaxDepth(SCREENING_DEPTH);
 
-            const int seedOfRun = sampler.getNext();
+            CURFIL_INFO("screening " << RUNS << " runs with depth " << SCREENING_DEPTH);
 
-            std::vector<LabeledRGBDImage> trainImages;
-            std::vector<LabeledRGBDImage> testImages;
+            screeningResults = trainAndTest(numTrees, screeningConfiguration, histogramBias, runs);
 
-            randomSplit(seedOfRun, testRatio, trainImages, testImages);
+            std::vector<double> screeningLosses;
+            for (size_t run = 0; run < RUNS; run++) {
+                screeningLosses.push_back(screeningResults[run].getLoss());
+                log(3, BSON("screeningRun" << static_cast<int>(run)
+                        << "result" << screeningResults[run].toBSON()));
+            }
+            checkpoint();
 
-            unsigned int imageCacheSize = 0;
-            unsigned int maxSamplesPerBatch = 0;
+            mongo::BSONObj bestTask;
+            if (get_best_task(bestTask)) {
+                const std::vector<double> bestScreeningLosses = getLosses(bestTask, "result.screening_results.loss");
+                if (bestScreeningLosses.size() < 2) {
+                    // the best task predates the screening or was not screened
+                    CURFIL_INFO("best task has " << bestScreeningLosses.size() << " screening losses. skip screening");
+                } else if (!continueSearching(bestScreeningLosses, screeningLosses)) {
+                    log(1, BSON("stopScreening" << true
+                            << "bestScreeningLosses" << bestScreeningLosses
+                            << "screeningLosses" << screeningLosses));
+                    CURFIL_INFO("stop after screening");
+                    stoppedEarly = true;
+                }
+            }
+        }
 
-            determineImageCacheSizeAndSamplesPerBatch(trainImages, deviceIds, featureCount, thresholds,
-                    imageCacheSizeMB, imageCacheSize, maxSamplesPerBatch);
+        std::vector<double> currentRunLosses;
 
-            TrainingConfiguration configuration(seedOfRun, samplesPerImage, featureCount, minSampleCount, maxDepth,
-                    boxRadius, regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch,
-                    accelerationMode, useCIELab, useDepthFilling, deviceIds, subsamplingType, ignoredColors);
+        // one run per device at a time
+        for (size_t runBegin = 0; runBegin < RUNS && !stoppedEarly; runBegin += deviceIds.size()) {
 
-            mongo::BSONObj msg = BSON("run" << run
-                    << "randomSeed" << seedOfRun
-                    << "numTrainImages" << static_cast<int>(trainImages.size())
-                    << "numTestImages" << static_cast<int>(testImages.size()));
+            const size_t runEnd = std::min(RUNS, runBegin + deviceIds.size());
 
-            log(3, msg);
-            checkpoint();
+            for (size_t run = runBegin; run < runEnd; run++) {
+                CURFIL_INFO("starting run " << (run + 1) << "/" << RUNS);
 
-            RandomForestImage forest = train(numTrees, configuration, trainImages);
-            forest.normalizeHistograms(histogramBias);
-            Result result = test(forest, testImages);
-            result.setRandomSeed(seedOfRun);
+                mongo::BSONObj msg = BSON("run" << static_cast<int>(run)
+                        << "randomSeed" << runs[run].randomSeed
+                        << "numTrainImages" << static_cast<int>(runs[run].trainImages.size())
+                        << "numTestImages" << static_cast<int>(runs[run].testImages.size()));
 
-            results.push_back(result);
+                log(3, msg);
+            }
+            checkpoint();
 
-            currentRunLosses.push_back(result.getLoss());
+            const std::vector<Run> currentRuns(runs.begin() + runBegin, runs.begin() + runEnd);
+            const std::vector<Result> currentResults = trainAndTest(numTrees, configuration, histogramBias,
+                    currentRuns);
 
-            log(3, result.toBSON());
+            for (size_t i = 0; i < currentResults.size(); i++) {
+                results.push_back(currentResults[i]);
+                currentRunLosses.push_back(currentResults[i].getLoss());
+                log(3, currentResults[i].toBSON());
+            }
             checkpoint();
 
             mongo::BSONObj bestTask;
@@ -388,52 +530,51 @@ void HyperoptClient::handle_task(const mongo::BSONObj& task) {
 
                 CURFIL_INFO("best task so far: " << bestTask.getObjectField("result").toString());
 
-                std::vector<double> currentBestLosses;
-
-                mongo::BSONElementSet values;
-                bestTask.getFieldsDotted("result.results.loss", values);
-
-                for (const mongo::BSONElement& loss : values) {
-                    currentBestLosses.push_back(loss.Double());
-                }
+                const std::vector<double> currentBestLosses = getLosses(bestTask, "result.results.loss");
 
                 if (!continueSearching(currentBestLosses, currentRunLosses)) {
                     log(1, BSON("stopSearching" << true
-                            << "run" << run
+                            << "run" << static_cast<int>(runEnd - 1)
                             << "currentBestLosses" << currentBestLosses
                             << "currentRunLosses" << currentRunLosses ));
                     CURFIL_INFO("stop searching");
-                    break;
+                    stoppedEarly = true;
                 } else {
                     CURFIL_INFO("continue searching");
                 }
             } else {
                 CURFIL_INFO("no finished task so far");
             }
-
         }
 
-        double lossVariance;
-        double loss = getAverageLossAndVariance(results, lossVariance);
-
-        unsigned int imageCacheSize = 0;
-        unsigned int maxSamplesPerBatch = 0;
+        if (!screening) {
+            // the forests do not grow deeper than the screening depth
+            screeningResults = results;
+        }
 
-        determineImageCacheSizeAndSamplesPerBatch(allRGBDImages, deviceIds, featureCount, thresholds,
-                imageCacheSizeMB, imageCacheSize, maxSamplesPerBatch);
+        // a task that stopped after the screening only has the losses of the forests with the screening depth
+        const bool screeningLoss = results.empty();
 
-        TrainingConfiguration configuration(randomSeed, samplesPerImage, featureCount, minSampleCount, maxDepth,
-                boxRadius, regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch,
-                accelerationMode, useCIELab, useDepthFilling, deviceIds, subsamplingType, ignoredColors);
+        double lossVariance;
+        double loss = getAverageLossAndVariance(screeningLoss ? screeningResults : results, lossVariance);
 
-        double trueLossVariance;
-        double trueLoss = measureTrueLoss(numTrees, configuration, histogramBias, trueLossVariance);
+        // the true loss is only measured for parameters that came through
+        double trueLossVariance = lossVariance;
+        double trueLoss = loss;
+        if (!stoppedEarly) {
+            trueLoss = measureTrueLoss(numTrees, configuration, histogramBias, trueLossVariance);
+        }
 
         mongo::BSONObjBuilder builder(64);
 
         builder << "status" << "ok";
         builder << "loss" << loss << "loss_variance" << lossVariance;
         builder << "true_loss" << trueLoss << "true_loss_variance" << trueLossVariance;
+        builder << "stopped_early" << stoppedEarly;
+        builder << "screening_loss" << screeningLoss;
+        if (screeningLoss) {
+            builder << "screening_depth" << SCREENING_DEPTH;
+        }
 
         std::vector<mongo::BSONObj> resultsDetails;
         for (size_t i = 0; i < results.size(); i++) {
@@ -442,10 +583,20 @@ void HyperoptClient::handle_task(const mongo::BSONObj& task) {
 
         builder.append("results", resultsDetails);
 
+        std::vector<mongo::BSONObj> screeningResultsDetails;
+        for (size_t i = 0; i < screeningResults.size(); i++) {
+            screeningResultsDetails.push_back(screeningResults[i].toBSON());
+        }
+
+        builder.append("screening_results", screeningResultsDetails);
+
+        boost::filesystem::remove_all(checkpointFolder);
+
         finish(builder.obj(), true);
 
     } catch (const std::runtime_error& e) {
         CURFIL_ERROR(e.what());
+        boost::filesystem::remove_all(checkpointFolder);
         finish(BSON("status" << "fail" << "why" << e.what()), false);
         throw e;
     }
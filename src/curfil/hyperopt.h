@@ -4,6 +4,7 @@
 #include <boost/asio/io_service.hpp>
 #include <mdbq/client.hpp>
 #include <mongo/bson/bson.h>
+#include <tbb/mutex.h>
 
 #include "image.h"
 #include "predict.h"
@@ -15,6 +16,12 @@ namespace curfil {
 bool continueSearching(const std::vector<double>& currentBestAccuracies,
         const std::vector<double>& currentRunAccuracies);
 
+/**
+ * @param field the dotted path of the losses in the task, for example "result.results.loss"
+ * @return the losses of the finished task or an empty vector if the task has no such field
+ */
+std::vector<double> getLosses(const mongo::BSONObj& task, const std::string& field);
+
 enum LossFunctionType {
     CLASS_ACCURACY, //
     CLASS_ACCURACY_WITHOUT_VOID, //
@@ -99,9 +106,41 @@ private:
 
     boost::asio::io_service ios;
 
+    // the label statistics of the images are shared by the forests of all runs and tasks
+    TrainingSetIndex trainingSetIndex;
+
+    // the runs on different devices log concurrently
+    tbb::mutex logMutex;
+
+    // the image cache size of the first task. the image caches of the devices keep their images across the
+    // tasks as long as their size does not change
+    unsigned int imageCacheSize;
+
+    struct Run {
+        int randomSeed;
+        std::vector<LabeledRGBDImage> trainImages;
+        std::vector<LabeledRGBDImage> testImages;
+        // if not empty, the training resumes the checkpoints of a previous, shallower training of the run
+        std::string checkpointFolder;
+    };
+
     RandomForestImage train(size_t trees,
             const TrainingConfiguration& configuration,
-            const std::vector<LabeledRGBDImage>& trainImages);
+            const std::vector<LabeledRGBDImage>& trainImages,
+            const std::string& checkpointFolder = std::string());
+
+    /**
+     * Trains and tests the forests of the runs. The runs are distributed over the devices and
+     * the runs on different devices are trained concurrently.
+     */
+    std::vector<Result> trainAndTest(size_t trees, const TrainingConfiguration& configuration,
+            const double histogramBias, const std::vector<Run>& runs);
+
+    // also determines the image cache size in the first task. the forests of 'numTrees' are tested on the devices
+    unsigned int determineMaxSamplesPerBatch(size_t featureCount, size_t numThresholds, size_t numTrees);
+
+    // the distinct labels of the training images, see RandomTreeImage::calculateLabelPriorDistribution()
+    size_t countLabels();
 
     void randomSplit(const int randomSeed, const double testRatio,
             std::vector<LabeledRGBDImage>& trainImages,
@@ -147,7 +186,10 @@ public:
                     numThreads(numThreads),
                     subsamplingType(subsamplingType),
                     ignoredColors(ignoredColors),
-                    lossFunction(parseLossFunction(lossFunction))
+                    lossFunction(parseLossFunction(lossFunction)),
+                    trainingSetIndex(),
+                    logMutex(),
+                    imageCacheSize(0)
     {
     }
 
@@ -3,6 +3,7 @@
 
 #include "hyperopt.h"
 #include "image.h"
+#include "preprocessing_cache.h"
 #include "utils.h"
 #include "version.h"
 
@@ -25,9 +26,10 @@ int main(int argc, char **argv) {
     std::vector<std::string> ignoredColors;
     bool useCIELab = true;
     bool useDepthFilling = false;
-    int deviceId = 0;
+    std::vector<int> deviceIds;
     bool profiling = false;
     std::string lossFunction;
+    std::string cacheFolder;
 
     // Declare the supported options.
     po::options_description options("options");
@@ -36,7 +38,8 @@ int main(int argc, char **argv) {
     ("version", "show version and exit")
     ("url", po::value<std::string>(&url)->required(), "MongoDB url")
     ("db", po::value<std::string>(&db)->required(), "database name")
-    ("deviceId", po::value<int>(&deviceId)->default_value(deviceId), "GPU device id")
+    ("deviceId", po::value<std::vector<int> >(&deviceIds)->multitoken(),
+            "GPU device id(s). the folds of a task are trained concurrently on the given devices. default: 0")
     ("experiment", po::value<std::string>(&experiment)->required(), "experiment name")
     ("trainingFolder", po::value<std::string>(&trainingFolder)->required(), "folder with training images")
     ("testingFolder", po::value<std::string>(&testingFolder)->required(), "folder with testing images")
@@ -48,6 +51,8 @@ int main(int argc, char **argv) {
     ("useCIELab", po::value<bool>(&useCIELab)->default_value(useCIELab), "convert images to CIE lab space")
     ("useDepthFilling", po::value<bool>(&useDepthFilling)->implicit_value(true)->default_value(useDepthFilling),
             "whether to do simple depth filling")
+    ("cacheFolder", po::value<std::string>(&cacheFolder)->default_value(cacheFolder),
+            "cache the preprocessed images in this folder and load them from there in subsequent runs")
     ("randomSeed", po::value<int>(&randomSeed)->default_value(randomSeed), "random seed")
     ("profile", po::value<bool>(&profiling)->implicit_value(true)->default_value(profiling), "profiling")
     ("ignoreColor", po::value<std::vector<std::string> >(&ignoredColors),
@@ -82,6 +87,7 @@ int main(int argc, char **argv) {
     logVersionInfo();
 
     utils::Profile::setEnabled(profiling);
+    PreprocessingCache::setFolder(cacheFolder);
 
     CURFIL_INFO("used loss function is " << lossFunction);
 
@@ -90,8 +96,9 @@ int main(int argc, char **argv) {
     const auto trainImages = loadImages(trainingFolder, useCIELab, useDepthFilling);
     const auto testImages = loadImages(testingFolder, useCIELab, useDepthFilling);
 
-    // currently training on only on GPU is tested
-    std::vector<int> deviceIds(1, deviceId);
+    if (deviceIds.empty()) {
+        deviceIds.push_back(0);
+    }
 
     HyperoptClient client(trainImages, testImages, useCIELab, useDepthFilling, deviceIds, maxImages, imageCacheSizeMB,
             randomSeed, numThreads, subsamplingType, ignoredColors, lossFunction, url, db,
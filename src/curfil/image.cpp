@@ -4,16 +4,19 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <cmath>
+#include <cuda_runtime_api.h>
 #include <iomanip>
 #include <map>
 #include <string>
 #include <tbb/mutex.h>
 #include <tbb/parallel_for.h>
+#include <unistd.h>
 #include <vigra/colorconversions.hxx>
 #include <vigra/imageinfo.hxx>
 #include <vigra/impex.hxx>
 #include <vigra/transformimage.hxx>
 
+#include "preprocessing_cache.h"
 #include "utils.h"
 
 namespace fs = boost::filesystem;
@@ -59,15 +62,6 @@ RGBColor::RGBColor(const std::string& colorString) :
     }
 }
 
-static vigra::DVector3Image convertRGB2CIELab(const vigra::DVector3Image& srcImage) {
-    vigra::DVector3Image dstImage(srcImage.width(), srcImage.height());
-
-    vigra::transformImage(srcImageRange(srcImage), destImage(dstImage),
-            vigra::RGB2LabFunctor<double>());
-
-    return dstImage;
-}
-
 static vigra::DVector3Image convertCIELab2RGB(const vigra::DVector3Image& srcImage) {
     vigra::DVector3Image dstImage(srcImage.width(), srcImage.height());
 
@@ -77,6 +71,27 @@ static vigra::DVector3Image convertCIELab2RGB(const vigra::DVector3Image& srcIma
     return dstImage;
 }
 
+// 'color(x, y)' returns the RGB values of a pixel in the range 0-255.
+// the CIELab conversion happens in double precision per pixel, the rows are converted in parallel
+template<class ColorAccessor>
+static void setColors(RGBDImage& image, const ColorAccessor& color, bool convertToCIELab) {
+    tbb::parallel_for(tbb::blocked_range<int>(0, image.getHeight()),
+            [&](const tbb::blocked_range<int>& range) {
+                const vigra::RGB2LabFunctor<double> rgb2lab;
+                for (int y = range.begin(); y != range.end(); ++y) {
+                    for (int x = 0; x < image.getWidth(); ++x) {
+                        vigra::TinyVector<double, 3> value = color(x, y);
+                        if (convertToCIELab) {
+                            value = rgb2lab(value);
+                        }
+                        for (unsigned int c = 0; c < 3; ++c) {
+                            image.setColor(x, y, c, value[c]);
+                        }
+                    }
+                }
+            });
+}
+
 template<class T>
 static void loadImage(const std::string& filename, T& image) {
     vigra::ImageImportInfo info(filename.c_str());
@@ -96,7 +111,7 @@ RGBDImage::RGBDImage(const std::string& filename, const std::string& depthFilena
         filename(filename), depthFilename(depthFilename),
                 colorImage(boost::make_shared<cuv::cuda_allocator>()),
                 depthImage(boost::make_shared<cuv::cuda_allocator>()),
-                inCIELab(false), integratedColor(false), integratedDepth(false) {
+                inCIELab(false), integratedColor(false), integratedDepth(false), pinned(false) {
 
     {
         utils::Profile profile("loadImage");
@@ -108,21 +123,13 @@ RGBDImage::RGBDImage(const std::string& filename, const std::string& depthFilena
             throw std::runtime_error(std::string("failed to load image '") + filename + "': " + e.what());
         }
 
-        if (convertToCIELab) {
-            image = convertRGB2CIELab(image);
-        }
-
         width = image.width();
         height = image.height();
         assert(width >= 0 && height >= 0);
         colorImage.resize(cuv::extents[COLOR_CHANNELS][getHeight()][getWidth()]);
-        for (int y = 0; y < getHeight(); ++y) {
-            for (int x = 0; x < getWidth(); ++x) {
-                for (unsigned int c = 0; c < COLOR_CHANNELS; ++c) {
-                    setColor(x, y, c, image(x, y)[c]);
-                }
-            }
-        }
+        setColors(*this, [&](int x, int y) {
+            return image(x, y);
+        }, convertToCIELab);
 
         inCIELab = true;
 
@@ -143,12 +150,158 @@ RGBDImage::RGBDImage(const std::string& filename, const std::string& depthFilena
     }
 }
 
+RGBDImage::RGBDImage(int width, int height, const uint8_t* colors, const uint16_t* depths, bool convertToCIELab,
+        bool useDepthFilling, bool calculateIntegralImage) :
+        filename(""), depthFilename(""),
+                width(width), height(height),
+                colorImage(cuv::extents[COLOR_CHANNELS][height][width], boost::make_shared<cuv::cuda_allocator>()),
+                depthImage(cuv::extents[DEPTH_CHANNELS][height][width], boost::make_shared<cuv::cuda_allocator>()),
+                inCIELab(false), integratedColor(false), integratedDepth(false), pinned(false) {
+
+    if (width <= 0 || height <= 0) {
+        throw std::runtime_error((boost::format("illegal image size: %dx%d") % width % height).str());
+    }
+
+    setColors(*this, [&](int x, int y) {
+        const uint8_t* color = colors + 3 * (static_cast<size_t>(y) * width + x);
+        return vigra::TinyVector<double, 3>(color[0], color[1], color[2]);
+    }, convertToCIELab);
+
+    inCIELab = true;
+
+    setDepths(depths, "frame");
+
+    if (useDepthFilling) {
+        fillDepth();
+    }
+
+    if (calculateIntegralImage) {
+        calculateIntegral();
+    }
+}
+
 RGBDImage::RGBDImage(const RGBDImage& other) :
         filename(other.filename), depthFilename(other.depthFilename),
                 width(other.width), height(other.height),
                 colorImage(other.colorImage.copy()),
                 depthImage(other.depthImage.copy()),
-                inCIELab(other.inCIELab), integratedColor(other.integratedColor), integratedDepth(other.integratedDepth) {
+                inCIELab(other.inCIELab), integratedColor(other.integratedColor), integratedDepth(other.integratedDepth),
+                pinned(false) {
+}
+
+RGBDImage::~RGBDImage() {
+    // must happen before the memory is freed
+    unpinMemory();
+}
+
+RGBDImage& RGBDImage::operator=(const RGBDImage& other) {
+    if (this != &other) {
+        unpinMemory();
+        filename = other.filename;
+        depthFilename = other.depthFilename;
+        width = other.width;
+        height = other.height;
+        colorImage = other.colorImage.copy();
+        depthImage = other.depthImage.copy();
+        inCIELab = other.inCIELab;
+        integratedColor = other.integratedColor;
+        integratedDepth = other.integratedDepth;
+    }
+    return *this;
+}
+
+static tbb::mutex pinnedMemoryMutex;
+static size_t totalPinnedMemory = 0;
+
+// unregisters the buffers and returns the reserved memory if pinning the image fails half-way
+class PinnedMemoryGuard {
+
+public:
+
+    explicit PinnedMemoryGuard(size_t size) :
+            size(size), buffers(), committed(false) {
+    }
+
+    ~PinnedMemoryGuard() {
+        if (committed) {
+            return;
+        }
+
+        for (size_t i = 0; i < buffers.size(); i++) {
+            if (cudaHostUnregister(buffers[i]) != cudaSuccess) {
+                CURFIL_WARNING("failed to unregister pinned buffer: " << cudaGetErrorString(cudaGetLastError()));
+            }
+        }
+
+        tbb::mutex::scoped_lock lock(pinnedMemoryMutex);
+        assert(totalPinnedMemory >= size);
+        totalPinnedMemory -= size;
+    }
+
+    void registerBuffer(void* buffer, size_t bytes) {
+        // portable: the image is transferred to every device that trains a tree
+        cudaSafeCall(cudaHostRegister(buffer, bytes, cudaHostRegisterPortable));
+        buffers.push_back(buffer);
+    }
+
+    void commit() {
+        committed = true;
+    }
+
+private:
+
+    const size_t size;
+    std::vector<void*> buffers;
+    bool committed;
+
+    PinnedMemoryGuard(const PinnedMemoryGuard&);
+    PinnedMemoryGuard& operator=(const PinnedMemoryGuard&);
+};
+
+bool RGBDImage::pinMemory(size_t maxPinnedMemory) {
+
+    if (pinned) {
+        return true;
+    }
+
+    const size_t size = getSizeInMemory();
+
+    {
+        tbb::mutex::scoped_lock lock(pinnedMemoryMutex);
+        if (totalPinnedMemory + size > maxPinnedMemory) {
+            return false;
+        }
+        totalPinnedMemory += size;
+    }
+
+    PinnedMemoryGuard guard(size);
+    guard.registerBuffer(colorImage.ptr(), colorImage.size() * sizeof(float));
+    guard.registerBuffer(depthImage.ptr(), depthImage.size() * sizeof(int));
+    guard.commit();
+
+    pinned = true;
+    return true;
+}
+
+void RGBDImage::unpinMemory() {
+
+    if (!pinned) {
+        return;
+    }
+
+    cudaSafeCall(cudaHostUnregister(colorImage.ptr()));
+    cudaSafeCall(cudaHostUnregister(depthImage.ptr()));
+
+    pinned = false;
+
+    tbb::mutex::scoped_lock lock(pinnedMemoryMutex);
+    assert(totalPinnedMemory >= getSizeInMemory());
+    totalPinnedMemory -= getSizeInMemory();
+}
+
+size_t RGBDImage::getTotalPinnedMemory() {
+    tbb::mutex::scoped_lock lock(pinnedMemoryMutex);
+    return totalPinnedMemory;
 }
 
 template<class A, class B>
@@ -200,46 +353,57 @@ void RGBDImage::calculateDerivative(cuv::ndarray_view<T, cuv::host_memory_space>
     }
 }
 
-// integrates channel in double precision
-void RGBDImage::calculateIntegral(cuv::ndarray_view<float, cuv::host_memory_space>& data) {
+// integrates the channel in double precision with the Kahan summation algorithm
+// http://en.wikipedia.org/wiki/Kahan_summation_algorithm
+// only the previous and the current row are kept in double precision
+void RGBDImage::calculateIntegral(cuv::ndarray_view<float, cuv::host_memory_space>& view) {
 
-    assert(data.ndim() == 2);
+    assert(view.ndim() == 2);
+    const int height = view.shape(0);
+    const int width = view.shape(1);
+    float* data = view.ptr();
 
-    cuv::ndarray<double, cuv::host_memory_space> tempData(data.shape());
-    copy(tempData, data);
+    // the first element of each row is the zero column left of the image
+    std::vector<double> previousRow(width + 1, 0.0);
+    std::vector<double> currentRow(width + 1, 0.0);
 
-    cuv::ndarray_view<double, cuv::host_memory_space> view =
-            tempData[cuv::indices[cuv::index_range()][cuv::index_range()]];
-    calculateIntegral<double>(view);
+    double c = 0.0;
 
-    copy(data, tempData);
+    for (int y = 0; y < height; ++y) {
+        const double* above = &previousRow[1];
+        double* current = &currentRow[1];
+        float* row = data + static_cast<size_t>(y) * width;
+        for (int x = 0; x < width; ++x) {
+            const double value = row[x];
+            const double dy = (current[x - 1] + above[x] - above[x - 1]) - c;
+            const double t = value + dy;
+            c = (t - value) - dy;
+
+            current[x] = t;
+            row[x] = t;
+        }
+        previousRow.swap(currentRow);
+    }
 }
 
-template<class T>
-void RGBDImage::calculateIntegral(cuv::ndarray_view<T, cuv::host_memory_space>& view) {
+// integer sums are exact: the prefix sum of the row plus the integral of the row above
+void RGBDImage::calculateIntegral(cuv::ndarray_view<int, cuv::host_memory_space>& view) {
 
     assert(view.ndim() == 2);
     const int height = view.shape(0);
     const int width = view.shape(1);
-    T* data = view.ptr();
-
-    // Kahan summation algorithm
-    // http://en.wikipedia.org/wiki/Kahan_summation_algorithm
-    double c = 0.0;
+    int* data = view.ptr();
 
     for (int y = 0; y < height; ++y) {
-        const int previousRow = (y - 1) * width;
-        const int rowOffset = y * width;
-        for (int x = 0; x < width; ++x) {
-            T above = (y > 0) ? static_cast<T>(data[previousRow + x]) : T();
-            T left = (x > 0) ? static_cast<T>(data[rowOffset + x - 1]) : T();
-            T aboveLeft = (x > 0 && y > 0) ? static_cast<T>(data[previousRow + x - 1]) : T();
-
-            double dy = (left + above - aboveLeft) - c;
-            double t = data[rowOffset + x] + dy;
-            c = (t - data[rowOffset + x]) - dy;
-
-            data[rowOffset + x] = t;
+        int* row = data + static_cast<size_t>(y) * width;
+        for (int x = 1; x < width; ++x) {
+            row[x] += row[x - 1];
+        }
+        if (y > 0) {
+            const int* above = row - width;
+            for (int x = 0; x < width; ++x) {
+                row[x] += above[x];
+            }
         }
     }
 }
@@ -283,15 +447,18 @@ void RGBDImage::fillDepthFromRight() {
     }
 
     int* depths = depthImage.ptr();
-    for (int y = 0; y < getHeight(); y++) {
-        const size_t rowOffset = y * getWidth();
-        for (int x = getWidth() - 2; x >= 0; x--) {
-            int& depth = depths[rowOffset + x];
-            if (!depth) {
-                depth = depths[rowOffset + x + 1];
-            }
-        }
-    }
+    const int width = getWidth();
+    tbb::parallel_for(tbb::blocked_range<int>(0, getHeight()),
+            [&](const tbb::blocked_range<int>& range) {
+                for (int y = range.begin(); y != range.end(); y++) {
+                    int* row = depths + static_cast<size_t>(y) * width;
+                    for (int x = width - 2; x >= 0; x--) {
+                        if (!row[x]) {
+                            row[x] = row[x + 1];
+                        }
+                    }
+                }
+            });
 }
 
 void RGBDImage::fillDepthFromLeft() {
@@ -299,15 +466,18 @@ void RGBDImage::fillDepthFromLeft() {
         throw std::runtime_error("can not fill depth on integrated depth");
     }
     int* depths = depthImage.ptr();
-    for (int y = 0; y < getHeight(); y++) {
-        const size_t rowOffset = y * getWidth();
-        for (int x = 1; x < getWidth(); x++) {
-            int& depth = depths[rowOffset + x];
-            if (!depth) {
-                depth = depths[rowOffset + x - 1];
-            }
-        }
-    }
+    const int width = getWidth();
+    tbb::parallel_for(tbb::blocked_range<int>(0, getHeight()),
+            [&](const tbb::blocked_range<int>& range) {
+                for (int y = range.begin(); y != range.end(); y++) {
+                    int* row = depths + static_cast<size_t>(y) * width;
+                    for (int x = 1; x < width; x++) {
+                        if (!row[x]) {
+                            row[x] = row[x - 1];
+                        }
+                    }
+                }
+            });
 }
 
 void RGBDImage::fillDepthFromTop() {
@@ -367,6 +537,11 @@ void RGBDImage::loadDepthImage(const std::string& depthFilename) {
 
     vigra::importImage(info, vigra::destImage(image));
 
+    setDepths(image.data(), depthFilename);
+}
+
+void RGBDImage::setDepths(const uint16_t* values, const std::string& source) {
+
     depthImage.resize(cuv::extents[DEPTH_CHANNELS][getHeight()][getWidth()]);
 
     utils::Average depthAverage;
@@ -377,10 +552,10 @@ void RGBDImage::loadDepthImage(const std::string& depthFilename) {
     for (int y = 0; y < getHeight(); y++) {
         const size_t rowOffset = y * getWidth();
         for (int x = 0; x < getWidth(); x++) {
-            const int depth = image(x, y);
+            const int depth = values[rowOffset + x];
             if (depth < 0 || depth > 50000) {
                 throw std::runtime_error((boost::format("illegal depth value in image %s @%d,%d: %d")
-                        % depthFilename % x % y % depth).str());
+                        % source % x % y % depth).str());
             }
 
             if (depth > 0) {
@@ -394,7 +569,7 @@ void RGBDImage::loadDepthImage(const std::string& depthFilename) {
 
     double depthAvg = depthAverage.getAverage();
     if (depthAvg < 0.01 || depthAvg > 10.0) {
-        throw std::runtime_error((boost::format("illegal average depth of '%s': %e") % depthFilename % depthAvg).str());
+        throw std::runtime_error((boost::format("illegal average depth of '%s': %e") % source % depthAvg).str());
     }
 }
 
@@ -599,6 +774,11 @@ void addColorId(const RGBColor& color, const LabelType& id) {
     }
 }
 
+void clearColorIds() {
+    tbb::mutex::scoped_lock lock(colorsMutex);
+    colors.clear();
+}
+
 static LabelType encodeColor(const vigra::UInt8RGBImage& labelImage, int x, int y) {
     const vigra::RGBValue<vigra::UInt8> c = labelImage(x, y);
     RGBColor color(c[0], c[1], c[2]);
@@ -638,6 +818,23 @@ RGBColor LabelImage::decodeLabel(const LabelType& v) {
     throw std::runtime_error(o.str());
 }
 
+std::vector<LabelType> LabelImage::encodeColors(const std::vector<RGBColor>& labelColors) {
+    tbb::mutex::scoped_lock lock(colorsMutex);
+
+    std::vector<LabelType> labels;
+    for (const RGBColor& color : labelColors) {
+        std::map<RGBColor, LabelType>::iterator it = colors.find(color);
+        if (it != colors.end()) {
+            labels.push_back(it->second);
+        } else {
+            const LabelType id = static_cast<LabelType>(colors.size());
+            addColorId(color, id);
+            labels.push_back(id);
+        }
+    }
+    return labels;
+}
+
 LabelImage::LabelImage(const std::string& filename) :
         filename(filename) {
 
@@ -711,10 +908,27 @@ LabeledRGBDImage loadImagePair(const std::string& filename, bool useCIELab, bool
         throw std::runtime_error(std::string("illegal depth image filename: ") + depthFilename);
     }
 
+    const bool useCache = PreprocessingCache::isEnabled();
+
+    if (useCache) {
+        LabeledRGBDImage cachedImage;
+        if (PreprocessingCache::load(filename, depthFilename, labelFilename, useCIELab, useDepthFilling,
+                calculateIntegralImages, cachedImage)) {
+            return cachedImage;
+        }
+    }
+
     const auto rgbdImage = boost::make_shared<RGBDImage>(filename, depthFilename, useCIELab, useDepthFilling,
             calculateIntegralImages);
     const auto labelImage = boost::make_shared<LabelImage>(labelFilename);
-    return LabeledRGBDImage(rgbdImage, labelImage);
+    const LabeledRGBDImage image(rgbdImage, labelImage);
+
+    if (useCache) {
+        PreprocessingCache::store(filename, depthFilename, labelFilename, useCIELab, useDepthFilling,
+                calculateIntegralImages, image);
+    }
+
+    return image;
 }
 
 std::vector<std::string> listImageFilenames(const std::string& path) {
@@ -744,13 +958,27 @@ std::vector<std::string> listImageFilenames(const std::string& path) {
     return filenames;
 }
 
-std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIELab, bool useDepthFilling) {
+std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIELab, bool useDepthFilling,
+        size_t maxPinnedMemoryMB) {
 
     std::vector<std::string> filenames = listImageFilenames(folder);
     CURFIL_INFO("going to load " << filenames.size() << " images from " << folder);
 
     size_t totalSizeInMemory = 0;
 
+    size_t maxPinnedMemory = maxPinnedMemoryMB * 1024lu * 1024lu;
+    if (maxPinnedMemory > 0) {
+        const size_t physicalMemory = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+        if (maxPinnedMemory > physicalMemory / 2) {
+            maxPinnedMemory = physicalMemory / 2;
+            CURFIL_WARNING("limiting pinned memory to half of the physical memory: "
+                    << (boost::format("%.2f MB") % (maxPinnedMemory / static_cast<double>(1024 * 1024))).str());
+        }
+    }
+
+    const size_t pinnedMemoryStart = RGBDImage::getTotalPinnedMemory();
+    size_t numPinned = 0;
+
     LabeledRGBDImage emptyImage;
     std::vector<LabeledRGBDImage> images(filenames.size(), emptyImage);
 
@@ -762,8 +990,12 @@ std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIEL
 
                     const auto& filename = filenames[i];
                     images[i] = loadImagePair(filename, useCIELab, useDepthFilling);
+                    const bool pinned = (maxPinnedMemory > 0 && images[i].rgbdImage->pinMemory(maxPinnedMemory));
                     {
                         tbb::mutex::scoped_lock lock(imageCounterMutex);
+                        if (pinned) {
+                            numPinned++;
+                        }
                         if (++numImages % 50 == 0) {
                             CURFIL_INFO("loaded " << numImages << "/" << images.size() << " images");
                         }
@@ -798,6 +1030,12 @@ std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIEL
     CURFIL_INFO("finished loading " << images.size() << " images. size in memory: "
             << (boost::format("%.2f MB") % (totalSizeInMemory / static_cast<double>(1024 * 1024))).str());
 
+    if (maxPinnedMemory > 0) {
+        const size_t pinnedMemory = RGBDImage::getTotalPinnedMemory() - pinnedMemoryStart;
+        CURFIL_INFO("pinned " << numPinned << "/" << images.size() << " images in host memory: "
+                << (boost::format("%.2f MB") % (pinnedMemory / static_cast<double>(1024 * 1024))).str());
+    }
+
     return images;
 }
 
@@ -60,6 +60,11 @@ LabelType getOrAddColorId(const RGBColor& color, const LabelType& label);
 
 void addColorId(const RGBColor& color, const LabelType& label);
 
+/**
+ * Forgets the colors of all labels, as in a process that did not load any label image yet. Meant for tests.
+ */
+void clearColorIds();
+
 /**
  * Wrapper class that represent a depth value as it occurs in RGB-D images.
  *
@@ -163,6 +168,15 @@ public:
             bool useDepthFilling = false,
             bool calculateIntegralImage = true);
 
+    /**
+     * Creates the image from a RGB color buffer with three interleaved 8-bit channels and a 16-bit depth buffer
+     * in millimeters, both in row-major order. The buffers are processed as if they were loaded from disk.
+     */
+    explicit RGBDImage(int width, int height, const uint8_t* colors, const uint16_t* depths,
+            bool convertToCIELab = true,
+            bool useDepthFilling = false,
+            bool calculateIntegralImage = true);
+
     /**
      * For the test case
      */
@@ -171,13 +185,43 @@ public:
                     width(width), height(height),
                     colorImage(cuv::extents[COLOR_CHANNELS][height][width], boost::make_shared<cuv::cuda_allocator>()),
                     depthImage(cuv::extents[DEPTH_CHANNELS][height][width], boost::make_shared<cuv::cuda_allocator>()),
-                    inCIELab(false), integratedColor(false), integratedDepth(false) {
+                    inCIELab(false), integratedColor(false), integratedDepth(false), pinned(false) {
         assert(width >= 0 && height >= 0);
         reset();
     }
 
     RGBDImage(const RGBDImage& other);
 
+    ~RGBDImage();
+
+    RGBDImage& operator=(const RGBDImage& other);
+
+    /**
+     * Page-locks the color and depth matrices in host memory so that transfers to the GPU are asynchronous
+     * and do not need to be staged by the driver.
+     *
+     * @param maxPinnedMemory the total number of bytes that all images together may page-lock
+     * @return true if the image is pinned. false if pinning it would exceed maxPinnedMemory
+     */
+    bool pinMemory(size_t maxPinnedMemory);
+
+    /**
+     * Releases the page-lock. Called by the destructor.
+     */
+    void unpinMemory();
+
+    /**
+     * @return true if the memory of this image is page-locked
+     */
+    bool isPinned() const {
+        return pinned;
+    }
+
+    /**
+     * @return number of bytes that are page-locked by all images
+     */
+    static size_t getTotalPinnedMemory();
+
     /**
      * @return total size in memory in bytes
      */
@@ -355,6 +399,9 @@ public:
 
 private:
 
+    // restores the preprocessed matrices from disk
+    friend class PreprocessingCache;
+
     std::string filename;
     std::string depthFilename;
     int width;
@@ -365,12 +412,16 @@ private:
     bool inCIELab;
     bool integratedColor;
     bool integratedDepth;
+    bool pinned;
 
     static const unsigned int COLOR_CHANNELS = 3;
     static const unsigned int DEPTH_CHANNELS = 2;
 
     void loadDepthImage(const std::string& depthFilename);
 
+    // depths in millimeters in row-major order. 'source' names the origin of the values in error messages
+    void setDepths(const uint16_t* depths, const std::string& source);
+
     void fillDepthFromRight();
     void fillDepthFromLeft();
     void fillDepthFromBottom();
@@ -379,9 +430,7 @@ private:
     template<class T>
     static void calculateDerivative(cuv::ndarray_view<T, cuv::host_memory_space>& data);
 
-    template<class T>
-    static void calculateIntegral(cuv::ndarray_view<T, cuv::host_memory_space>& data);
-
+    static void calculateIntegral(cuv::ndarray_view<int, cuv::host_memory_space>& data);
     static void calculateIntegral(cuv::ndarray_view<float, cuv::host_memory_space>& data);
     static void calculateDerivative(cuv::ndarray_view<float, cuv::host_memory_space>& data);
 
@@ -396,6 +445,9 @@ class LabelImage {
 
 private:
 
+    // restores the labels from disk
+    friend class PreprocessingCache;
+
     std::string filename;
     int width;
     int height;
@@ -452,6 +504,11 @@ public:
      */
     static RGBColor decodeLabel(const LabelType& v);
 
+    /**
+     * Assigns the unique label ids to the colors as if they were encountered in this order in a label image file.
+     */
+    static std::vector<LabelType> encodeColors(const std::vector<RGBColor>& colors);
+
     /**
      * @return the total memory usage of this image in bytes
      */
@@ -477,6 +534,17 @@ public:
         return image(y, x);
     }
 
+    /**
+     * @return the labels in a H×W matrix in row-major order. allows to fill the image without a per-pixel copy
+     */
+    LabelType* getLabels() {
+        return image.ptr();
+    }
+
+    const LabelType* getLabels() const {
+        return image.ptr();
+    }
+
 };
 
 /**
@@ -537,8 +605,12 @@ std::vector<std::string> listImageFilenames(const std::string& folder);
 /**
  * Convenience function to find all files in the given folder that match the required filename schema.
  * See the README for the filename schema.
+ *
+ * Up to maxPinnedMemoryMB of the RGBD images are page-locked, see RGBDImage::pinMemory().
+ * At most half of the physical memory is page-locked.
  */
-std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIELab, bool useDepthFilling);
+std::vector<LabeledRGBDImage> loadImages(const std::string& folder, bool useCIELab, bool useDepthFilling,
+        size_t maxPinnedMemoryMB = 0);
 
 }
 
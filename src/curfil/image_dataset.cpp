@@ -0,0 +1,214 @@
+#include "image_dataset.h"
+
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <sstream>
+#include <stdexcept>
+#include <tbb/parallel_for.h>
+#include <unistd.h>
+
+#include "random_tree_image_gpu.h"
+#include "utils.h"
+
+namespace curfil {
+
+namespace {
+
+// keeps the image alive and removes it from the device image caches before it is freed
+class ImageReleaser {
+
+public:
+
+    explicit ImageReleaser(const boost::shared_ptr<RGBDImage>& image) :
+            image(image) {
+    }
+
+    void operator()(RGBDImage*) {
+        removeFromImageCache(image.get());
+        image.reset();
+    }
+
+private:
+    boost::shared_ptr<RGBDImage> image;
+};
+
+}
+
+ImageDataset::ImageDataset(const std::string& folder, bool useCIELab, bool useDepthFilling,
+        size_t maxHostMemoryMB, size_t maxPinnedMemoryMB) :
+        filenames(listImageFilenames(folder)), useCIELab(useCIELab), useDepthFilling(useDepthFilling),
+                maxHostMemory(maxHostMemoryMB * 1024lu * 1024lu), maxPinnedMemory(maxPinnedMemoryMB * 1024lu * 1024lu),
+                width(0), height(0), imageSizeInMemory(0), loadMutexes(), mutex(),
+                rgbdImages(filenames.size()), labelImages(filenames.size()), residentImages(),
+                residentPositions(filenames.size()), resident(filenames.size(), false), residentMemory(0),
+                numLoads(0) {
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        loadMutexes.push_back(boost::make_shared<tbb::mutex>());
+    }
+
+    if (maxPinnedMemory > 0) {
+        const size_t physicalMemory = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+        if (maxPinnedMemory > physicalMemory / 2) {
+            maxPinnedMemory = physicalMemory / 2;
+            CURFIL_WARNING("limiting pinned memory to half of the physical memory: "
+                    << (boost::format("%.2f MB") % (maxPinnedMemory / static_cast<double>(1024 * 1024))).str());
+        }
+    }
+
+    CURFIL_INFO("found " << filenames.size() << " images in " << folder);
+
+    if (!filenames.empty()) {
+        // the first image determines the size of all images
+        const LabeledRGBDImage image = getImage(0);
+        width = image.getWidth();
+        height = image.getHeight();
+        imageSizeInMemory = image.getSizeInMemory();
+    }
+
+    if (maxHostMemory > 0) {
+        CURFIL_INFO("keeping up to " << (boost::format("%.2f MB") % (maxHostMemory / static_cast<double>(1024 * 1024)))
+                << " of unused images in memory");
+    }
+}
+
+ImageDataset::ImageDataset(const std::vector<LabeledRGBDImage>& images) :
+        filenames(), useCIELab(false), useDepthFilling(false), maxHostMemory(0), maxPinnedMemory(0),
+                width(0), height(0), imageSizeInMemory(0), loadMutexes(), mutex(),
+                rgbdImages(), labelImages(), residentImages(), residentPositions(images.size()),
+                resident(images.size(), false), residentMemory(0), numLoads(0) {
+
+    for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+        const LabeledRGBDImage& image = images[imageNr];
+        filenames.push_back(image.getRGBDImage().getFilename());
+        loadMutexes.push_back(boost::make_shared<tbb::mutex>());
+        rgbdImages.push_back(image.rgbdImage);
+        labelImages.push_back(image.labelImage);
+        touch(imageNr, image);
+    }
+
+    if (!images.empty()) {
+        width = images[0].getWidth();
+        height = images[0].getHeight();
+        imageSizeInMemory = images[0].getSizeInMemory();
+    }
+}
+
+size_t ImageDataset::getNumLoads() const {
+    tbb::mutex::scoped_lock lock(mutex);
+    return numLoads;
+}
+
+LabeledRGBDImage ImageDataset::getImage(size_t imageNr) const {
+
+    if (imageNr >= filenames.size()) {
+        throw std::runtime_error((boost::format("illegal image number: %d (images: %d)")
+                % imageNr % filenames.size()).str());
+    }
+
+    tbb::mutex::scoped_lock loadLock(*loadMutexes[imageNr]);
+
+    boost::shared_ptr<RGBDImage> rgbdImage;
+    boost::shared_ptr<LabelImage> labelImage;
+    {
+        tbb::mutex::scoped_lock lock(mutex);
+        rgbdImage = rgbdImages[imageNr].lock();
+        labelImage = labelImages[imageNr].lock();
+    }
+
+    const LabeledRGBDImage image = (rgbdImage && labelImage) ?
+            LabeledRGBDImage(rgbdImage, labelImage) : loadImage(imageNr);
+
+    std::vector<LabeledRGBDImage> releasedImages;
+    {
+        tbb::mutex::scoped_lock lock(mutex);
+        releasedImages = touch(imageNr, image);
+    }
+
+    // the last references of the released images might be dropped here
+    releasedImages.clear();
+
+    return image;
+}
+
+std::vector<LabeledRGBDImage> ImageDataset::getImages(const std::vector<size_t>& imageNrs) const {
+
+    std::vector<LabeledRGBDImage> images(imageNrs.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, imageNrs.size()),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t i = range.begin(); i != range.end(); i++) {
+                    images[i] = getImage(imageNrs[i]);
+                }
+            });
+
+    return images;
+}
+
+LabeledRGBDImage ImageDataset::loadImage(size_t imageNr) const {
+
+    const std::string& filename = filenames[imageNr];
+    const LabeledRGBDImage image = loadImagePair(filename, useCIELab, useDepthFilling);
+
+    if (width > 0 && (image.getWidth() != width || image.getHeight() != height)) {
+        std::ostringstream o;
+        o << "Image " << filename << " has different size: ";
+        o << image.getWidth() << "x" << image.getHeight();
+        o << ". All images in the dataset must have the same size (" << width << "x" << height << ")";
+        throw std::runtime_error(o.str());
+    }
+    if (imageSizeInMemory > 0 && image.getSizeInMemory() != imageSizeInMemory) {
+        std::ostringstream o;
+        o << "Image " << filename << " has different size in memory: ";
+        o << image.getSizeInMemory() << " (expected: " << imageSizeInMemory << ").";
+        o << " This must not happen.";
+        throw std::runtime_error(o.str());
+    }
+
+    if (maxPinnedMemory > 0) {
+        image.rgbdImage->pinMemory(maxPinnedMemory);
+    }
+
+    // the address of the image might be reused by an image that is loaded later
+    const boost::shared_ptr<RGBDImage> rgbdImage(image.rgbdImage.get(), ImageReleaser(image.rgbdImage));
+    const LabeledRGBDImage releasableImage(rgbdImage, image.labelImage);
+
+    tbb::mutex::scoped_lock lock(mutex);
+    rgbdImages[imageNr] = releasableImage.rgbdImage;
+    labelImages[imageNr] = releasableImage.labelImage;
+    if (++numLoads % 50 == 0) {
+        CURFIL_INFO("loaded " << numLoads << " images");
+    }
+
+    return releasableImage;
+}
+
+std::vector<LabeledRGBDImage> ImageDataset::touch(size_t imageNr, const LabeledRGBDImage& image) const {
+
+    if (resident[imageNr]) {
+        residentImages.splice(residentImages.begin(), residentImages, residentPositions[imageNr]);
+    } else {
+        residentImages.push_front(std::make_pair(imageNr, image));
+        residentPositions[imageNr] = residentImages.begin();
+        resident[imageNr] = true;
+        residentMemory += image.getSizeInMemory();
+    }
+
+    std::vector<LabeledRGBDImage> releasedImages;
+    if (maxHostMemory == 0) {
+        return releasedImages;
+    }
+
+    // the requested image is not released, even if it exceeds the budget on its own
+    while (residentMemory > maxHostMemory && residentImages.size() > 1) {
+        const std::pair<size_t, LabeledRGBDImage>& oldest = residentImages.back();
+        resident[oldest.first] = false;
+        residentMemory -= oldest.second.getSizeInMemory();
+        releasedImages.push_back(oldest.second);
+        residentImages.pop_back();
+    }
+
+    return releasedImages;
+}
+
+}
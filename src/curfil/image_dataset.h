@@ -0,0 +1,126 @@
+#ifndef CURFIL_IMAGE_DATASET_H
+#define CURFIL_IMAGE_DATASET_H
+
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <list>
+#include <string>
+#include <tbb/mutex.h>
+#include <vector>
+
+#include "image.h"
+
+namespace curfil {
+
+/**
+ * Handle of the images of a training folder that are loaded when they are needed for the first time.
+ *
+ * Only the filenames and the size of the first image are read when the dataset is opened. An image is loaded
+ * (from the preprocessing cache if there is one, see PreprocessingCache) when a tree samples it.
+ * The dataset keeps the most recently used images in memory up to the given host memory budget.
+ * Older images are freed as soon as no tree references them anymore and are loaded again if they are needed later.
+ */
+class ImageDataset {
+
+public:
+
+    /**
+     * @param maxHostMemoryMB the memory budget of the images that are not in use. 0 keeps all loaded images
+     * @param maxPinnedMemoryMB up to this many MB of images are page-locked, see RGBDImage::pinMemory()
+     */
+    ImageDataset(const std::string& folder, bool useCIELab, bool useDepthFilling, size_t maxHostMemoryMB = 0,
+            size_t maxPinnedMemoryMB = 0);
+
+    /**
+     * Wraps images that are already loaded. They are never released by the dataset.
+     */
+    explicit ImageDataset(const std::vector<LabeledRGBDImage>& images);
+
+    size_t size() const {
+        return filenames.size();
+    }
+
+    bool empty() const {
+        return filenames.empty();
+    }
+
+    const std::string& getFilename(size_t imageNr) const {
+        return filenames.at(imageNr);
+    }
+
+    /**
+     * @return the width of all images in the dataset
+     */
+    int getWidth() const {
+        return width;
+    }
+
+    /**
+     * @return the height of all images in the dataset
+     */
+    int getHeight() const {
+        return height;
+    }
+
+    /**
+     * @return the size of a RGB-D image and its label image in memory
+     */
+    size_t getImageSizeInMemory() const {
+        return imageSizeInMemory;
+    }
+
+    /**
+     * Loads the image if it is not in memory. The image stays alive as long as the returned handle exists.
+     */
+    LabeledRGBDImage getImage(size_t imageNr) const;
+
+    /**
+     * Loads the given images in parallel.
+     */
+    std::vector<LabeledRGBDImage> getImages(const std::vector<size_t>& imageNrs) const;
+
+    /**
+     * @return the number of times an image was loaded from disk
+     */
+    size_t getNumLoads() const;
+
+private:
+
+    std::vector<std::string> filenames;
+    bool useCIELab;
+    bool useDepthFilling;
+    size_t maxHostMemory;
+    size_t maxPinnedMemory;
+
+    int width;
+    int height;
+    size_t imageSizeInMemory;
+
+    // serializes the loading of each image
+    mutable std::vector<boost::shared_ptr<tbb::mutex> > loadMutexes;
+
+    mutable tbb::mutex mutex;
+
+    // all images that are alive, whether they are kept by the dataset or not
+    mutable std::vector<boost::weak_ptr<RGBDImage> > rgbdImages;
+    mutable std::vector<boost::weak_ptr<LabelImage> > labelImages;
+
+    // the images kept by the dataset. the most recently used image comes first
+    mutable std::list<std::pair<size_t, LabeledRGBDImage> > residentImages;
+    mutable std::vector<std::list<std::pair<size_t, LabeledRGBDImage> >::iterator> residentPositions;
+    mutable std::vector<bool> resident;
+    mutable size_t residentMemory;
+    mutable size_t numLoads;
+
+    LabeledRGBDImage loadImage(size_t imageNr) const;
+
+    // marks the image as most recently used. returns the released images which must be freed without the lock
+    std::vector<LabeledRGBDImage> touch(size_t imageNr, const LabeledRGBDImage& image) const;
+
+    ImageDataset(const ImageDataset&);
+    ImageDataset& operator=(const ImageDataset&);
+};
+
+}
+
+#endif
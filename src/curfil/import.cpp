@@ -9,6 +9,12 @@
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/property_tree/json_parser.hpp>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "export.h"
+#include "random_tree_image_gpu.h"
 
 namespace curfil {
 
@@ -22,7 +28,8 @@ XY RandomTreeImport::readXY(const boost::property_tree::ptree& pt) {
     return XY(x, y);
 }
 
-SplitFunction<PixelInstance, ImageFeatureFunction> RandomTreeImport::parseSplit(const boost::property_tree::ptree& pt) {
+SplitFunction<PixelInstance, ImageFeatureFunction> RandomTreeImport::parseSplit(const boost::property_tree::ptree& pt,
+        bool singlePrecision) {
 
     float threshold = pt.get<float>("threshold");
     ScoreType score = pt.get<ScoreType>("score");
@@ -62,12 +69,12 @@ SplitFunction<PixelInstance, ImageFeatureFunction> RandomTreeImport::parseSplit(
 
     ImageFeatureFunction feature(featureType, offset1, region1, channel1, offset2, region2, channel2);
 
-    SplitFunction<PixelInstance, ImageFeatureFunction> split(featureId, feature, threshold, score);
+    SplitFunction<PixelInstance, ImageFeatureFunction> split(featureId, feature, threshold, score, singlePrecision);
     return split;
 }
 
 boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > RandomTreeImport::readTree(
-        const boost::property_tree::ptree& pt,
+        const boost::property_tree::ptree& pt, bool singlePrecision,
         const boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >& parent) {
     int id = pt.get<int>("id");
     int level = pt.get<int>("level");
@@ -120,9 +127,9 @@ boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > RandomTreeIm
             RandomTree<PixelInstance, ImageFeatureFunction> >(id, level, parent, histogram);
 
     if (pt.find("left") != pt.not_found()) {
-        const auto split = parseSplit(pt.get_child("split"));
-        auto left = readTree(pt.get_child("left"), tree);
-        auto right = readTree(pt.get_child("right"), tree);
+        const auto split = parseSplit(pt.get_child("split"), singlePrecision);
+        auto left = readTree(pt.get_child("left"), singlePrecision, tree);
+        auto right = readTree(pt.get_child("right"), singlePrecision, tree);
         tree->addChildren(split, left, right);
     }
 
@@ -142,30 +149,7 @@ cuv::ndarray<WeightType, cuv::host_memory_space> RandomTreeImport::readClassLabe
     return classLabelPriorDistribution;
 }
 
-TrainingConfiguration RandomTreeImport::readJSON(const std::string& filename,
-        boost::shared_ptr<RandomTreeImage>& tree,
-        std::string& hostname,
-        boost::filesystem::path& folderTraining,
-        boost::posix_time::ptime& date) {
-
-    if (!boost::filesystem::is_regular_file(filename)) {
-        throw std::runtime_error(std::string("failed to read tree file: '") + filename + "' is not a regular file");
-    }
-
-    boost::property_tree::ptree pt;
-
-    boost::iostreams::filtering_istream istream;
-
-    if (boost::algorithm::ends_with(filename, ".gz")) {
-        istream.push(boost::iostreams::gzip_decompressor());
-    }
-    istream.push(boost::iostreams::file_source(filename));
-
-    boost::property_tree::read_json(istream, pt);
-
-    date = boost::posix_time::time_from_string(pt.get<std::string>("date"));
-    folderTraining = pt.get<boost::filesystem::path>("folderTraining");
-    hostname = pt.get<std::string>("hostname");
+TrainingConfiguration RandomTreeImport::readConfiguration(const boost::property_tree::ptree& pt) {
     int randomSeed = pt.get<int>("randomSeed");
     unsigned int samplesPerImage = pt.get<int>("samplesPerImage");
     unsigned int featureCount = pt.get<int>("featureCount");
@@ -204,10 +188,6 @@ TrainingConfiguration RandomTreeImport::readJSON(const std::string& filename,
     unsigned int maxSamplesPerBatch = pt.get<unsigned int>("maxSamplesPerBatch");
     const std::string accelerationModeString = pt.get<std::string>("accelerationMode");
 
-    const cuv::ndarray<WeightType, cuv::host_memory_space> classLabelPriorDistribution =
-            readClassLabelPriorDistribution(
-                    pt.get_child("classLabelPriorDistribution"));
-
     const std::vector<std::string> ignoredColors = fromPropertyTree<std::string>(
             pt.get_child_optional("ignoredColors"));
 
@@ -218,7 +198,52 @@ TrainingConfiguration RandomTreeImport::readJSON(const std::string& filename,
             TrainingConfiguration::parseAccelerationModeString(accelerationModeString), useCIELab, useDepthFilling,
             deviceIds, subsamplingType, ignoredColors);
 
-    boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > randomTree = readTree(pt.get_child("tree"));
+    const boost::optional<bool> singlePrecisionFeaturesValue = pt.get_optional<bool>("singlePrecisionFeatures");
+    if (singlePrecisionFeaturesValue) {
+        configuration.setSinglePrecisionFeatures(singlePrecisionFeaturesValue.get());
+    }
+
+    const boost::optional<bool> binnedSplitsValue = pt.get_optional<bool>("binnedSplits");
+    if (binnedSplitsValue) {
+        configuration.setBinnedSplits(binnedSplitsValue.get());
+    }
+
+    return configuration;
+}
+
+TrainingConfiguration RandomTreeImport::readJSON(const std::string& filename,
+        boost::shared_ptr<RandomTreeImage>& tree,
+        std::string& hostname,
+        boost::filesystem::path& folderTraining,
+        boost::posix_time::ptime& date) {
+
+    if (!boost::filesystem::is_regular_file(filename)) {
+        throw std::runtime_error(std::string("failed to read tree file: '") + filename + "' is not a regular file");
+    }
+
+    boost::property_tree::ptree pt;
+
+    boost::iostreams::filtering_istream istream;
+
+    if (boost::algorithm::ends_with(filename, ".gz")) {
+        istream.push(boost::iostreams::gzip_decompressor());
+    }
+    istream.push(boost::iostreams::file_source(filename));
+
+    boost::property_tree::read_json(istream, pt);
+
+    date = boost::posix_time::time_from_string(pt.get<std::string>("date"));
+    folderTraining = pt.get<boost::filesystem::path>("folderTraining");
+    hostname = pt.get<std::string>("hostname");
+
+    const TrainingConfiguration configuration = readConfiguration(pt);
+
+    const cuv::ndarray<WeightType, cuv::host_memory_space> classLabelPriorDistribution =
+            readClassLabelPriorDistribution(
+                    pt.get_child("classLabelPriorDistribution"));
+
+    boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > randomTree = readTree(pt.get_child("tree"),
+            configuration.isSinglePrecisionSplits());
     assert(randomTree->isRoot());
 
     tree = boost::make_shared<RandomTreeImage>(randomTree, configuration, classLabelPriorDistribution);
@@ -226,4 +251,185 @@ TrainingConfiguration RandomTreeImport::readJSON(const std::string& filename,
     return configuration;
 }
 
+bool RandomTreeImport::isBinary(const std::string& filename) {
+    char magic[sizeof(BINARY_FOREST_MAGIC)];
+    std::ifstream istream(filename.c_str(), std::ios::binary);
+    return istream.read(magic, sizeof(magic)) && memcmp(magic, BINARY_FOREST_MAGIC, sizeof(magic)) == 0;
+}
+
+bool RandomTreeImport::isManifest(const std::string& filename) {
+    return boost::algorithm::ends_with(filename, FOREST_MANIFEST_EXTENSION);
+}
+
+std::vector<std::string> RandomTreeImport::readManifest(const std::string& filename) {
+
+    boost::property_tree::ptree pt;
+    boost::property_tree::read_json(filename, pt);
+
+    const int manifestVersion = pt.get<int>("manifestVersion");
+    if (manifestVersion != FOREST_MANIFEST_VERSION) {
+        throw std::runtime_error((boost::format("unsupported version of forest manifest '%s': %d (expected: %d)")
+                % filename % manifestVersion % FOREST_MANIFEST_VERSION).str());
+    }
+
+    const boost::filesystem::path folder = boost::filesystem::path(filename).parent_path();
+
+    std::vector<std::string> treeFiles;
+    for (const std::string& treeFile : fromPropertyTree<std::string>(pt.get_child_optional("trees"))) {
+        const boost::filesystem::path path(treeFile);
+        treeFiles.push_back(path.is_absolute() ? path.string() : (folder / path).string());
+    }
+
+    if (treeFiles.empty()) {
+        throw std::runtime_error(std::string("forest manifest lists no trees: ") + filename);
+    }
+
+    return treeFiles;
+}
+
+TrainingConfiguration RandomTreeImport::readBinary(const std::string& filename,
+        std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        std::vector<cuv::ndarray<WeightType, cuv::host_memory_space> >& classLabelPriorDistributions,
+        double& histogramBias) {
+
+    utils::Timer timer;
+
+    const boost::shared_ptr<const utils::MappedFile> file = boost::make_shared<const utils::MappedFile>(filename);
+
+    if (file->getSize() < sizeof(BinaryForestHeader)) {
+        throw std::runtime_error(std::string("binary forest file is truncated: ") + filename);
+    }
+
+    const BinaryForestHeader& header = *reinterpret_cast<const BinaryForestHeader*>(file->ptr());
+
+    if (memcmp(header.magic, BINARY_FOREST_MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error(std::string("not a binary forest file: ") + filename);
+    }
+    if (header.version != BINARY_FOREST_VERSION) {
+        throw std::runtime_error((boost::format("unsupported version of binary forest file '%s': %d (expected: %d)")
+                % filename % header.version % BINARY_FOREST_VERSION).str());
+    }
+    if (header.nodeSize != TreeNodes::getNodeSize() || header.nodesPerLayer != NODES_PER_TREE_LAYER) {
+        throw std::runtime_error((boost::format("binary forest file '%s' has an incompatible node layout")
+                % filename).str());
+    }
+    if (header.fileSize != file->getSize() || header.numTrees == 0 || header.numLabels == 0
+            || header.numLabels > 256) {
+        throw std::runtime_error(std::string("binary forest file is truncated or corrupt: ") + filename);
+    }
+
+    // all sections must be inside of the file
+    const auto checkSection = [&](uint64_t offset, uint64_t size) {
+        if (offset % BINARY_FOREST_ALIGNMENT != 0 || offset > header.fileSize || size > header.fileSize - offset) {
+            throw std::runtime_error((boost::format("binary forest file '%s' is corrupt: illegal section at %d")
+                    % filename % offset).str());
+        }
+    };
+
+    checkSection(header.configurationOffset, header.configurationSize);
+    checkSection(header.paletteOffset, 3 * header.numLabels);
+    checkSection(header.treesOffset, header.numTrees * sizeof(BinaryForestTree));
+
+    boost::property_tree::ptree pt;
+    std::istringstream configurationStream(std::string(
+            reinterpret_cast<const char*>(file->ptr() + header.configurationOffset), header.configurationSize));
+    boost::property_tree::read_json(configurationStream, pt);
+
+    const TrainingConfiguration configuration = readConfiguration(pt);
+
+    // the label ids of the forest must decode to the colors of the training
+    const uint8_t* palette = reinterpret_cast<const uint8_t*>(file->ptr() + header.paletteOffset);
+    for (size_t label = 0; label < header.numLabels; label++) {
+        const RGBColor color(palette[3 * label], palette[3 * label + 1], palette[3 * label + 2]);
+        const LabelType id = getOrAddColorId(color, label);
+        if (id != label) {
+            throw std::runtime_error((boost::format("binary forest file '%s': color %s of label %d is already "
+                    "assigned to label %d") % filename % color % label % static_cast<int>(id)).str());
+        }
+    }
+
+    const BinaryForestTree* treeHeaders = reinterpret_cast<const BinaryForestTree*>(file->ptr()
+            + header.treesOffset);
+
+    trees.clear();
+    classLabelPriorDistributions.clear();
+
+    for (size_t treeNr = 0; treeNr < header.numTrees; treeNr++) {
+        const BinaryForestTree& treeHeader = treeHeaders[treeNr];
+
+        checkSection(treeHeader.priorOffset, header.numLabels * sizeof(uint32_t));
+        checkSection(treeHeader.nodesOffset, treeHeader.nodeLayers * NODES_PER_TREE_LAYER * header.nodeSize);
+        checkSection(treeHeader.histogramsOffset,
+                treeHeader.leafLayers * NODES_PER_TREE_LAYER * header.numLabels * sizeof(float));
+
+        const uint32_t* prior = reinterpret_cast<const uint32_t*>(file->ptr() + treeHeader.priorOffset);
+        cuv::ndarray<WeightType, cuv::host_memory_space> priorDistribution(header.numLabels);
+        for (size_t label = 0; label < header.numLabels; label++) {
+            priorDistribution[label] = prior[label];
+        }
+        classLabelPriorDistributions.push_back(priorDistribution);
+
+        trees.push_back(boost::make_shared<const TreeNodes>(treeHeader.treeId, treeHeader.numNodes,
+                treeHeader.numLeaves, header.numLabels,
+                treeHeader.nodeLayers, file->ptr() + treeHeader.nodesOffset,
+                treeHeader.leafLayers, reinterpret_cast<const float*>(file->ptr() + treeHeader.histogramsOffset),
+                file));
+    }
+
+    histogramBias = header.histogramBias;
+
+    CURFIL_INFO("mapped " << header.numTrees << " trees from " << filename << " in " << timer.format(3));
+
+    return configuration;
+}
+
+RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction> RandomTreeImport::readCheckpoint(
+        const std::string& filename, const TrainingConfiguration& configuration) {
+
+    if (!boost::filesystem::is_regular_file(filename)) {
+        throw std::runtime_error(std::string("failed to read checkpoint: '") + filename + "' is not a regular file");
+    }
+
+    boost::property_tree::ptree pt;
+
+    boost::iostreams::filtering_istream istream;
+
+    if (boost::algorithm::ends_with(filename, ".gz")) {
+        istream.push(boost::iostreams::gzip_decompressor());
+    }
+    istream.push(boost::iostreams::file_source(filename));
+
+    boost::property_tree::read_json(istream, pt);
+
+    const boost::property_tree::ptree& checkpointConfiguration = pt.get_child("configuration");
+    const boost::property_tree::ptree expectedConfiguration = RandomTreeExport::getCheckpointConfiguration(
+            configuration);
+
+    boost::property_tree::ptree::const_iterator it;
+    for (it = expectedConfiguration.begin(); it != expectedConfiguration.end(); it++) {
+        const boost::optional<const boost::property_tree::ptree&> value =
+                checkpointConfiguration.get_child_optional(it->first);
+        if (!value || value.get() != it->second) {
+            throw std::runtime_error(boost::str(
+                    boost::format("checkpoint '%s' was written with a different configuration value of '%s'")
+                            % filename % it->first));
+        }
+    }
+
+    RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction> checkpoint(pt.get<size_t>("samples"));
+
+    for (it = pt.get_child("splits").begin(); it != pt.get_child("splits").end(); it++) {
+        checkpoint.addSplit(it->second.get<size_t>("nodeId"),
+                parseSplit(it->second, configuration.isSinglePrecisionSplits()));
+    }
+
+    checkpoint.setState(pt.get<int>("level"), pt.get<int>("idNode"), pt.get<int>("randomSource"));
+
+    for (it = pt.get_child("frontier").begin(); it != pt.get_child("frontier").end(); it++) {
+        checkpoint.addFrontierNode(it->second.get<size_t>("nodeId"), it->second.get<size_t>("samples"));
+    }
+
+    return checkpoint;
+}
+
 }
@@ -5,6 +5,7 @@
 #include <boost/filesystem.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <string>
+#include <vector>
 
 #include "random_forest_image.h"
 
@@ -28,14 +29,54 @@ public:
             boost::filesystem::path& folderTraining,
             boost::posix_time::ptime& date);
 
+    /**
+     * @return true if the file starts with the magic of a binary forest file
+     */
+    static bool isBinary(const std::string& filename);
+
+    /**
+     * @return true if the file has the extension of a forest manifest, see RandomTreeExport::writeManifest()
+     */
+    static bool isManifest(const std::string& filename);
+
+    /**
+     * @return the tree files that are listed in the manifest. relative paths are resolved against the folder of
+     *         the manifest
+     */
+    static std::vector<std::string> readManifest(const std::string& filename);
+
+    /**
+     * load a random forest that was written with RandomTreeExport::writeBinary().
+     * The file is memory-mapped and the tree nodes refer to the mapped pages without parsing or copying them.
+     * Processes that load the same file share one copy in the page cache.
+     *
+     * @param histogramBias the bias the histograms in the file were normalized with
+     */
+    static TrainingConfiguration readBinary(const std::string& filename,
+            std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+            std::vector<cuv::ndarray<WeightType, cuv::host_memory_space> >& classLabelPriorDistributions,
+            double& histogramBias);
+
+    /**
+     * load the checkpoint of a partially trained tree that was written with RandomTreeExport::writeCheckpoint()
+     *
+     * @throws std::runtime_error if the checkpoint was written with a different configuration
+     */
+    static RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction> readCheckpoint(const std::string& filename,
+            const TrainingConfiguration& configuration);
+
 private:
 
+    static TrainingConfiguration readConfiguration(const boost::property_tree::ptree& pt);
+
     static XY readXY(const boost::property_tree::ptree& pt);
 
-    static SplitFunction<PixelInstance, ImageFeatureFunction> parseSplit(const boost::property_tree::ptree& pt);
+    // singlePrecision: see TrainingConfiguration::isSinglePrecisionSplits()
+    static SplitFunction<PixelInstance, ImageFeatureFunction> parseSplit(const boost::property_tree::ptree& pt,
+            bool singlePrecision);
 
     static boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > readTree(
-            const boost::property_tree::ptree& pt,
+            const boost::property_tree::ptree& pt, bool singlePrecision,
             const boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >& parent = boost::shared_ptr<
                     RandomTree<PixelInstance, ImageFeatureFunction> >());
 
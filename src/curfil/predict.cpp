@@ -3,11 +3,13 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <iomanip>
-#include <tbb/mutex.h>
-#include <tbb/parallel_for_each.h>
-#include <tbb/parallel_for.h>
+#include <tbb/enumerable_thread_specific.h>
+#include <tbb/pipeline.h>
+#include <tbb/task_scheduler_init.h>
 
+#include "device_memory.h"
 #include "image.h"
+#include "image_dataset.h"
 #include "ndarray_ops.h"
 #include "random_forest_image.h"
 #include "random_tree_image.h"
@@ -161,6 +163,105 @@ double calculatePixelAccuracy(const LabelImage& prediction, const LabelImage& gr
     return static_cast<double>(correct) / numPixels;
 }
 
+PredictionScheduler::PredictionScheduler(const RandomForestImage& randomForest, bool useGPU, bool useCPU) :
+        randomForest(randomForest), useGPU(useGPU), useCPU(useCPU), gpuQueueLength(), gpuMutex(),
+                statisticsMutex(), gpuMillisecondsPerPixel(0.0), cpuMillisecondsPerPixel(0.0),
+                numPredictedOnGPU(), numPredictedOnCPU() {
+    if (!useGPU && !useCPU) {
+        throw std::runtime_error("prediction needs at least the CPU or the GPU");
+    }
+    gpuQueueLength = 0;
+    numPredictedOnGPU = 0;
+    numPredictedOnCPU = 0;
+}
+
+bool PredictionScheduler::shouldPredictOnGPU(size_t numPixels) {
+    if (!useCPU) {
+        return true;
+    }
+    if (!useGPU) {
+        return false;
+    }
+
+    const int waiting = gpuQueueLength;
+    if (waiting == 0) {
+        return true;
+    }
+
+    tbb::mutex::scoped_lock lock(statisticsMutex);
+    if (cpuMillisecondsPerPixel == 0.0) {
+        // the GPU is busy and the CPU was not measured yet
+        return false;
+    }
+
+    const double gpuMilliseconds = (waiting + 1) * gpuMillisecondsPerPixel * numPixels;
+    const double cpuMilliseconds = cpuMillisecondsPerPixel * numPixels;
+    return gpuMilliseconds <= cpuMilliseconds;
+}
+
+void PredictionScheduler::addMeasurement(double& millisecondsPerPixel, double milliseconds, size_t numPixels) {
+    // adapts to changes in the load within a few images
+    static const double weight = 0.25;
+
+    tbb::mutex::scoped_lock lock(statisticsMutex);
+    const double value = milliseconds / numPixels;
+    if (millisecondsPerPixel == 0.0) {
+        millisecondsPerPixel = value;
+    } else {
+        millisecondsPerPixel = (1.0 - weight) * millisecondsPerPixel + weight * value;
+    }
+}
+
+LabelImage PredictionScheduler::predict(const RGBDImage& image,
+        cuv::ndarray<float, cuv::host_memory_space>* probabilities) {
+
+    const size_t numPixels = static_cast<size_t>(image.getWidth()) * image.getHeight();
+    assert(numPixels > 0);
+
+    if (shouldPredictOnGPU(numPixels)) {
+        gpuQueueLength++;
+        try {
+            tbb::mutex::scoped_lock lock(gpuMutex);
+            utils::Timer timer;
+            LabelImage prediction = randomForest.predict(image, probabilities, true);
+            addMeasurement(gpuMillisecondsPerPixel, timer.getMilliseconds(), numPixels);
+            gpuQueueLength--;
+            numPredictedOnGPU++;
+            return prediction;
+        } catch (...) {
+            gpuQueueLength--;
+            throw;
+        }
+    }
+
+    utils::Timer timer;
+    LabelImage prediction = randomForest.predict(image, probabilities, false);
+    addMeasurement(cpuMillisecondsPerPixel, timer.getMilliseconds(), numPixels);
+    numPredictedOnCPU++;
+    return prediction;
+}
+
+namespace {
+
+/**
+ * The state of one test image while it passes through the stages of the prediction pipeline.
+ */
+struct PredictionItem {
+    size_t fileNr;
+    LabeledRGBDImage imageLabelPair;
+    LabelImage prediction;
+    cuv::ndarray<float, cuv::host_memory_space> probabilities;
+    double accuracy;
+    double accuracyWithoutVoid;
+
+    explicit PredictionItem(size_t fileNr) :
+            fileNr(fileNr), imageLabelPair(), prediction(0, 0), probabilities(),
+                    accuracy(0.0), accuracyWithoutVoid(0.0) {
+    }
+};
+
+}
+
 void test(RandomForestImage& randomForest, const std::string& folderTesting,
         const std::string& folderPrediction, const bool useDepthFilling,
         const bool writeProbabilityImages) {
@@ -179,138 +280,184 @@ void test(RandomForestImage& randomForest, const std::string& folderTesting,
         CURFIL_INFO("label: " << static_cast<int>(labelColor.first) << ", color: RGB(" << color << ")");
     }
 
-    tbb::mutex totalMutex;
     utils::Average averageAccuracy;
     utils::Average averageAccuracyWithoutVoid;
 
     const LabelType numClasses = randomForest.getNumClasses();
     ConfusionMatrix totalConfusionMatrix(numClasses);
 
-    size_t i = 0;
+    // one confusion matrix per thread that are merged after all images were processed
+    tbb::enumerable_thread_specific<ConfusionMatrix> confusionMatrices;
 
     const bool useCIELab = randomForest.getConfiguration().isUseCIELab();
     CURFIL_INFO("CIELab: " << useCIELab);
     CURFIL_INFO("DepthFilling: " << useDepthFilling);
 
-    bool onGPU = randomForest.getConfiguration().getAccelerationMode() == GPU_ONLY;
-
-    size_t grainSize = 1;
-    if (!onGPU) {
-        grainSize = filenames.size();
+    const AccelerationMode accelerationMode = randomForest.getConfiguration().getAccelerationMode();
+    const bool useGPU = (accelerationMode != CPU_ONLY);
+    const bool useCPU = (accelerationMode == CPU_ONLY || accelerationMode == HYBRID);
+
+    if (useGPU) {
+        // the tree cache and the buffers of the predicted images, see RandomForestImage::predict()
+        const DeviceMemoryPlan plan(ImageDataset(folderTesting, useCIELab, useDepthFilling),
+                randomForest.getConfiguration().getDeviceIds(), 0, 0, 0,
+                randomForest.getConfiguration().isSinglePrecisionFeatures(), numClasses,
+                randomForest.getTrees().size());
+        plan.apply();
+        CURFIL_INFO("device memory plan: " << plan);
     }
 
+    PredictionScheduler scheduler(randomForest, useGPU, useCPU);
+
+    // several images are classified at the same time only if they are shared between the CPU and the GPU
+    const tbb::filter::mode predictMode =
+            (useGPU && useCPU) ? tbb::filter::parallel : tbb::filter::serial_out_of_order;
+
     bool writeImages = true;
     if (folderPrediction.empty()) {
         CURFIL_WARNING("no prediction folder given. will not write images");
         writeImages = false;
     }
 
-    tbb::parallel_for(tbb::blocked_range<size_t>(0, filenames.size(), grainSize),
-            [&](const tbb::blocked_range<size_t>& range) {
-                for(size_t fileNr = range.begin(); fileNr != range.end(); fileNr++) {
-                    const std::string& filename = filenames[fileNr];
-                    const auto imageLabelPair = loadImagePair(filename, useCIELab, useDepthFilling);
-                    const RGBDImage& testImage = imageLabelPair.getRGBDImage();
-                    const LabelImage& groundTruth = imageLabelPair.getLabelImage();
-                    LabelImage prediction(testImage.getWidth(), testImage.getHeight());
-
-                    for(int y = 0; y < groundTruth.getHeight(); y++) {
-                        for(int x = 0; x < groundTruth.getWidth(); x++) {
-                            const LabelType label = groundTruth.getLabel(x, y);
-                            if (label >= numClasses) {
-                                const auto msg = (boost::format("illegal label in ground truth image '%s' at pixel (%d,%d): %d RGB(%3d,%3d,%3d) (numClasses: %d)")
-                                        % filename
-                                        % x % y
-                                        % static_cast<int>(label)
-                                        % LabelImage::decodeLabel(label)[0]
-                                        % LabelImage::decodeLabel(label)[1]
-                                        % LabelImage::decodeLabel(label)[2]
-                                        % static_cast<int>(numClasses)
-                                ).str();
-                                throw std::runtime_error(msg);
-                            }
-                        }
-                    }
-
-                    boost::filesystem::path fn(testImage.getFilename());
-                    const std::string basepath = folderPrediction + "/" + boost::filesystem::basename(fn);
+    // bounds the number of decoded images that are held in memory at the same time
+    const size_t maxImagesInFlight = 2 * tbb::task_scheduler_init::default_num_threads();
 
-                    cuv::ndarray<float, cuv::host_memory_space> probabilities;
+    size_t nextFileNr = 0;
+    size_t numPredicted = 0;
 
-                    prediction = randomForest.predict(testImage, &probabilities, onGPU);
+    // decoding and writing of images runs in parallel while a single stage feeds the GPU
+    tbb::parallel_pipeline(maxImagesInFlight,
+            tbb::make_filter<void, PredictionItem*>(tbb::filter::serial_in_order,
+                    [&](tbb::flow_control& fc) -> PredictionItem* {
+                        if (nextFileNr >= filenames.size()) {
+                            fc.stop();
+                            return 0;
+                        }
+                        return new PredictionItem(nextFileNr++);
+                    })
+            & tbb::make_filter<PredictionItem*, PredictionItem*>(tbb::filter::parallel,
+                    [&](PredictionItem* item) {
+                        const std::string& filename = filenames[item->fileNr];
+                        item->imageLabelPair = loadImagePair(filename, useCIELab, useDepthFilling);
+                        const LabelImage& groundTruth = item->imageLabelPair.getLabelImage();
+
+                        for(int y = 0; y < groundTruth.getHeight(); y++) {
+                            for(int x = 0; x < groundTruth.getWidth(); x++) {
+                                const LabelType label = groundTruth.getLabel(x, y);
+                                if (label >= numClasses) {
+                                    const auto msg = (boost::format("illegal label in ground truth image '%s' at pixel (%d,%d): %d RGB(%3d,%3d,%3d) (numClasses: %d)")
+                                            % filename
+                                            % x % y
+                                            % static_cast<int>(label)
+                                            % LabelImage::decodeLabel(label)[0]
+                                            % LabelImage::decodeLabel(label)[1]
+                                            % LabelImage::decodeLabel(label)[2]
+                                            % static_cast<int>(numClasses)
+                                    ).str();
+                                    delete item;
+                                    throw std::runtime_error(msg);
+                                }
+                            }
+                        }
+                        return item;
+                    })
+            & tbb::make_filter<PredictionItem*, PredictionItem*>(predictMode,
+                    [&](PredictionItem* item) {
+                        item->prediction = scheduler.predict(item->imageLabelPair.getRGBDImage(),
+                                &item->probabilities);
+                        return item;
+                    })
+            & tbb::make_filter<PredictionItem*, PredictionItem*>(tbb::filter::parallel,
+                    [&](PredictionItem* item) {
+                        const RGBDImage& testImage = item->imageLabelPair.getRGBDImage();
+                        const LabelImage& groundTruth = item->imageLabelPair.getLabelImage();
+                        const LabelImage& prediction = item->prediction;
+                        const cuv::ndarray<float, cuv::host_memory_space>& probabilities = item->probabilities;
+
+                        boost::filesystem::path fn(testImage.getFilename());
+                        const std::string basepath = folderPrediction + "/" + boost::filesystem::basename(fn);
 
 #ifndef NDEBUG
-            for(LabelType label = 0; label < randomForest.getNumClasses(); label++) {
-                if (!randomForest.shouldIgnoreLabel(label)) {
-                    continue;
-                }
-
-                // ignored classes must not be predicted as we did not sample them
-                for(size_t y = 0; y < probabilities.shape(0); y++) {
-                    for(size_t x = 0; x < probabilities.shape(1); x++) {
-                        const float& probability = probabilities(label, y, x);
-                        assert(probability == 0.0);
-                    }
-                }
-            }
-#endif
-
-            if (writeImages && writeProbabilityImages) {
-                utils::Profile profile("writeProbabilityImages");
-                RGBDImage probabilityImage(testImage.getWidth(), testImage.getHeight());
-                for(LabelType label = 0; label< randomForest.getNumClasses(); label++) {
+                        for(LabelType label = 0; label < randomForest.getNumClasses(); label++) {
+                            if (!randomForest.shouldIgnoreLabel(label)) {
+                                continue;
+                            }
 
-                    if (randomForest.shouldIgnoreLabel(label)) {
-                        continue;
-                    }
+                            // ignored classes must not be predicted as we did not sample them
+                            for(size_t y = 0; y < probabilities.shape(1); y++) {
+                                for(size_t x = 0; x < probabilities.shape(2); x++) {
+                                    const float& probability = probabilities(label, y, x);
+                                    assert(probability == 0.0);
+                                }
+                            }
+                        }
+#endif
 
-                    for(int y = 0; y < probabilityImage.getHeight(); y++) {
-                        for(int x = 0; x < probabilityImage.getWidth(); x++) {
-                            const float& probability = probabilities(label, y, x);
-                            for(int c=0; c<3; c++) {
-                                probabilityImage.setColor(x, y, c, probability);
+                        if (writeImages && writeProbabilityImages) {
+                            utils::Profile profile("writeProbabilityImages");
+                            RGBDImage probabilityImage(testImage.getWidth(), testImage.getHeight());
+                            for(LabelType label = 0; label< randomForest.getNumClasses(); label++) {
+
+                                if (randomForest.shouldIgnoreLabel(label)) {
+                                    continue;
+                                }
+
+                                for(int y = 0; y < probabilityImage.getHeight(); y++) {
+                                    for(int x = 0; x < probabilityImage.getWidth(); x++) {
+                                        const float& probability = probabilities(label, y, x);
+                                        for(int c=0; c<3; c++) {
+                                            probabilityImage.setColor(x, y, c, probability);
+                                        }
+                                    }
+                                }
+                                const std::string filename = (boost::format("%s_label_%d.png")
+                                        % basepath % static_cast<int>(label)).str();
+                                probabilityImage.saveColor(filename);
                             }
                         }
-                    }
-                    const std::string filename = (boost::format("%s_label_%d.png") % basepath % static_cast<int>(label)).str();
-                    probabilityImage.saveColor(filename);
-                }
-            }
 
-            int thisNumber;
+                        if (writeImages) {
+                            utils::Profile profile("writeImages");
+                            testImage.saveColor(basepath + ".png");
+                            testImage.saveDepth(basepath + "_depth.png");
+                            groundTruth.save(basepath + "_ground_truth.png");
+                            prediction.save(basepath + "_prediction.png");
+                        }
 
-            {
-                tbb::mutex::scoped_lock total(totalMutex);
-                thisNumber = i++;
-            }
+                        bool exists = false;
+                        ConfusionMatrix& confusionMatrix = confusionMatrices.local(exists);
+                        if (!exists) {
+                            confusionMatrix.resize(numClasses);
+                        }
 
-            if (writeImages) {
-                utils::Profile profile("writeImages");
-                testImage.saveColor(basepath + ".png");
-                testImage.saveDepth(basepath + "_depth.png");
-                groundTruth.save(basepath + "_ground_truth.png");
-                prediction.save(basepath + "_prediction.png");
-            }
+                        item->accuracy = calculatePixelAccuracy(prediction, groundTruth, true, &confusionMatrix);
+                        item->accuracyWithoutVoid = calculatePixelAccuracy(prediction, groundTruth, false);
 
-            ConfusionMatrix confusionMatrix(numClasses);
-            double accuracy = calculatePixelAccuracy(prediction, groundTruth, true, &confusionMatrix);
-            double accuracyWithoutVoid = calculatePixelAccuracy(prediction, groundTruth, false);
+                        // the images are not needed anymore
+                        item->imageLabelPair = LabeledRGBDImage();
+                        item->probabilities = cuv::ndarray<float, cuv::host_memory_space>();
 
-            tbb::mutex::scoped_lock lock(totalMutex);
+                        return item;
+                    })
+            & tbb::make_filter<PredictionItem*, void>(tbb::filter::serial_out_of_order,
+                    [&](PredictionItem* item) {
+                        CURFIL_INFO("prediction " << (++numPredicted) << "/" << filenames.size()
+                                << " (" << filenames[item->fileNr] << "): pixel accuracy (without void): "
+                                << 100 * item->accuracy << " (" << 100 * item->accuracyWithoutVoid << ")");
 
-            CURFIL_INFO("prediction " << (thisNumber + 1) << "/" << filenames.size()
-                    << " (" << testImage.getFilename() << "): pixel accuracy (without void): " << 100 * accuracy
-                    << " (" << 100 * accuracyWithoutVoid << ")");
+                        averageAccuracy.addValue(item->accuracy);
+                        averageAccuracyWithoutVoid.addValue(item->accuracyWithoutVoid);
 
-            averageAccuracy.addValue(accuracy);
-            averageAccuracyWithoutVoid.addValue(accuracyWithoutVoid);
+                        delete item;
+                    }));
 
-            totalConfusionMatrix += confusionMatrix;
-        }
+    CURFIL_INFO("predicted " << scheduler.getNumPredictedOnGPU() << " images on the GPU and "
+            << scheduler.getNumPredictedOnCPU() << " images on the CPU");
 
-    });
+    for (const ConfusionMatrix& confusionMatrix : confusionMatrices) {
+        totalConfusionMatrix += confusionMatrix;
+    }
 
-    tbb::mutex::scoped_lock lock(totalMutex);
     double accuracy = averageAccuracy.getAverage();
     double accuracyWithoutVoid = averageAccuracyWithoutVoid.getAverage();
 
@@ -320,6 +467,10 @@ void test(RandomForestImage& randomForest, const std::string& folderTesting,
 
     CURFIL_INFO("pixel accuracy: " << 100 * accuracy);
     CURFIL_INFO("pixel accuracy without void: " << 100 * accuracyWithoutVoid);
+
+    if (useGPU) {
+        DeviceMemoryUsage::log();
+    }
 }
 
 }
@@ -3,6 +3,8 @@
 
 #include <cuv/ndarray.hpp>
 #include <string>
+#include <tbb/atomic.h>
+#include <tbb/mutex.h>
 
 #include "random_forest_image.h"
 
@@ -85,6 +87,59 @@ public:
 double calculatePixelAccuracy(const LabelImage& prediction, const LabelImage& groundTruth,
         const bool includeVoid = true, ConfusionMatrix* confusionMatrix = 0);
 
+/**
+ * Shares the prediction of images between the GPU and the CPU.
+ *
+ * An image is classified on the GPU whenever the GPU is idle. Otherwise, it is classified on the CPU if the measured
+ * time per pixel on the CPU is shorter than the time it would wait for and be classified on the GPU.
+ * predict() may be called concurrently.
+ */
+class PredictionScheduler {
+
+public:
+
+    PredictionScheduler(const RandomForestImage& randomForest, bool useGPU, bool useCPU);
+
+    LabelImage predict(const RGBDImage& image, cuv::ndarray<float, cuv::host_memory_space>* probabilities = 0);
+
+    size_t getNumPredictedOnGPU() const {
+        return numPredictedOnGPU;
+    }
+
+    size_t getNumPredictedOnCPU() const {
+        return numPredictedOnCPU;
+    }
+
+private:
+
+    const RandomForestImage& randomForest;
+    const bool useGPU;
+    const bool useCPU;
+
+    // images that are classified on or wait for the GPU
+    tbb::atomic<int> gpuQueueLength;
+    tbb::mutex gpuMutex;
+
+    // moving averages of the wall-clock milliseconds per pixel. zero until the first measurement
+    tbb::mutex statisticsMutex;
+    double gpuMillisecondsPerPixel;
+    double cpuMillisecondsPerPixel;
+
+    tbb::atomic<size_t> numPredictedOnGPU;
+    tbb::atomic<size_t> numPredictedOnCPU;
+
+    bool shouldPredictOnGPU(size_t numPixels);
+
+    void addMeasurement(double& millisecondsPerPixel, double milliseconds, size_t numPixels);
+
+    PredictionScheduler(const PredictionScheduler&);
+    PredictionScheduler& operator=(const PredictionScheduler&);
+};
+
+/**
+ * Classifies the images on the CPU or on the GPU according to the acceleration mode of the forest.
+ * In HYBRID mode, the images are shared between the GPU and the CPU, see PredictionScheduler.
+ */
 void test(RandomForestImage& randomForest, const std::string& folderTesting,
         const std::string& folderPrediction, const bool useDepthFilling,
         const bool writeProbabilityImages);
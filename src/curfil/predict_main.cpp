@@ -3,12 +3,17 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
+#include <csignal>
 #include <iomanip>
 #include <tbb/task_scheduler_init.h>
 
+#include "export.h"
 #include "import.h"
+#include "preprocessing_cache.h"
 #include "random_forest_image.h"
 #include "random_tree_image.h"
+#include "server.h"
+#include "trace.h"
 #include "utils.h"
 #include "version.h"
 
@@ -16,6 +21,14 @@ namespace po = boost::program_options;
 
 using namespace curfil;
 
+static PredictionServer* runningServer = 0;
+
+static void stopServer(int) {
+    if (runningServer) {
+        runningServer->stop();
+    }
+}
+
 static void initDevice(int deviceId) {
     cudaDeviceProp prop;
 
@@ -37,10 +50,15 @@ int main(int argc, char **argv) {
     int numThreads;
     double histogramBias = 0.0;
     bool profiling = false;
+    std::string traceFile;
     std::string modeString = "gpu";
     int deviceId = 0;
     bool useDepthFillingOption = false;
     bool writeProbabilityImages = false;
+    std::string serverSocket = "";
+    int maxBatchSize = 8;
+    std::string binaryForestFile = "";
+    std::string cacheFolder;
 
     // Declare the supported options.
     po::options_description options("options");
@@ -49,20 +67,32 @@ int main(int argc, char **argv) {
     ("version", "show version and exit")
     ("folderPrediction", po::value<std::string>(&folderPrediction)->default_value(folderPrediction),
             "folder to output prediction images. leave it empty to suppress writing of prediction images")
-    ("folderTesting", po::value<std::string>(&folderTesting)->required(), "folder with test images")
-    ("treeFile", po::value<std::vector<std::string> >(&treeFiles)->required(), "serialized tree(s) (JSON)")
+    ("folderTesting", po::value<std::string>(&folderTesting), "folder with test images")
+    ("treeFile", po::value<std::vector<std::string> >(&treeFiles)->required(),
+            "serialized tree(s) (JSON), a binary forest file or a forest manifest")
     ("histogramBias", po::value<double>(&histogramBias)->default_value(histogramBias), "histogram bias")
     ("numThreads", po::value<int>(&numThreads)->default_value(tbb::task_scheduler_init::default_num_threads()),
             "number of threads")
-    ("mode", po::value<std::string>(&modeString)->default_value(modeString), "mode: 'cpu' or 'gpu'")
+    ("mode", po::value<std::string>(&modeString)->default_value(modeString),
+            "mode: 'cpu', 'gpu' or 'hybrid' (share the images between the CPU and the GPU)")
     ("deviceId", po::value<int>(&deviceId)->default_value(deviceId), "GPU device id")
     ("profile", po::value<bool>(&profiling)->implicit_value(true)->default_value(profiling), "profiling")
+    ("trace", po::value<std::string>(&traceFile)->default_value(traceFile),
+            "record the host and GPU spans of the prediction and write them to this file in the Chrome trace format")
     ("useDepthFilling",
             po::value<bool>(&useDepthFillingOption)->implicit_value(true)->default_value(useDepthFillingOption),
             "whether to do simple depth filling")
     ("writeProbabilityImages",
             po::value<bool>(&writeProbabilityImages)->implicit_value(true)->default_value(writeProbabilityImages),
             "whether to write probability PNGs of the prediction")
+    ("cacheFolder", po::value<std::string>(&cacheFolder)->default_value(cacheFolder),
+            "cache the preprocessed images in this folder and load them from there in subsequent runs")
+    ("serve", po::value<std::string>(&serverSocket)->default_value(serverSocket),
+            "run as prediction server on the given UNIX domain socket instead of predicting a folder")
+    ("maxBatchSize", po::value<int>(&maxBatchSize)->default_value(maxBatchSize),
+            "maximal number of server requests that are classified together")
+    ("writeBinary", po::value<std::string>(&binaryForestFile)->default_value(binaryForestFile),
+            "write the forest with normalized histograms to the given binary file that loads without parsing")
             ;
 
     po::positional_options_description pod;
@@ -90,6 +120,11 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    if (serverSocket.empty() && binaryForestFile.empty() && folderTesting.empty()) {
+        std::cerr << "the option '--folderTesting' is required but missing" << std::endl;
+        return EXIT_FAILURE;
+    }
+
     logVersionInfo();
 
     if (histogramBias < 0.0 || histogramBias >= 1.0) {
@@ -104,6 +139,10 @@ int main(int argc, char **argv) {
     CURFIL_INFO("writeProbabilityImages: " << writeProbabilityImages);
 
     utils::Profile::setEnabled(profiling);
+    if (!traceFile.empty()) {
+        trace::enable();
+    }
+    PreprocessingCache::setFolder(cacheFolder);
 
     tbb::task_scheduler_init init(numThreads);
 
@@ -128,7 +167,29 @@ int main(int argc, char **argv) {
         useDepthFilling = useDepthFillingOption;
     }
 
-    test(randomForest, folderTesting, folderPrediction, useDepthFilling, writeProbabilityImages);
+    if (!binaryForestFile.empty()) {
+        RandomTreeExport::writeBinary(binaryForestFile, randomForest, histogramBias);
+        if (serverSocket.empty() && folderTesting.empty()) {
+            CURFIL_INFO("finished");
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (!serverSocket.empty()) {
+        PredictionServer server(randomForest, serverSocket, useDepthFilling, maxBatchSize, deviceId);
+        runningServer = &server;
+        signal(SIGINT, stopServer);
+        signal(SIGTERM, stopServer);
+        server.run();
+        runningServer = 0;
+    } else {
+        test(randomForest, folderTesting, folderPrediction, useDepthFilling, writeProbabilityImages);
+    }
+
+    if (!traceFile.empty()) {
+        trace::logSummary();
+        trace::writeChromeTrace(traceFile);
+    }
 
     CURFIL_INFO("finished");
     return EXIT_SUCCESS;
@@ -0,0 +1,291 @@
+#include "preprocessing_cache.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/make_shared.hpp>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace fs = boost::filesystem;
+
+namespace curfil {
+
+namespace {
+
+static const char PREPROCESSING_CACHE_MAGIC[8] = { 'C', 'U', 'R', 'F', 'I', 'L', 'P', 'C' };
+static const uint32_t PREPROCESSING_CACHE_VERSION = 1;
+static const uint64_t PREPROCESSING_CACHE_ALIGNMENT = 64;
+
+// all sections start at a multiple of PREPROCESSING_CACHE_ALIGNMENT
+struct PreprocessingCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numLabelColors;
+    uint8_t useCIELab;
+    uint8_t useDepthFilling;
+    uint8_t calculateIntegralImage;
+    uint8_t inCIELab;
+    uint8_t integratedColor;
+    uint8_t integratedDepth;
+    uint8_t padding[2];
+    int64_t modificationTimes[3];
+    uint64_t fileSizes[3];
+    uint64_t pathLength;
+    uint64_t pathOffset;
+    uint64_t paletteOffset;
+    uint64_t colorOffset;
+    uint64_t depthOffset;
+    uint64_t labelOffset;
+    uint64_t fileSize;
+};
+
+struct SourceFile {
+    int64_t modificationTime;
+    uint64_t fileSize;
+};
+
+static SourceFile getSourceFile(const std::string& filename) {
+    SourceFile sourceFile;
+    sourceFile.modificationTime = fs::last_write_time(filename);
+    sourceFile.fileSize = fs::file_size(filename);
+    return sourceFile;
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + PREPROCESSING_CACHE_ALIGNMENT - 1) / PREPROCESSING_CACHE_ALIGNMENT
+            * PREPROCESSING_CACHE_ALIGNMENT;
+}
+
+static void writeAt(std::ofstream& ostream, uint64_t offset, const void* data, size_t size) {
+    ostream.seekp(offset);
+    ostream.write(reinterpret_cast<const char*>(data), size);
+}
+
+}
+
+std::string PreprocessingCache::folder;
+
+void PreprocessingCache::setFolder(const std::string& cacheFolder) {
+    if (!cacheFolder.empty()) {
+        fs::create_directories(cacheFolder);
+        CURFIL_INFO("caching preprocessed images in " << cacheFolder);
+    }
+    folder = cacheFolder;
+}
+
+std::string PreprocessingCache::getEntryFilename(const std::string& filename, bool useCIELab, bool useDepthFilling,
+        bool calculateIntegralImage) {
+    size_t key = 0;
+    boost::hash_combine(key, fs::absolute(filename).string());
+    boost::hash_combine(key, useCIELab);
+    boost::hash_combine(key, useDepthFilling);
+    boost::hash_combine(key, calculateIntegralImage);
+    return (fs::path(folder) / (boost::format("%016x.bin") % key).str()).string();
+}
+
+bool PreprocessingCache::load(const std::string& filename, const std::string& depthFilename,
+        const std::string& labelFilename, bool useCIELab, bool useDepthFilling, bool calculateIntegralImage,
+        LabeledRGBDImage& image) {
+
+    assert(isEnabled());
+
+    const std::string entryFilename = getEntryFilename(filename, useCIELab, useDepthFilling, calculateIntegralImage);
+    if (!fs::exists(entryFilename)) {
+        return false;
+    }
+
+    try {
+        const utils::MappedFile file(entryFilename);
+
+        if (file.getSize() < sizeof(PreprocessingCacheHeader)) {
+            throw std::runtime_error("entry is truncated");
+        }
+
+        const PreprocessingCacheHeader& header = *reinterpret_cast<const PreprocessingCacheHeader*>(file.ptr());
+        if (memcmp(header.magic, PREPROCESSING_CACHE_MAGIC, sizeof(header.magic)) != 0
+                || header.version != PREPROCESSING_CACHE_VERSION) {
+            throw std::runtime_error("unknown entry format");
+        }
+        if (header.fileSize != file.getSize()) {
+            throw std::runtime_error("entry is truncated");
+        }
+
+        const std::string absolutePath = fs::absolute(filename).string();
+        if (header.pathLength != absolutePath.size()
+                || header.pathOffset + header.pathLength > header.fileSize
+                || memcmp(file.ptr() + header.pathOffset, absolutePath.data(), absolutePath.size()) != 0
+                || header.useCIELab != useCIELab || header.useDepthFilling != useDepthFilling
+                || header.calculateIntegralImage != calculateIntegralImage) {
+            // hash collision with the entry of another image
+            return false;
+        }
+
+        const std::string filenames[] = { filename, depthFilename, labelFilename };
+        for (size_t i = 0; i < 3; i++) {
+            const SourceFile sourceFile = getSourceFile(filenames[i]);
+            if (header.modificationTimes[i] != sourceFile.modificationTime
+                    || header.fileSizes[i] != sourceFile.fileSize) {
+                CURFIL_DEBUG("cache entry of " << filename << " is stale");
+                return false;
+            }
+        }
+
+        const int width = header.width;
+        const int height = header.height;
+        const size_t numPixels = static_cast<size_t>(width) * height;
+        if (width <= 0 || height <= 0 || header.numLabelColors > 256
+                || header.paletteOffset + 3 * header.numLabelColors > header.fileSize
+                || header.colorOffset + 3 * numPixels * sizeof(float) > header.fileSize
+                || header.depthOffset + 2 * numPixels * sizeof(int) > header.fileSize
+                || header.labelOffset + numPixels > header.fileSize) {
+            throw std::runtime_error("illegal section bounds");
+        }
+
+        std::vector<RGBColor> palette;
+        const uint8_t* paletteData = reinterpret_cast<const uint8_t*>(file.ptr() + header.paletteOffset);
+        for (size_t i = 0; i < header.numLabelColors; i++) {
+            palette.push_back(RGBColor(paletteData[3 * i], paletteData[3 * i + 1], paletteData[3 * i + 2]));
+        }
+
+        boost::shared_ptr<RGBDImage> rgbdImage = boost::make_shared<RGBDImage>(width, height);
+        rgbdImage->filename = filename;
+        rgbdImage->depthFilename = depthFilename;
+        rgbdImage->inCIELab = header.inCIELab;
+        rgbdImage->integratedColor = header.integratedColor;
+        rgbdImage->integratedDepth = header.integratedDepth;
+        memcpy(rgbdImage->colorImage.ptr(), file.ptr() + header.colorOffset, 3 * numPixels * sizeof(float));
+        memcpy(rgbdImage->depthImage.ptr(), file.ptr() + header.depthOffset, 2 * numPixels * sizeof(int));
+
+        boost::shared_ptr<LabelImage> labelImage = boost::make_shared<LabelImage>(width, height);
+        labelImage->filename = labelFilename;
+
+        // the palette is in the order of the first occurrence in the label image,
+        // hence the label ids are identical to the ones assigned when loading the label image itself
+        const std::vector<LabelType> labels = LabelImage::encodeColors(palette);
+        const uint8_t* indices = reinterpret_cast<const uint8_t*>(file.ptr() + header.labelOffset);
+        for (size_t i = 0; i < numPixels; i++) {
+            if (indices[i] >= labels.size()) {
+                throw std::runtime_error("illegal label index");
+            }
+            labelImage->getLabels()[i] = labels[indices[i]];
+        }
+
+        image = LabeledRGBDImage(rgbdImage, labelImage);
+    } catch (const std::exception& e) {
+        CURFIL_WARNING("ignoring cache entry " << entryFilename << " of " << filename << ": " << e.what());
+        return false;
+    }
+
+    return true;
+}
+
+void PreprocessingCache::store(const std::string& filename, const std::string& depthFilename,
+        const std::string& labelFilename, bool useCIELab, bool useDepthFilling, bool calculateIntegralImage,
+        const LabeledRGBDImage& image) {
+
+    assert(isEnabled());
+
+    const std::string entryFilename = getEntryFilename(filename, useCIELab, useDepthFilling, calculateIntegralImage);
+
+    try {
+        write(entryFilename, filename, depthFilename, labelFilename, image);
+    } catch (const std::exception& e) {
+        CURFIL_WARNING("failed to write cache entry " << entryFilename << " of " << filename << ": " << e.what());
+    }
+}
+
+void PreprocessingCache::write(const std::string& entryFilename, const std::string& filename,
+        const std::string& depthFilename, const std::string& labelFilename, const LabeledRGBDImage& image) {
+
+    const RGBDImage& rgbdImage = image.getRGBDImage();
+    const LabelImage& labelImage = image.getLabelImage();
+    const int width = rgbdImage.getWidth();
+    const int height = rgbdImage.getHeight();
+    const size_t numPixels = static_cast<size_t>(width) * height;
+
+    // same scan order as in the LabelImage constructor
+    std::map<LabelType, uint8_t> paletteIndices;
+    std::vector<uint8_t> palette;
+    std::vector<uint8_t> indices(numPixels);
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            const LabelType label = labelImage.getLabel(x, y);
+            std::map<LabelType, uint8_t>::const_iterator it = paletteIndices.find(label);
+            if (it == paletteIndices.end()) {
+                const RGBColor color = LabelImage::decodeLabel(label);
+                for (int c = 0; c < 3; c++) {
+                    palette.push_back(color[c]);
+                }
+                it = paletteIndices.insert(std::make_pair(label, paletteIndices.size())).first;
+            }
+            indices[y * width + x] = it->second;
+        }
+    }
+
+    const std::string absolutePath = fs::absolute(filename).string();
+
+    PreprocessingCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PREPROCESSING_CACHE_MAGIC, sizeof(header.magic));
+    header.version = PREPROCESSING_CACHE_VERSION;
+    header.width = width;
+    header.height = height;
+    header.numLabelColors = paletteIndices.size();
+    header.useCIELab = useCIELab;
+    header.useDepthFilling = useDepthFilling;
+    header.calculateIntegralImage = calculateIntegralImage;
+    header.inCIELab = rgbdImage.inCIELab;
+    header.integratedColor = rgbdImage.integratedColor;
+    header.integratedDepth = rgbdImage.integratedDepth;
+
+    const std::string filenames[] = { filename, depthFilename, labelFilename };
+    for (size_t i = 0; i < 3; i++) {
+        const SourceFile sourceFile = getSourceFile(filenames[i]);
+        header.modificationTimes[i] = sourceFile.modificationTime;
+        header.fileSizes[i] = sourceFile.fileSize;
+    }
+
+    header.pathLength = absolutePath.size();
+    header.pathOffset = alignOffset(sizeof(header));
+    header.paletteOffset = alignOffset(header.pathOffset + header.pathLength);
+    header.colorOffset = alignOffset(header.paletteOffset + palette.size());
+    header.depthOffset = alignOffset(header.colorOffset + 3 * numPixels * sizeof(float));
+    header.labelOffset = alignOffset(header.depthOffset + 2 * numPixels * sizeof(int));
+    header.fileSize = header.labelOffset + numPixels;
+
+    // unique per process, since several processes may preprocess the same image
+    const std::string temporaryFilename = (boost::format("%s.%d.tmp") % entryFilename % getpid()).str();
+
+    {
+        std::ofstream ostream(temporaryFilename.c_str(), std::ios::binary | std::ios::trunc);
+        if (!ostream) {
+            throw std::runtime_error(std::string("failed to open ") + temporaryFilename + " for writing");
+        }
+
+        writeAt(ostream, 0, &header, sizeof(header));
+        writeAt(ostream, header.pathOffset, absolutePath.data(), absolutePath.size());
+        writeAt(ostream, header.paletteOffset, &palette[0], palette.size());
+        writeAt(ostream, header.colorOffset, rgbdImage.colorImage.ptr(), 3 * numPixels * sizeof(float));
+        writeAt(ostream, header.depthOffset, rgbdImage.depthImage.ptr(), 2 * numPixels * sizeof(int));
+        writeAt(ostream, header.labelOffset, &indices[0], indices.size());
+
+        ostream.flush();
+        if (!ostream) {
+            fs::remove(temporaryFilename);
+            throw std::runtime_error(std::string("failed to write ") + temporaryFilename);
+        }
+    }
+
+    fs::rename(temporaryFilename, entryFilename);
+}
+
+}
@@ -0,0 +1,67 @@
+#ifndef CURFIL_PREPROCESSING_CACHE_H
+#define CURFIL_PREPROCESSING_CACHE_H
+
+#include <string>
+
+#include "image.h"
+
+namespace curfil {
+
+/**
+ * On-disk cache of preprocessed images.
+ *
+ * An entry holds the final color and depth matrices of an RGB-D image (after the CIELab conversion, the depth filling
+ * and the integral image calculation) together with its label image. Entries are keyed by the absolute path of the
+ * color image and the preprocessing flags and become stale as soon as the modification time or the size of one of
+ * the source files changes.
+ *
+ * Entries are mapped read-only while they are loaded and the matrices are copied into the images, which own their
+ * memory. Loading an entry saves the decoding and the preprocessing, but not the memory of the images.
+ * The files are written to a temporary name and renamed, so concurrent processes may share a cache folder.
+ */
+class PreprocessingCache {
+
+public:
+
+    /**
+     * Enables the cache in the given folder which is created if it does not exist.
+     * An empty folder disables the cache.
+     */
+    static void setFolder(const std::string& folder);
+
+    static const std::string& getFolder() {
+        return folder;
+    }
+
+    static bool isEnabled() {
+        return !folder.empty();
+    }
+
+    /**
+     * @return true if an up-to-date entry was found and loaded into 'image'
+     */
+    static bool load(const std::string& filename, const std::string& depthFilename, const std::string& labelFilename,
+            bool useCIELab, bool useDepthFilling, bool calculateIntegralImage, LabeledRGBDImage& image);
+
+    /**
+     * Writes the entry for the given preprocessed image. Failures are logged and otherwise ignored.
+     */
+    static void store(const std::string& filename, const std::string& depthFilename,
+            const std::string& labelFilename, bool useCIELab, bool useDepthFilling, bool calculateIntegralImage,
+            const LabeledRGBDImage& image);
+
+private:
+
+    static std::string folder;
+
+    static std::string getEntryFilename(const std::string& filename, bool useCIELab, bool useDepthFilling,
+            bool calculateIntegralImage);
+
+    static void write(const std::string& entryFilename, const std::string& filename,
+            const std::string& depthFilename, const std::string& labelFilename,
+            const LabeledRGBDImage& image);
+};
+
+}
+
+#endif
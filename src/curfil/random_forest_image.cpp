@@ -1,11 +1,19 @@
 #include "random_forest_image.h"
 
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
 #include <boost/shared_ptr.hpp>
 #include <cassert>
+#include <cstring>
+#include <limits>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
 #include <tbb/parallel_for_each.h>
 #include <tbb/task_scheduler_init.h>
 #include <vector>
 
+#include "device_memory.h"
 #include "image.h"
 #include "import.h"
 #include "random_tree_image_gpu.h"
@@ -13,18 +21,362 @@
 
 namespace curfil {
 
+FlatForest::FlatForest(const std::vector<boost::shared_ptr<RandomTreeImage> >& ensemble, bool singlePrecision) :
+        nodes(), roots(), histograms(), numClasses(0), singlePrecision(singlePrecision) {
+
+    if (ensemble.empty()) {
+        throw std::runtime_error("cannot compile empty forest");
+    }
+
+    numClasses = ensemble[0]->getTree()->getNumClasses();
+
+    std::vector<const RandomTree<PixelInstance, ImageFeatureFunction>*> treeNodes;
+
+    for (const boost::shared_ptr<RandomTreeImage>& randomTree : ensemble) {
+        const boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> > tree = randomTree->getTree();
+        if (tree->getNumClasses() != numClasses) {
+            throw std::runtime_error((boost::format("tree %d has %d classes, expected %d")
+                    % tree->getTreeId() % tree->getNumClasses() % static_cast<int>(numClasses)).str());
+        }
+
+        const size_t root = nodes.size();
+        const size_t numTreeNodes = tree->countNodes();
+        roots.push_back(root);
+        nodes.resize(root + numTreeNodes);
+        treeNodes.assign(numTreeNodes, 0);
+
+        convert(tree, root, treeNodes);
+
+        // leaf histograms in breadth-first order
+        for (size_t offset = 0; offset < numTreeNodes; offset++) {
+            const RandomTree<PixelInstance, ImageFeatureFunction>* node = treeNodes[offset];
+            assert(node != 0);
+            if (!node->isLeaf()) {
+                continue;
+            }
+            const cuv::ndarray<double, cuv::host_memory_space>& histogram = node->getNormalizedHistogram();
+            assert(histogram.shape(0) == numClasses);
+            nodes[root + offset].child = -static_cast<int32_t>(histograms.size() / numClasses) - 1;
+            for (LabelType label = 0; label < numClasses; label++) {
+                histograms.push_back(static_cast<float>(histogram(label)));
+            }
+        }
+    }
+}
+
+FlatForest::FlatForest(const std::vector<boost::shared_ptr<const TreeNodes> >& trees, bool singlePrecision) :
+        nodes(), roots(), histograms(), numClasses(0), singlePrecision(singlePrecision) {
+
+    if (trees.empty()) {
+        throw std::runtime_error("cannot compile empty forest");
+    }
+
+    numClasses = trees[0]->numLabels();
+
+    for (const boost::shared_ptr<const TreeNodes>& tree : trees) {
+        if (tree->numLabels() != numClasses) {
+            throw std::runtime_error((boost::format("tree %d has %d classes, expected %d")
+                    % tree->getTreeId() % tree->numLabels() % static_cast<int>(numClasses)).str());
+        }
+
+        const size_t root = nodes.size();
+        const int32_t leafBase = histograms.size() / numClasses;
+        roots.push_back(root);
+        nodes.resize(root + tree->numNodes());
+
+        for (size_t offset = 0; offset < tree->numNodes(); offset++) {
+            Node& node = nodes[root + offset];
+            memset(&node, 0, sizeof(node));
+
+            const int leftNodeOffset = tree->getLeftNodeOffset(offset);
+            if (leftNodeOffset < 0) {
+                node.child = leftNodeOffset - leafBase;
+                node.threshold = std::numeric_limits<float>::quiet_NaN();
+                continue;
+            }
+
+            node.child = static_cast<int32_t>(root + offset + leftNodeOffset);
+            if (offset + leftNodeOffset + 1 >= tree->numNodes()) {
+                throw std::runtime_error((boost::format("tree %d, node %d: illegal child offset: %d")
+                        % tree->getTreeId() % offset % leftNodeOffset).str());
+            }
+
+            node.type = static_cast<uint8_t>(tree->getType(offset));
+            node.offset1X = tree->getOffset1X(offset);
+            node.offset1Y = tree->getOffset1Y(offset);
+            node.region1X = tree->getRegion1X(offset);
+            node.region1Y = tree->getRegion1Y(offset);
+            node.offset2X = tree->getOffset2X(offset);
+            node.offset2Y = tree->getOffset2Y(offset);
+            node.region2X = tree->getRegion2X(offset);
+            node.region2Y = tree->getRegion2Y(offset);
+            node.channel1 = static_cast<uint8_t>(tree->getChannel1(offset));
+            node.channel2 = static_cast<uint8_t>(tree->getChannel2(offset));
+            node.threshold = tree->getThreshold(offset);
+        }
+
+        const float* treeHistograms = tree->histograms().ptr();
+        histograms.insert(histograms.end(), treeHistograms, treeHistograms + tree->numLeaves() * numClasses);
+    }
+}
+
+void FlatForest::convert(const boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> >& tree,
+        size_t root, std::vector<const RandomTree<PixelInstance, ImageFeatureFunction>*>& treeNodes) {
+
+    const size_t offset = tree->getNodeId() - tree->getTreeId();
+    if (offset >= treeNodes.size()) {
+        throw std::runtime_error((boost::format("tree %d, illegal offset: %d (numNodes: %d)")
+                % tree->getTreeId() % offset % treeNodes.size()).str());
+    }
+
+    treeNodes[offset] = tree.get();
+
+    Node& node = nodes[root + offset];
+    memset(&node, 0, sizeof(node));
+
+    if (tree->isLeaf()) {
+        node.threshold = std::numeric_limits<float>::quiet_NaN();
+        return;
+    }
+
+    const ImageFeatureFunction& feature = tree->getSplit().getFeature();
+    node.type = static_cast<uint8_t>(feature.getType());
+    node.offset1X = static_cast<int16_t>(feature.getOffset1().getX());
+    node.offset1Y = static_cast<int16_t>(feature.getOffset1().getY());
+    node.region1X = static_cast<int16_t>(feature.getRegion1().getX());
+    node.region1Y = static_cast<int16_t>(feature.getRegion1().getY());
+    node.offset2X = static_cast<int16_t>(feature.getOffset2().getX());
+    node.offset2Y = static_cast<int16_t>(feature.getOffset2().getY());
+    node.region2X = static_cast<int16_t>(feature.getRegion2().getX());
+    node.region2Y = static_cast<int16_t>(feature.getRegion2().getY());
+    node.channel1 = feature.getChannel1();
+    node.channel2 = feature.getChannel2();
+    node.threshold = tree->getSplit().getThreshold();
+
+    // tree nodes must be already in breadth-first order
+    assert(tree->getRight()->getNodeId() == tree->getLeft()->getNodeId() + 1);
+    node.child = static_cast<int32_t>(root + tree->getLeft()->getNodeId() - tree->getTreeId());
+
+    convert(tree->getLeft(), root, treeNodes);
+    convert(tree->getRight(), root, treeNodes);
+}
+
+// must match ImageFeatureFunction::calculateFeatureResponse
+template<class FeatureResponse>
+FeatureResponse FlatForest::calculateFeatureResponse(const Node& node, const PixelInstance& instance) {
+
+    const Depth depth = instance.getDepth();
+    if (!depth.isValid()) {
+        return std::numeric_limits<FeatureResponse>::quiet_NaN();
+    }
+
+    const Offset offset1 = Offset(node.offset1X, node.offset1Y).normalize(depth);
+    const Region region1 = Region(node.region1X, node.region1Y).normalize(depth);
+    const Offset offset2 = Offset(node.offset2X, node.offset2Y).normalize(depth);
+    const Region region2 = Region(node.region2X, node.region2Y).normalize(depth);
+
+    FeatureResponse a;
+    FeatureResponse b;
+
+    if (node.type == COLOR) {
+        a = instance.averageRegionColor<FeatureResponse>(offset1, region1, node.channel1);
+        if (isnan(a)) {
+            return a;
+        }
+        b = instance.averageRegionColor<FeatureResponse>(offset2, region2, node.channel2);
+    } else {
+        assert(node.type == DEPTH);
+        a = instance.averageRegionDepth<FeatureResponse>(offset1, region1);
+        if (isnan(a)) {
+            return a;
+        }
+        b = instance.averageRegionDepth<FeatureResponse>(offset2, region2);
+    }
+
+    if (isnan(b)) {
+        return b;
+    }
+
+    return (a - b);
+}
+
+void FlatForest::classifyTile(const std::vector<PixelInstance>& pixels,
+        std::vector<float>& tileProbabilities) const {
+
+    const size_t numPixels = pixels.size();
+    assert(numPixels <= static_cast<size_t>(TILE_WIDTH));
+
+    std::fill(tileProbabilities.begin(), tileProbabilities.begin() + numPixels * numClasses, 0.0f);
+
+    int32_t current[TILE_WIDTH];
+
+    for (const size_t root : roots) {
+
+        for (size_t i = 0; i < numPixels; i++) {
+            current[i] = static_cast<int32_t>(root);
+        }
+
+        // all pixels of the tile descend one level at a time, such that they share the cached upper nodes
+        bool pending = true;
+        while (pending) {
+            pending = false;
+            for (size_t i = 0; i < numPixels; i++) {
+                const Node& node = nodes[current[i]];
+                if (node.child < 0) {
+                    continue;
+                }
+                pending = true;
+                const bool left = singlePrecision ?
+                        (calculateFeatureResponse<float>(node, pixels[i]) <= node.threshold) :
+                        (calculateFeatureResponse<FeatureResponseType>(node, pixels[i]) <= node.threshold);
+                current[i] = left ? node.child : node.child + 1;
+            }
+        }
+
+        for (size_t i = 0; i < numPixels; i++) {
+            const size_t leaf = -(nodes[current[i]].child + 1);
+            const float* histogram = &histograms[leaf * numClasses];
+            float* probabilities = &tileProbabilities[i * numClasses];
+            for (LabelType label = 0; label < numClasses; label++) {
+                probabilities[label] += histogram[label];
+            }
+        }
+    }
+}
+
+LabelType FlatForest::normalize(const float* probabilities, float* output, size_t stride) const {
+    double sum = 0.0f;
+    for (LabelType label = 0; label < numClasses; label++) {
+        sum += probabilities[label];
+    }
+    LabelType bestLabel = 0;
+    float bestProb = -1.0f;
+    for (LabelType label = 0; label < numClasses; label++) {
+        const float prob = probabilities[label] / sum;
+        output[label * stride] = prob;
+        if (prob > bestProb) {
+            bestLabel = label;
+            bestProb = prob;
+        }
+    }
+    return bestLabel;
+}
+
+void FlatForest::predict(const RGBDImage& image, cuv::ndarray<float, cuv::host_memory_space>& probabilities,
+        LabelImage& prediction) const {
+
+    assert(probabilities.ndim() == 3);
+    assert(probabilities.shape(0) == numClasses);
+    assert(static_cast<int>(probabilities.shape(1)) == image.getHeight());
+    assert(static_cast<int>(probabilities.shape(2)) == image.getWidth());
+
+    const size_t numPixels = static_cast<size_t>(image.getWidth()) * image.getHeight();
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, image.getHeight()),
+            [&](const tbb::blocked_range<size_t>& range) {
+
+                std::vector<PixelInstance> pixels;
+                pixels.reserve(TILE_WIDTH);
+                std::vector<float> tileProbabilities(TILE_WIDTH * numClasses);
+
+                for(size_t y = range.begin(); y != range.end(); y++) {
+                    for(int tileX = 0; tileX < image.getWidth(); tileX += TILE_WIDTH) {
+                        const int tileEnd = std::min(image.getWidth(), tileX + TILE_WIDTH);
+
+                        pixels.clear();
+                        for(int x = tileX; x < tileEnd; x++) {
+                            pixels.push_back(PixelInstance(&image, 0, x, y));
+                        }
+
+                        classifyTile(pixels, tileProbabilities);
+
+                        for(int x = tileX; x < tileEnd; x++) {
+                            const float* p = &tileProbabilities[(x - tileX) * numClasses];
+                            float* output = probabilities.ptr() + y * image.getWidth() + x;
+                            prediction.setLabel(x, y, normalize(p, output, numPixels));
+                        }
+                    }
+                }
+            });
+}
+
+void FlatForest::classifyPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+        cuv::ndarray<float, cuv::host_memory_space>& probabilities, std::vector<LabelType>& labels) const {
+
+    assert(probabilities.ndim() == 2);
+    assert(probabilities.shape(0) == numClasses);
+    assert(probabilities.shape(1) == pixels.size());
+
+    labels.resize(pixels.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, pixels.size(), TILE_WIDTH),
+            [&](const tbb::blocked_range<size_t>& range) {
+
+                std::vector<PixelInstance> tile;
+                tile.reserve(TILE_WIDTH);
+                std::vector<float> tileProbabilities(TILE_WIDTH * numClasses);
+
+                for(size_t tileBegin = range.begin(); tileBegin < range.end(); tileBegin += TILE_WIDTH) {
+                    const size_t tileEnd = std::min(range.end(), tileBegin + TILE_WIDTH);
+
+                    tile.clear();
+                    for(size_t i = tileBegin; i < tileEnd; i++) {
+                        tile.push_back(PixelInstance(&image, 0, pixels[i].getX(), pixels[i].getY()));
+                    }
+
+                    classifyTile(tile, tileProbabilities);
+
+                    for(size_t i = tileBegin; i < tileEnd; i++) {
+                        const float* p = &tileProbabilities[(i - tileBegin) * numClasses];
+                        labels[i] = normalize(p, probabilities.ptr() + i, pixels.size());
+                    }
+                }
+            });
+}
+
 RandomForestImage::RandomForestImage(const std::vector<std::string>& treeFiles,
                     const std::vector<int>& deviceIds,
                     const AccelerationMode accelerationMode,
                     const double histogramBias)
- : configuration(), ensemble(treeFiles.size()),
-   m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>())
+ : configuration(), ensemble(),
+   m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>()),
+   predictionPlansMutex(boost::make_shared<tbb::mutex>()), predictionPlans(), batchImageCacheSizes()
 {
 
     if (treeFiles.empty()) {
         throw std::runtime_error("cannot construct empty forest");
     }
 
+    if (treeFiles.size() == 1 && RandomTreeImport::isManifest(treeFiles[0])) {
+        CURFIL_INFO("reading forest manifest " << treeFiles[0]);
+        *this = RandomForestImage(RandomTreeImport::readManifest(treeFiles[0]), deviceIds, accelerationMode,
+                histogramBias);
+        return;
+    }
+
+    if (treeFiles.size() == 1 && RandomTreeImport::isBinary(treeFiles[0])) {
+        double fileHistogramBias;
+        std::vector<cuv::ndarray<WeightType, cuv::host_memory_space> > classLabelPriorDistributions;
+        configuration = RandomTreeImport::readBinary(treeFiles[0], treeData, classLabelPriorDistributions,
+                fileHistogramBias);
+
+        // the histograms were normalized when the file was written
+        if (histogramBias != fileHistogramBias) {
+            CURFIL_WARNING("histograms of " << treeFiles[0] << " are normalized with bias " << fileHistogramBias
+                    << ". ignoring histogram bias " << histogramBias);
+        }
+
+        CURFIL_INFO("training configuration " << configuration);
+
+        configuration.setDeviceIds(deviceIds);
+        configuration.setAccelerationMode(accelerationMode);
+
+        flatForest = boost::make_shared<FlatForest>(treeData, configuration.isSinglePrecisionFeatures());
+        return;
+    }
+
+    ensemble.resize(treeFiles.size());
+
     std::vector<TrainingConfiguration> configurations(treeFiles.size());
 
     tbb::parallel_for(tbb::blocked_range<size_t>(0, treeFiles.size(), 1),
@@ -81,7 +433,8 @@ RandomForestImage::RandomForestImage(const std::vector<std::string>& treeFiles,
 
 RandomForestImage::RandomForestImage(unsigned int treeCount, const TrainingConfiguration& configuration) :
         configuration(configuration), ensemble(treeCount),
-                m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>())
+                m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>()),
+                predictionPlansMutex(boost::make_shared<tbb::mutex>()), predictionPlans(), batchImageCacheSizes()
 {
     assert(treeCount > 0);
 }
@@ -89,7 +442,8 @@ RandomForestImage::RandomForestImage(unsigned int treeCount, const TrainingConfi
 RandomForestImage::RandomForestImage(const std::vector<boost::shared_ptr<RandomTreeImage> >& ensemble,
         const TrainingConfiguration& configuration) :
         configuration(configuration), ensemble(ensemble),
-                m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>()) {
+                m_predictionAllocator(boost::make_shared<cuv::pooled_cuda_allocator>()),
+                predictionPlansMutex(boost::make_shared<tbb::mutex>()), predictionPlans(), batchImageCacheSizes() {
     assert(!ensemble.empty());
 #ifndef NDEBUG
     for (auto& tree : ensemble) {
@@ -102,154 +456,689 @@ RandomForestImage::RandomForestImage(const std::vector<boost::shared_ptr<RandomT
 
 // Usage identical to RandomTreeImage class
 void RandomForestImage::train(const std::vector<LabeledRGBDImage>& trainLabelImages,
-        bool trainTreesSequentially) {
+        bool trainTreesSequentially, const std::string& checkpointFolder) {
+    train(ImageDataset(trainLabelImages), trainTreesSequentially, checkpointFolder);
+}
 
-    if (trainLabelImages.empty()) {
+void RandomForestImage::train(const ImageDataset& trainImages, bool trainTreesSequentially,
+        const std::string& checkpointFolder) {
+    // the label statistics of an image are computed only once for all trees that sample it
+    TrainingSetIndex trainingSetIndex;
+    train(trainImages, trainingSetIndex, trainTreesSequentially, checkpointFolder);
+}
+
+void RandomForestImage::train(const ImageDataset& trainImages, TrainingSetIndex& trainingSetIndex,
+        bool trainTreesSequentially, const std::string& checkpointFolder) {
+    std::vector<size_t> treeIds;
+    for (size_t treeNr = 0; treeNr < ensemble.size(); treeNr++) {
+        treeIds.push_back(treeNr);
+    }
+    train(trainImages, trainingSetIndex, treeIds, trainTreesSequentially, checkpointFolder);
+}
+
+void RandomForestImage::train(const ImageDataset& trainImages, TrainingSetIndex& trainingSetIndex,
+        const std::vector<size_t>& treeIds, bool trainTreesSequentially, const std::string& checkpointFolder) {
+
+    if (trainImages.empty()) {
         throw std::runtime_error("no training images");
     }
 
-    const size_t treeCount = ensemble.size();
+    if (!checkpointFolder.empty()) {
+        boost::filesystem::create_directories(checkpointFolder);
+    }
+
+    // the samples per image are distributed over all trees of the forest, also if only some of them are trained
+    const size_t forestSize = ensemble.size();
+    const size_t treeCount = treeIds.size();
 
     const int numThreads = configuration.getNumThreads();
     tbb::task_scheduler_init init(numThreads);
 
-    CURFIL_INFO("learning image tree ensemble. " << treeCount << " trees with " << numThreads << " threads");
+    if (treeCount == forestSize) {
+        CURFIL_INFO("learning image tree ensemble. " << treeCount << " trees with " << numThreads << " threads");
+    } else {
+        CURFIL_INFO("learning " << treeCount << " of " << forestSize << " trees of the image tree ensemble with "
+                << numThreads << " threads");
+    }
 
+    ensemble.resize(treeCount);
     for (size_t treeNr = 0; treeNr < treeCount; ++treeNr) {
-        ensemble[treeNr] = boost::make_shared<RandomTreeImage>(treeNr, configuration);
+        if (treeIds[treeNr] >= forestSize) {
+            throw std::runtime_error((boost::format("illegal tree id %d for a forest of %d trees")
+                    % treeIds[treeNr] % forestSize).str());
+        }
+        ensemble[treeNr] = boost::make_shared<RandomTreeImage>(treeIds[treeNr], configuration);
     }
 
     RandomSource randomSource(configuration.getRandomSeed());
     const int SEED = randomSource.uniformSampler(0xFFFF).getNext();
 
+    // only the sampled images are in memory while the tree is trained
+    auto sampleTrainImages =
+            [&](const RandomTreeImage& tree, RandomSource& randomSource) -> std::vector<LabeledRGBDImage> {
+                std::vector<size_t> imageNrs;
+
+                if (configuration.getMaxImages() > 0 && static_cast<int>(trainImages.size()) > configuration.getMaxImages()) {
+                    ReservoirSampler<size_t> reservoirSampler(configuration.getMaxImages());
+                    Sampler sampler = randomSource.uniformSampler(0, 10 * trainImages.size());
+                    for (size_t imageNr = 0; imageNr < trainImages.size(); imageNr++) {
+                        reservoirSampler.sample(sampler, imageNr);
+                    }
+
+                    CURFIL_INFO("tree " << tree.getId() << ": sampled " << reservoirSampler.getReservoir().size()
+                            << " out of " << trainImages.size() << " images");
+                    imageNrs = reservoirSampler.getReservoir();
+                } else {
+                    for (size_t imageNr = 0; imageNr < trainImages.size(); imageNr++) {
+                        imageNrs.push_back(imageNr);
+                    }
+                }
+
+                return trainImages.getImages(imageNrs);
+            };
+
+    auto getCheckpointFile =
+            [&](const RandomTreeImage& tree) -> std::string {
+                std::string checkpointFile;
+                if (!checkpointFolder.empty()) {
+                    checkpointFile = boost::str(boost::format("%s/tree%d.checkpoint.json.gz")
+                            % checkpointFolder % tree.getId());
+                }
+                return checkpointFile;
+            };
+
     auto train =
             [&](boost::shared_ptr<RandomTreeImage>& tree) {
                 utils::Timer timer;
                 auto seed = SEED + tree->getId();
                 RandomSource randomSource(seed);
 
-                std::vector<LabeledRGBDImage> sampledTrainLabelImages = trainLabelImages;
+                const std::vector<LabeledRGBDImage> sampledTrainLabelImages = sampleTrainImages(*tree, randomSource);
 
-                if (configuration.getMaxImages() > 0 && static_cast<int>(trainLabelImages.size()) > configuration.getMaxImages()) {
-                    ReservoirSampler<LabeledRGBDImage> reservoirSampler(configuration.getMaxImages());
-                    Sampler sampler = randomSource.uniformSampler(0, 10 * trainLabelImages.size());
-                    for (auto& image : trainLabelImages) {
-                        reservoirSampler.sample(sampler, image);
-                    }
+                tree->train(sampledTrainLabelImages, randomSource, configuration.getSamplesPerImage() / forestSize,
+                        trainingSetIndex, getCheckpointFile(*tree));
+                CURFIL_INFO("finished tree " << tree->getId() << " with random seed " << seed << " in " << timer.format(3));
+            };
 
-                    CURFIL_INFO("tree " << tree->getId() << ": sampled " << reservoirSampler.getReservoir().size()
-                            << " out of " << trainLabelImages.size() << " images");
-                    sampledTrainLabelImages = reservoirSampler.getReservoir();
+    // the trees share the transfers of their images to the GPU, see RandomTreeImage::train()
+    auto trainTogether =
+            [&]() {
+                std::vector<RandomSource> randomSources;
+                std::vector<std::string> checkpointFiles;
+                for (size_t treeNr = 0; treeNr < treeCount; treeNr++) {
+                    randomSources.push_back(RandomSource(SEED + ensemble[treeNr]->getId()));
+                    checkpointFiles.push_back(getCheckpointFile(*ensemble[treeNr]));
                 }
 
-                tree->train(sampledTrainLabelImages, randomSource, configuration.getSamplesPerImage() / treeCount);
-                CURFIL_INFO("finished tree " << tree->getId() << " with random seed " << seed << " in " << timer.format(3));
+                std::vector<std::vector<LabeledRGBDImage> > sampledTrainLabelImages(treeCount);
+                tbb::parallel_for(tbb::blocked_range<size_t>(0, treeCount, 1),
+                        [&](const tbb::blocked_range<size_t>& range) {
+                            for (size_t treeNr = range.begin(); treeNr != range.end(); treeNr++) {
+                                sampledTrainLabelImages[treeNr] = sampleTrainImages(*ensemble[treeNr],
+                                        randomSources[treeNr]);
+                            }
+                        });
+
+                RandomTreeImage::train(ensemble, sampledTrainLabelImages, randomSources,
+                        configuration.getSamplesPerImage() / forestSize, trainingSetIndex, checkpointFiles);
             };
 
-    if (!trainTreesSequentially && numThreads > 1) {
+    const std::vector<int>& deviceIds = configuration.getDeviceIds();
+    const bool multipleDevices = deviceIds.size() > 1 && configuration.getAccelerationMode() != CPU_ONLY;
+
+    if (!trainTreesSequentially && numThreads > 1 && configuration.getAccelerationMode() == GPU_ONLY) {
+        trainTogether();
+    } else if (!trainTreesSequentially && numThreads > 1) {
         tbb::parallel_for_each(ensemble.begin(), ensemble.end(), train);
+    } else if (multipleDevices) {
+        // tree i is trained on device i % #devices (see ImageFeatureEvaluation::selectDevice()).
+        // the devices work in parallel, the trees of one device are trained sequentially
+        const size_t numDevices = std::min(deviceIds.size(), treeCount);
+        if (numThreads < static_cast<int>(numDevices)) {
+            CURFIL_WARNING("only " << numThreads << " threads for " << numDevices << " devices");
+        }
+
+        CURFIL_INFO("training " << treeCount << " trees on " << numDevices << " devices");
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numDevices, 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for(size_t device = range.begin(); device != range.end(); device++) {
+                        for(size_t treeNr = device; treeNr < treeCount; treeNr += deviceIds.size()) {
+                            train(ensemble[treeNr]);
+                        }
+                    }
+                });
     } else {
         std::for_each(ensemble.begin(), ensemble.end(), train);
     }
 }
 
-LabelImage RandomForestImage::predict(const RGBDImage& image,
-         cuv::ndarray<float, cuv::host_memory_space>* probabilities, const bool onGPU) const {
-
-    LabelImage prediction(image.getWidth(), image.getHeight());
-
-    const LabelType numClasses = getNumClasses();
-
-    if (treeData.size() != ensemble.size()) {
+void RandomForestImage::checkTreeData() const {
+    // forests that were loaded from a binary file only consist of the tree data
+    if (treeData.empty() || (!ensemble.empty() && treeData.size() != ensemble.size())) {
         throw std::runtime_error((boost::format("tree data size: %d, ensemble size: %d. histograms normalized?")
                 % treeData.size() % ensemble.size()).str());
     }
+}
 
-    cuv::ndarray<float, cuv::host_memory_space> hostProbabilities(
+const FlatForest& RandomForestImage::getFlatForest() const {
+    if (!flatForest) {
+        throw std::runtime_error("the forest has no trees for the prediction on the CPU. histograms normalized?");
+    }
+    return *flatForest;
+}
+
+// the device buffers of a prediction, see DeviceMemoryUsage
+static size_t predictionBytes(const cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        const cuv::ndarray<LabelType, cuv::dev_memory_space>& labels) {
+    return probabilities.size() * sizeof(float) + labels.size() * sizeof(LabelType);
+}
+
+void RandomForestImage::classifyOnGPU(const RGBDImage& image,
+        cuv::ndarray<float, cuv::dev_memory_space>& deviceProbabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& output) const {
+
+    checkTreeData();
+
+    const LabelType numClasses = getNumClasses();
+
+    deviceProbabilities = cuv::ndarray<float, cuv::dev_memory_space>(
             cuv::extents[numClasses][image.getHeight()][image.getWidth()],
             m_predictionAllocator);
 
-    if (onGPU) {
-        cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities(
-                cuv::extents[numClasses][image.getHeight()][image.getWidth()],
-                m_predictionAllocator);
-        cudaSafeCall(cudaMemset(deviceProbabilities.ptr(), 0, static_cast<size_t>(deviceProbabilities.size() * sizeof(float))));
+    output = cuv::ndarray<LabelType, cuv::dev_memory_space>(image.getHeight(), image.getWidth(),
+            m_predictionAllocator);
+
+    if (treeData.size() <= MAX_FOREST_TREES) {
+        utils::Profile profile("classifyImagesGPU");
+        classifyImage(treeData, deviceProbabilities, output, image, numClasses,
+                configuration.isSinglePrecisionFeatures());
+    } else {
+        // the trees do not fit into the tree cache at once
+        cudaSafeCall(cudaMemset(deviceProbabilities.ptr(), 0,
+                static_cast<size_t>(deviceProbabilities.size() * sizeof(float))));
 
         {
             utils::Profile profile("classifyImagesGPU");
             for (const boost::shared_ptr<const TreeNodes>& data : treeData) {
-                classifyImage(treeData.size(), deviceProbabilities, image, numClasses, data);
+                classifyImage(MAX_FOREST_TREES, deviceProbabilities, image, numClasses, data,
+                        configuration.isSinglePrecisionFeatures());
             }
         }
 
         normalizeProbabilities(deviceProbabilities);
-
-        cuv::ndarray<LabelType, cuv::dev_memory_space> output(image.getHeight(), image.getWidth(),
-                m_predictionAllocator);
         determineMaxProbabilities(deviceProbabilities, output);
+    }
+}
 
-        hostProbabilities = deviceProbabilities;
-        cuv::ndarray<LabelType, cuv::host_memory_space> outputHost(image.getHeight(), image.getWidth(),
+boost::shared_ptr<PredictionPlan> RandomForestImage::getPredictionPlan(int width, int height) const {
+
+    checkTreeData();
+
+    int deviceId;
+    cudaSafeCall(cudaGetDevice(&deviceId));
+
+    const std::pair<int, std::pair<int, int> > key(deviceId, std::make_pair(width, height));
+
+    tbb::mutex::scoped_lock lock(*predictionPlansMutex);
+
+    auto it = predictionPlans.find(key);
+    if (it != predictionPlans.end()) {
+        return it->second;
+    }
+
+    // plans that are still executed are kept alive by their callers
+    static const size_t MAX_PREDICTION_PLANS = 8;
+    if (predictionPlans.size() >= MAX_PREDICTION_PLANS) {
+        predictionPlans.clear();
+    }
+
+    boost::shared_ptr<PredictionPlan> plan = boost::make_shared<PredictionPlan>(treeData, width, height,
+            getNumClasses(), configuration.isSinglePrecisionFeatures());
+    predictionPlans[key] = plan;
+    return plan;
+}
+
+LabelImage RandomForestImage::predictOnCPU(const RGBDImage& image,
+        cuv::ndarray<float, cuv::host_memory_space>& probabilities) const {
+
+    checkTreeData();
+
+    LabelImage prediction(image.getWidth(), image.getHeight());
+
+    probabilities = cuv::ndarray<float, cuv::host_memory_space>(
+            cuv::extents[getNumClasses()][image.getHeight()][image.getWidth()],
+            m_predictionAllocator);
+
+    utils::Profile profile("classifyImagesCPU");
+    getFlatForest().predict(image, probabilities, prediction);
+
+    return prediction;
+}
+
+static void copyLabels(const LabelType* output, LabelImage& prediction) {
+    utils::Profile profile("copyLabels");
+    const size_t size = static_cast<size_t>(prediction.getWidth()) * prediction.getHeight() * sizeof(LabelType);
+    cudaSafeCall(cudaMemcpy(prediction.getLabels(), output, size, cudaMemcpyDeviceToHost));
+}
+
+LabelImage RandomForestImage::predict(const RGBDImage& image,
+         cuv::ndarray<float, cuv::host_memory_space>* probabilities, const bool onGPU) const {
+
+    if (!onGPU) {
+        cuv::ndarray<float, cuv::host_memory_space> hostProbabilities;
+        LabelImage prediction = predictOnCPU(image, hostProbabilities);
+        if (probabilities) {
+            *probabilities = hostProbabilities;
+        }
+        return prediction;
+    }
+
+    if (treeData.size() <= MAX_FOREST_TREES) {
+        boost::shared_ptr<PredictionPlan> plan = getPredictionPlan(image.getWidth(), image.getHeight());
+
+        LabelImage prediction(image.getWidth(), image.getHeight());
+        if (probabilities) {
+            cuv::ndarray<float, cuv::host_memory_space> hostProbabilities(
+                    cuv::extents[getNumClasses()][image.getHeight()][image.getWidth()],
+                    m_predictionAllocator);
+            plan->execute(image, prediction.getLabels(), hostProbabilities.ptr());
+            *probabilities = hostProbabilities;
+        } else {
+            plan->execute(image, prediction.getLabels());
+        }
+        return prediction;
+    }
+
+    cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities;
+    cuv::ndarray<LabelType, cuv::dev_memory_space> output;
+    classifyOnGPU(image, deviceProbabilities, output);
+    const DeviceMemoryUsage::Scope predictionMemory("prediction", predictionBytes(deviceProbabilities, output));
+
+    LabelImage prediction(image.getWidth(), image.getHeight());
+    copyLabels(output.ptr(), prediction);
+
+    // only transfer the probabilities if they were requested
+    if (probabilities) {
+        cuv::ndarray<float, cuv::host_memory_space> hostProbabilities(
+                cuv::extents[getNumClasses()][image.getHeight()][image.getWidth()],
                 m_predictionAllocator);
+        hostProbabilities = deviceProbabilities;
+        *probabilities = hostProbabilities;
+    }
 
-        outputHost = output;
+    return prediction;
+}
 
-        {
-            utils::Profile profile("setLabels");
-            for (int y = 0; y < image.getHeight(); ++y) {
-                for (int x = 0; x < image.getWidth(); ++x) {
-                    prediction.setLabel(x, y, static_cast<LabelType>(outputHost(y, x)));
-                }
+LabelImage RandomForestImage::predictWithConfidence(const RGBDImage& image,
+        cuv::ndarray<float, cuv::host_memory_space>& confidence, const bool onGPU) const {
+
+    confidence = cuv::ndarray<float, cuv::host_memory_space>(image.getHeight(), image.getWidth(),
+            m_predictionAllocator);
+
+    if (!onGPU) {
+        cuv::ndarray<float, cuv::host_memory_space> probabilities;
+        LabelImage prediction = predictOnCPU(image, probabilities);
+        for (int y = 0; y < image.getHeight(); y++) {
+            for (int x = 0; x < image.getWidth(); x++) {
+                confidence(y, x) = probabilities(prediction.getLabel(x, y), y, x);
             }
         }
-    } else {
-        utils::Profile profile("classifyImagesCPU");
+        return prediction;
+    }
 
-        tbb::parallel_for(tbb::blocked_range<size_t>(0, image.getHeight()),
-                [&](const tbb::blocked_range<size_t>& range) {
-                    for(size_t y = range.begin(); y != range.end(); y++) {
-                        for(int x=0; x < image.getWidth(); x++) {
+    cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities;
+    cuv::ndarray<LabelType, cuv::dev_memory_space> output;
+    classifyOnGPU(image, deviceProbabilities, output);
+    const DeviceMemoryUsage::Scope predictionMemory("prediction", predictionBytes(deviceProbabilities, output));
 
-                            for (LabelType label = 0; label < numClasses; label++) {
-                                hostProbabilities(label, y, x) = 0.0f;
-                            }
+    cuv::ndarray<float, cuv::dev_memory_space> deviceConfidence(image.getHeight(), image.getWidth(),
+            m_predictionAllocator);
+    determineMaxProbabilities(deviceProbabilities, output, &deviceConfidence);
 
-                            for (const auto& tree : ensemble) {
-                                const auto& t = tree->getTree();
-                                PixelInstance pixel(&image, 0, x, y);
-                                const auto& hist = t->classifySoft(pixel);
-                                assert(hist.size() == numClasses);
-                                for(LabelType label = 0; label<hist.size(); label++) {
-                                    hostProbabilities(label, y, x) += hist[label];
-                                }
-                            }
+    LabelImage prediction(image.getWidth(), image.getHeight());
+    copyLabels(output.ptr(), prediction);
 
-                            double sum = 0.0f;
-                            for (LabelType label = 0; label < numClasses; label++) {
-                                sum += hostProbabilities(label, y, x);
-                            }
-                            float bestProb = -1.0f;
-                            for (LabelType label = 0; label < numClasses; label++) {
-                                hostProbabilities(label, y, x) /= sum;
-                                float prob = hostProbabilities(label, y, x);
-                                if (prob > bestProb) {
-                                    prediction.setLabel(x, y, label);
-                                    bestProb = prob;
-                                }
-                            }
-                        }
-                    }
-                });
+    cudaSafeCall(cudaMemcpy(confidence.ptr(), deviceConfidence.ptr(), confidence.size() * sizeof(float),
+            cudaMemcpyDeviceToHost));
+
+    return prediction;
+}
+
+LabelImage RandomForestImage::predictHalf(const RGBDImage& image,
+        cuv::ndarray<unsigned short, cuv::host_memory_space>& probabilities) const {
+
+    cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities;
+    cuv::ndarray<LabelType, cuv::dev_memory_space> output;
+    classifyOnGPU(image, deviceProbabilities, output);
+    const DeviceMemoryUsage::Scope predictionMemory("prediction", predictionBytes(deviceProbabilities, output));
+
+    cuv::ndarray<unsigned short, cuv::dev_memory_space> halfProbabilities(deviceProbabilities.shape(),
+            m_predictionAllocator);
+    convertToHalf(deviceProbabilities, halfProbabilities);
+
+    LabelImage prediction(image.getWidth(), image.getHeight());
+    copyLabels(output.ptr(), prediction);
+
+    probabilities = cuv::ndarray<unsigned short, cuv::host_memory_space>(deviceProbabilities.shape(),
+            m_predictionAllocator);
+    cudaSafeCall(cudaMemcpy(probabilities.ptr(), halfProbabilities.ptr(),
+            probabilities.size() * sizeof(unsigned short), cudaMemcpyDeviceToHost));
+
+    return prediction;
+}
+
+std::vector<Point> selectPixels(const RegionOfInterest& region, int stride) {
+    if (stride < 1) {
+        throw std::runtime_error((boost::format("illegal stride: %d") % stride).str());
+    }
+    std::vector<Point> pixels;
+    for (int y = region.y; y < region.y + region.height; y += stride) {
+        for (int x = region.x; x < region.x + region.width; x += stride) {
+            pixels.push_back(Point(x, y));
+        }
+    }
+    return pixels;
+}
+
+std::vector<Point> selectPixels(const LabelImage& mask, int stride) {
+    if (stride < 1) {
+        throw std::runtime_error((boost::format("illegal stride: %d") % stride).str());
+    }
+    std::vector<Point> pixels;
+    for (int y = 0; y < mask.getHeight(); y += stride) {
+        for (int x = 0; x < mask.getWidth(); x += stride) {
+            if (mask.getLabel(x, y) != 0) {
+                pixels.push_back(Point(x, y));
+            }
+        }
+    }
+    return pixels;
+}
+
+void RandomForestImage::classifyPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+        cuv::ndarray<float, cuv::host_memory_space>& probabilities, std::vector<LabelType>& labels,
+        const bool onGPU) const {
+
+    checkTreeData();
+
+    for (const Point& pixel : pixels) {
+        if (!image.inImage(pixel.getX(), pixel.getY())) {
+            throw std::runtime_error((boost::format("pixel (%d,%d) is not in image of size %dx%d")
+                    % pixel.getX() % pixel.getY() % image.getWidth() % image.getHeight()).str());
+        }
+    }
+
+    const LabelType numClasses = getNumClasses();
+
+    probabilities = cuv::ndarray<float, cuv::host_memory_space>(cuv::extents[numClasses][pixels.size()],
+            m_predictionAllocator);
+    labels.resize(pixels.size());
+
+    if (pixels.empty()) {
+        return;
+    }
+
+    if (!onGPU || treeData.size() > MAX_FOREST_TREES) {
+        utils::Profile profile("classifyPixelsCPU");
+        getFlatForest().classifyPixels(image, pixels, probabilities, labels);
+        return;
+    }
+
+    cuv::ndarray<int, cuv::host_memory_space> hostPixels(cuv::extents[2][pixels.size()], m_predictionAllocator);
+    for (size_t i = 0; i < pixels.size(); i++) {
+        hostPixels(0, i) = pixels[i].getX();
+        hostPixels(1, i) = pixels[i].getY();
+    }
+
+    cuv::ndarray<int, cuv::dev_memory_space> devicePixels(cuv::extents[2][pixels.size()], m_predictionAllocator);
+    devicePixels = hostPixels;
+
+    cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities(cuv::extents[numClasses][pixels.size()],
+            m_predictionAllocator);
+    cuv::ndarray<LabelType, cuv::dev_memory_space> output(pixels.size(), m_predictionAllocator);
+    const DeviceMemoryUsage::Scope predictionMemory("prediction", predictionBytes(deviceProbabilities, output)
+            + devicePixels.size() * sizeof(int));
+
+    {
+        utils::Profile profile("classifyPixelsGPU");
+        curfil::classifyPixels(treeData, devicePixels, deviceProbabilities, output, image, numClasses,
+                configuration.isSinglePrecisionFeatures());
+    }
+
+    probabilities = deviceProbabilities;
+    cudaSafeCall(cudaMemcpy(&labels[0], output.ptr(), pixels.size() * sizeof(LabelType), cudaMemcpyDeviceToHost));
+}
+
+LabelImage RandomForestImage::predictPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+        cuv::ndarray<float, cuv::host_memory_space>* probabilities, const bool onGPU) const {
+
+    cuv::ndarray<float, cuv::host_memory_space> pixelProbabilities;
+    std::vector<LabelType> labels;
+    classifyPixels(image, pixels, pixelProbabilities, labels, onGPU);
+
+    LabelImage prediction(image.getWidth(), image.getHeight());
+    for (size_t i = 0; i < pixels.size(); i++) {
+        prediction.setLabel(pixels[i].getX(), pixels[i].getY(), labels[i]);
     }
 
     if (probabilities) {
-        *probabilities = hostProbabilities;
+        const LabelType numClasses = getNumClasses();
+        *probabilities = cuv::ndarray<float, cuv::host_memory_space>(
+                cuv::extents[numClasses][image.getHeight()][image.getWidth()], m_predictionAllocator);
+        *probabilities = 0.0f;
+        for (LabelType label = 0; label < numClasses; label++) {
+            for (size_t i = 0; i < pixels.size(); i++) {
+                (*probabilities)(label, pixels[i].getY(), pixels[i].getX()) = pixelProbabilities(label, i);
+            }
+        }
     }
 
     return prediction;
 }
 
+LabelImage RandomForestImage::predictCoarseToFine(const RGBDImage& image, int stride, float confidenceThreshold,
+        cuv::ndarray<float, cuv::host_memory_space>* probabilities, const bool onGPU) const {
+
+    const int width = image.getWidth();
+    const int height = image.getHeight();
+    const LabelType numClasses = getNumClasses();
+
+    // coarse pass on the grid
+    const std::vector<Point> grid = selectPixels(RegionOfInterest(0, 0, width, height), stride);
+    const int gridWidth = (width + stride - 1) / stride;
+
+    cuv::ndarray<float, cuv::host_memory_space> gridProbabilities;
+    std::vector<LabelType> gridLabels;
+    classifyPixels(image, grid, gridProbabilities, gridLabels, onGPU);
+
+    if (probabilities) {
+        *probabilities = cuv::ndarray<float, cuv::host_memory_space>(
+                cuv::extents[numClasses][height][width], m_predictionAllocator);
+    }
+
+    LabelImage prediction(width, height);
+
+    // fills pixel (x, y) with the result of the grid pixel at (gridX, gridY)
+    auto fill = [&](int x, int y, int gridX, int gridY) {
+        const size_t gridPixel = gridY * gridWidth + gridX;
+        prediction.setLabel(x, y, gridLabels[gridPixel]);
+        if (probabilities) {
+            for (LabelType label = 0; label < numClasses; label++) {
+                (*probabilities)(label, y, x) = gridProbabilities(label, gridPixel);
+            }
+        }
+    };
+
+    auto isConfident = [&](int gridX, int gridY, LabelType label) {
+        const size_t gridPixel = gridY * gridWidth + gridX;
+        return (gridLabels[gridPixel] == label
+                && gridProbabilities(label, gridPixel) >= confidenceThreshold);
+    };
+
+    std::vector<Point> refine;
+
+    for (int y = 0; y < height; y++) {
+        const int gridY0 = y / stride;
+        const int gridY1 = std::min(gridY0 + 1, (height - 1) / stride);
+        for (int x = 0; x < width; x++) {
+            const int gridX0 = x / stride;
+            const int gridX1 = std::min(gridX0 + 1, (width - 1) / stride);
+
+            if (x % stride == 0 && y % stride == 0) {
+                fill(x, y, gridX0, gridY0);
+                continue;
+            }
+
+            const LabelType label = gridLabels[gridY0 * gridWidth + gridX0];
+            if (isConfident(gridX0, gridY0, label) && isConfident(gridX1, gridY0, label)
+                    && isConfident(gridX0, gridY1, label) && isConfident(gridX1, gridY1, label)) {
+                const int nearestX = (x % stride <= stride / 2) ? gridX0 : gridX1;
+                const int nearestY = (y % stride <= stride / 2) ? gridY0 : gridY1;
+                fill(x, y, nearestX, nearestY);
+            } else {
+                refine.push_back(Point(x, y));
+            }
+        }
+    }
+
+    CURFIL_DEBUG("coarse-to-fine prediction: " << grid.size() << " grid pixels, refining "
+            << refine.size() << " of " << width * height << " pixels");
+
+    // fine pass on the uncertain pixels
+    cuv::ndarray<float, cuv::host_memory_space> refineProbabilities;
+    std::vector<LabelType> refineLabels;
+    classifyPixels(image, refine, refineProbabilities, refineLabels, onGPU);
+
+    for (size_t i = 0; i < refine.size(); i++) {
+        const int x = refine[i].getX();
+        const int y = refine[i].getY();
+        prediction.setLabel(x, y, refineLabels[i]);
+        if (probabilities) {
+            for (LabelType label = 0; label < numClasses; label++) {
+                (*probabilities)(label, y, x) = refineProbabilities(label, i);
+            }
+        }
+    }
+
+    return prediction;
+}
+
+size_t RandomForestImage::getBatchImageCacheSize(const RGBDImage& image, LabelType numClasses) const {
+
+    int deviceId;
+    cudaSafeCall(cudaGetDevice(&deviceId));
+
+    tbb::mutex::scoped_lock lock(*predictionPlansMutex);
+
+    std::map<int, size_t>::const_iterator it = batchImageCacheSizes.find(deviceId);
+    if (it != batchImageCacheSizes.end()) {
+        return it->second;
+    }
+
+    // the image in the image cache, its probabilities and labels
+    const size_t numPixels = static_cast<size_t>(image.getWidth()) * image.getHeight();
+    const size_t memoryPerImage = image.getSizeInMemory()
+            + numPixels * (numClasses * sizeof(float) + sizeof(LabelType));
+
+    // the budget of the device memory plan, if any. otherwise at most half of the free memory
+    size_t cacheSize;
+    const size_t imageCacheMemory = DeviceMemoryUsage::getBudget("imageCache");
+    if (imageCacheMemory > 0) {
+        cacheSize = imageCacheMemory / image.getSizeInMemory();
+    } else {
+        cacheSize = utils::getFreeMemoryOnGPU(deviceId) / 2 / memoryPerImage;
+    }
+    cacheSize = std::max(static_cast<size_t>(1), std::min(cacheSize, static_cast<size_t>(MAX_BATCH_IMAGES)));
+
+    CURFIL_INFO("image cache for the batch prediction on device " << deviceId << ": " << cacheSize << " images");
+
+    batchImageCacheSizes[deviceId] = cacheSize;
+    return cacheSize;
+}
+
+std::vector<LabelImage> RandomForestImage::predictBatch(const std::vector<const RGBDImage*>& images,
+        cuv::ndarray<float, cuv::host_memory_space>* probabilities) const {
+
+    std::vector<LabelImage> predictions;
+    if (images.empty()) {
+        return predictions;
+    }
+
+    checkTreeData();
+
+    const LabelType numClasses = getNumClasses();
+    const int width = images[0]->getWidth();
+    const int height = images[0]->getHeight();
+    const size_t numPixels = static_cast<size_t>(width) * height;
+
+    for (const RGBDImage* image : images) {
+        if (image->getWidth() != width || image->getHeight() != height) {
+            throw std::runtime_error("all images of a batch must have the same size");
+        }
+    }
+
+    if (probabilities) {
+        *probabilities = cuv::ndarray<float, cuv::host_memory_space>(
+                cuv::extents[images.size()][numClasses][height][width], m_predictionAllocator);
+    }
+
+    predictions.reserve(images.size());
+
+    if (treeData.size() > MAX_FOREST_TREES) {
+        for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+            cuv::ndarray<float, cuv::host_memory_space> imageProbabilities;
+            predictions.push_back(predict(*images[imageNr], probabilities ? &imageProbabilities : 0));
+            if (probabilities) {
+                std::copy(imageProbabilities.ptr(), imageProbabilities.ptr() + imageProbabilities.size(),
+                        probabilities->ptr() + imageNr * numClasses * numPixels);
+            }
+        }
+        return predictions;
+    }
+
+    // the image cache keeps its size for all batches so that it is not reallocated between them
+    const size_t imageCacheSize = getBatchImageCacheSize(*images[0], numClasses);
+    const size_t batchSize = std::min(images.size(), imageCacheSize);
+
+    CURFIL_INFO("classifying " << images.size() << " images in batches of " << batchSize);
+
+    utils::Profile profile("classifyImageBatchesGPU");
+
+    for (size_t batchBegin = 0; batchBegin < images.size(); batchBegin += batchSize) {
+        const size_t batchEnd = std::min(images.size(), batchBegin + batchSize);
+        const std::vector<const RGBDImage*> batch(images.begin() + batchBegin, images.begin() + batchEnd);
+
+        cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities(
+                cuv::extents[batch.size()][numClasses][height][width], m_predictionAllocator);
+        cuv::ndarray<LabelType, cuv::dev_memory_space> output(cuv::extents[batch.size()][height][width],
+                m_predictionAllocator);
+        const DeviceMemoryUsage::Scope predictionMemory("prediction", predictionBytes(deviceProbabilities, output));
+
+        classifyImages(treeData, deviceProbabilities, output, batch, numClasses, imageCacheSize,
+                configuration.isSinglePrecisionFeatures());
+
+        if (probabilities) {
+            cudaSafeCall(cudaMemcpy(probabilities->ptr() + batchBegin * numClasses * numPixels,
+                    deviceProbabilities.ptr(), deviceProbabilities.size() * sizeof(float),
+                    cudaMemcpyDeviceToHost));
+        }
+
+        for (size_t imageNr = 0; imageNr < batch.size(); imageNr++) {
+            LabelImage prediction(width, height);
+            copyLabels(output.ptr() + imageNr * numPixels, prediction);
+            predictions.push_back(prediction);
+        }
+    }
+
+    return predictions;
+}
+
 LabelType RandomForestImage::getNumClasses() const {
+    if (ensemble.empty() && !treeData.empty()) {
+        return treeData[0]->numLabels();
+    }
+
     LabelType numClasses = 0;
     for (const boost::shared_ptr<RandomTreeImage>& tree : ensemble) {
         if (numClasses == 0) {
@@ -263,19 +1152,37 @@ LabelType RandomForestImage::getNumClasses() const {
 
 void RandomForestImage::normalizeHistograms(const double histogramBias) {
 
+    if (ensemble.empty()) {
+        throw std::runtime_error("the histograms of a forest that was loaded from a binary file are normalized");
+    }
+
     treeData.clear();
 
+    {
+        // the plans refer to the previous tree data
+        tbb::mutex::scoped_lock lock(*predictionPlansMutex);
+        predictionPlans.clear();
+    }
+
     for (size_t treeNr = 0; treeNr < ensemble.size(); treeNr++) {
         CURFIL_INFO("normalizing histograms of tree " << treeNr <<
                 " with " << ensemble[treeNr]->getTree()->countLeafNodes() << " leaf nodes");
         ensemble[treeNr]->normalizeHistograms(histogramBias);
         treeData.push_back(convertTree(ensemble[treeNr]));
     }
+
+    flatForest = boost::make_shared<FlatForest>(ensemble, configuration.isSinglePrecisionFeatures());
 }
 
 std::map<LabelType, RGBColor> RandomForestImage::getLabelColorMap() const {
     std::map<LabelType, RGBColor> labelColorMap;
 
+    if (ensemble.empty()) {
+        for (LabelType label = 0; label < getNumClasses(); label++) {
+            labelColorMap[label] = LabelImage::decodeLabel(label);
+        }
+    }
+
     for (size_t treeNr = 0; treeNr < ensemble.size(); treeNr++) {
         const cuv::ndarray<WeightType, cuv::host_memory_space>& hist = ensemble[treeNr]->getTree()->getHistogram();
         for (LabelType label = 0; label < hist.size(); label++) {
@@ -287,6 +1194,16 @@ std::map<LabelType, RGBColor> RandomForestImage::getLabelColorMap() const {
 }
 
 bool RandomForestImage::shouldIgnoreLabel(const LabelType& label) const {
+    if (ensemble.empty()) {
+        const RGBColor color = LabelImage::decodeLabel(label);
+        for (const std::string& colorString : configuration.getIgnoredColors()) {
+            if (color == RGBColor(colorString)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
     for (const auto& tree : ensemble) {
         if (tree->shouldIgnoreLabel(label)) {
             return true;
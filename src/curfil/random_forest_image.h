@@ -2,17 +2,147 @@
 #define CURFIL_RANDOM_FOREST_IMAGE_H
 
 #include <boost/shared_ptr.hpp>
+#include <map>
+#include <tbb/mutex.h>
+#include <utility>
 #include <vector>
 
+#include "image_dataset.h"
 #include "random_tree_image.h"
 
 namespace curfil {
 
+class PredictionPlan;
 class TreeNodes;
 
+/**
+ * Compiled representation of a random forest for the prediction on the CPU.
+ *
+ * The nodes of all trees are stored in one contiguous array in breadth-first order where the two children of a node
+ * are adjacent. The normalized histograms of the leaf nodes are stored in a separate table.
+ */
+class FlatForest {
+
+public:
+
+    /**
+     * @param ensemble the trees of the forest. the histograms must be normalized
+     * @param singlePrecision whether the feature responses are calculated in single precision,
+     *        see TrainingConfiguration::isSinglePrecisionFeatures()
+     */
+    explicit FlatForest(const std::vector<boost::shared_ptr<RandomTreeImage> >& ensemble,
+            bool singlePrecision = false);
+
+    /**
+     * @param trees the trees in the layout that is uploaded to the GPU, for example from a binary forest file
+     */
+    explicit FlatForest(const std::vector<boost::shared_ptr<const TreeNodes> >& trees, bool singlePrecision = false);
+
+    /**
+     * Classifies the image on the CPU. Rows are classified in parallel, pixels of a row in tiles.
+     *
+     * @param probabilities probabilities per class in a C×H×W matrix that is allocated by the caller
+     * @param prediction the label image which has the same size as 'image'
+     */
+    void predict(const RGBDImage& image, cuv::ndarray<float, cuv::host_memory_space>& probabilities,
+            LabelImage& prediction) const;
+
+    /**
+     * Classifies the pixels of a list on the CPU.
+     *
+     * @param probabilities probabilities per class in a C×N matrix for the N pixels that is allocated by the caller
+     * @param labels the predicted label per pixel of the list
+     */
+    void classifyPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+            cuv::ndarray<float, cuv::host_memory_space>& probabilities, std::vector<LabelType>& labels) const;
+
+    size_t numTrees() const {
+        return roots.size();
+    }
+
+    size_t numNodes() const {
+        return nodes.size();
+    }
+
+    size_t numLeaves() const {
+        return histograms.size() / numClasses;
+    }
+
+    LabelType getNumClasses() const {
+        return numClasses;
+    }
+
+private:
+
+    // number of pixels of a row which traverse a tree together
+    static const int TILE_WIDTH = 32;
+
+    struct Node {
+        // absolute index of the left child. the right child follows it. -(leaf index + 1) for leaf nodes
+        int32_t child;
+        float threshold;
+        int16_t offset1X, offset1Y;
+        int16_t region1X, region1Y;
+        int16_t offset2X, offset2Y;
+        int16_t region2X, region2Y;
+        uint8_t type;
+        uint8_t channel1;
+        uint8_t channel2;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<size_t> roots;
+    std::vector<float> histograms;
+    LabelType numClasses;
+    bool singlePrecision;
+
+    void convert(const boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> >& tree,
+            size_t root, std::vector<const RandomTree<PixelInstance, ImageFeatureFunction>*>& treeNodes);
+
+    template<class FeatureResponse>
+    static FeatureResponse calculateFeatureResponse(const Node& node, const PixelInstance& instance);
+
+    void classifyTile(const std::vector<PixelInstance>& pixels, std::vector<float>& tileProbabilities) const;
+
+    // normalizes the summed probabilities of a pixel to output[label * stride] and returns the most probable label
+    LabelType normalize(const float* probabilities, float* output, size_t stride) const;
+};
+
+/**
+ * A rectangular region of interest of an image
+ */
+class RegionOfInterest {
+
+public:
+
+    RegionOfInterest(int x, int y, int width, int height) :
+            x(x), y(y), width(width), height(height) {
+        assert(width >= 0 && height >= 0);
+    }
+
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/**
+ * @return the pixels of the region of interest on a grid with the given stride in row-major order
+ */
+std::vector<Point> selectPixels(const RegionOfInterest& region, int stride = 1);
+
+/**
+ * @return the pixels on a grid with the given stride where the mask has a non-zero label, in row-major order
+ */
+std::vector<Point> selectPixels(const LabelImage& mask, int stride = 1);
+
 class RandomForestImage {
 public:
 
+    /**
+     * @param treeFiles the JSON files of the trees or a single binary forest file, see RandomTreeExport::writeBinary()
+     * @param histogramBias ignored for binary forest files whose histograms are already normalized
+     */
     explicit RandomForestImage(const std::vector<std::string>& treeFiles,
             const std::vector<int>& deviceIds = std::vector<int>(1, 0),
             const AccelerationMode accelerationMode = GPU_ONLY,
@@ -24,17 +154,97 @@ public:
     explicit RandomForestImage(const std::vector<boost::shared_ptr<RandomTreeImage> >& ensemble,
             const TrainingConfiguration& configuration);
 
-    void train(const std::vector<LabeledRGBDImage>& trainLabelImages, bool trainTreesSequentially = false);
+    /**
+     * @param trainTreesSequentially if false and there are several threads, the trees are trained in parallel.
+     *        in GPU_ONLY mode, the trees are trained together level by level and share the image transfers
+     * @param checkpointFolder if not empty, each tree writes a checkpoint to this folder after each trained level
+     *        and resumes from the checkpoint it finds there
+     */
+    void train(const std::vector<LabeledRGBDImage>& trainLabelImages, bool trainTreesSequentially = false,
+            const std::string& checkpointFolder = std::string());
+
+    /**
+     * Each tree loads the images it samples from the dataset and releases them when it is trained.
+     */
+    void train(const ImageDataset& trainImages, bool trainTreesSequentially = false,
+            const std::string& checkpointFolder = std::string());
+
+    /**
+     * @param trainingSetIndex the label statistics of the images that are shared with other forests that are
+     *        trained on the same images
+     */
+    void train(const ImageDataset& trainImages, TrainingSetIndex& trainingSetIndex,
+            bool trainTreesSequentially = false, const std::string& checkpointFolder = std::string());
+
+    /**
+     * Trains only the trees with the given ids. They are identical to the trees with these ids of a training of
+     * the complete forest. Afterwards, the forest consists of the trained trees in the given order.
+     */
+    void train(const ImageDataset& trainImages, TrainingSetIndex& trainingSetIndex,
+            const std::vector<size_t>& treeIds, bool trainTreesSequentially = false,
+            const std::string& checkpointFolder = std::string());
 
     /**
      * @param image the image which should be classified
-     * @param if not null, probabilities per class in a C×H×W matrix for C classes and an image of size W×H
+     * @param if not null, probabilities per class in a C×H×W matrix for C classes and an image of size W×H.
+     *        they are only transferred from the GPU if requested
      * @return prediction image which has the same size as 'image'
      */
     LabelImage predict(const RGBDImage& image,
             cuv::ndarray<float, cuv::host_memory_space>* prediction = 0,
             const bool onGPU = true) const;
 
+    /**
+     * @param confidence the probability of the predicted label per pixel in a H×W matrix
+     * @return prediction image which has the same size as 'image'
+     */
+    LabelImage predictWithConfidence(const RGBDImage& image,
+            cuv::ndarray<float, cuv::host_memory_space>& confidence,
+            const bool onGPU = true) const;
+
+    /**
+     * Classifies the image on the GPU and transfers the probabilities in half precision.
+     *
+     * @param probabilities IEEE 754 half precision probabilities per class in a C×H×W matrix, see halfToFloat()
+     * @return prediction image which has the same size as 'image'
+     */
+    LabelImage predictHalf(const RGBDImage& image,
+            cuv::ndarray<unsigned short, cuv::host_memory_space>& probabilities) const;
+
+    /**
+     * Classifies only the given pixels of the image. Pixels that are not in the list are labeled zero (void).
+     *
+     * @param pixels the pixels to classify, for example from selectPixels()
+     * @param probabilities if not null, probabilities per class in a C×H×W matrix. zero for pixels not in the list
+     * @return prediction image which has the same size as 'image'
+     */
+    LabelImage predictPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+            cuv::ndarray<float, cuv::host_memory_space>* probabilities = 0,
+            const bool onGPU = true) const;
+
+    /**
+     * Classifies the pixels on a grid with the given stride first. A pixel in between is only classified if the
+     * labels of the surrounding grid pixels disagree or one of their probabilities is below 'confidenceThreshold'.
+     * Otherwise, it takes the label and probabilities of the nearest grid pixel.
+     *
+     * @param probabilities if not null, probabilities per class in a C×H×W matrix
+     * @return prediction image which has the same size as 'image'
+     */
+    LabelImage predictCoarseToFine(const RGBDImage& image, int stride, float confidenceThreshold,
+            cuv::ndarray<float, cuv::host_memory_space>* probabilities = 0,
+            const bool onGPU = true) const;
+
+    /**
+     * Classifies the images in batches on the GPU. The batch size is determined once per device from the device
+     * memory plan or the free memory on the GPU.
+     *
+     * @param images the images which should be classified. all images must have the same size
+     * @param probabilities if not null, probabilities per class in a N×C×H×W matrix for N images
+     * @return one prediction image per input image
+     */
+    std::vector<LabelImage> predictBatch(const std::vector<const RGBDImage*>& images,
+            cuv::ndarray<float, cuv::host_memory_space>* probabilities = 0) const;
+
     std::map<std::string, size_t> countFeatures() const;
 
     LabelType getNumClasses() const;
@@ -47,10 +257,16 @@ public:
 #endif
     }
 
+    // empty if the forest was loaded from a binary file
     const std::vector<boost::shared_ptr<RandomTreeImage> >& getTrees() const {
         return ensemble;
     }
 
+    // the trees in the layout that is uploaded to the GPU. empty until the histograms are normalized
+    const std::vector<boost::shared_ptr<const TreeNodes> >& getTreeData() const {
+        return treeData;
+    }
+
     const TrainingConfiguration& getConfiguration() const {
         return configuration;
     }
@@ -63,11 +279,43 @@ public:
 
 private:
 
+    // throws if the histograms were not normalized
+    void checkTreeData() const;
+
+    // the trees for the prediction on the CPU. throws if the histograms were not normalized
+    const FlatForest& getFlatForest() const;
+
+    void classifyOnGPU(const RGBDImage& image,
+            cuv::ndarray<float, cuv::dev_memory_space>& deviceProbabilities,
+            cuv::ndarray<LabelType, cuv::dev_memory_space>& output) const;
+
+    LabelImage predictOnCPU(const RGBDImage& image,
+            cuv::ndarray<float, cuv::host_memory_space>& probabilities) const;
+
+    // the launch plan for images of the given size on the current device. created on first use
+    boost::shared_ptr<PredictionPlan> getPredictionPlan(int width, int height) const;
+
+    // the number of images of the image cache for predictBatch() on the current device. determined on first use
+    // from the device memory plan or the free memory, at most MAX_BATCH_IMAGES
+    size_t getBatchImageCacheSize(const RGBDImage& image, LabelType numClasses) const;
+
+    // probabilities in a C×N matrix and labels for the N pixels of the list
+    void classifyPixels(const RGBDImage& image, const std::vector<Point>& pixels,
+            cuv::ndarray<float, cuv::host_memory_space>& probabilities, std::vector<LabelType>& labels,
+            const bool onGPU) const;
+
     TrainingConfiguration configuration;
 
     std::vector<boost::shared_ptr<RandomTreeImage> > ensemble;
     std::vector<boost::shared_ptr<const TreeNodes> > treeData;
+    boost::shared_ptr<const FlatForest> flatForest;
     boost::shared_ptr<cuv::allocator> m_predictionAllocator;
+
+    // prediction plans per device, width and height. only a few image sizes are kept
+    boost::shared_ptr<tbb::mutex> predictionPlansMutex;
+    mutable std::map<std::pair<int, std::pair<int, int> >, boost::shared_ptr<PredictionPlan> > predictionPlans;
+    // image cache sizes of predictBatch() per device. guarded by predictionPlansMutex
+    mutable std::map<int, size_t> batchImageCacheSizes;
 };
 
 }
@@ -80,6 +80,12 @@ int Sampler::getNext() {
     return value;
 }
 
+uint64_t IndexSampler::getNext(uint64_t n) {
+    assert(n > 0);
+    boost::random::uniform_int_distribution<uint64_t> distribution(0, n - 1);
+    return distribution(rng);
+}
+
 AccelerationMode TrainingConfiguration::parseAccelerationModeString(const std::string& modeString) {
     if (modeString == "cpu") {
         return AccelerationMode::CPU_ONLY;
@@ -87,6 +93,8 @@ AccelerationMode TrainingConfiguration::parseAccelerationModeString(const std::s
         return AccelerationMode::GPU_ONLY;
     } else if (modeString == "compare") {
         return AccelerationMode::GPU_AND_CPU_COMPARE;
+    } else if (modeString == "hybrid") {
+        return AccelerationMode::HYBRID;
     } else {
         throw std::runtime_error(std::string("illegal acceleration mode: ") + modeString);
     }
@@ -100,11 +108,15 @@ std::string TrainingConfiguration::getAccelerationModeString() const {
             return "cpu";
         case GPU_AND_CPU_COMPARE:
             return "compare";
+        case HYBRID:
+            return "hybrid";
         default:
             throw std::runtime_error(boost::str(boost::format("unknown acceleration mode: %d") % accelerationMode));
     }
 }
 
+const unsigned int TrainingConfiguration::DEFAULT_HYBRID_SAMPLE_THRESHOLD;
+
 TrainingConfiguration::TrainingConfiguration(const TrainingConfiguration& other) {
     *this = other;
 }
@@ -128,6 +140,10 @@ TrainingConfiguration& TrainingConfiguration::operator=(const TrainingConfigurat
     deviceIds = other.deviceIds;
     subsamplingType = other.subsamplingType;
     ignoredColors = other.ignoredColors;
+    hybridSampleThreshold = other.hybridSampleThreshold;
+    compactImageCacheSize = other.compactImageCacheSize;
+    singlePrecisionFeatures = other.singlePrecisionFeatures;
+    binnedSplits = other.binnedSplits;
     assert(*this == other);
     return *this;
 }
@@ -143,6 +159,10 @@ bool TrainingConfiguration::equals(const TrainingConfiguration& other,
         return false;
     if (strict && maxSamplesPerBatch != other.maxSamplesPerBatch)
         return false;
+    if (strict && hybridSampleThreshold != other.hybridSampleThreshold)
+        return false;
+    if (strict && compactImageCacheSize != other.compactImageCacheSize)
+        return false;
 
     if (samplesPerImage != other.samplesPerImage)
         return false;
@@ -172,6 +192,10 @@ bool TrainingConfiguration::equals(const TrainingConfiguration& other,
         return false;
     if (useDepthFilling != other.useDepthFilling)
         return false;
+    if (singlePrecisionFeatures != other.singlePrecisionFeatures)
+        return false;
+    if (binnedSplits != other.binnedSplits)
+        return false;
 
     return true;
 }
@@ -199,11 +223,23 @@ std::ostream& operator<<(std::ostream& os, const curfil::TrainingConfiguration&
     os << "thresholds: " << configuration.getThresholds() << std::endl;
     os << "maxImages: " << configuration.getMaxImages() << std::endl;
     os << "imageCacheSize: " << configuration.getImageCacheSize() << std::endl;
+    if (configuration.getCompactImageCacheSize() > 0) {
+        os << "compactImageCacheSize: " << configuration.getCompactImageCacheSize() << std::endl;
+    }
     os << "accelerationMode: " << configuration.getAccelerationModeString() << std::endl;
+    if (configuration.getAccelerationMode() == curfil::HYBRID) {
+        os << "hybridSampleThreshold: " << configuration.getHybridSampleThreshold() << std::endl;
+    }
     os << "maxSamplesPerBatch: " << configuration.getMaxSamplesPerBatch() << std::endl;
     os << "subsamplingType: " << configuration.getSubsamplingType() << std::endl;
     os << "useCIELab: " << configuration.isUseCIELab() << std::endl;
     os << "useDepthFilling: " << configuration.isUseDepthFilling() << std::endl;
+    if (configuration.isSinglePrecisionFeatures()) {
+        os << "singlePrecisionFeatures: " << configuration.isSinglePrecisionFeatures() << std::endl;
+    }
+    if (configuration.isBinnedSplits()) {
+        os << "binnedSplits: " << configuration.isBinnedSplits() << std::endl;
+    }
     os << "deviceIds: " << joinToString(configuration.getDeviceIds()) << std::endl;
     os << "ignoredColors: " << joinToString(configuration.getIgnoredColors()) << std::endl;
     return os;
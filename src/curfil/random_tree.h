@@ -1,6 +1,7 @@
 #ifndef CURFIL_RANDOMTREE_H
 #define CURFIL_RANDOMTREE_H
 
+#include <algorithm>
 #include <boost/format.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/random.hpp>
@@ -14,12 +15,15 @@
 #include <map>
 #include <ostream>
 #include <set>
+#include <stdint.h>
+#include <tbb/blocked_range.h>
 #include <tbb/concurrent_vector.h>
 #include <tbb/parallel_for.h>
 #include <utility>
 #include <vector>
 
 #include "score.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace curfil {
@@ -47,7 +51,8 @@ enum SplitBranch {
 enum AccelerationMode {
     CPU_ONLY,
     GPU_ONLY,
-    GPU_AND_CPU_COMPARE
+    GPU_AND_CPU_COMPARE,
+    HYBRID // every node is evaluated either on the CPU or on the GPU, see HybridCostModel
 };
 
 template<class Instance, class FeatureFunction> class SplitFunction {
@@ -56,13 +61,17 @@ public:
     // Note: feat is copied and SplitFunction assumes ownership.
     // To be able to test on any sample, FeatureFunction must be implemented
     // such that it can lookup these Instances dynamically.
-    SplitFunction(size_t featureId, const FeatureFunction& feature, float threshold, ScoreType score) :
-            featureId(featureId), feature(feature), threshold(threshold), score(score) {
+    // singlePrecision: the feature response is calculated in the precision the split was scored with,
+    // see TrainingConfiguration::isSinglePrecisionSplits()
+    SplitFunction(size_t featureId, const FeatureFunction& feature, float threshold, ScoreType score,
+            bool singlePrecision = false) :
+            featureId(featureId), feature(feature), threshold(threshold), score(score),
+                    singlePrecision(singlePrecision) {
     }
 
     SplitFunction() :
             featureId(0), feature(), threshold(std::numeric_limits<float>::quiet_NaN()), score(
-                    std::numeric_limits<float>::quiet_NaN()) {
+                    std::numeric_limits<float>::quiet_NaN()), singlePrecision(false) {
     }
 
     SplitFunction& operator=(const SplitFunction& other) {
@@ -72,11 +81,17 @@ public:
         feature = other.feature;
         threshold = other.threshold;
         score = other.score;
+        singlePrecision = other.singlePrecision;
+        leftHistogram = other.leftHistogram;
+        rightHistogram = other.rightHistogram;
         return (*this);
     }
 
     // Return left or right branch for a given instance and feature function.
     SplitBranch split(const Instance& instance) const {
+        if (singlePrecision) {
+            return (feature.template calculateFeatureResponse<float>(instance) <= getThreshold() ? LEFT : RIGHT);
+        }
         return (feature.calculateFeatureResponse(instance) <= getThreshold() ? LEFT : RIGHT);
     }
 
@@ -99,17 +114,47 @@ public:
         return featureId;
     }
 
+    bool isSinglePrecision() const {
+        return singlePrecision;
+    }
+
+    /**
+     * Sets the class histograms of the training samples that go left and right, as counted by the evaluation.
+     */
+    void setHistograms(const std::vector<WeightType>& left, const std::vector<WeightType>& right) {
+        assert(left.size() == right.size());
+        leftHistogram = left;
+        rightHistogram = right;
+    }
+
+    /**
+     * @return false if the split was not evaluated, e.g. if it was replayed from a checkpoint
+     */
+    bool hasHistograms() const {
+        return !leftHistogram.empty();
+    }
+
+    const std::vector<WeightType>& getHistogram(SplitBranch branch) const {
+        assert(hasHistograms());
+        return (branch == LEFT ? leftHistogram : rightHistogram);
+    }
+
 private:
     size_t featureId;
     FeatureFunction feature;
     float threshold;
     ScoreType score;
+    bool singlePrecision;
+    std::vector<WeightType> leftHistogram;
+    std::vector<WeightType> rightHistogram;
 };
 
 class TrainingConfiguration {
 
 public:
 
+    static const unsigned int DEFAULT_HYBRID_SAMPLE_THRESHOLD = 2000;
+
     explicit TrainingConfiguration() :
             randomSeed(0),
                     samplesPerImage(0),
@@ -128,7 +173,11 @@ public:
                     useDepthFilling(0),
                     deviceIds(),
                     subsamplingType(),
-                    ignoredColors() {
+                    ignoredColors(),
+                    hybridSampleThreshold(DEFAULT_HYBRID_SAMPLE_THRESHOLD),
+                    compactImageCacheSize(0),
+                    singlePrecisionFeatures(false),
+                    binnedSplits(false) {
     }
 
     TrainingConfiguration(const TrainingConfiguration& other);
@@ -168,7 +217,11 @@ public:
                     useDepthFilling(useDepthFilling),
                     deviceIds(deviceIds),
                     subsamplingType(subsamplingType),
-                    ignoredColors(ignoredColors)
+                    ignoredColors(ignoredColors),
+                    hybridSampleThreshold(DEFAULT_HYBRID_SAMPLE_THRESHOLD),
+                    compactImageCacheSize(0),
+                    singlePrecisionFeatures(false),
+                    binnedSplits(false)
     {
         for (size_t c = 0; c < ignoredColors.size(); c++) {
             if (ignoredColors[c].empty()) {
@@ -206,6 +259,11 @@ public:
         return maxDepth;
     }
 
+    void setMaxDepth(int maxDepth) {
+        assert(maxDepth > 0);
+        this->maxDepth = maxDepth;
+    }
+
     uint16_t getBoxRadius() const {
         return boxRadius;
     }
@@ -258,6 +316,51 @@ public:
         return subsamplingType;
     }
 
+    // HYBRID mode: nodes with at least this many samples are evaluated on the GPU until the cost model is calibrated
+    unsigned int getHybridSampleThreshold() const {
+        return hybridSampleThreshold;
+    }
+
+    void setHybridSampleThreshold(unsigned int hybridSampleThreshold) {
+        this->hybridSampleThreshold = hybridSampleThreshold;
+    }
+
+    // number of images that are kept on the GPU in a compact format in addition to the image cache
+    int getCompactImageCacheSize() const {
+        return compactImageCacheSize;
+    }
+
+    void setCompactImageCacheSize(int compactImageCacheSize) {
+        this->compactImageCacheSize = compactImageCacheSize;
+    }
+
+    // whether the feature responses are calculated in single instead of double precision.
+    // the CPU stays in double precision in GPU_AND_CPU_COMPARE mode to check the agreement of the best splits
+    bool isSinglePrecisionFeatures() const {
+        return singlePrecisionFeatures;
+    }
+
+    void setSinglePrecisionFeatures(bool singlePrecisionFeatures) {
+        this->singlePrecisionFeatures = singlePrecisionFeatures;
+    }
+
+    // whether the best splits are scored on single precision feature responses, such that the samples must
+    // be split and classified in single precision as well. the CPU reference of GPU_AND_CPU_COMPARE is double
+    bool isSinglePrecisionSplits() const {
+        return singlePrecisionFeatures && accelerationMode != GPU_AND_CPU_COMPARE;
+    }
+
+    // whether the thresholds of a feature are sorted sampled quantiles of its responses, such that the GPU bins
+    // every response with a binary search instead of comparing it with all thresholds.
+    // the thresholds are the boundaries of getThresholds() + 1 bins. the GPU stores the counters per bin and label
+    bool isBinnedSplits() const {
+        return binnedSplits;
+    }
+
+    void setBinnedSplits(bool binnedSplits) {
+        this->binnedSplits = binnedSplits;
+    }
+
     bool isUseCIELab() const {
         return useCIELab;
     }
@@ -303,6 +406,10 @@ private:
     std::vector<int> deviceIds;
     std::string subsamplingType;
     std::vector<std::string> ignoredColors;
+    unsigned int hybridSampleThreshold;
+    int compactImageCacheSize;
+    bool singlePrecisionFeatures;
+    bool binnedSplits;
 };
 
 template<class Instance, class FeatureFunction>
@@ -314,8 +421,8 @@ public:
             const std::vector<const Instance*>& samples, size_t numClasses,
             const boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& parent = boost::shared_ptr<
                     RandomTree<Instance, FeatureFunction> >()) :
-            nodeId(nodeId), level(level), parent(parent), leaf(true), trainSamples(),
-                    numClasses(numClasses), histogram(numClasses), timers(),
+            nodeId(nodeId), level(level), parent(parent), leaf(true), numTrainSamples(samples.size()),
+                    trainSamples(), numClasses(numClasses), histogram(numClasses), timers(),
                     split(), left(), right() {
 
         assert(histogram.ndim() == 1);
@@ -325,21 +432,56 @@ public:
 
         for (size_t i = 0; i < samples.size(); i++) {
             histogram[samples[i]->getLabel()] += samples[i]->getWeight();
-            trainSamples.push_back(*samples[i]);
         }
+
+        storeTrainSamples(samples);
+    }
+
+    /**
+     * Takes the histogram of the samples as it was counted by the evaluation of the split of the parent,
+     * instead of another pass over the samples.
+     */
+    RandomTree(const size_t& nodeId, const int level,
+            const std::vector<const Instance*>& samples, const std::vector<WeightType>& histogram,
+            const boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& parent) :
+            nodeId(nodeId), level(level), parent(parent), leaf(true), numTrainSamples(samples.size()),
+                    trainSamples(), numClasses(histogram.size()), histogram(histogram.size()), timers(),
+                    split(), left(), right() {
+
+        for (size_t i = 0; i < histogram.size(); i++) {
+            this->histogram[i] = histogram[i];
+        }
+
+        storeTrainSamples(samples);
     }
 
     RandomTree(const size_t& nodeId, const int level,
             const boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& parent,
             const std::vector<WeightType>& histogram) :
-            nodeId(nodeId), level(level), parent(parent), leaf(true), trainSamples(),
+            nodeId(nodeId), level(level), parent(parent), leaf(true), numTrainSamples(0), trainSamples(),
                     numClasses(histogram.size()), histogram(histogram.size()), timers(),
                     split(), left(), right() {
 
+        WeightType sum = 0;
         for (size_t i = 0; i < histogram.size(); i++) {
             this->histogram[i] = histogram[i];
+            sum += histogram[i];
         }
 
+        // all training samples have a weight of one
+        numTrainSamples = sum;
+    }
+
+    /**
+     * Lets every node that is trained afterwards keep a copy of its training samples (see getTrainSamples()).
+     * This is meant for debugging and tests only, since every level then holds another copy of the training set.
+     */
+    static void setKeepTrainSamples(bool keep) {
+        keepTrainSamples = keep;
+    }
+
+    static bool isKeepingTrainSamples() {
+        return keepTrainSamples;
     }
 
     /**
@@ -398,7 +540,7 @@ public:
     }
 
     size_t getNumTrainSamples() const {
-        return trainSamples.size();
+        return numTrainSamples;
     }
 
     const std::map<std::string, double>& getTimerValues() const {
@@ -567,11 +709,24 @@ public:
         return normalizedHistogram;
     }
 
+    /**
+     * @return the training samples of this node. empty unless setKeepTrainSamples() was enabled during the training
+     */
     const std::vector<Instance>& getTrainSamples() const {
         return trainSamples;
     }
 
 private:
+
+    void storeTrainSamples(const std::vector<const Instance*>& samples) {
+        if (keepTrainSamples) {
+            trainSamples.reserve(samples.size());
+            for (size_t i = 0; i < samples.size(); i++) {
+                trainSamples.push_back(*samples[i]);
+            }
+        }
+    }
+
     // A unique node identifier within this tree
     const size_t nodeId;
     const int level;
@@ -586,7 +741,11 @@ private:
     // If true, this node is a leaf node
     bool leaf;
 
+    size_t numTrainSamples;
+
+    // only kept in debug mode, see setKeepTrainSamples()
     std::vector<Instance> trainSamples;
+    static bool keepTrainSamples;
 
     size_t numClasses;
 
@@ -635,6 +794,9 @@ private:
 
 };
 
+template<class Instance, class FeatureFunction>
+bool RandomTree<Instance, FeatureFunction>::keepTrainSamples = false;
+
 class Sampler {
 public:
     Sampler(int seed, int lower, int upper) :
@@ -672,6 +834,38 @@ private:
     boost::uniform_int<> distribution;
 };
 
+/**
+ * Draws uniformly distributed 64-bit indices, for example into the pixels of a class in all training images
+ * which might be more than 2^31.
+ */
+class IndexSampler {
+public:
+    explicit IndexSampler(int seed) :
+            seed(seed), rng(seed) {
+    }
+
+    IndexSampler(const IndexSampler& other) :
+            seed(other.seed), rng(seed) {
+    }
+
+    /**
+     * @return a uniformly distributed index in [0, n)
+     */
+    uint64_t getNext(uint64_t n);
+
+    int getSeed() const {
+        return seed;
+    }
+
+private:
+    IndexSampler& operator=(const IndexSampler&);
+    IndexSampler();
+
+    int seed;
+
+    boost::random::mt19937_64 rng;
+};
+
 template<class T>
 class ReservoirSampler {
 public:
@@ -729,6 +923,10 @@ public:
             seed(seed) {
     }
 
+    int getSeed() const {
+        return seed;
+    }
+
     Sampler uniformSampler(int val) {
         return uniformSampler(0, val - 1);
     }
@@ -736,6 +934,79 @@ public:
     Sampler uniformSampler(int lower, int upper) {
         return Sampler(seed++, lower, upper);
     }
+
+    IndexSampler indexSampler() {
+        return IndexSampler(seed++);
+    }
+};
+
+/**
+ * State of a partially trained tree after a completed level that is needed to resume the training.
+ *
+ * The samples of the nodes are not stored. They are restored by replaying the splits on the subsamples of the tree.
+ */
+template<class Instance, class FeatureFunction>
+class RandomTreeCheckpoint {
+public:
+
+    explicit RandomTreeCheckpoint(size_t numSamples = 0) :
+            level(0), idNode(0), randomSeed(0), numSamples(numSamples), splits(), frontier() {
+    }
+
+    /**
+     * @param level the last completed level
+     * @param idNode the id of the last node that was created
+     * @param randomSeed the state of the RandomSource after the level
+     */
+    void setState(int level, int idNode, int randomSeed) {
+        this->level = level;
+        this->idNode = idNode;
+        this->randomSeed = randomSeed;
+        frontier.clear();
+    }
+
+    void addSplit(size_t nodeId, const SplitFunction<Instance, FeatureFunction>& split) {
+        splits.insert(std::make_pair(nodeId, split));
+    }
+
+    // a node of the next level that still needs to be trained
+    void addFrontierNode(size_t nodeId, size_t samples) {
+        frontier.push_back(std::make_pair(nodeId, samples));
+    }
+
+    int getLevel() const {
+        return level;
+    }
+
+    int getIdNode() const {
+        return idNode;
+    }
+
+    int getRandomSeed() const {
+        return randomSeed;
+    }
+
+    // number of samples of the root node
+    size_t getNumSamples() const {
+        return numSamples;
+    }
+
+    const std::map<size_t, SplitFunction<Instance, FeatureFunction> >& getSplits() const {
+        return splits;
+    }
+
+    // node id and number of samples of the nodes of the next level
+    const std::vector<std::pair<size_t, size_t> >& getFrontier() const {
+        return frontier;
+    }
+
+private:
+    int level;
+    int idNode;
+    int randomSeed;
+    size_t numSamples;
+    std::map<size_t, SplitFunction<Instance, FeatureFunction> > splits;
+    std::vector<std::pair<size_t, size_t> > frontier;
 };
 
 template<class Instance, class FeatureEvaluation, class FeatureFunction>
@@ -752,10 +1023,30 @@ public:
      *    the tree learning is stopped when the given depth is reached.
      */
     RandomTreeTrain(int id, size_t numClasses, const TrainingConfiguration& configuration) :
-            id(id), numClasses(numClasses), configuration(configuration) {
+            id(id), numClasses(numClasses), configuration(configuration), checkpointHandler(), checkpoint(),
+                    resumeCheckpoint(), resuming(false) {
         assert(configuration.getMaxDepth() > 0);
     }
 
+    typedef RandomTreeCheckpoint<Instance, FeatureFunction> Checkpoint;
+
+    /**
+     * The handler is called after each completed level of the training.
+     */
+    void setCheckpointHandler(const std::function<void(const Checkpoint&)>& handler) {
+        checkpointHandler = handler;
+    }
+
+    /**
+     * The next training replays the splits of the checkpoint instead of evaluating them
+     * and continues after the last level of the checkpoint.
+     * The resulting tree is identical to a tree that was trained without interruption.
+     */
+    void resume(const Checkpoint& checkpoint) {
+        resumeCheckpoint = checkpoint;
+        resuming = true;
+    }
+
 private:
 
     bool shouldContinueGrowing(const boost::shared_ptr<RandomTree<Instance, FeatureFunction> > node) const {
@@ -772,6 +1063,24 @@ private:
     typedef boost::shared_ptr<RandomTree<Instance, FeatureFunction> > RandomTreePointer;
     typedef std::vector<const Instance*> Samples;
 
+    void checkResumedLevel(const std::vector<std::pair<RandomTreePointer, Samples> >& samplesPerNodeNextLevel,
+            int idNode) const {
+
+        const std::vector<std::pair<size_t, size_t> >& frontier = resumeCheckpoint.getFrontier();
+
+        bool matches = (idNode == resumeCheckpoint.getIdNode() && frontier.size() == samplesPerNodeNextLevel.size());
+        for (size_t i = 0; matches && i < frontier.size(); i++) {
+            matches = (frontier[i].first == samplesPerNodeNextLevel[i].first->getNodeId()
+                    && frontier[i].second == samplesPerNodeNextLevel[i].second.size());
+        }
+
+        if (!matches) {
+            throw std::runtime_error(boost::str(
+                    boost::format("checkpoint of tree %d does not match the training data at level %d")
+                            % id % resumeCheckpoint.getLevel()));
+        }
+    }
+
     void compareHistograms(boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& currentNode,
             boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& leftNode,
             boost::shared_ptr<RandomTree<Instance, FeatureFunction> >& rightNode,
@@ -811,62 +1120,129 @@ private:
 
 public:
 
-    /* Train a single random tree breadth-first */
+    typedef std::vector<std::pair<RandomTreePointer, Samples> > SamplesPerNode;
+
+    /* Train a single random tree breadth-first.
+     *
+     * The sample vectors of samplesPerNode are partitioned in place and handed over to the child nodes.
+     */
     void train(FeatureEvaluation& featureEvaluation,
             RandomSource& randomSource,
-            const std::vector<std::pair<RandomTreePointer, Samples> >& samplesPerNode,
-            int idNode, int currentLevel = 1) const {
+            SamplesPerNode& samplesPerNode,
+            int idNode, int currentLevel = 1) {
 
-        // Depth exhausted: leaf node
-        if (currentLevel == configuration.getMaxDepth()) {
-            return;
+        for (; shouldTrainLevel(samplesPerNode, currentLevel); currentLevel++) {
+
+            trace::LevelScope levelScope(currentLevel);
+
+            utils::Timer trainTimer;
+
+            std::vector<SplitFunction<Instance, FeatureFunction> > bestSplits;
+            if (beginLevel(samplesPerNode, currentLevel)) {
+                bestSplits = getCheckpointSplits(samplesPerNode);
+            } else {
+                bestSplits = featureEvaluation.evaluateBestSplits(randomSource, samplesPerNode);
+            }
+
+            finishLevel(randomSource, samplesPerNode, bestSplits, idNode, currentLevel);
+
+            CURFIL_INFO("training level " << currentLevel << " took " << trainTimer.format(3));
         }
+    }
 
-        CURFIL_INFO("training level " << currentLevel << ". nodes: " << samplesPerNode.size());
+    /**
+     * @return false if the tree is complete: there are no more nodes to split or the depth is exhausted
+     */
+    bool shouldTrainLevel(const SamplesPerNode& samplesPerNode, int currentLevel) const {
+        return (!samplesPerNode.empty() && currentLevel < configuration.getMaxDepth());
+    }
 
-        utils::Timer trainTimer;
+    /**
+     * Starts the training of a level. The splits of the level are then either evaluated or,
+     * if this method returns true, taken from the resumed checkpoint by getCheckpointSplits().
+     */
+    bool beginLevel(const SamplesPerNode& samplesPerNode, int currentLevel) {
 
-        std::vector<std::pair<RandomTreePointer, Samples> > samplesPerNodeNextLevel;
+        const bool replay = resuming && currentLevel <= resumeCheckpoint.getLevel();
 
-        std::vector<SplitFunction<Instance, FeatureFunction> > bestSplits = featureEvaluation.evaluateBestSplits(
-                randomSource, samplesPerNode);
+        if (currentLevel == 1) {
+            assert(samplesPerNode.size() == 1);
+            const size_t numSamples = samplesPerNode[0].second.size();
+            if (replay && numSamples != resumeCheckpoint.getNumSamples()) {
+                throw std::runtime_error(boost::str(
+                        boost::format("checkpoint of tree %d has %d samples instead of %d")
+                                % id % resumeCheckpoint.getNumSamples() % numSamples));
+            }
+            checkpoint = Checkpoint(numSamples);
+        }
 
-        assert(bestSplits.size() == samplesPerNode.size());
+        CURFIL_INFO((replay ? "replaying level " : "training level ") << currentLevel
+                << ". nodes: " << samplesPerNode.size());
+
+        return replay;
+    }
 
+    std::vector<SplitFunction<Instance, FeatureFunction> > getCheckpointSplits(
+            const SamplesPerNode& samplesPerNode) const {
+
+        const std::map<size_t, SplitFunction<Instance, FeatureFunction> >& splits = resumeCheckpoint.getSplits();
+
+        std::vector<SplitFunction<Instance, FeatureFunction> > bestSplits;
+        bestSplits.reserve(samplesPerNode.size());
         for (size_t i = 0; i < samplesPerNode.size(); i++) {
+            const size_t nodeId = samplesPerNode[i].first->getNodeId();
+            auto it = splits.find(nodeId);
+            if (it == splits.end()) {
+                throw std::runtime_error(boost::str(boost::format("checkpoint has no split for node %d") % nodeId));
+            }
+            bestSplits.push_back(it->second);
+        }
+        return bestSplits;
+    }
 
-            const std::pair<RandomTreePointer, Samples>& it = samplesPerNode[i];
+    /**
+     * Splits the nodes of the level by the given best splits and replaces samplesPerNode by the nodes of the
+     * next level.
+     */
+    void finishLevel(RandomSource& randomSource, SamplesPerNode& samplesPerNode,
+            const std::vector<SplitFunction<Instance, FeatureFunction> >& bestSplits,
+            int& idNode, int currentLevel) {
+
+        const bool replay = resuming && currentLevel <= resumeCheckpoint.getLevel();
+
+        SamplesPerNode samplesPerNodeNextLevel;
+
+        assert(bestSplits.size() == samplesPerNode.size());
+
+        // reused for all nodes of this level
+        std::vector<SplitBranch> branches;
 
-            const std::vector<const Instance*>& samples = it.second;
+        for (size_t i = 0; i < samplesPerNode.size(); i++) {
+
+            std::pair<RandomTreePointer, Samples>& it = samplesPerNode[i];
 
             boost::shared_ptr<RandomTree<Instance, FeatureFunction> > currentNode = it.first;
             assert(currentNode);
 
             const SplitFunction<Instance, FeatureFunction>& bestSplit = bestSplits[i];
 
-            // Split all training instances into the subtrees.  The way we train
-            // the trees ensures we have no more than 2*N instances to manage in
-            // memory.
-            std::vector<const Instance*> samplesLeft;
-            std::vector<const Instance*> samplesRight;
-
-            for (size_t sample = 0; sample < samples.size(); sample++) {
-                assert(samples[sample] != NULL);
-                if (bestSplit.split(*samples[sample]) == LEFT) {
-                    samplesLeft.push_back(samples[sample]);
-                } else {
-                    samplesRight.push_back(samples[sample]);
-                }
-            }
+            // Split all training instances into the subtrees. The left subtree takes over the storage of the
+            // current node and only the samples of the right subtree are moved to a new vector.
+            // Both subtrees keep the order of the samples. The samples of the current node are no longer needed
+            // afterwards, so we have no more than N instances to manage in memory.
+            Samples samplesLeft;
+            Samples samplesRight;
+            const size_t numSamples = it.second.size();
+            partitionSamples(bestSplit, it.second, samplesRight, branches);
+            samplesLeft.swap(it.second);
 
-            assert(samplesLeft.size() + samplesRight.size() == samples.size());
+            assert(samplesLeft.size() + samplesRight.size() == numSamples);
 
-            boost::shared_ptr<RandomTree<Instance, FeatureFunction> > leftNode = boost::make_shared<RandomTree<Instance,
-                    FeatureFunction> >(++idNode, currentNode->getLevel() + 1, samplesLeft, numClasses, currentNode);
+            boost::shared_ptr<RandomTree<Instance, FeatureFunction> > leftNode = createChild(++idNode, currentNode,
+                    samplesLeft, bestSplit, LEFT);
 
-            boost::shared_ptr<RandomTree<Instance, FeatureFunction> > rightNode = boost::make_shared<
-                    RandomTree<Instance, FeatureFunction> >(++idNode, currentNode->getLevel() + 1, samplesRight,
-                    numClasses, currentNode);
+            boost::shared_ptr<RandomTree<Instance, FeatureFunction> > rightNode = createChild(++idNode, currentNode,
+                    samplesRight, bestSplit, RIGHT);
 
 #ifndef NDEBUG
             compareHistograms(currentNode, leftNode, rightNode, bestSplit);
@@ -874,7 +1250,7 @@ public:
 
             if (samplesLeft.empty() || samplesRight.empty()) {
                 CURFIL_ERROR("best split score: " << bestSplit.getScore());
-                CURFIL_ERROR("samples: " << samples.size());
+                CURFIL_ERROR("samples: " << numSamples);
                 CURFIL_ERROR("threshold: " << bestSplit.getThreshold());
                 CURFIL_ERROR("feature: " << bestSplit.getFeature());
                 CURFIL_ERROR("histogram: " << currentNode->getHistogram());
@@ -893,19 +1269,35 @@ public:
 
             currentNode->addChildren(bestSplit, leftNode, rightNode);
 
+            if (checkpointHandler) {
+                checkpoint.addSplit(currentNode->getNodeId(), bestSplit);
+            }
+
             if (shouldContinueGrowing(leftNode)) {
-                samplesPerNodeNextLevel.push_back(std::make_pair(leftNode, samplesLeft));
+                samplesPerNodeNextLevel.push_back(std::make_pair(leftNode, Samples()));
+                samplesPerNodeNextLevel.back().second.swap(samplesLeft);
             }
 
             if (shouldContinueGrowing(rightNode)) {
-                samplesPerNodeNextLevel.push_back(std::make_pair(rightNode, samplesRight));
+                samplesPerNodeNextLevel.push_back(std::make_pair(rightNode, Samples()));
+                samplesPerNodeNextLevel.back().second.swap(samplesRight);
             }
         }
 
-        CURFIL_INFO("training level " << currentLevel << " took " << trainTimer.format(3));
-        if (!samplesPerNodeNextLevel.empty()) {
-            train(featureEvaluation, randomSource, samplesPerNodeNextLevel, idNode, currentLevel + 1);
+        if (replay && currentLevel == resumeCheckpoint.getLevel()) {
+            checkResumedLevel(samplesPerNodeNextLevel, idNode);
+            randomSource = RandomSource(resumeCheckpoint.getRandomSeed());
+            resuming = false;
+            CURFIL_INFO("tree " << id << ": resumed training after level " << currentLevel);
+        } else if (!replay && checkpointHandler) {
+            checkpoint.setState(currentLevel, idNode, randomSource.getSeed());
+            for (const auto& nodeSamples : samplesPerNodeNextLevel) {
+                checkpoint.addFrontierNode(nodeSamples.first->getNodeId(), nodeSamples.second.size());
+            }
+            checkpointHandler(checkpoint);
         }
+
+        samplesPerNode.swap(samplesPerNodeNextLevel);
     }
 
 private:
@@ -919,9 +1311,79 @@ private:
         return v;
     }
 
+    // The histogram of the child is taken from the counters of the best split, if the evaluation provided them
+    // and they add up to the partitioned samples. Otherwise, e.g. for replayed splits, the samples are counted.
+    RandomTreePointer createChild(int idNode, const RandomTreePointer& parent, const Samples& samples,
+            const SplitFunction<Instance, FeatureFunction>& split, SplitBranch branch) const {
+
+        if (split.hasHistograms()) {
+            const std::vector<WeightType>& histogram = split.getHistogram(branch);
+            assert(histogram.size() == numClasses);
+
+            WeightType total = 0;
+            for (size_t label = 0; label < histogram.size(); label++) {
+                total += histogram[label];
+            }
+
+            // all training samples have a weight of one
+            if (total == samples.size()) {
+                return boost::make_shared<RandomTree<Instance, FeatureFunction> >(idNode, parent->getLevel() + 1,
+                        samples, histogram, parent);
+            }
+
+            CURFIL_WARNING("node " << idNode << ": the split counted " << total << " samples instead of "
+                    << samples.size());
+        }
+
+        return boost::make_shared<RandomTree<Instance, FeatureFunction> >(idNode, parent->getLevel() + 1, samples,
+                numClasses, parent);
+    }
+
+    // Stable in-place partition of the samples by the given split. The samples that go to the left remain in
+    // 'samples', the others are moved to 'samplesRight'.
+    void partitionSamples(const SplitFunction<Instance, FeatureFunction>& split, Samples& samples,
+            Samples& samplesRight, std::vector<SplitBranch>& branches) const {
+
+        const size_t numSamples = samples.size();
+        branches.resize(numSamples);
+
+        const size_t grainSize = std::max(static_cast<size_t>(1000),
+                numSamples / std::max(1, configuration.getNumThreads()));
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, numSamples, grainSize),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t sample = range.begin(); sample != range.end(); sample++) {
+                        assert(samples[sample] != NULL);
+                        branches[sample] = split.split(*samples[sample]);
+                    }
+                });
+
+        const size_t numRight = std::count(branches.begin(), branches.end(), RIGHT);
+
+        samplesRight.clear();
+        samplesRight.reserve(numRight);
+
+        size_t numLeft = 0;
+        for (size_t sample = 0; sample < numSamples; sample++) {
+            if (branches[sample] == LEFT) {
+                samples[numLeft++] = samples[sample];
+            } else {
+                samplesRight.push_back(samples[sample]);
+            }
+        }
+
+        assert(numLeft + numRight == numSamples);
+        samples.resize(numLeft);
+    }
+
     int id;
     size_t numClasses;
     const TrainingConfiguration configuration;
+
+    std::function<void(const Checkpoint&)> checkpointHandler;
+    Checkpoint checkpoint;
+    Checkpoint resumeCheckpoint;
+    bool resuming;
 }
 ;
 
@@ -1,114 +1,198 @@
 #include "random_tree_image.h"
 
+#include <algorithm>
+#include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <limits>
 #include <map>
 #include <math.h>
 #include <set>
+#include <tbb/atomic.h>
 #include <tbb/mutex.h>
+#include <tbb/parallel_for.h>
 #include <tbb/parallel_for_each.h>
+#include <tbb/parallel_invoke.h>
 #include <thrust/gather.h>
 #include <thrust/sort.h>
 
+#include "device_memory.h"
+#include "export.h"
+#include "import.h"
 #include "ndarray_ops.h"
 #include "random_tree_image_gpu.h"
 #include "random_tree.h"
 #include "score.h"
+#include "trace.h"
 
 namespace curfil {
 
-// for statistics
-extern ImageCache imageCache;
+// the samples of a node ordered by image and cut into tiles, such that FeatureEvaluationCPU evaluates all features
+// of a block on the samples of a tile while the integral image of the tile is in the cache
+class SampleTiles {
 
+public:
+
+    static const size_t MAX_TILE_SIZE = 256;
+
+    explicit SampleTiles(const std::vector<const PixelInstance*>& samples) :
+            samples(samples), tileBegins() {
+
+        std::stable_sort(this->samples.begin(), this->samples.end(), compareImages);
+
+        for (size_t sample = 0; sample < this->samples.size(); sample++) {
+            if (tileBegins.empty() || sample - tileBegins.back() == MAX_TILE_SIZE
+                    || this->samples[sample]->getRGBDImage() != this->samples[sample - 1]->getRGBDImage()) {
+                tileBegins.push_back(sample);
+            }
+        }
+        tileBegins.push_back(this->samples.size());
+    }
+
+    size_t numTiles() const {
+        return tileBegins.size() - 1;
+    }
+
+    // the samples [getTileBegin(tile), getTileEnd(tile)) belong to the same image
+    size_t getTileBegin(size_t tile) const {
+        return tileBegins[tile];
+    }
+
+    size_t getTileEnd(size_t tile) const {
+        return tileBegins[tile + 1];
+    }
+
+    const PixelInstance* getSample(size_t sample) const {
+        return samples[sample];
+    }
+
+private:
+    std::vector<const PixelInstance*> samples;
+    std::vector<size_t> tileBegins;
+
+    static bool compareImages(const PixelInstance* a, const PixelInstance* b) {
+        return a->getRGBDImage() < b->getRGBDImage();
+    }
+};
+
+// FeatureResponse is the precision of the feature responses, see TrainingConfiguration::isSinglePrecisionFeatures().
+// every task evaluates a block of features on all samples and writes the counters of its features. the tasks never
+// write the same counters, so there are neither copies of the counters per task nor a merge.
+template<class FeatureResponse>
 class FeatureEvaluationCPU {
 
 public:
 
+    // the maximal number of features of a task, which bounds the counters of a task
+    static const size_t FEATURES_PER_TASK = 16;
+
+    /**
+     * @param binned whether the thresholds of every feature are sorted, see TrainingConfiguration::isBinnedSplits()
+     * @param counters labels × features × thresholds × 2. all counters of all features are written
+     */
     FeatureEvaluationCPU(size_t numClasses,
             size_t numFeatures,
             size_t numThresholds,
-            const std::vector<const PixelInstance*>& samples,
+            bool binned,
+            const SampleTiles& tiles,
             const ImageFeaturesAndThresholds<cuv::host_memory_space>& features,
-            tbb::concurrent_vector<cuv::ndarray<WeightType, cuv::host_memory_space>>& perClassHistograms) :
+            cuv::ndarray<WeightType, cuv::host_memory_space>& counters) :
             numClasses(numClasses),
                     numFeatures(numFeatures),
                     numThresholds(numThresholds),
-                    samples(samples), features(features), perClassHistograms(perClassHistograms) {
-
-        assert(!samples.empty());
+                    binned(binned),
+                    tiles(tiles), features(features), counters(counters) {
+
+        assert(tiles.numTiles() > 0);
+        assert(counters.ndim() == 4);
+        assert(counters.shape(0) == numClasses);
+        assert(counters.shape(1) == numFeatures);
+        assert(counters.shape(2) == numThresholds);
     }
 
     // must be a const-method for TBB
     void operator()(const tbb::blocked_range<size_t>& range) const {
 
-        cuv::ndarray<WeightType, cuv::host_memory_space> perClassHistogram(
-                cuv::extents[numClasses][numFeatures][numThresholds][2]);
+        const size_t numTaskFeatures = range.size();
 
-        for (size_t i = 0; i < perClassHistogram.size(); i++) {
-            perClassHistogram[i] = 0;
+        std::vector<ImageFeatureFunction> featureFunctions(numTaskFeatures);
+        std::vector<float> thresholds(numTaskFeatures * numThresholds);
+        for (size_t feature = 0; feature < numTaskFeatures; feature++) {
+            featureFunctions[feature] = features.getFeatureFunction(range.begin() + feature);
+            for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                thresholds[feature * numThresholds + thresh] = features.getThreshold(thresh, range.begin() + feature);
+                assert(!isnan(thresholds[feature * numThresholds + thresh]));
+            }
         }
 
-        std::vector<ImageFeatureFunction> featureFunctions(numFeatures);
-        for (size_t featureNr = 0; featureNr < numFeatures; ++featureNr) {
-            featureFunctions[featureNr] = features.getFeatureFunction(featureNr);
-        }
+        // per feature and label: the samples that go right of every threshold followed by all samples.
+        // if binned: the samples per bin between two thresholds. the last bin holds the samples right of all
+        const size_t countersPerLabel = numThresholds + 1;
+        const size_t countersPerFeature = numClasses * countersPerLabel;
+        std::vector<WeightType> taskCounters(numTaskFeatures * countersPerFeature, 0);
+
+        for (size_t tile = 0; tile < tiles.numTiles(); tile++) {
+            for (size_t feature = 0; feature < numTaskFeatures; feature++) {
+                const ImageFeatureFunction& featureFunction = featureFunctions[feature];
+                const float* featureThresholds = &thresholds[feature * numThresholds];
+                WeightType* featureCounters = &taskCounters[feature * countersPerFeature];
+
+                for (size_t s = tiles.getTileBegin(tile); s < tiles.getTileEnd(tile); s++) {
+                    const PixelInstance* sample = tiles.getSample(s);
+                    const FeatureResponse value = featureFunction.calculateFeatureResponse<FeatureResponse>(*sample);
+                    const WeightType weight = sample->getWeight();
+                    WeightType* labelCounters = featureCounters + sample->getLabel() * countersPerLabel;
+
+                    if (binned) {
+                        // the first threshold that the sample does not go right of. NaN goes right of all
+                        const size_t bin = isnan(value) ? numThresholds :
+                                std::lower_bound(featureThresholds, featureThresholds + numThresholds, value)
+                                        - featureThresholds;
+                        labelCounters[bin] += weight;
+                        continue;
+                    }
 
-        // transpose the thresholds
-        std::vector<std::vector<float> > thresholds;
-        for (size_t featureNr = 0; featureNr < numFeatures; ++featureNr) {
-            std::vector<float> thresholdsPerFeature;
-            for (size_t threshNr = 0; threshNr < numThresholds; ++threshNr) {
-                thresholdsPerFeature.push_back(features.getThreshold(threshNr, featureNr));
+                    // branch-free over the consecutive thresholds.
+                    // important: (!(x<=y)) is not the same as (x>y) because of NaNs!
+                    for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                        const WeightType right = static_cast<WeightType>(!(value <= featureThresholds[thresh]));
+                        labelCounters[thresh] += weight * right;
+                    }
+                    labelCounters[numThresholds] += weight;
+                }
             }
-            thresholds.push_back(thresholdsPerFeature);
         }
 
-        assert(perClassHistogram.ndim() == 4);
-        const unsigned int labelStride = perClassHistogram.stride(0);
-        const unsigned int featureStride = perClassHistogram.stride(1);
-        const unsigned int thresholdsStride = perClassHistogram.stride(2);
+        for (size_t feature = 0; feature < numTaskFeatures; feature++) {
+            for (size_t label = 0; label < numClasses; label++) {
+                WeightType* labelCounters = &taskCounters[feature * countersPerFeature + label * countersPerLabel];
 
-        for (size_t s = range.begin(); s != range.end(); s++) {
-            const PixelInstance* sample = samples[s];
-            assert(sample);
-            const LabelType label = sample->getLabel();
-            const WeightType weight = sample->getWeight();
-
-            const unsigned int labelOffset = label * labelStride;
-
-            for (size_t featureNr = 0; featureNr < numFeatures; ++featureNr) {
-                double value = featureFunctions[featureNr].calculateFeatureResponse(*sample);
-                const std::vector<float>& thresholdsPerFeature = thresholds[featureNr];
-
-                const unsigned int featureOffset = labelOffset + featureNr * featureStride;
-
-                for (size_t threshNr = 0; threshNr < numThresholds; ++threshNr) {
-                    const float threshold = thresholdsPerFeature[threshNr];
-                    assert(!isnan(threshold));
+                if (binned) {
+                    // prefix sum: the samples that go left of every threshold followed by all samples
+                    for (size_t bin = 1; bin <= numThresholds; bin++) {
+                        labelCounters[bin] += labelCounters[bin - 1];
+                    }
+                }
 
-                    // avoid the if () else () branch here by casting the compare into 0 or 1
-                    // important: (!(x<=y)) is not the same as (x>y) because of NaNs!
-                    int offset = static_cast<int>(!(value <= threshold));
-                    assert(offset == ((value <= threshold) ? 0 : 1));
-
-                    // offset stride must be 1
-                    assert(perClassHistogram.stride(3) == 1);
-                    unsigned int idx = featureOffset + threshNr * thresholdsStride + offset;
-                    perClassHistogram.ptr()[idx] += weight;
-                    assert(perClassHistogram(label, featureNr, threshNr, offset) == perClassHistogram.ptr()[idx]);
+                const WeightType total = labelCounters[numThresholds];
+                for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                    const WeightType right = binned ? total - labelCounters[thresh] : labelCounters[thresh];
+                    assert(right <= total);
+                    counters(label, range.begin() + feature, thresh, 0) = total - right;
+                    counters(label, range.begin() + feature, thresh, 1) = right;
                 }
             }
         }
-
-        perClassHistograms.push_back(perClassHistogram);
     }
 
 private:
     const size_t numClasses;
     const size_t numFeatures;
     const size_t numThresholds;
-    const std::vector<const PixelInstance*>& samples;
+    const bool binned;
+    const SampleTiles& tiles;
     const ImageFeaturesAndThresholds<cuv::host_memory_space>& features;
-    tbb::concurrent_vector<cuv::ndarray<WeightType, cuv::host_memory_space> >& perClassHistograms;
+    cuv::ndarray<WeightType, cuv::host_memory_space>& counters;
 };
 
 bool ImageFeatureFunction::operator==(const ImageFeatureFunction& other) const {
@@ -182,6 +266,138 @@ cuv::ndarray<ScoreType, cuv::host_memory_space> ImageFeatureEvaluation::calculat
     return scores;
 }
 
+const size_t HybridCostModel::MIN_MEASUREMENTS;
+
+HybridCostModel::HybridCostModel(unsigned int initialSampleThreshold) :
+        initialSampleThreshold(initialSampleThreshold), mutex(),
+                gpuMeasurements(0), gpuSamples(0), gpuSeconds(0), gpuSamplesSquared(0), gpuSamplesSeconds(0),
+                transferImages(0), transferSeconds(0),
+                cpuMeasurements(0), cpuSamples(0), cpuSeconds(0) {
+}
+
+bool HybridCostModel::isCalibrated() const {
+    tbb::mutex::scoped_lock lock(mutex);
+    return (gpuMeasurements >= MIN_MEASUREMENTS && cpuMeasurements >= MIN_MEASUREMENTS);
+}
+
+bool HybridCostModel::evaluateOnGPU(size_t numSamples, size_t numUncachedImages) const {
+    if (!isCalibrated()) {
+        return (numSamples >= initialSampleThreshold);
+    }
+
+    tbb::mutex::scoped_lock lock(mutex);
+    return (estimateGPUSeconds(numSamples, numUncachedImages) <= estimateCPUSeconds(numSamples));
+}
+
+void HybridCostModel::addGPUMeasurement(size_t numSamples, double seconds) {
+    tbb::mutex::scoped_lock lock(mutex);
+    gpuMeasurements++;
+    gpuSamples += numSamples;
+    gpuSeconds += seconds;
+    gpuSamplesSquared += static_cast<double>(numSamples) * numSamples;
+    gpuSamplesSeconds += numSamples * seconds;
+}
+
+void HybridCostModel::addTransferMeasurement(size_t numUncachedImages, double seconds) {
+    tbb::mutex::scoped_lock lock(mutex);
+    transferImages += numUncachedImages;
+    transferSeconds += seconds;
+}
+
+void HybridCostModel::addCPUMeasurement(size_t numSamples, double seconds) {
+    tbb::mutex::scoped_lock lock(mutex);
+    cpuMeasurements++;
+    cpuSamples += numSamples;
+    cpuSeconds += seconds;
+}
+
+double HybridCostModel::estimateGPUSeconds(size_t numSamples, size_t numUncachedImages) const {
+    assert(gpuMeasurements > 0);
+
+    // least squares fit of seconds = overhead + perSample * samples
+    double perSample = gpuSeconds / gpuSamples;
+    double overhead = 0;
+
+    const double n = gpuMeasurements;
+    const double denominator = n * gpuSamplesSquared - gpuSamples * gpuSamples;
+    if (denominator > 0) {
+        perSample = std::max(0.0, (n * gpuSamplesSeconds - gpuSamples * gpuSeconds) / denominator);
+        overhead = std::max(0.0, (gpuSeconds - perSample * gpuSamples) / n);
+    }
+
+    double perImage = 0;
+    if (transferImages > 0) {
+        perImage = transferSeconds / transferImages;
+    }
+
+    return overhead + perSample * numSamples + perImage * numUncachedImages;
+}
+
+double HybridCostModel::estimateCPUSeconds(size_t numSamples) const {
+    assert(cpuMeasurements > 0);
+    return cpuSeconds / cpuSamples * numSamples;
+}
+
+std::vector<const PixelInstance*> ImageFeatureEvaluation::getFeatureGenerationSamples(
+        const std::vector<std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
+                std::vector<const PixelInstance*> > >& samplesPerNode) const {
+
+    const AccelerationMode accelerationMode = configuration.getAccelerationMode();
+
+    std::set<const RGBDImage*> images;
+    std::vector<const PixelInstance*> allSamples;
+    unsigned int numSkipped = 0;
+    for (size_t nodeId = 0; nodeId < samplesPerNode.size(); nodeId++) {
+
+        const std::vector<const PixelInstance*>& samples = samplesPerNode[nodeId].second;
+        for (size_t s = 0; s < samples.size(); s++) {
+            const PixelInstance* sample = samples[s];
+            if (accelerationMode != CPU_ONLY) {
+                if (images.size() == static_cast<size_t>(configuration.getImageCacheSize())) {
+                    if (images.find(sample->getRGBDImage()) == images.end()) {
+                        // skip sample. image does not fit in cache
+                        numSkipped++;
+                        continue;
+                    }
+                }
+            }
+            images.insert(sample->getRGBDImage());
+            allSamples.push_back(sample);
+        }
+
+    }
+
+    if (numSkipped > 0) {
+        CURFIL_INFO("randomFeatureGeneration: skipped " << numSkipped << " samples");
+    }
+
+    return allSamples;
+}
+
+// returns the score of the best split and its position. the scores are scanned in the same order as in bestSplitsKernel
+static ScoreType findBestSplit(const cuv::ndarray<ScoreType, cuv::host_memory_space>& scores,
+        uint16_t& bestThresh, unsigned int& bestFeat) {
+
+    assert(scores.ndim() == 2);
+    const uint16_t numThresholds = scores.shape(0);
+    const unsigned int numFeatures = scores.shape(1);
+
+    ScoreType bestScore = -std::numeric_limits<ScoreType>::infinity();
+    bestThresh = 0;
+    bestFeat = 0;
+    for (uint16_t thresh = 0; thresh < numThresholds; thresh++) {
+        for (unsigned int feat = 0; feat < numFeatures; feat++) {
+            const ScoreType score = scores(thresh, feat);
+            if (isnan(bestScore) || detail::isScoreBetter(bestScore, score, feat)) {
+                bestFeat = feat;
+                bestThresh = thresh;
+                bestScore = score;
+            }
+        }
+    }
+    return bestScore;
+}
+
 std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > ImageFeatureEvaluation::evaluateBestSplits(
         RandomSource& randomSource,
         const std::vector<std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
@@ -195,231 +411,336 @@ std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > ImageFeatureEva
     ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholdsGPU(configuration.getFeatureCount(),
             configuration.getThresholds(), featuresAllocator);
 
+    // for statistics
+    const ImageCache& imageCache = getDeviceContext().getImageCache();
+
     size_t totalTransferTimeMicrosecondsStart = imageCache.getTotalTransferTimeMircoseconds();
+    const CacheStatistics imageCacheStatisticsStart(imageCache);
 
     const AccelerationMode accelerationMode = configuration.getAccelerationMode();
 
-    utils::Timer generatingRandomFeaturesTimer;
+    // in compare mode, the CPU is the double precision reference of the GPU
+    const bool singlePrecisionOnCPU = configuration.isSinglePrecisionFeatures()
+            && accelerationMode != GPU_AND_CPU_COMPARE;
+    const bool compareBestSplits = configuration.isSinglePrecisionFeatures()
+            && accelerationMode == GPU_AND_CPU_COMPARE;
 
-    {
-        std::set<const RGBDImage*> images;
-        std::vector<const PixelInstance*> allSamples;
-        unsigned int numSkipped = 0;
-        for (size_t nodeId = 0; nodeId < samplesPerNode.size(); nodeId++) {
-
-            const std::vector<const PixelInstance*>& samples = samplesPerNode[nodeId].second;
-            for (size_t s = 0; s < samples.size(); s++) {
-                const PixelInstance* sample = samples[s];
-                if (accelerationMode == GPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
-                    if (images.size() == static_cast<size_t>(configuration.getImageCacheSize())) {
-                        if (images.find(sample->getRGBDImage()) == images.end()) {
-                            // skip sample. image does not fit in cache
-                            numSkipped++;
-                            continue;
-                        }
-                    }
-                }
-                images.insert(sample->getRGBDImage());
-                allSamples.push_back(sample);
-            }
+    // number of nodes where the best split of the GPU in single precision differs from the CPU in double precision
+    tbb::atomic<size_t> differentBestSplits;
+    differentBestSplits = 0;
 
-        }
+    utils::Timer generatingRandomFeaturesTimer;
 
-        if (numSkipped > 0) {
-            CURFIL_INFO("randomFeatureGeneration: skipped " << numSkipped << " samples");
-        }
+    {
+        const std::vector<const PixelInstance*> allSamples = getFeatureGenerationSamples(samplesPerNode);
 
         const int seed = randomSource.uniformSampler(0xFFFFFF).getNext();
 
         if (accelerationMode == CPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
             featuresAndThresholdsCPU = generateRandomFeatures(allSamples, seed, true, cuv::host_memory_space());
         }
-        if (accelerationMode == GPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
+        if (accelerationMode == GPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE || accelerationMode == HYBRID) {
             featuresAndThresholdsGPU = generateRandomFeatures(allSamples, seed, true, cuv::dev_memory_space());
         }
+        if (accelerationMode == HYBRID) {
+            // the nodes on the CPU evaluate the same features
+            featuresAndThresholdsCPU = featuresAndThresholdsGPU;
+        }
     }
 
     CURFIL_INFO("generating random features: " << generatingRandomFeaturesTimer.format(2));
 
     tbb::mutex cpuEvaluationMutex;
 
-    size_t grainSize = 1;
-    if (accelerationMode != CPU_ONLY) {
-        // GPU: use two threads
-        grainSize = ceil(samplesPerNode.size() / 2.0);
+    // the nodes that are evaluated on the GPU. evaluated on the CPU otherwise or additionally in compare mode
+    std::vector<bool> nodeOnGPU(samplesPerNode.size(), accelerationMode != CPU_ONLY);
+    std::vector<size_t> numUncachedImages(samplesPerNode.size(), 0);
+
+    if (accelerationMode == HYBRID) {
+        // the image cache must not change while we look into it
+        tbb::mutex::scoped_lock textureLock(getDeviceContext().getTextureMutex());
+
+        size_t numNodesOnGPU = 0;
+        for (size_t nodeNr = 0; nodeNr < samplesPerNode.size(); nodeNr++) {
+            const std::vector<const PixelInstance*>& samples = samplesPerNode[nodeNr].second;
+
+            std::set<const RGBDImage*> images;
+            for (size_t sample = 0; sample < samples.size(); sample++) {
+                images.insert(samples[sample]->getRGBDImage());
+            }
+            for (std::set<const RGBDImage*>::const_iterator it = images.begin(); it != images.end(); it++) {
+                if (!imageCache.containsElement(*it)) {
+                    numUncachedImages[nodeNr]++;
+                }
+            }
+
+            nodeOnGPU[nodeNr] = hybridCostModel.evaluateOnGPU(samples.size(), numUncachedImages[nodeNr]);
+            if (nodeOnGPU[nodeNr]) {
+                numNodesOnGPU++;
+            }
+        }
+
+        CURFIL_INFO("hybrid evaluation: " << numNodesOnGPU << " nodes on GPU, "
+                << samplesPerNode.size() - numNodesOnGPU << " nodes on CPU"
+                << (hybridCostModel.isCalibrated() ? "" : " (not calibrated)"));
     }
-    tbb::parallel_for(tbb::blocked_range<size_t>(0, samplesPerNode.size(), grainSize),
-            [&](const tbb::blocked_range<size_t>& range) {
-                for(size_t nodeNr = range.begin(); nodeNr != range.end(); nodeNr++) {
 
-                    const std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
-                    std::vector<const PixelInstance*> >& nodeSamples = samplesPerNode[nodeNr];
+    auto evaluateNode = [&](size_t nodeNr) {
 
-                    utils::Timer timerEvaluateBestSplit;
+        const std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
+        std::vector<const PixelInstance*> >& nodeSamples = samplesPerNode[nodeNr];
 
-                    RandomTree<PixelInstance, ImageFeatureFunction>& currentNode = *(nodeSamples.first);
-                    const std::vector<const PixelInstance*>& samples = nodeSamples.second;
+        utils::Timer timerEvaluateBestSplit;
 
-                    const size_t numLabels = currentNode.getNumClasses();
-                    assert(numLabels >= 2 && numLabels < 256);
-                    assert(!samples.empty());
+        RandomTree<PixelInstance, ImageFeatureFunction>& currentNode = *(nodeSamples.first);
+        const std::vector<const PixelInstance*>& samples = nodeSamples.second;
 
-                    SplitFunction<PixelInstance, ImageFeatureFunction> bestFeatureCPU;
-                    SplitFunction<PixelInstance, ImageFeatureFunction> bestFeatureGPU;
+        // the nodes might be evaluated by other threads than the one that trains the level
+        trace::LevelScope levelScope(currentNode.getLevel());
 
-                    cuv::ndarray<ScoreType, cuv::host_memory_space> scoresCPU;
-                    cuv::ndarray<ScoreType, cuv::host_memory_space> scoresGPU;
+        const size_t numLabels = currentNode.getNumClasses();
+        assert(numLabels >= 2 && numLabels < 256);
+        assert(!samples.empty());
 
-                    size_t transferTimeStart = imageCache.getTotalTransferTimeMircoseconds();
+        const bool evaluateOnGPU = nodeOnGPU[nodeNr];
+        const bool evaluateOnCPU = (accelerationMode == GPU_AND_CPU_COMPARE || !evaluateOnGPU);
 
-                    if (accelerationMode == CPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
+        SplitFunction<PixelInstance, ImageFeatureFunction> bestFeatureCPU;
+        SplitFunction<PixelInstance, ImageFeatureFunction> bestFeatureGPU;
 
-                        CURFIL_DEBUG("prepare batches");
+        cuv::ndarray<ScoreType, cuv::host_memory_space> scoresCPU;
+        cuv::ndarray<ScoreType, cuv::host_memory_space> scoresGPU;
 
-                        std::vector<std::vector<const PixelInstance*> > batches = prepare(samples, currentNode,
-                                cuv::host_memory_space());
+        // kept for the histograms of the best split
+        cuv::ndarray<WeightType, cuv::host_memory_space> countersCPU;
+        cuv::ndarray<WeightType, cuv::dev_memory_space> countersGPU;
+        boost::scoped_ptr<DeviceMemoryUsage::Scope> countersMemory;
 
-                        tbb::concurrent_vector<cuv::ndarray<WeightType, cuv::host_memory_space> > perClassHistograms;
-                        utils::Timer timeEvaluate;
+        // the image cache is shared with the other trees on the device. only the transfers of this thread count
+        const size_t transferTimeStart = imageCache.getThreadTransferTimeMicroseconds();
+        double transferTime = 0.0;
 
-                        int numThreads = configuration.getNumThreads();
+        if (evaluateOnCPU) {
 
-                        assert(numThreads > 0);
+            CURFIL_DEBUG("prepare batches");
 
-                        size_t grainSize = std::max(100ul, samples.size() / numThreads);
+            std::vector<std::vector<const PixelInstance*> > batches = prepare(samples, currentNode,
+                    cuv::host_memory_space());
 
-                        CURFIL_DEBUG("start evaluation");
+            utils::Timer timeEvaluate;
 
-                        cuv::ndarray<WeightType, cuv::host_memory_space> countersCPU(
-                                cuv::extents[numLabels][configuration.getFeatureCount()][configuration.getThresholds()][2]);
-                        for (size_t i = 0; i < countersCPU.size(); i++) {
-                            countersCPU[i] = 0;
-                        }
+            CURFIL_DEBUG("start evaluation");
 
-                        {
-                            // tbb::mutex::scoped_lock cpuEvaluationLock(cpuEvaluationMutex);
+            countersCPU = cuv::ndarray<WeightType, cuv::host_memory_space>(
+                    cuv::extents[numLabels][configuration.getFeatureCount()][configuration.getThresholds()][2]);
 
-                            utils::Profile profile("feature evaluation CPU");
+            {
+                utils::Profile profile("feature evaluation CPU");
 
-                            FeatureEvaluationCPU evaluation(numLabels, configuration.getFeatureCount(),
-                                    configuration.getThresholds(),
-                                    samples, featuresAndThresholdsCPU, perClassHistograms);
+                const SampleTiles tiles(samples);
 
-                            tbb::parallel_for(tbb::blocked_range<size_t>(0, samples.size(), grainSize), evaluation);
-                            currentNode.setTimerValue("featureEvaluation", profile.getSeconds());
+                // the tasks write the counters of disjoint features
+                const unsigned int numFeatures = configuration.getFeatureCount();
+                const unsigned int numThresholds = configuration.getThresholds();
+                const bool binned = configuration.isBinnedSplits();
+                const tbb::blocked_range<size_t> range(0, numFeatures, FeatureEvaluationCPU<float>::FEATURES_PER_TASK);
+                if (singlePrecisionOnCPU) {
+                    tbb::parallel_for(range, FeatureEvaluationCPU<float>(numLabels, numFeatures, numThresholds,
+                            binned, tiles, featuresAndThresholdsCPU, countersCPU));
+                } else {
+                    tbb::parallel_for(range, FeatureEvaluationCPU<FeatureResponseType>(numLabels, numFeatures,
+                            numThresholds, binned, tiles, featuresAndThresholdsCPU, countersCPU));
+                }
+                currentNode.setTimerValue("featureEvaluation", profile.getSeconds());
+            }
 
-                            assert(!perClassHistograms.empty());
+            CURFIL_DEBUG("calculate scores");
 
-                            utils::Profile reaggregateHistograms("reaggregateHistograms");
-                            for (size_t i = 0; i < perClassHistograms.size(); i++) {
-                                countersCPU += perClassHistograms[i];
-                            }
-                            currentNode.setTimerValue("reaggregateHistograms", reaggregateHistograms.getSeconds());
-                        }
+            {
+                utils::Profile profile("calculateScores");
+                scoresCPU = calculateScores(countersCPU, featuresAndThresholdsCPU, currentNode.getHistogram());
+                currentNode.setTimerValue("calculateScores", profile.getSeconds());
+            }
 
-                        CURFIL_DEBUG("calculate scores");
+            const double evaluationTime = timeEvaluate.getSeconds();
+            currentNode.setTimerValue("evaluationTime", evaluationTime);
 
-                        {
-                            utils::Profile profile("calculateScores");
-                            scoresCPU = calculateScores(countersCPU, featuresAndThresholdsCPU, currentNode.getHistogram());
-                            currentNode.setTimerValue("calculateScores", profile.getSeconds());
-                        }
+            if (accelerationMode == HYBRID) {
+                hybridCostModel.addCPUMeasurement(samples.size(), evaluationTime);
+            }
+        }
 
-                        currentNode.setTimerValue("evaluationTime", timeEvaluate);
-                    }
+        if (evaluateOnGPU) {
 
-                    if (accelerationMode == GPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
+            std::vector<std::vector<const PixelInstance*> > batches = prepare(samples, currentNode,
+                    cuv::dev_memory_space());
 
-                        std::vector<std::vector<const PixelInstance*> > batches = prepare(samples, currentNode,
-                                cuv::dev_memory_space());
+            if (accelerationMode == GPU_AND_CPU_COMPARE) {
+                featuresAndThresholdsGPU = featuresAndThresholdsCPU;
+            }
 
-                        if (accelerationMode == GPU_AND_CPU_COMPARE) {
-                            featuresAndThresholdsGPU = featuresAndThresholdsCPU;
-                        }
+            utils::Timer featureResponsesAndHistograms;
 
-                        utils::Timer featureResponsesAndHistograms;
+            countersGPU = calculateFeatureResponsesAndHistograms(currentNode, batches, featuresAndThresholdsGPU);
+            countersMemory.reset(new DeviceMemoryUsage::Scope("counters", countersGPU.size() * sizeof(WeightType)));
 
-                        cuv::ndarray<WeightType, cuv::dev_memory_space> counters = calculateFeatureResponsesAndHistograms(
-                                currentNode, batches, featuresAndThresholdsGPU);
+            currentNode.setTimerValue("featureResponsesAndHistograms", featureResponsesAndHistograms);
 
-                        currentNode.setTimerValue("featureResponsesAndHistograms", featureResponsesAndHistograms);
+            const double featureResponsesAndHistogramsTime = featureResponsesAndHistograms.getSeconds();
 
-                        utils::Timer calculateScoresTimer;
+            // the image uploads of calculateFeatureResponsesAndHistograms()
+            transferTime = (imageCache.getThreadTransferTimeMicroseconds() - transferTimeStart)
+                    / static_cast<double>(1e6);
 
-                        cuv::ndarray<WeightType, cuv::dev_memory_space> histogram = currentNode.getHistogram();
-                        scoresGPU = calculateScores(counters, featuresAndThresholdsGPU, histogram);
+            utils::Timer calculateScoresTimer;
 
-                        currentNode.setTimerValue("calculateScores", calculateScoresTimer);
-                    }
+            cuv::ndarray<WeightType, cuv::dev_memory_space> histogram = currentNode.getHistogram();
+            scoresGPU = calculateScores(countersGPU, featuresAndThresholdsGPU, histogram);
 
-                    size_t transferTimeEnd = imageCache.getTotalTransferTimeMircoseconds();
+            const double calculateScoresTime = calculateScoresTimer.getSeconds();
+            currentNode.setTimerValue("calculateScores", calculateScoresTime);
 
-                    currentNode.setTimerValue("transferImages", (transferTimeEnd - transferTimeStart) / static_cast<double>(1e6));
+            if (accelerationMode == HYBRID) {
+                hybridCostModel.addGPUMeasurement(samples.size(),
+                        std::max(0.0, featureResponsesAndHistogramsTime - transferTime) + calculateScoresTime);
+                hybridCostModel.addTransferMeasurement(numUncachedImages[nodeNr], transferTime);
+            }
+        }
 
-                    currentNode.setTimerValue("evaluateBestSplit", timerEvaluateBestSplit);
+        currentNode.setTimerValue("transferImages", transferTime);
 
-                    if (accelerationMode == GPU_AND_CPU_COMPARE) {
-                        if (scoresCPU.shape() != scoresGPU.shape()) {
-                            throw std::runtime_error("different shapes");
-                        }
-                        for (size_t i = 0; i < scoresCPU.size(); i++) {
-                            ScoreType diff = abs(static_cast<ScoreType>(scoresCPU[i] - scoresGPU[i]));
-                            if (diff > 1e-10) {
-                                const std::string message = boost::str(
-                                        boost::format("different scores [%d]: %.10f vs. %.10f, diff: %.10f")
-                                        % i
-                                        % scoresCPU[i]
-                                        % scoresGPU[i]
-                                        % diff);
-                                throw std::runtime_error(message);
-                            }
-                        }
-                    }
+        currentNode.setTimerValue("evaluateBestSplit", timerEvaluateBestSplit);
 
-                    cuv::ndarray<ScoreType, cuv::host_memory_space> scores;
-                    if (accelerationMode == CPU_ONLY || accelerationMode == GPU_AND_CPU_COMPARE) {
-                        scores = scoresCPU;
-                    } else {
-                        scores = scoresGPU;
-                    }
+        if (compareBestSplits) {
+            if (scoresCPU.shape() != scoresGPU.shape()) {
+                throw std::runtime_error("different shapes");
+            }
+            // the scores differ in single precision. only the selected split matters
+            uint16_t threshCPU, threshGPU;
+            unsigned int featCPU, featGPU;
+            const ScoreType bestScoreCPU = findBestSplit(scoresCPU, threshCPU, featCPU);
+            const ScoreType bestScoreGPU = findBestSplit(scoresGPU, threshGPU, featGPU);
+            if (threshCPU != threshGPU || featCPU != featGPU) {
+                differentBestSplits++;
+                CURFIL_DEBUG("tree " << currentNode.getTreeId() << ", node " << currentNode.getNodeId()
+                        << ": different best split in single precision. "
+                        << boost::format("feature %d, threshold %d, score %.10f vs. feature %d, threshold %d, "
+                                "score %.10f") % featCPU % threshCPU % bestScoreCPU
+                                % featGPU % threshGPU % bestScoreGPU);
+            }
+        } else if (accelerationMode == GPU_AND_CPU_COMPARE) {
+            if (scoresCPU.shape() != scoresGPU.shape()) {
+                throw std::runtime_error("different shapes");
+            }
+            for (size_t i = 0; i < scoresCPU.size(); i++) {
+                ScoreType diff = abs(static_cast<ScoreType>(scoresCPU[i] - scoresGPU[i]));
+                if (diff > 1e-10) {
+                    const std::string message = boost::str(
+                            boost::format("different scores [%d]: %.10f vs. %.10f, diff: %.10f")
+                            % i
+                            % scoresCPU[i]
+                            % scoresGPU[i]
+                            % diff);
+                    throw std::runtime_error(message);
+                }
+            }
+        }
 
-                    assert(scores.ndim() == 2);
-                    assert(scores.shape(0) == configuration.getThresholds());
-                    assert(scores.shape(1) == configuration.getFeatureCount());
-                    ScoreType bestScore = -std::numeric_limits<ScoreType>::infinity();
-                    uint16_t bestThresh = 0;
-                    unsigned int bestFeat = 0;
-                    for (uint16_t thresh = 0; thresh < configuration.getThresholds(); thresh++) {
-                        for (unsigned int feat = 0; feat < configuration.getFeatureCount(); feat++) {
-                            const ScoreType score = scores(thresh, feat);
-                            if (isnan(bestScore) || detail::isScoreBetter(bestScore, score, feat)) {
-                                bestFeat = feat;
-                                bestThresh = thresh;
-                                bestScore = score;
-                            }
-                        }
-                    }
+        cuv::ndarray<ScoreType, cuv::host_memory_space> scores;
+        if (evaluateOnCPU) {
+            scores = scoresCPU;
+        } else {
+            scores = scoresGPU;
+        }
 
-                    assert(bestScore > 0.0);
+        assert(scores.ndim() == 2);
+        assert(scores.shape(0) == configuration.getThresholds());
+        assert(scores.shape(1) == configuration.getFeatureCount());
+        uint16_t bestThresh;
+        unsigned int bestFeat;
+        const ScoreType bestScore = findBestSplit(scores, bestThresh, bestFeat);
+
+        assert(bestScore > 0.0);
+
+        ImageFeatureFunction feature;
+        float threshold;
+        if (!evaluateOnGPU) {
+            feature = featuresAndThresholdsCPU.getFeatureFunction(bestFeat);
+            threshold = featuresAndThresholdsCPU.getThreshold(bestThresh, bestFeat);
+        } else {
+            feature = featuresAndThresholdsGPU.getFeatureFunction(bestFeat);
+            threshold = featuresAndThresholdsGPU.getThreshold(bestThresh, bestFeat);
+        }
 
-                    ImageFeatureFunction feature;
-                    float threshold;
-                    if (accelerationMode == CPU_ONLY) {
-                        feature = featuresAndThresholdsCPU.getFeatureFunction(bestFeat);
-                        threshold = featuresAndThresholdsCPU.getThreshold(bestThresh, bestFeat);
-                    } else {
-                        feature = featuresAndThresholdsGPU.getFeatureFunction(bestFeat);
-                        threshold = featuresAndThresholdsGPU.getThreshold(bestThresh, bestFeat);
-                    }
+        SplitFunction<PixelInstance, ImageFeatureFunction> bestFeature(bestFeat, feature, threshold, bestScore,
+                configuration.isSinglePrecisionSplits());
 
-                    SplitFunction<PixelInstance, ImageFeatureFunction> bestFeature(bestFeat, feature, threshold, bestScore);
+        // the histograms of the children, taken from the counters that selected the split
+        std::vector<WeightType> leftHistogram(numLabels);
+        std::vector<WeightType> rightHistogram(numLabels);
+        if (evaluateOnCPU) {
+            for (size_t label = 0; label < numLabels; label++) {
+                leftHistogram[label] = countersCPU(label, bestFeat, bestThresh, 0);
+                rightHistogram[label] = countersCPU(label, bestFeat, bestThresh, 1);
+            }
+        } else {
+            copySplitHistograms(countersGPU.ptr(), bestFeat, bestThresh, leftHistogram, rightHistogram);
+        }
+        bestFeature.setHistograms(leftHistogram, rightHistogram);
 
-                    CURFIL_DEBUG("tree " << currentNode.getTreeId() << ", node " << currentNode.getNodeId() <<
-                            ", best score: " << bestScore << ", " << feature);
+        CURFIL_DEBUG("tree " << currentNode.getTreeId() << ", node " << currentNode.getNodeId() <<
+                ", best score: " << bestScore << ", " << feature);
 
-                    bestSplits[nodeNr]= bestFeature;
-                }
-            });
+        bestSplits[nodeNr]= bestFeature;
+    };
+
+    std::vector<size_t> gpuNodes;
+    std::vector<size_t> cpuNodes;
+    for (size_t nodeNr = 0; nodeNr < samplesPerNode.size(); nodeNr++) {
+        if (nodeOnGPU[nodeNr]) {
+            gpuNodes.push_back(nodeNr);
+        } else {
+            cpuNodes.push_back(nodeNr);
+        }
+    }
+
+    if (!gpuNodes.empty()) {
+        // the GPU nodes take the texture mutex in about this order
+        std::vector<std::set<const RGBDImage*> > schedule(gpuNodes.size());
+        for (size_t i = 0; i < gpuNodes.size(); i++) {
+            const std::vector<const PixelInstance*>& samples = samplesPerNode[gpuNodes[i]].second;
+            for (size_t sample = 0; sample < samples.size(); sample++) {
+                schedule[i].insert(samples[sample]->getRGBDImage());
+            }
+        }
+
+        tbb::mutex::scoped_lock textureLock(getDeviceContext().getTextureMutex());
+        getDeviceContext().getImageCache().setSchedule(schedule);
+    }
+
+    auto evaluateNodes = [&](const std::vector<size_t>& nodes, size_t grainSize) {
+        if (nodes.empty()) {
+            return;
+        }
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size(), grainSize),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for(size_t i = range.begin(); i != range.end(); i++) {
+                        evaluateNode(nodes[i]);
+                    }
+                });
+    };
+
+    // GPU: use two threads. the CPU nodes are taken by the remaining threads at the same time
+    tbb::parallel_invoke(
+            [&]() {evaluateNodes(gpuNodes, std::max(1.0, ceil(gpuNodes.size() / 2.0)));},
+            [&]() {evaluateNodes(cpuNodes, 1);});
+
+    if (compareBestSplits) {
+        const size_t numDifferent = differentBestSplits;
+        CURFIL_INFO("single precision: best split of " << numDifferent << " of " << samplesPerNode.size()
+                << " nodes differs from double precision"
+                << (boost::format(" (%.2f%%)") % (100.0 * numDifferent / samplesPerNode.size())).str());
+    }
 
     size_t totalTransferTimeMicrosecondsEnd = imageCache.getTotalTransferTimeMircoseconds();
     assert(totalTransferTimeMicrosecondsEnd >= totalTransferTimeMicrosecondsStart);
@@ -428,6 +749,7 @@ std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > ImageFeatureEva
 
     if (transferTime > 0) {
         CURFIL_INFO((boost::format("image cache transfer time: %.3f s") % transferTime).str());
+        CURFIL_INFO("image cache: " << (CacheStatistics(imageCache) - imageCacheStatisticsStart));
     }
 
     return bestSplits;
@@ -514,6 +836,10 @@ ImageFeaturesAndThresholds<cuv::host_memory_space> ImageFeatureEvaluation::gener
     unsigned int numFeatures = configuration.getFeatureCount();
     unsigned int numThresholds = configuration.getThresholds();
 
+    // in compare mode, the GPU evaluates these thresholds as well. they are drawn in double precision then
+    const bool singlePrecision = configuration.isSinglePrecisionFeatures()
+            && configuration.getAccelerationMode() != GPU_AND_CPU_COMPARE;
+
     ImageFeaturesAndThresholds<cuv::host_memory_space> featuresAndThresholds(numFeatures, numThresholds,
             featuresAllocator);
 
@@ -547,7 +873,11 @@ ImageFeaturesAndThresholds<cuv::host_memory_space> ImageFeatureEvaluation::gener
             do {
                 const PixelInstance* sample = samples.at(sampleGen.getNext());
                 assert(sample);
-                threshold = feature.calculateFeatureResponse(*sample);
+                if (singlePrecision) {
+                    threshold = feature.calculateFeatureResponse<float>(*sample);
+                } else {
+                    threshold = feature.calculateFeatureResponse(*sample);
+                }
             } while (isnan(threshold) && --maxTries > 0);
 
             if (isnan(threshold)) {
@@ -563,6 +893,18 @@ ImageFeaturesAndThresholds<cuv::host_memory_space> ImageFeatureEvaluation::gener
             continue;
         }
 
+        if (configuration.isBinnedSplits()) {
+            // sampled quantiles as generateRandomFeaturesKernel draws them
+            std::vector<float> thresholds(numThresholds);
+            for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                thresholds[thresh] = featuresAndThresholds.getThreshold(thresh, generatedFeatures);
+            }
+            std::sort(thresholds.begin(), thresholds.end());
+            for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                featuresAndThresholds.thresholds()(thresh, generatedFeatures) = thresholds[thresh];
+            }
+        }
+
         featuresAndThresholds.setFeatureFunction(generatedFeatures, feature);
 
         keysIndices(0, generatedFeatures) = feature.getSortKey();
@@ -647,24 +989,179 @@ RandomTreeImage::RandomTreeImage(boost::shared_ptr<RandomTree<PixelInstance, Ima
                 tree(tree), classLabelPriorDistribution(classLabelPriorDistribution) {
 }
 
-void RandomTreeImage::doTrain(RandomSource& randomSource, size_t numClasses,
-        std::vector<const PixelInstance*>& subsamples) {
+void RandomTreeImage::initCheckpoints(TreeTrain& treeTrain, const std::string& checkpointFile) const {
+
+    if (checkpointFile.empty()) {
+        return;
+    }
+
+    if (boost::filesystem::exists(checkpointFile)) {
+        CURFIL_INFO("tree " << getId() << ": resuming from checkpoint " << checkpointFile);
+        treeTrain.resume(RandomTreeImport::readCheckpoint(checkpointFile, configuration));
+    }
+
+    treeTrain.setCheckpointHandler([this, checkpointFile](const TreeTrain::Checkpoint& checkpoint) {
+        utils::Timer timer;
+        RandomTreeExport::writeCheckpoint(checkpointFile, checkpoint, configuration);
+        CURFIL_INFO("tree " << getId() << ": wrote checkpoint of level " << checkpoint.getLevel()
+                << " to " << checkpointFile << " in " << timer.format(3));
+    });
+}
 
-    RandomTreeTrain<PixelInstance, ImageFeatureEvaluation, ImageFeatureFunction> treeTrain(getId(), numClasses,
-            configuration);
+RandomTreeImage::TreeTrain::SamplesPerNode RandomTreeImage::createRoot(size_t numClasses,
+        std::vector<const PixelInstance*>& subsamples) {
 
     tree = boost::make_shared<RandomTree<PixelInstance, ImageFeatureFunction> >(getId(), 1, subsamples, numClasses); // no parent
     assert(tree->isRoot());
 
-    std::vector<
-            std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
-                    std::vector<const PixelInstance*> > > samplesPerNode;
-    samplesPerNode.push_back(std::make_pair(tree, subsamples));
+    TreeTrain::SamplesPerNode samplesPerNode;
+    // the training partitions the samples in place
+    samplesPerNode.push_back(std::make_pair(tree, std::vector<const PixelInstance*>()));
+    samplesPerNode.back().second.swap(subsamples);
+    return samplesPerNode;
+}
+
+void RandomTreeImage::doTrain(RandomSource& randomSource, size_t numClasses,
+        std::vector<const PixelInstance*>& subsamples, const std::string& checkpointFile) {
+
+    TreeTrain treeTrain(getId(), numClasses, configuration);
+    initCheckpoints(treeTrain, checkpointFile);
+
+    TreeTrain::SamplesPerNode samplesPerNode = createRoot(numClasses, subsamples);
 
-    ImageFeatureEvaluation featureEvaluation(tree->getTreeId(), configuration);
+    LevelFeatureEvaluation featureEvaluation(tree->getTreeId(), configuration);
     treeTrain.train(featureEvaluation, randomSource, samplesPerNode, getId());
 }
 
+void RandomTreeImage::train(const std::vector<boost::shared_ptr<RandomTreeImage> >& trees,
+        const std::vector<std::vector<LabeledRGBDImage> >& trainLabelImages,
+        std::vector<RandomSource>& randomSources, size_t subsampleCount, TrainingSetIndex& trainingSetIndex,
+        const std::vector<std::string>& checkpointFiles) {
+
+    const size_t numTrees = trees.size();
+    assert(trainLabelImages.size() == numTrees);
+    assert(randomSources.size() == numTrees);
+    assert(checkpointFiles.size() == numTrees);
+
+    utils::Timer trainTimer;
+
+    std::vector<std::vector<PixelInstance> > subsamples(numTrees);
+    std::vector<TreeTrain::SamplesPerNode> samplesPerNode(numTrees);
+    std::vector<boost::shared_ptr<TreeTrain> > treeTrains(numTrees);
+    std::vector<boost::shared_ptr<LevelFeatureEvaluation> > featureEvaluations(numTrees);
+    std::vector<int> idNodes(numTrees);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numTrees, 1),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t treeNr = range.begin(); treeNr != range.end(); treeNr++) {
+                    RandomTreeImage& tree = *trees[treeNr];
+                    assert(tree.finishedTraining == false);
+                    assert(tree.tree == NULL);
+                    assert(!trainLabelImages[treeNr].empty());
+
+                    subsamples[treeNr] = tree.subsampleTrainingData(trainLabelImages[treeNr],
+                            randomSources[treeNr], subsampleCount, trainingSetIndex);
+
+                    std::vector<const PixelInstance*> subsamplePointers;
+                    subsamplePointers.reserve(subsamples[treeNr].size());
+                    for (size_t sample = 0; sample < subsamples[treeNr].size(); sample++) {
+                        subsamplePointers.push_back(&subsamples[treeNr][sample]);
+                    }
+
+                    const size_t numClasses = tree.classLabelPriorDistribution.size();
+                    treeTrains[treeNr] = boost::make_shared<TreeTrain>(tree.getId(), numClasses, tree.configuration);
+                    tree.initCheckpoints(*treeTrains[treeNr], checkpointFiles[treeNr]);
+                    samplesPerNode[treeNr] = tree.createRoot(numClasses, subsamplePointers);
+                    idNodes[treeNr] = tree.getId();
+                }
+            });
+
+    // selects the device of the tree in the calling thread
+    for (size_t treeNr = 0; treeNr < numTrees; treeNr++) {
+        featureEvaluations[treeNr] = boost::make_shared<LevelFeatureEvaluation>(trees[treeNr]->tree->getTreeId(),
+                trees[treeNr]->configuration);
+    }
+
+    for (int currentLevel = 1;; currentLevel++) {
+
+        std::vector<size_t> levelTrees;
+        for (size_t treeNr = 0; treeNr < numTrees; treeNr++) {
+            if (treeTrains[treeNr]->shouldTrainLevel(samplesPerNode[treeNr], currentLevel)) {
+                levelTrees.push_back(treeNr);
+            }
+        }
+
+        if (levelTrees.empty()) {
+            break;
+        }
+
+        trace::LevelScope levelScope(currentLevel);
+
+        utils::Timer levelTimer;
+
+        std::vector<std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > > bestSplits(numTrees);
+
+        // the trees of a device are evaluated together. the devices work in parallel
+        std::map<int, std::vector<size_t> > treesPerDevice;
+        for (size_t i = 0; i < levelTrees.size(); i++) {
+            const size_t treeNr = levelTrees[i];
+            if (treeTrains[treeNr]->beginLevel(samplesPerNode[treeNr], currentLevel)) {
+                bestSplits[treeNr] = treeTrains[treeNr]->getCheckpointSplits(samplesPerNode[treeNr]);
+            } else {
+                treesPerDevice[featureEvaluations[treeNr]->getDeviceId()].push_back(treeNr);
+            }
+        }
+
+        std::vector<std::vector<size_t> > deviceTrees;
+        for (auto it = treesPerDevice.begin(); it != treesPerDevice.end(); it++) {
+            deviceTrees.push_back(it->second);
+        }
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, deviceTrees.size(), 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t device = range.begin(); device != range.end(); device++) {
+                        const std::vector<size_t>& treeNrs = deviceTrees[device];
+
+                        std::vector<LevelFeatureEvaluation*> evaluations;
+                        std::vector<RandomSource*> levelRandomSources;
+                        std::vector<const LevelFeatureEvaluation::SamplesPerNode*> levelSamplesPerNode;
+                        for (size_t i = 0; i < treeNrs.size(); i++) {
+                            evaluations.push_back(featureEvaluations[treeNrs[i]].get());
+                            levelRandomSources.push_back(&randomSources[treeNrs[i]]);
+                            levelSamplesPerNode.push_back(&samplesPerNode[treeNrs[i]]);
+                        }
+
+                        const std::vector<std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > > splits =
+                                LevelFeatureEvaluation::evaluateBestSplits(evaluations, levelRandomSources,
+                                        levelSamplesPerNode);
+
+                        for (size_t i = 0; i < treeNrs.size(); i++) {
+                            bestSplits[treeNrs[i]] = splits[i];
+                        }
+                    }
+                });
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, levelTrees.size(), 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+                    for (size_t i = range.begin(); i != range.end(); i++) {
+                        const size_t treeNr = levelTrees[i];
+                        treeTrains[treeNr]->finishLevel(randomSources[treeNr], samplesPerNode[treeNr],
+                                bestSplits[treeNr], idNodes[treeNr], currentLevel);
+                    }
+                });
+
+        CURFIL_INFO("training level " << currentLevel << " of " << levelTrees.size() << " trees took "
+                << levelTimer.format(3));
+    }
+
+    for (size_t treeNr = 0; treeNr < numTrees; treeNr++) {
+        assert(trees[treeNr]->tree != NULL);
+        trees[treeNr]->finishedTraining = true;
+    }
+
+    CURFIL_INFO("trained " << numTrees << " trees together in " << trainTimer.format(2));
+}
+
 void RandomTreeImage::normalizeHistograms(const double histogramBias) {
     tree->normalizeHistograms(classLabelPriorDistribution, histogramBias);
 }
@@ -680,65 +1177,43 @@ bool RandomTreeImage::shouldIgnoreLabel(const LabelType& label) const {
 }
 
 void RandomTreeImage::train(const std::vector<LabeledRGBDImage>& trainLabelImages,
-        RandomSource& randomSource, size_t subsampleCount) {
+        RandomSource& randomSource, size_t subsampleCount, const std::string& checkpointFile) {
+    TrainingSetIndex trainingSetIndex;
+    train(trainLabelImages, randomSource, subsampleCount, trainingSetIndex, checkpointFile);
+}
+
+std::vector<PixelInstance> RandomTreeImage::subsampleTrainingData(
+        const std::vector<LabeledRGBDImage>& trainLabelImages, RandomSource& randomSource, size_t subsampleCount,
+        TrainingSetIndex& trainingSetIndex) {
 
     assert(subsampleCount > 0);
-    assert(finishedTraining == false);
-    assert(tree == NULL);
-    assert(!trainLabelImages.empty());
 
-    calculateLabelPriorDistribution(trainLabelImages);
+    const std::vector<boost::shared_ptr<const ImageLabelIndex> > indices =
+            trainingSetIndex.getIndices(trainLabelImages);
 
-    // Subsample training set
-    std::vector<PixelInstance> subsamples;
+    calculateLabelPriorDistribution(indices);
 
+    // Subsample training set.
+    // the samples are ordered by image, class id and 10x10 pixel block (to improve CPU caching)
     if (configuration.getSubsamplingType() == "pixelUniform") {
-        subsamples = subsampleTrainingDataPixelUniform(trainLabelImages, randomSource, subsampleCount);
+        return subsampleTrainingDataPixelUniform(trainLabelImages, indices, randomSource, subsampleCount);
     } else if (configuration.getSubsamplingType() == "classUniform") {
-        subsamples = subsampleTrainingDataClassUniform(trainLabelImages, randomSource, subsampleCount);
-    } else {
-        throw std::runtime_error(
-                boost::str(boost::format("unknown subsamplingType: %d") % configuration.getSubsamplingType()));
+        return subsampleTrainingDataClassUniform(trainLabelImages, indices, randomSource, subsampleCount);
     }
+    throw std::runtime_error(
+            boost::str(boost::format("unknown subsamplingType: %d") % configuration.getSubsamplingType()));
+}
 
-    CURFIL_INFO("sorting " << subsamples.size() << " samples");
-
-    utils::Timer sortTimer;
-
-    // interesting fact: sorting the concrete instances is faster than sorting with pointers!
-    // sort by imageid, class id (to improve CPU caching)
-
-    const int SORT_BLOCK_SIZE = 200000;
-    auto iterator = subsamples.begin();
-    auto end = std::min(subsamples.end(), iterator + SORT_BLOCK_SIZE);
-    while (iterator < end) {
-        std::sort(iterator, end, [](const PixelInstance& a, const PixelInstance& b) {
-            if (a.getRGBDImage() != b.getRGBDImage()) {
-                return(a.getRGBDImage() < b.getRGBDImage());
-            }
-
-            if (a.getLabel() != b.getLabel()) {
-                return (a.getLabel() < b.getLabel());
-            }
-
-            // FIXME optimize magic value
-            const int quantisation = 10;
-            if (a.getY()/quantisation != b.getY()/quantisation) {
-                return (a.getY()/quantisation < b.getY()/quantisation);
-            }
-            if (a.getX()/quantisation != b.getX()/quantisation) {
-                return (a.getX()/quantisation < b.getX()/quantisation);
-            }
-            return false;
-        });
-        iterator += SORT_BLOCK_SIZE;
-        end += SORT_BLOCK_SIZE;
-        end = std::min(subsamples.end(), end);
-    }
+void RandomTreeImage::train(const std::vector<LabeledRGBDImage>& trainLabelImages,
+        RandomSource& randomSource, size_t subsampleCount, TrainingSetIndex& trainingSetIndex,
+        const std::string& checkpointFile) {
 
-    sortTimer.stop();
+    assert(finishedTraining == false);
+    assert(tree == NULL);
+    assert(!trainLabelImages.empty());
 
-    CURFIL_INFO("sorted in " << sortTimer.format(2));
+    const std::vector<PixelInstance> subsamples = subsampleTrainingData(trainLabelImages, randomSource,
+            subsampleCount, trainingSetIndex);
 
     std::vector<const PixelInstance*> subsamplePointers;
     subsamplePointers.reserve(subsamples.size());
@@ -752,7 +1227,7 @@ void RandomTreeImage::train(const std::vector<LabeledRGBDImage>& trainLabelImage
 
     const size_t numClasses = classLabelPriorDistribution.size();
 
-    doTrain(randomSource, numClasses, subsamplePointers);
+    doTrain(randomSource, numClasses, subsamplePointers, checkpointFile);
     assert(tree != NULL);
     finishedTraining = true;
 
@@ -773,70 +1248,294 @@ void RandomTreeImage::test(const RGBDImage* image, LabelImage& prediction) const
     }
 }
 
+namespace {
+
+static std::vector<size_t> sumLabelCounts(const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices) {
+    std::vector<size_t> labelCounts;
+    for (const boost::shared_ptr<const ImageLabelIndex>& index : indices) {
+        const std::vector<size_t>& imageLabelCounts = index->getLabelCounts();
+        if (imageLabelCounts.size() > labelCounts.size()) {
+            labelCounts.resize(imageLabelCounts.size(), 0);
+        }
+        for (size_t label = 0; label < imageLabelCounts.size(); label++) {
+            labelCounts[label] += imageLabelCounts[label];
+        }
+    }
+    return labelCounts;
+}
+
+// the order of the samples of one image that the sort of the complete training set used to produce
+static bool compareSamples(const PixelInstance& a, const PixelInstance& b) {
+    if (a.getLabel() != b.getLabel()) {
+        return (a.getLabel() < b.getLabel());
+    }
+
+    // FIXME optimize magic value
+    const int quantisation = 10;
+    if (a.getY() / quantisation != b.getY() / quantisation) {
+        return (a.getY() / quantisation < b.getY() / quantisation);
+    }
+    return (a.getX() / quantisation < b.getX() / quantisation);
+}
+
+static std::vector<PixelInstance> concatenateSamples(std::vector<std::vector<PixelInstance> >& samplesPerImage) {
+    size_t numSamples = 0;
+    for (const std::vector<PixelInstance>& samples : samplesPerImage) {
+        numSamples += samples.size();
+    }
+
+    std::vector<PixelInstance> allSamples;
+    allSamples.reserve(numSamples);
+    for (std::vector<PixelInstance>& samples : samplesPerImage) {
+        allSamples.insert(allSamples.end(), samples.begin(), samples.end());
+        std::vector<PixelInstance>().swap(samples);
+    }
+    return allSamples;
+}
+
+// Floyd's algorithm. draws 'count' distinct numbers out of [0, n) and returns them in ascending order
+static std::vector<size_t> sampleWithoutReplacement(IndexSampler& sampler, size_t n, size_t count) {
+    std::vector<size_t> selection;
+    if (count >= n) {
+        selection.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            selection.push_back(i);
+        }
+        return selection;
+    }
+
+    std::set<size_t> selected;
+    for (size_t j = n - count; j < n; j++) {
+        const size_t rand = sampler.getNext(j + 1);
+        if (!selected.insert(rand).second) {
+            selected.insert(j);
+        }
+    }
+    selection.assign(selected.begin(), selected.end());
+    return selection;
+}
+
+}
+
+ImageLabelIndex::ImageLabelIndex(const LabeledRGBDImage& image) :
+        labelCounts(), validPixels() {
+
+    const RGBDImage& rgbdImage = image.getRGBDImage();
+    const LabelImage& labelImage = image.getLabelImage();
+
+    if (!rgbdImage.hasIntegratedDepth()) {
+        throw std::runtime_error("image is not integrated");
+    }
+
+    const int width = labelImage.getWidth();
+    const int height = labelImage.getHeight();
+    const LabelType* labels = labelImage.getLabels();
+
+    std::vector<size_t> counts(std::numeric_limits<LabelType>::max() + 1, 0);
+    validPixels.resize(counts.size());
+
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const LabelType label = labels[y * width + x];
+            counts[label]++;
+
+            // same as in the PixelInstance constructor
+            const int aboveValid = (y > 0) ? rgbdImage.getDepthValid(x, y - 1) : 0;
+            const int leftValid = (x > 0) ? rgbdImage.getDepthValid(x - 1, y) : 0;
+            const int aboveLeftValid = (x > 0 && y > 0) ? rgbdImage.getDepthValid(x - 1, y - 1) : 0;
+            const int valid = rgbdImage.getDepthValid(x, y) - (leftValid + aboveValid - aboveLeftValid);
+            assert(valid == 0 || valid == 1);
+
+            if (valid == 1) {
+                validPixels[label].push_back(y * width + x);
+            }
+        }
+    }
+
+    size_t numLabels = counts.size();
+    while (numLabels > 0 && counts[numLabels - 1] == 0) {
+        numLabels--;
+    }
+    labelCounts.assign(counts.begin(), counts.begin() + numLabels);
+    validPixels.resize(numLabels);
+}
+
+const std::vector<uint32_t>& ImageLabelIndex::getValidPixels(LabelType label) const {
+    static const std::vector<uint32_t> noPixels;
+    if (label >= validPixels.size()) {
+        return noPixels;
+    }
+    return validPixels[label];
+}
+
+std::vector<boost::shared_ptr<const ImageLabelIndex> > TrainingSetIndex::getIndices(
+        const std::vector<LabeledRGBDImage>& images) {
+
+    std::vector<boost::shared_ptr<const ImageLabelIndex> > imageIndices(images.size());
+
+    {
+        tbb::mutex::scoped_lock lock(mutex);
+
+        // the address of a freed label image might be reused by an image that is loaded later
+        for (auto it = indices.begin(); it != indices.end();) {
+            if (it->second.first.expired()) {
+                indices.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+
+        for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+            auto it = indices.find(images[imageNr].labelImage.get());
+            if (it != indices.end()) {
+                imageIndices[imageNr] = it->second.second;
+            }
+        }
+    }
+
+    size_t missingIndices = 0;
+    for (const boost::shared_ptr<const ImageLabelIndex>& index : imageIndices) {
+        if (!index) {
+            missingIndices++;
+        }
+    }
+
+    if (missingIndices == 0) {
+        return imageIndices;
+    }
+
+    utils::Timer timer;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, images.size()),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t imageNr = range.begin(); imageNr != range.end(); imageNr++) {
+                    if (!imageIndices[imageNr]) {
+                        imageIndices[imageNr] = boost::make_shared<ImageLabelIndex>(images[imageNr]);
+                    }
+                }
+            });
+
+    {
+        tbb::mutex::scoped_lock lock(mutex);
+        for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+            const boost::shared_ptr<LabelImage>& labelImage = images[imageNr].labelImage;
+            indices[labelImage.get()] = std::make_pair(boost::weak_ptr<LabelImage>(labelImage), imageIndices[imageNr]);
+        }
+    }
+
+    CURFIL_INFO("indexed the labels of " << missingIndices << " images in " << timer.format(3));
+
+    return imageIndices;
+}
+
 std::vector<PixelInstance> RandomTreeImage::subsampleTrainingDataPixelUniform(
         const std::vector<LabeledRGBDImage>& trainLabelImages,
+        const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices,
         RandomSource& randomSource,
         size_t subsampleCount) const {
+
+    utils::Timer samplingTimer;
+
+    const size_t numImages = trainLabelImages.size();
+
     // Random across imags type [0..(n-1)]
-    auto rgen_image = randomSource.uniformSampler(trainLabelImages.size());
+    Sampler rgen_image = randomSource.uniformSampler(numImages);
 
-    std::vector<PixelInstance> subsamples;
-    for (size_t n = 0; n < subsampleCount * trainLabelImages.size(); ++n) {
+    std::vector<size_t> samplesPerImage(numImages, 0);
+    for (size_t n = 0; n < subsampleCount * numImages; ++n) {
         unsigned int image_id = rgen_image.getNext();
-        assert(image_id < trainLabelImages.size());
+        assert(image_id < numImages);
+        samplesPerImage[image_id]++;
+    }
 
-        // Sample a random (x,y) coordinate for the image
-        const auto image = trainLabelImages[image_id].getLabelImage();
+    const std::vector<size_t> labelCounts = sumLabelCounts(indices);
+    std::vector<bool> ignoredLabels(labelCounts.size(), false);
+    for (size_t label = 0; label < labelCounts.size(); label++) {
+        if (labelCounts[label] > 0) {
+            ignoredLabels[label] = shouldIgnoreLabel(label);
+        }
+    }
 
-        auto rgen_x = randomSource.uniformSampler(image.getWidth());
-        auto rgen_y = randomSource.uniformSampler(image.getHeight());
+    const int randomSeed = randomSource.uniformSampler(0xFFFFFF).getNext();
 
-        do {
-            uint16_t x = static_cast<uint16_t>(rgen_x.getNext());
-            uint16_t y = static_cast<uint16_t>(rgen_y.getNext());
-            assert(x < image.getWidth());
-            assert(y < image.getHeight());
+    std::vector<std::vector<PixelInstance> > samples(numImages);
 
-            LabelType label = image.getLabel(x, y);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numImages),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t imageNr = range.begin(); imageNr != range.end(); imageNr++) {
+                    if (samplesPerImage[imageNr] == 0) {
+                        continue;
+                    }
 
-            if (shouldIgnoreLabel(label)) {
-                continue;
-            }
+                    const RGBDImage* rgbdImage = &(trainLabelImages[imageNr].getRGBDImage());
+                    const LabelImage& labelImage = trainLabelImages[imageNr].getLabelImage();
 
-            // Append to sample list
-            subsamples.push_back(PixelInstance(&(trainLabelImages[image_id].getRGBDImage()), label, x, y));
-            break;
-        } while (true);
-    }
+                    const std::vector<size_t>& imageLabelCounts = indices[imageNr]->getLabelCounts();
+                    size_t numPixels = 0;
+                    for (size_t label = 0; label < imageLabelCounts.size(); label++) {
+                        if (!ignoredLabels[label]) {
+                            numPixels += imageLabelCounts[label];
+                        }
+                    }
+                    if (numPixels == 0) {
+                        throw std::runtime_error((boost::format("image %s has only pixels of ignored colors")
+                                        % rgbdImage->getFilename()).str());
+                    }
 
-    return subsamples;
-}
+                    // the seed only depends on the image, not on the scheduling of the threads
+                    const int width = labelImage.getWidth();
+                    Sampler rgen_pixel(randomSeed + imageNr, 0, width * labelImage.getHeight() - 1);
+
+                    std::vector<PixelInstance>& imageSamples = samples[imageNr];
+                    imageSamples.reserve(samplesPerImage[imageNr]);
+                    while (imageSamples.size() < samplesPerImage[imageNr]) {
+                        const int pixel = rgen_pixel.getNext();
+                        const uint16_t x = static_cast<uint16_t>(pixel % width);
+                        const uint16_t y = static_cast<uint16_t>(pixel / width);
+
+                        const LabelType label = labelImage.getLabel(x, y);
+                        if (ignoredLabels[label]) {
+                            continue;
+                        }
+
+                        imageSamples.push_back(PixelInstance(rgbdImage, label, x, y));
+                    }
 
-void RandomTreeImage::calculateLabelPriorDistribution(const std::vector<LabeledRGBDImage>& trainLabelImages) {
+                    std::stable_sort(imageSamples.begin(), imageSamples.end(), compareSamples);
+                }
+            });
 
-    std::map<LabelType, size_t> priorDistribution;
-    for (const auto& trainLabelImage : trainLabelImages) {
+    std::vector<PixelInstance> allSubsamples = concatenateSamples(samples);
 
-        const auto& img = trainLabelImage.getLabelImage();
+    CURFIL_INFO("sampled " << allSubsamples.size() << " pixels from " << numImages << " images in "
+            << samplingTimer.format(4));
 
-        for (int y = 0; y < img.getHeight(); ++y) {
-            for (int x = 0; x < img.getWidth(); ++x) {
-                LabelType label = img.getLabel(x, y);
-                assert(label >= 0);
-                priorDistribution[label]++;
-            }
+    return allSubsamples;
+}
+
+void RandomTreeImage::calculateLabelPriorDistribution(
+        const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices) {
+
+    const std::vector<size_t> labelCounts = sumLabelCounts(indices);
+
+    // the prior has one entry per distinct label in the training set
+    size_t numLabels = 0;
+    for (size_t count : labelCounts) {
+        if (count > 0) {
+            numLabels++;
         }
     }
 
-    classLabelPriorDistribution.resize(priorDistribution.size());
-    for (LabelType label = 0; label < priorDistribution.size(); label++) {
-        classLabelPriorDistribution[label] = priorDistribution[label];
+    classLabelPriorDistribution.resize(numLabels);
+    for (LabelType label = 0; label < numLabels; label++) {
+        classLabelPriorDistribution[label] = (label < labelCounts.size()) ? labelCounts[label] : 0;
     }
 
 }
 
 std::vector<PixelInstance> RandomTreeImage::subsampleTrainingDataClassUniform(
         const std::vector<LabeledRGBDImage>& trainLabelImages,
+        const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices,
         RandomSource& randomSource,
         size_t subsampleCount) const {
 
@@ -862,21 +1561,15 @@ std::vector<PixelInstance> RandomTreeImage::subsampleTrainingDataClassUniform(
         numLabels--;
     }
 
+    const size_t numImages = trainLabelImages.size();
+
     // Number of samples per class, rounded up
     const size_t samplesPerClass = static_cast<size_t>(
-            ceil(trainLabelImages.size() * static_cast<double>(subsampleCount) /
+            ceil(numImages * static_cast<double>(subsampleCount) /
                     static_cast<double>(numLabels)));
 
-    std::vector<PixelInstance> allSubsamples;
-
     CURFIL_INFO("sampling " << numLabels << " classes. " << samplesPerClass << " samples per class with "
-            << configuration.getNumThreads() << " threads from " << trainLabelImages.size() << " images");
-
-    tbb::concurrent_vector<std::map<LabelType, ReservoirSampler<PixelInstance> > > samplersPerLabel;
-
-    int grainSize = ceil(trainLabelImages.size() / static_cast<double>(configuration.getNumThreads()));
-
-    const int randomSeed = randomSource.uniformSampler(0xFFFFFF).getNext();
+            << configuration.getNumThreads() << " threads from " << numImages << " images");
 
     std::set<LabelType> labelsToIgnore;
     for (const std::string colorString : configuration.getIgnoredColors()) {
@@ -888,94 +1581,84 @@ std::vector<PixelInstance> RandomTreeImage::subsampleTrainingDataClassUniform(
         labelsToIgnore.insert(label);
     }
 
-    // Parallel Reservoir Sampling
-    tbb::parallel_for(tbb::blocked_range<size_t>(0, trainLabelImages.size(), grainSize),
-            [&](const tbb::blocked_range<size_t>& range) {
-
-#ifndef NDEBUG
-            size_t numImages = range.end() - range.begin();
-            assert(numImages > 0);
-            assert(numImages <= trainLabelImages.size());
-#endif
-
-            std::map<LabelType, ReservoirSampler<PixelInstance> > reservoirSamplers;
-
-            for (LabelType label = 0; label < classLabelPriorDistribution.size(); label++) {
-                reservoirSamplers[label] = ReservoirSampler<PixelInstance>(samplesPerClass);
-            }
-
-            const int randMax = 0x7FFFFFFF;
-            RandomSource randomSource(randomSeed);
-            Sampler sampler = randomSource.uniformSampler(randMax);
-
-            for(unsigned int imageNr = range.begin(); imageNr != range.end(); imageNr++) {
-
-                const auto image = trainLabelImages[imageNr].getLabelImage();
-                for(int y=0; y < image.getHeight(); y++) {
-                    for(int x=0; x < image.getWidth(); x++) {
-                        const LabelType label = image.getLabel(x, y);
-
-                        if (labelsToIgnore.find(label) != labelsToIgnore.end()) {
-                            continue;
-                        }
-
-                        PixelInstance sample(&(trainLabelImages[imageNr].getRGBDImage()), label, x, y);
-                        if (!sample.getDepth().isValid()) {
-                            continue;
-                        }
-
-                        reservoirSamplers[label].sample(sampler, sample);
-                    }
-                }
-
-            }
+    const size_t numClasses = classLabelPriorDistribution.size();
 
-            samplersPerLabel.push_back(reservoirSamplers);
+    // the selected entries of the valid pixels per image and label
+    std::vector<std::vector<std::vector<uint32_t> > > selectedPixels(numImages,
+            std::vector<std::vector<uint32_t> >(numClasses));
 
-        });
+    IndexSampler sampler = randomSource.indexSampler();
 
-    const int randMax = 0x7FFFFFFF;
-    Sampler sampler = randomSource.uniformSampler(randMax);
+    size_t numSamples = 0;
+    std::vector<size_t> offsets(numImages + 1, 0);
 
-    for (LabelType label = 0; label < classLabelPriorDistribution.size(); label++) {
+    for (LabelType label = 0; label < numClasses; label++) {
 
-        ReservoirSampler<PixelInstance> reservoirSampler(samplesPerClass);
+        if (labelsToIgnore.find(label) != labelsToIgnore.end()) {
+            continue;
+        }
 
-        for (auto& samplers : samplersPerLabel) {
-            const auto& samples = samplers[label].getReservoir();
+        // the valid pixels of the label in all images are numbered consecutively
+        for (size_t imageNr = 0; imageNr < numImages; imageNr++) {
+            offsets[imageNr + 1] = offsets[imageNr] + indices[imageNr]->getValidPixels(label).size();
+        }
 
-            if (labelsToIgnore.find(label) != labelsToIgnore.end()) {
-                if (!samples.empty()) {
-                    throw std::runtime_error("sampled pixels for ignored class. must not happen");
-                }
-                continue;
-            }
+        const std::vector<size_t> selection = sampleWithoutReplacement(sampler, offsets[numImages],
+                samplesPerClass);
 
-            for (const PixelInstance& sample : samples) {
-                reservoirSampler.sample(sampler, sample);
+        size_t imageNr = 0;
+        for (size_t pixelNr : selection) {
+            while (pixelNr >= offsets[imageNr + 1]) {
+                imageNr++;
             }
+            selectedPixels[imageNr][label].push_back(pixelNr - offsets[imageNr]);
         }
 
-        const std::vector<PixelInstance>& reservoir = reservoirSampler.getReservoir();
-
         auto color = LabelImage::decodeLabel(label);
         CURFIL_INFO((boost::format("sampled %d pixels of class '%d' RGB(%s)")
-                % reservoir.size()
+                % selection.size()
                 % static_cast<int>(label)
                 % color.toString()).str());
 
-        allSubsamples.insert(allSubsamples.begin(), reservoir.begin(), reservoir.end());
+        numSamples += selection.size();
+    }
+
+    if (numSamples != samplesPerClass * numLabels) {
+        throw std::runtime_error("failed to sample enough pixels");
     }
 
+    std::vector<std::vector<PixelInstance> > samples(numImages);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numImages),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t imageNr = range.begin(); imageNr != range.end(); imageNr++) {
+                    const RGBDImage* rgbdImage = &(trainLabelImages[imageNr].getRGBDImage());
+                    const int width = rgbdImage->getWidth();
+
+                    std::vector<PixelInstance>& imageSamples = samples[imageNr];
+                    for (LabelType label = 0; label < numClasses; label++) {
+                        const std::vector<uint32_t>& validPixels = indices[imageNr]->getValidPixels(label);
+                        for (uint32_t pixelNr : selectedPixels[imageNr][label]) {
+                            const uint32_t pixel = validPixels[pixelNr];
+                            PixelInstance sample(rgbdImage, label, pixel % width, pixel / width);
+                            assert(sample.getDepth().isValid());
+                            imageSamples.push_back(sample);
+                        }
+                        std::vector<uint32_t>().swap(selectedPixels[imageNr][label]);
+                    }
+
+                    std::stable_sort(imageSamples.begin(), imageSamples.end(), compareSamples);
+                }
+            });
+
+    std::vector<PixelInstance> allSubsamples = concatenateSamples(samples);
+
     samplingTimer.stop();
 
     CURFIL_INFO("sampled " << allSubsamples.size() << " pixels for "
             << numLabels << " classes (" << samplesPerClass << " samples/class)"
             << " in " << samplingTimer.format(4));
 
-    if (allSubsamples.size() != samplesPerClass * numLabels) {
-        throw std::runtime_error("failed to sample enough pixels");
-    }
     return allSubsamples;
 }
 
@@ -4,9 +4,12 @@
 #include <algorithm>
 #include <assert.h>
 #include <boost/make_shared.hpp>
+#include <boost/weak_ptr.hpp>
 #include <cuv/ndarray.hpp>
 #include <list>
+#include <map>
 #include <stdint.h>
+#include <tbb/mutex.h>
 #include <vector>
 
 #include "image.h"
@@ -14,6 +17,8 @@
 
 namespace curfil {
 
+class DeviceContext;
+
 class XY {
 public:
     XY() :
@@ -122,6 +127,12 @@ public:
     }
 
     FeatureResponseType averageRegionColor(const Offset& offset, const Region& region, uint8_t channel) const {
+        return averageRegionColor<FeatureResponseType>(offset, region, channel);
+    }
+
+    // FeatureResponse is float or double, see TrainingConfiguration::isSinglePrecisionFeatures()
+    template<class FeatureResponse>
+    FeatureResponse averageRegionColor(const Offset& offset, const Region& region, uint8_t channel) const {
 
         assert(region.getX() >= 0);
         assert(region.getY() >= 0);
@@ -140,7 +151,7 @@ public:
         int lowerY = y + height;
 
         if (leftX < 0 || rightX >= image->getWidth() || upperY < 0 || lowerY >= image->getHeight()) {
-            return std::numeric_limits<double>::quiet_NaN();
+            return std::numeric_limits<FeatureResponse>::quiet_NaN();
         }
 
         assert(inImage(x, y));
@@ -150,17 +161,22 @@ public:
         Point lowerLeft(leftX, lowerY);
         Point lowerRight(rightX, lowerY);
 
-        FeatureResponseType lowerRightPixel = getColor(lowerRight, channel);
-        FeatureResponseType lowerLeftPixel = getColor(lowerLeft, channel);
-        FeatureResponseType upperRightPixel = getColor(upperRight, channel);
-        FeatureResponseType upperLeftPixel = getColor(upperLeft, channel);
+        FeatureResponse lowerRightPixel = getColor(lowerRight, channel);
+        FeatureResponse lowerLeftPixel = getColor(lowerLeft, channel);
+        FeatureResponse upperRightPixel = getColor(upperRight, channel);
+        FeatureResponse upperLeftPixel = getColor(upperLeft, channel);
 
-        FeatureResponseType sum = (lowerRightPixel - upperRightPixel) + (upperLeftPixel - lowerLeftPixel);
+        FeatureResponse sum = (lowerRightPixel - upperRightPixel) + (upperLeftPixel - lowerLeftPixel);
 
         return sum;
     }
 
     FeatureResponseType averageRegionDepth(const Offset& offset, const Region& region) const {
+        return averageRegionDepth<FeatureResponseType>(offset, region);
+    }
+
+    template<class FeatureResponse>
+    FeatureResponse averageRegionDepth(const Offset& offset, const Region& region) const {
         assert(region.getX() >= 0);
         assert(region.getY() >= 0);
 
@@ -178,7 +194,7 @@ public:
         int lowerY = y + height;
 
         if (leftX < 0 || rightX >= image->getWidth() || upperY < 0 || lowerY >= image->getHeight()) {
-            return std::numeric_limits<double>::quiet_NaN();
+            return std::numeric_limits<FeatureResponse>::quiet_NaN();
         }
 
         assert(inImage(x, y));
@@ -197,7 +213,7 @@ public:
         assert(numValid >= 0);
 
         if (numValid == 0) {
-            return std::numeric_limits<double>::quiet_NaN();
+            return std::numeric_limits<FeatureResponse>::quiet_NaN();
         }
 
         const int lowerRightDepth = getDepth(lowerRight).getIntValue();
@@ -206,7 +222,7 @@ public:
         const int upperLeftDepth = getDepth(upperLeft).getIntValue();
 
         int sum = (lowerRightDepth - upperRightDepth) + (upperLeftDepth - lowerLeftDepth);
-        FeatureResponseType feat = sum / static_cast<FeatureResponseType>(1000);
+        FeatureResponse feat = sum / static_cast<FeatureResponse>(1000);
         return (feat / numValid);
     }
 
@@ -322,12 +338,17 @@ public:
     }
 
     FeatureResponseType calculateFeatureResponse(const PixelInstance& instance) const {
+        return calculateFeatureResponse<FeatureResponseType>(instance);
+    }
+
+    template<class FeatureResponse>
+    FeatureResponse calculateFeatureResponse(const PixelInstance& instance) const {
         assert(isValid());
         switch (featureType) {
             case DEPTH:
-                return calculateDepthFeature(instance);
+                return calculateDepthFeature<FeatureResponse>(instance);
             case COLOR:
-                return calculateColorFeature(instance);
+                return calculateColorFeature<FeatureResponse>(instance);
             default:
                 assert(false);
                 break;
@@ -376,39 +397,43 @@ private:
     Region region2;
     uint8_t channel2;
 
-    FeatureResponseType calculateColorFeature(const PixelInstance& instance) const {
+    template<class FeatureResponse>
+    FeatureResponse calculateColorFeature(const PixelInstance& instance) const {
 
         const Depth depth = instance.getDepth();
         if (!depth.isValid()) {
-            return std::numeric_limits<double>::quiet_NaN();
+            return std::numeric_limits<FeatureResponse>::quiet_NaN();
         }
 
-        FeatureResponseType a = instance.averageRegionColor(offset1.normalize(depth), region1.normalize(depth),
-                channel1);
+        FeatureResponse a = instance.averageRegionColor<FeatureResponse>(offset1.normalize(depth),
+                region1.normalize(depth), channel1);
         if (isnan(a))
             return a;
 
-        FeatureResponseType b = instance.averageRegionColor(offset2.normalize(depth), region2.normalize(depth),
-                channel2);
+        FeatureResponse b = instance.averageRegionColor<FeatureResponse>(offset2.normalize(depth),
+                region2.normalize(depth), channel2);
         if (isnan(b))
             return b;
 
         return (a - b);
     }
 
-    FeatureResponseType calculateDepthFeature(const PixelInstance& instance) const {
+    template<class FeatureResponse>
+    FeatureResponse calculateDepthFeature(const PixelInstance& instance) const {
 
         const Depth depth = instance.getDepth();
         if (!depth.isValid()) {
-            return std::numeric_limits<double>::quiet_NaN();
+            return std::numeric_limits<FeatureResponse>::quiet_NaN();
         }
 
-        FeatureResponseType a = instance.averageRegionDepth(offset1.normalize(depth), region1.normalize(depth));
+        FeatureResponse a = instance.averageRegionDepth<FeatureResponse>(offset1.normalize(depth),
+                region1.normalize(depth));
         if (isnan(a)) {
             return a;
         }
 
-        FeatureResponseType b = instance.averageRegionDepth(offset2.normalize(depth), region2.normalize(depth));
+        FeatureResponse b = instance.averageRegionDepth<FeatureResponse>(offset2.normalize(depth),
+                region2.normalize(depth));
         if (isnan(b)) {
             return b;
         }
@@ -648,8 +673,66 @@ public:
 
 };
 
+/**
+ * Decides in HYBRID mode whether the split of a node is evaluated on the CPU or on the GPU.
+ *
+ * Until both paths were measured a few times, nodes with at least TrainingConfiguration::getHybridSampleThreshold()
+ * samples go to the GPU. Afterwards the measured times decide:
+ * GPU: overhead + perSample * samples + perImage * uncached images, fitted by linear regression
+ * CPU: perSample * samples
+ */
+class HybridCostModel {
+
+public:
+
+    explicit HybridCostModel(unsigned int initialSampleThreshold);
+
+    // thread-safe
+    bool evaluateOnGPU(size_t numSamples, size_t numUncachedImages) const;
+
+    // 'seconds' excludes the image transfers
+    void addGPUMeasurement(size_t numSamples, double seconds);
+
+    void addTransferMeasurement(size_t numUncachedImages, double seconds);
+
+    void addCPUMeasurement(size_t numSamples, double seconds);
+
+    bool isCalibrated() const;
+
+private:
+
+    // number of measurements of each path before the timings are used
+    static const size_t MIN_MEASUREMENTS = 3;
+
+    double estimateGPUSeconds(size_t numSamples, size_t numUncachedImages) const;
+    double estimateCPUSeconds(size_t numSamples) const;
+
+    const unsigned int initialSampleThreshold;
+
+    mutable tbb::mutex mutex;
+
+    // sums for the linear regression of the GPU time
+    size_t gpuMeasurements;
+    double gpuSamples;
+    double gpuSeconds;
+    double gpuSamplesSquared;
+    double gpuSamplesSeconds;
+
+    double transferImages;
+    double transferSeconds;
+
+    size_t cpuMeasurements;
+    double cpuSamples;
+    double cpuSeconds;
+};
+
 class ImageFeatureEvaluation {
 public:
+
+    // the batch pipeline uploads the samples of the next batch while the histograms of the current batch
+    // are aggregated. every buffer of samples and feature responses is used by every NUM_BATCH_BUFFERS-th batch
+    static const size_t NUM_BATCH_BUFFERS = 2;
+
     // box_radius: > 0, half the box side length to uniformly sample
     //    (dx,dy) offsets from.
     ImageFeatureEvaluation(const size_t treeId, const TrainingConfiguration& configuration) :
@@ -660,7 +743,8 @@ public:
                     keysIndicesAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("keysIndices")),
                     scoresAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("scores")),
                     countersAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("counters")),
-                    featureResponsesAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("featureResponses")) {
+                    featureResponsesAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("featureResponses")),
+                    hybridCostModel(configuration.getHybridSampleThreshold()) {
         assert(configuration.getBoxRadius() > 0);
         assert(configuration.getRegionSize() > 0);
 
@@ -689,6 +773,8 @@ public:
     void sortFeatures(ImageFeaturesAndThresholds<memory_space>& featuresAndThresholds,
             const cuv::ndarray<int, memory_space>& keysIndices) const;
 
+    // features × thresholds × labels × 2 counters, or, if binned on the device,
+    // features × (thresholds + 1) × labels counters left of every threshold, the last being the totals
     template<class memory_space>
     cuv::ndarray<WeightType, memory_space> calculateFeatureResponsesAndHistograms(
             RandomTree<PixelInstance, ImageFeatureFunction>& node,
@@ -704,15 +790,45 @@ public:
 
 private:
 
+    friend class LevelFeatureEvaluation;
+
+    // the samples of all nodes that are used to generate the random features of a tree level
+    std::vector<const PixelInstance*> getFeatureGenerationSamples(
+            const std::vector<std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
+                    std::vector<const PixelInstance*> > >& samplesPerNode) const;
+
+    // the device this tree is trained on
+    int getDeviceId() const;
+
+    // selects the device of this tree for the calling thread
+    DeviceContext& getDeviceContext();
+
     void selectDevice();
 
     void initDevice();
 
+    // calculateFeatureResponsesAndHistograms() on the device in the precision of FeatureResponse
+    template<class FeatureResponse>
+    cuv::ndarray<WeightType, cuv::dev_memory_space> calculateFeatureResponsesAndHistogramsOnDevice(
+            RandomTree<PixelInstance, ImageFeatureFunction>& node,
+            const std::vector<std::vector<const PixelInstance*> >& batches,
+            const ImageFeaturesAndThresholds<cuv::dev_memory_space>& featuresAndThresholds,
+            cuv::ndarray<FeatureResponseType, cuv::host_memory_space>* featureResponsesHost);
+
     void copyFeaturesToDevice();
 
+    // the class histograms of the samples that go left and right of a threshold of a feature,
+    // read from the counters of a node on the device, see calculateFeatureResponsesAndHistograms()
+    void copySplitHistograms(const WeightType* counters, unsigned int feature, unsigned int threshold,
+            std::vector<WeightType>& leftHistogram, std::vector<WeightType>& rightHistogram) const;
+
     Samples<cuv::dev_memory_space> copySamplesToDevice(const std::vector<const PixelInstance*>& samples,
             cudaStream_t stream);
 
+    // 'samplesOnHost' must be pinned memory with space for all samples
+    Samples<cuv::dev_memory_space> copySamplesToDeviceAsync(const std::vector<const PixelInstance*>& samples,
+            Samples<cuv::host_memory_space>& samplesOnHost, cudaStream_t stream);
+
     const ImageFeatureFunction sampleFeature(RandomSource& randomSource,
             const std::vector<const PixelInstance*>&) const;
 
@@ -728,6 +844,123 @@ private:
     boost::shared_ptr<cuv::allocator> scoresAllocator;
     boost::shared_ptr<cuv::allocator> countersAllocator;
     boost::shared_ptr<cuv::allocator> featureResponsesAllocator;
+
+    // calibrated over all levels of the tree
+    HybridCostModel hybridCostModel;
+};
+
+/**
+ * Evaluates the splits of all nodes of a tree level together on the GPU.
+ *
+ * The samples of many nodes are concatenated into the same batches. A segment array maps the samples to their
+ * nodes. Feature responses, histograms, scores and the best split of every node are calculated with one sequence of
+ * kernel launches per batch, instead of one sequence per node.
+ *
+ * Falls back to ImageFeatureEvaluation if the acceleration mode is not GPU_ONLY or if the counters of a node do
+ * not fit into shared memory.
+ */
+class LevelFeatureEvaluation {
+public:
+
+    typedef std::vector<std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
+            std::vector<const PixelInstance*> > > SamplesPerNode;
+
+    LevelFeatureEvaluation(const size_t treeId, const TrainingConfiguration& configuration);
+
+    std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > evaluateBestSplits(RandomSource& randomSource,
+            const SamplesPerNode& samplesPerNode);
+
+    /**
+     * Evaluates the same level of several trees together. All trees must be trained on the same device.
+     *
+     * The batches are grouped by image instead of by tree: the images that fit into the image cache are
+     * transferred once and then serve the samples of all trees that sampled them, before the next images are
+     * transferred.
+     *
+     * @return the best splits of the nodes of each tree
+     */
+    static std::vector<std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > > evaluateBestSplits(
+            const std::vector<LevelFeatureEvaluation*>& evaluations,
+            const std::vector<RandomSource*>& randomSources,
+            const std::vector<const SamplesPerNode*>& samplesPerNode);
+
+    int getDeviceId() const {
+        return nodeEvaluation.getDeviceId();
+    }
+
+private:
+
+    // consecutive nodes of a tree whose counters are allocated together
+    class LevelNodes;
+
+    // upper bound for the memory of the histogram counters of all nodes that are evaluated together
+    static const size_t MAX_COUNTERS_MEMORY = 256lu * 1024lu * 1024lu;
+
+    // maximal number of samples per thread block
+    static const unsigned int MAX_SEGMENT_SIZE = 2048;
+
+    bool isApplicable(const SamplesPerNode& samplesPerNode);
+
+    // evaluates the nodes of all trees whose counters fit into the device memory at the same time
+    static void evaluateNodes(const std::vector<LevelNodes>& levelNodes);
+
+    const TrainingConfiguration& configuration;
+
+    ImageFeatureEvaluation nodeEvaluation;
+
+    boost::shared_ptr<cuv::allocator> segmentsAllocator;
+    boost::shared_ptr<cuv::allocator> histogramsAllocator;
+    boost::shared_ptr<cuv::allocator> bestSplitsAllocator;
+};
+
+/**
+ * Label statistics of a training image that do not depend on the tree that is trained.
+ */
+class ImageLabelIndex {
+public:
+
+    explicit ImageLabelIndex(const LabeledRGBDImage& image);
+
+    /**
+     * @return the number of pixels per label id, up to the largest label id in the image
+     */
+    const std::vector<size_t>& getLabelCounts() const {
+        return labelCounts;
+    }
+
+    /**
+     * @return the positions (y * width + x) of the pixels with the given label and a valid depth in row-major order
+     */
+    const std::vector<uint32_t>& getValidPixels(LabelType label) const;
+
+private:
+    std::vector<size_t> labelCounts;
+    std::vector<std::vector<uint32_t> > validPixels;
+};
+
+/**
+ * Shares the ImageLabelIndex of the training images between the trees of a forest.
+ * The index of an image is computed once and kept as long as its label image is alive.
+ */
+class TrainingSetIndex {
+public:
+
+    TrainingSetIndex() :
+            mutex(), indices() {
+    }
+
+    /**
+     * Computes the missing indices of the given images in parallel.
+     */
+    std::vector<boost::shared_ptr<const ImageLabelIndex> > getIndices(const std::vector<LabeledRGBDImage>& images);
+
+private:
+    tbb::mutex mutex;
+    std::map<const LabelImage*,
+            std::pair<boost::weak_ptr<LabelImage>, boost::shared_ptr<const ImageLabelIndex> > > indices;
+
+    TrainingSetIndex(const TrainingSetIndex&);
+    TrainingSetIndex& operator=(const TrainingSetIndex&);
 };
 
 class RandomTreeImage {
@@ -739,8 +972,20 @@ public:
             const TrainingConfiguration& configuration,
             const cuv::ndarray<WeightType, cuv::host_memory_space>& classLabelPriorDistribution);
 
+    /**
+     * @param checkpointFile if not empty, a checkpoint is written to this file after each level
+     *        and the training resumes from it if the file exists
+     */
+    void train(const std::vector<LabeledRGBDImage>& trainLabelImages,
+            RandomSource& randomSource, size_t subsampleCount,
+            const std::string& checkpointFile = std::string());
+
+    /**
+     * @param trainingSetIndex the label statistics of the images that are shared with the other trees of the forest
+     */
     void train(const std::vector<LabeledRGBDImage>& trainLabelImages,
-            RandomSource& randomSource, size_t subsampleCount);
+            RandomSource& randomSource, size_t subsampleCount, TrainingSetIndex& trainingSetIndex,
+            const std::string& checkpointFile = std::string());
 
     void test(const RGBDImage* image, LabelImage& prediction) const;
 
@@ -760,10 +1005,37 @@ public:
 
     bool shouldIgnoreLabel(const LabelType& label) const;
 
+    /**
+     * Trains the trees together, level by level, instead of one after the other.
+     *
+     * The nodes of a level of all trees that are trained on the same device are evaluated together by
+     * LevelFeatureEvaluation::evaluateBestSplits(), such that the trees share the transfers of the images they
+     * sampled. The trees are identical to the trees that train() produces with the same arguments.
+     *
+     * @param trainLabelImages the training images of each tree
+     * @param randomSources the random source of each tree
+     * @param checkpointFiles the checkpoint file of each tree, see train(). empty strings disable the checkpoints
+     */
+    static void train(const std::vector<boost::shared_ptr<RandomTreeImage> >& trees,
+            const std::vector<std::vector<LabeledRGBDImage> >& trainLabelImages,
+            std::vector<RandomSource>& randomSources, size_t subsampleCount, TrainingSetIndex& trainingSetIndex,
+            const std::vector<std::string>& checkpointFiles);
+
 private:
 
+    typedef RandomTreeTrain<PixelInstance, LevelFeatureEvaluation, ImageFeatureFunction> TreeTrain;
+
+    // also calculates the label prior distribution
+    std::vector<PixelInstance> subsampleTrainingData(const std::vector<LabeledRGBDImage>& trainLabelImages,
+            RandomSource& randomSource, size_t subsampleCount, TrainingSetIndex& trainingSetIndex);
+
+    void initCheckpoints(TreeTrain& treeTrain, const std::string& checkpointFile) const;
+
+    // creates the root node that takes over the given samples
+    TreeTrain::SamplesPerNode createRoot(size_t numClasses, std::vector<const PixelInstance*>& subsamples);
+
     void doTrain(RandomSource& randomSource, size_t numClasses,
-            std::vector<const PixelInstance*>& subsamples);
+            std::vector<const PixelInstance*>& subsamples, const std::string& checkpointFile);
 
     bool finishedTraining;
     size_t id;
@@ -774,14 +1046,16 @@ private:
 
     cuv::ndarray<WeightType, cuv::host_memory_space> classLabelPriorDistribution;
 
-    void calculateLabelPriorDistribution(const std::vector<LabeledRGBDImage>& trainLabelImages);
+    void calculateLabelPriorDistribution(const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices);
 
     std::vector<PixelInstance> subsampleTrainingDataPixelUniform(
             const std::vector<LabeledRGBDImage>& trainLabelImages,
+            const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices,
             RandomSource& randomSource, size_t subsampleCount) const;
 
     std::vector<PixelInstance> subsampleTrainingDataClassUniform(
             const std::vector<LabeledRGBDImage>& trainLabelImages,
+            const std::vector<boost::shared_ptr<const ImageLabelIndex> >& indices,
             RandomSource& randomSource, size_t subsampleCount) const;
 
 };
@@ -1,15 +1,24 @@
 #include "random_tree_image_gpu.h"
 
+#include <algorithm>
 #include <boost/format.hpp>
+#include <cmath>
+#include <cstring>
+#include <cuda_fp16.h>
 #include <cuda_runtime_api.h>
 #include <curand_kernel.h>
+#include <limits>
+#include <map>
 #include <set>
+#include <tbb/atomic.h>
 #include <tbb/mutex.h>
 #include <thrust/device_ptr.h>
 #include <thrust/sort.h>
 
+#include "device_memory.h"
 #include "random_tree_image.h"
 #include "score.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace curfil {
@@ -19,16 +28,10 @@ texture<float, cudaTextureType2DLayered, cudaReadModeElementType> colorTexture;
 texture<int, cudaTextureType2DLayered, cudaReadModeElementType> depthTexture;
 
 texture<float, cudaTextureType2DLayered, cudaReadModeElementType> treeTexture;
+texture<float, cudaTextureType2DLayered, cudaReadModeElementType> histogramTexture;
 
-tbb::mutex initMutex;
-volatile bool initialized = false;
-
-tbb::mutex textureMutex;
-
-const static int NUM_STREAMS = 2;
-cudaStream_t streams[NUM_STREAMS] = { NULL, NULL };
-ImageCache imageCache;
-TreeCache treeCache;
+tbb::mutex deviceContextsMutex;
+std::map<int, boost::shared_ptr<DeviceContext> > deviceContexts;
 
 __device__
 float getColorChannelValue(int x, int y, int imageNr, int channel) {
@@ -46,8 +49,11 @@ int getDepthValidValue(int x, int y, int imageNr) {
     return tex2DLayered(depthTexture, x, y, imageNr * depthChannels + depthValidChannel);
 }
 
+// the device functions and kernels that calculate feature responses are instantiated for float and double.
+// FeatureResponse is float if TrainingConfiguration::isSinglePrecisionFeatures() is set
+template<class FeatureResponse>
 __device__
-FeatureResponseType averageRegionDepth(int imageNr,
+FeatureResponse averageRegionDepth(int imageNr,
         const int16_t imageWidth, const int16_t imageHeight,
         int leftX, int rightX, int upperY, int lowerY) {
 
@@ -73,12 +79,13 @@ FeatureResponseType averageRegionDepth(int imageNr,
     int lowerLeftDepth = getDepthValue(leftX, lowerY, imageNr);
 
     int sum = (lowerRightDepth - upperRightDepth) + (upperLeftDepth - lowerLeftDepth);
-    FeatureResponseType feat = sum / static_cast<FeatureResponseType>(1000);
+    FeatureResponse feat = sum / static_cast<FeatureResponse>(1000);
     return (feat / numValid);
 }
 
+template<class FeatureResponse>
 __device__
-FeatureResponseType averageRegionDepth(int imageNr,
+FeatureResponse averageRegionDepth(int imageNr,
         const int16_t imageWidth, const int16_t imageHeight,
         float depth,
         int sampleX, int sampleY,
@@ -95,11 +102,12 @@ FeatureResponseType averageRegionDepth(int imageNr,
     int upperY = y - height;
     int lowerY = y + height;
 
-    return averageRegionDepth(imageNr, imageWidth, imageHeight, leftX, rightX, upperY, lowerY);
+    return averageRegionDepth<FeatureResponse>(imageNr, imageWidth, imageHeight, leftX, rightX, upperY, lowerY);
 }
 
+template<class FeatureResponse>
 __device__
-FeatureResponseType averageRegionColor(int imageNr,
+FeatureResponse averageRegionColor(int imageNr,
         uint16_t imageWidth, uint16_t imageHeight,
         int channel, float depth,
         int sampleX, int sampleY,
@@ -120,18 +128,19 @@ FeatureResponseType averageRegionColor(int imageNr,
         return nan("");
     }
 
-    FeatureResponseType upperLeftPixel = getColorChannelValue(leftX, upperY, imageNr, channel);
-    FeatureResponseType upperRightPixel = getColorChannelValue(rightX, upperY, imageNr, channel);
-    FeatureResponseType lowerRightPixel = getColorChannelValue(rightX, lowerY, imageNr, channel);
-    FeatureResponseType lowerLeftPixel = getColorChannelValue(leftX, lowerY, imageNr, channel);
+    FeatureResponse upperLeftPixel = getColorChannelValue(leftX, upperY, imageNr, channel);
+    FeatureResponse upperRightPixel = getColorChannelValue(rightX, upperY, imageNr, channel);
+    FeatureResponse lowerRightPixel = getColorChannelValue(rightX, lowerY, imageNr, channel);
+    FeatureResponse lowerLeftPixel = getColorChannelValue(leftX, lowerY, imageNr, channel);
 
-    FeatureResponseType sum = (lowerRightPixel - upperRightPixel) + (upperLeftPixel - lowerLeftPixel);
+    FeatureResponse sum = (lowerRightPixel - upperRightPixel) + (upperLeftPixel - lowerLeftPixel);
 
     return sum;
 }
 
+template<class FeatureResponse>
 __device__
-FeatureResponseType calculateDepthFeature(int imageNr,
+FeatureResponse calculateDepthFeature(int imageNr,
         int16_t imageWidth, int16_t imageHeight,
         int8_t offset1X, int8_t offset1Y,
         int8_t offset2X, int8_t offset2Y,
@@ -139,14 +148,14 @@ FeatureResponseType calculateDepthFeature(int imageNr,
         int8_t region2X, int8_t region2Y,
         int sampleX, int sampleY, float depth) {
 
-    FeatureResponseType a = averageRegionDepth(imageNr, imageWidth, imageHeight, depth, sampleX, sampleY, offset1X,
-            offset1Y, region1X, region1Y);
+    FeatureResponse a = averageRegionDepth<FeatureResponse>(imageNr, imageWidth, imageHeight, depth,
+            sampleX, sampleY, offset1X, offset1Y, region1X, region1Y);
 
     if (isnan(a))
         return a;
 
-    FeatureResponseType b = averageRegionDepth(imageNr, imageWidth, imageHeight, depth, sampleX, sampleY, offset2X,
-            offset2Y, region2X, region2Y);
+    FeatureResponse b = averageRegionDepth<FeatureResponse>(imageNr, imageWidth, imageHeight, depth,
+            sampleX, sampleY, offset2X, offset2Y, region2X, region2Y);
 
     if (isnan(b))
         return b;
@@ -154,8 +163,9 @@ FeatureResponseType calculateDepthFeature(int imageNr,
     return (a - b);
 }
 
+template<class FeatureResponse>
 __device__
-FeatureResponseType calculateColorFeature(int imageNr,
+FeatureResponse calculateColorFeature(int imageNr,
         const int16_t imageWidth, const int16_t imageHeight,
         int8_t offset1X, int8_t offset1Y,
         int8_t offset2X, int8_t offset2Y,
@@ -167,14 +177,14 @@ FeatureResponseType calculateColorFeature(int imageNr,
     assert(channel1 >= 0 && channel1 < 3);
     assert(channel2 >= 0 && channel2 < 3);
 
-    FeatureResponseType a = averageRegionColor(imageNr, imageWidth, imageHeight, channel1, depth, sampleX, sampleY,
-            offset1X, offset1Y, region1X, region1Y);
+    FeatureResponse a = averageRegionColor<FeatureResponse>(imageNr, imageWidth, imageHeight, channel1, depth,
+            sampleX, sampleY, offset1X, offset1Y, region1X, region1Y);
 
     if (isnan(a))
         return a;
 
-    FeatureResponseType b = averageRegionColor(imageNr, imageWidth, imageHeight, channel2, depth, sampleX, sampleY,
-            offset2X, offset2Y, region2X, region2Y);
+    FeatureResponse b = averageRegionColor<FeatureResponse>(imageNr, imageWidth, imageHeight, channel2, depth,
+            sampleX, sampleY, offset2X, offset2Y, region2X, region2Y);
 
     if (isnan(b))
         return b;
@@ -217,6 +227,7 @@ void randomRegion(curandState* state, int8_t* x, int8_t* y, const uint8_t region
     *y = vy;
 }
 
+template<class FeatureResponse>
 __global__
 void generateRandomFeaturesKernel(int seed,
         unsigned int numFeatures,
@@ -231,6 +242,7 @@ void generateRandomFeaturesKernel(int seed,
         int8_t* channels1, int8_t* channels2,
         float* thresholds,
         unsigned int numThresholds,
+        bool sortThresholds,
         unsigned int numSamples,
         int imageWidth, int imageHeight,
         int* imageNumbers,
@@ -285,10 +297,10 @@ void generateRandomFeaturesKernel(int seed,
     for (unsigned int thresh = 0; thresh < numThresholds; thresh++) {
         unsigned int numSample = curand_uniform(&localState) * (numSamples - 1);
 
-        FeatureResponseType featureResponse;
+        FeatureResponse featureResponse;
         switch (type) {
             case COLOR:
-                featureResponse = calculateColorFeature(imageNumbers[numSample],
+                featureResponse = calculateColorFeature<FeatureResponse>(imageNumbers[numSample],
                         imageWidth, imageHeight,
                         offset1X, offset1Y,
                         offset2X, offset2Y,
@@ -298,7 +310,7 @@ void generateRandomFeaturesKernel(int seed,
                         sampleX[numSample], sampleY[numSample], depths[numSample]);
                 break;
             case DEPTH:
-                featureResponse = calculateDepthFeature(imageNumbers[numSample],
+                featureResponse = calculateDepthFeature<FeatureResponse>(imageNumbers[numSample],
                         imageWidth, imageHeight,
                         offset1X, offset1Y,
                         offset2X, offset2Y,
@@ -315,7 +327,15 @@ void generateRandomFeaturesKernel(int seed,
             featureResponse = 0.0;
         }
 
-        thresholds[thresh * numFeatures + feat] = featureResponse;
+        const float threshold = featureResponse;
+
+        // insertion sort. the sorted thresholds are the sampled quantiles of the responses of the feature
+        unsigned int pos = thresh;
+        while (sortThresholds && pos > 0 && thresholds[(pos - 1) * numFeatures + feat] > threshold) {
+            thresholds[pos * numFeatures + feat] = thresholds[(pos - 1) * numFeatures + feat];
+            pos--;
+        }
+        thresholds[pos * numFeatures + feat] = threshold;
     }
 
     int32_t sortKey = 0;
@@ -347,12 +367,24 @@ void generateRandomFeaturesKernel(int seed,
 Samples<cuv::dev_memory_space> ImageFeatureEvaluation::copySamplesToDevice(
         const std::vector<const PixelInstance*>& samples, cudaStream_t stream) {
 
-    imageCache.copyImages(configuration.getImageCacheSize(), samples);
+    Samples<cuv::host_memory_space> samplesOnHost(samples.size(), sampleDataAllocator);
+    Samples<cuv::dev_memory_space> samplesOnDevice = copySamplesToDeviceAsync(samples, samplesOnHost, stream);
     cudaSafeCall(cudaStreamSynchronize(stream));
+    return samplesOnDevice;
+}
 
-    utils::Profile p("copySamplesToDevice");
+Samples<cuv::dev_memory_space> ImageFeatureEvaluation::copySamplesToDeviceAsync(
+        const std::vector<const PixelInstance*>& samples, Samples<cuv::host_memory_space>& samplesOnHost,
+        cudaStream_t stream) {
 
-    Samples<cuv::host_memory_space> samplesOnHost(samples.size(), sampleDataAllocator);
+    assert(samplesOnHost.data.shape(1) == samples.size());
+
+    // the image transfer is queued on the stream of the cache which must be the same as 'stream'
+    ImageCache& imageCache = getDeviceContext().getImageCache();
+    imageCache.setCompactCacheSize(configuration.getCompactImageCacheSize());
+    imageCache.copyImages(configuration.getImageCacheSize(), samples);
+
+    utils::Profile p("copySamplesToDevice");
 
     for (size_t i = 0; i < samples.size(); i++) {
         const PixelInstance* sample = samples[i];
@@ -363,45 +395,255 @@ Samples<cuv::dev_memory_space> ImageFeatureEvaluation::copySamplesToDevice(
         samplesOnHost.labels[i] = sample->getLabel();
     }
 
-    utils::Timer copySamplesAssignTimer;
-
+    // asynchronous copy. the caller must keep 'samplesOnHost' until the stream reached this point
+    trace::GpuSpan span("upload samples", stream, trace::TRANSFER);
     Samples<cuv::dev_memory_space> samplesOnDevice(samplesOnHost, stream);
-    cudaSafeCall(cudaStreamSynchronize(stream));
     return samplesOnDevice;
 }
 
 void clearImageCache() {
     CURFIL_INFO("clearing image cache");
+    DeviceContext::clearImageCaches();
+}
+
+void removeFromImageCache(const RGBDImage* image) {
+    DeviceContext::removeFromImageCaches(image);
+}
+
+DeviceContext::DeviceContext(int deviceId) :
+        deviceId(deviceId), sharedMemoryPerBlock(0), prefetchStream(NULL), imageCache(), treeCache(), textureMutex(),
+                forestTreePositions(), batchImagePositions() {
+
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+    assert(currentDeviceId == deviceId);
+
+    cudaDeviceProp prop;
+    cudaSafeCall(cudaGetDeviceProperties(&prop, deviceId));
+    sharedMemoryPerBlock = prop.sharedMemPerBlock;
+
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        cudaSafeCall(cudaStreamCreate(&streams[i]));
+    }
+    cudaSafeCall(cudaStreamCreate(&prefetchStream));
+    CURFIL_DEBUG("device " << deviceId << ": created " << NUM_STREAMS << " streams");
+
+    imageCache.setStream(streams[0]);
+    imageCache.setPrefetchStream(prefetchStream);
+    treeCache.setStream(streams[0]);
+}
+
+DeviceContext::~DeviceContext() {
+    // the caches and streams belong to this device
+    cudaSetDevice(deviceId);
     imageCache.clear();
+    treeCache.clear();
+    for (int i = 0; i < NUM_STREAMS; i++) {
+        cudaStreamDestroy(streams[i]);
+    }
+    cudaStreamDestroy(prefetchStream);
+}
+
+DeviceContext& DeviceContext::get(int deviceId) {
+    tbb::mutex::scoped_lock lock(deviceContextsMutex);
+
+    std::map<int, boost::shared_ptr<DeviceContext> >::const_iterator it = deviceContexts.find(deviceId);
+    if (it != deviceContexts.end()) {
+        return *(it->second);
+    }
+
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+    if (currentDeviceId != deviceId) {
+        cudaSafeCall(cudaSetDevice(deviceId));
+    }
+
+    boost::shared_ptr<DeviceContext> context(new DeviceContext(deviceId));
+    deviceContexts[deviceId] = context;
+
+    if (currentDeviceId != deviceId) {
+        cudaSafeCall(cudaSetDevice(currentDeviceId));
+    }
+
+    return *context;
+}
+
+DeviceContext& DeviceContext::getCurrent() {
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+    return get(currentDeviceId);
+}
+
+void DeviceContext::clearImageCaches() {
+
+    // do not hold the lock of the context map while waiting for a texture mutex
+    std::map<int, boost::shared_ptr<DeviceContext> > contexts;
+    {
+        tbb::mutex::scoped_lock lock(deviceContextsMutex);
+        contexts = deviceContexts;
+    }
+
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+
+    std::map<int, boost::shared_ptr<DeviceContext> >::const_iterator it;
+    for (it = contexts.begin(); it != contexts.end(); it++) {
+        DeviceContext& context = *(it->second);
+        tbb::mutex::scoped_lock textureLock(context.getTextureMutex());
+        cudaSafeCall(cudaSetDevice(context.getDeviceId()));
+        context.getImageCache().clear();
+    }
+
+    cudaSafeCall(cudaSetDevice(currentDeviceId));
+}
+
+void DeviceContext::removeFromImageCaches(const RGBDImage* image) {
+
+    std::map<int, boost::shared_ptr<DeviceContext> > contexts;
+    {
+        tbb::mutex::scoped_lock lock(deviceContextsMutex);
+        contexts = deviceContexts;
+    }
+
+    // no device was used, e.g. in CPU mode
+    if (contexts.empty()) {
+        return;
+    }
+
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+
+    std::map<int, boost::shared_ptr<DeviceContext> >::const_iterator it;
+    for (it = contexts.begin(); it != contexts.end(); it++) {
+        DeviceContext& context = *(it->second);
+        tbb::mutex::scoped_lock textureLock(context.getTextureMutex());
+        cudaSafeCall(cudaSetDevice(context.getDeviceId()));
+        context.getImageCache().removeImage(image);
+    }
+
+    cudaSafeCall(cudaSetDevice(currentDeviceId));
 }
 
 TreeNodes::TreeNodes(const TreeNodes& other) :
         m_treeId(other.getTreeId()),
                 m_numNodes(other.numNodes()),
+                m_numLeaves(other.numLeaves()),
                 m_numLabels(other.numLabels()),
                 m_sizePerNode(other.sizePerNode()),
-                m_data(other.data())
+                m_data(other.data()),
+                m_histograms(other.histograms()),
+                m_storage(other.m_storage)
 {
 }
 
 TreeNodes::TreeNodes(const boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> >& tree) :
         m_treeId(tree->getTreeId()),
                 m_numNodes(tree->countNodes()),
+                m_numLeaves(0),
                 m_numLabels(tree->getNumClasses()),
-                m_sizePerNode(offsetHistograms + sizeof(float) * m_numLabels),
-                m_data(LAYERS_PER_TREE * NODES_PER_TREE_LAYER, m_sizePerNode)
+                m_sizePerNode(nodeSize),
+                m_data(LAYERS_PER_TREE * NODES_PER_TREE_LAYER, m_sizePerNode),
+                m_histograms(),
+                m_storage()
 {
-    assert(offsetHistograms == 24);
+    assert(nodeSize == 24);
 
     const unsigned int MAX_NODES = LAYERS_PER_TREE * NODES_PER_TREE_LAYER;
     if (m_numNodes > MAX_NODES) {
         throw std::runtime_error((boost::format("too many nodes in tree %d: %d (max: %d)")
                 % tree->getTreeId() % m_numNodes % MAX_NODES).str());
     }
+
+    const size_t leafLayers = ceil(tree->countLeafNodes() / static_cast<double>(NODES_PER_TREE_LAYER));
+    assert(leafLayers <= LEAF_LAYERS_PER_TREE);
+    m_histograms = cuv::ndarray<float, cuv::host_memory_space>(leafLayers * NODES_PER_TREE_LAYER, m_numLabels);
+
     convert(tree);
+    assert(m_numLeaves == tree->countLeafNodes());
     assert(m_numLabels == tree->getHistogram().size());
 }
 
+TreeNodes::TreeNodes(size_t treeId, size_t numNodes, size_t numLeaves, size_t numLabels,
+        size_t nodeLayers, const int8_t* data, size_t leafLayers, const float* histograms,
+        const boost::shared_ptr<const void>& storage) :
+        m_treeId(treeId),
+                m_numNodes(numNodes),
+                m_numLeaves(numLeaves),
+                m_numLabels(numLabels),
+                m_sizePerNode(nodeSize),
+                m_data(cuv::extents[nodeLayers * NODES_PER_TREE_LAYER][nodeSize], const_cast<int8_t*>(data)),
+                m_histograms(cuv::extents[leafLayers * NODES_PER_TREE_LAYER][numLabels],
+                        const_cast<float*>(histograms)),
+                m_storage(storage)
+{
+    if (numNodes == 0 || nodeLayers != this->nodeLayers() || nodeLayers > LAYERS_PER_TREE) {
+        throw std::runtime_error((boost::format("tree %d: illegal number of node layers: %d (nodes: %d)")
+                % treeId % nodeLayers % numNodes).str());
+    }
+    if (leafLayers < 1 || leafLayers > LEAF_LAYERS_PER_TREE || numLeaves > leafLayers * NODES_PER_TREE_LAYER) {
+        throw std::runtime_error((boost::format("tree %d: illegal number of leaf layers: %d (leaves: %d)")
+                % treeId % leafLayers % numLeaves).str());
+    }
+}
+
+template<class T>
+T TreeNodes::getValue(size_t node, size_t offset) const {
+    assert(node < m_numNodes);
+    return *reinterpret_cast<const T*>(m_data.ptr() + node * m_sizePerNode + offset);
+}
+
+int TreeNodes::getLeftNodeOffset(size_t node) const {
+    return getValue<int>(node, offsetLeftNode);
+}
+
+float TreeNodes::getThreshold(size_t node) const {
+    return getValue<float>(node, offsetThreshold);
+}
+
+int TreeNodes::getType(size_t node) const {
+    return getValue<int>(node, offsetTypes);
+}
+
+int8_t TreeNodes::getOffset1X(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 0);
+}
+
+int8_t TreeNodes::getOffset1Y(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 1);
+}
+
+int8_t TreeNodes::getRegion1X(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 2);
+}
+
+int8_t TreeNodes::getRegion1Y(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 3);
+}
+
+int8_t TreeNodes::getOffset2X(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 4);
+}
+
+int8_t TreeNodes::getOffset2Y(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 5);
+}
+
+int8_t TreeNodes::getRegion2X(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 6);
+}
+
+int8_t TreeNodes::getRegion2Y(size_t node) const {
+    return getValue<int8_t>(node, offsetFeatures + 7);
+}
+
+uint16_t TreeNodes::getChannel1(size_t node) const {
+    return getValue<uint16_t>(node, offsetChannels + 0 * sizeof(uint16_t));
+}
+
+uint16_t TreeNodes::getChannel2(size_t node) const {
+    return getValue<uint16_t>(node, offsetChannels + 1 * sizeof(uint16_t));
+}
+
 template<class T>
 void TreeNodes::setValue(size_t node, size_t offset, const T& value) {
 
@@ -432,9 +674,10 @@ void TreeNodes::setThreshold(size_t node, float threshold) {
     setValue(node, offsetThreshold, threshold);
 }
 
-void TreeNodes::setHistogramValue(size_t node, size_t label, float value) {
-    assert(offsetHistograms == 6 * sizeof(float));
-    setValue(node, offsetHistograms + label * sizeof(value), value);
+void TreeNodes::setHistogramValue(size_t leaf, size_t label, float value) {
+    assert(leaf < m_histograms.shape(0));
+    assert(label < m_numLabels);
+    m_histograms(leaf, label) = value;
 }
 
 void TreeNodes::setType(size_t node, int8_t value) {
@@ -490,16 +733,16 @@ void TreeNodes::convert(const boost::shared_ptr<const RandomTree<PixelInstance,
                 % tree->getTreeId() % offset % m_numNodes).str());
     }
 
-    // could be limited to the leaf-node case
-    const cuv::ndarray<double, cuv::host_memory_space>& histogram = tree->getNormalizedHistogram();
-    assert(histogram.ndim() == 1);
-    assert(histogram.shape(0) == m_numLabels);
-    for (size_t label = 0; label < histogram.shape(0); label++) {
-        setHistogramValue(offset, label, static_cast<float>(histogram(label)));
-    }
-
     if (tree->isLeaf()) {
-        setLeftNodeOffset(offset, -1);
+        const size_t leaf = m_numLeaves++;
+        const cuv::ndarray<double, cuv::host_memory_space>& histogram = tree->getNormalizedHistogram();
+        assert(histogram.ndim() == 1);
+        assert(histogram.shape(0) == m_numLabels);
+        for (size_t label = 0; label < histogram.shape(0); label++) {
+            setHistogramValue(leaf, label, static_cast<float>(histogram(label)));
+        }
+
+        setLeftNodeOffset(offset, -static_cast<int>(leaf) - 1);
         setThreshold(offset, std::numeric_limits<float>::quiet_NaN());
         return;
     }
@@ -542,6 +785,80 @@ DeviceCache::~DeviceCache() {
     assert(elementTimes.empty());
     assert(elementIdMap.empty());
     assert(currentTime == 0);
+    assert(!transferPending);
+    assert(!prefetchPending);
+
+    cudaEvent_t events[] = { transferStart, transferStop, prefetchReady, prefetchStart, prefetchStop };
+    for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+        if (events[i] != NULL) {
+            cudaEventDestroy(events[i]);
+        }
+    }
+}
+
+size_t DeviceCache::getTotalTransferTimeMircoseconds() const {
+    finishTransfer();
+    return totalTransferTimeMicroseconds;
+}
+
+size_t DeviceCache::getThreadTransferTimeMicroseconds() const {
+    finishTransfer();
+    tbb::mutex::scoped_lock lock(transferMutex);
+    std::map<tbb::tbb_thread::id, size_t>::const_iterator it = threadTransferTimeMicroseconds.find(
+            tbb::this_tbb_thread::get_id());
+    return (it == threadTransferTimeMicroseconds.end()) ? 0 : it->second;
+}
+
+size_t DeviceCache::getNumHits() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+    return numHits;
+}
+
+size_t DeviceCache::getNumMisses() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+    return numMisses;
+}
+
+size_t DeviceCache::getNumEvictions() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+    return numEvictions;
+}
+
+size_t DeviceCache::getNumPrefetches() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+    return numPrefetches;
+}
+
+size_t DeviceCache::getTotalBytesTransferred() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+    return totalBytesTransferred;
+}
+
+void DeviceCache::finishTransfer() const {
+    tbb::mutex::scoped_lock lock(transferMutex);
+
+    if (transferPending) {
+        cudaSafeCall(cudaEventSynchronize(transferStop));
+
+        float elapsedMilliseconds = 0.0;
+        cudaSafeCall(cudaEventElapsedTime(&elapsedMilliseconds, transferStart, transferStop));
+        totalTransferTimeMicroseconds += static_cast<size_t>(elapsedMilliseconds * 1000);
+        threadTransferTimeMicroseconds[transferThread] += static_cast<size_t>(elapsedMilliseconds * 1000);
+
+        transferPending = false;
+    }
+
+    if (prefetchPending) {
+        // kernels may read the prefetched elements after this point
+        cudaSafeCall(cudaEventSynchronize(prefetchStop));
+
+        float elapsedMilliseconds = 0.0;
+        cudaSafeCall(cudaEventElapsedTime(&elapsedMilliseconds, prefetchStart, prefetchStop));
+        totalTransferTimeMicroseconds += static_cast<size_t>(elapsedMilliseconds * 1000);
+        threadTransferTimeMicroseconds[prefetchThread] += static_cast<size_t>(elapsedMilliseconds * 1000);
+
+        prefetchPending = false;
+    }
 }
 
 bool DeviceCache::containsElement(const void* element) const {
@@ -559,6 +876,9 @@ size_t DeviceCache::getElementPos(const void* element) const {
 }
 
 void DeviceCache::clear() {
+    // the arrays must not be freed while a transfer is still running
+    finishTransfer();
+
     if (bound) {
         unbind();
     }
@@ -570,6 +890,127 @@ void DeviceCache::clear() {
     currentTime = 0;
 }
 
+void DeviceCache::removeElement(const void* element) {
+
+    for (size_t i = 0; i < schedule.size(); i++) {
+        schedule[i].erase(element);
+    }
+
+    std::map<const void*, size_t>::iterator it = elementIdMap.find(element);
+    if (it == elementIdMap.end()) {
+        return;
+    }
+
+    // a running transfer might still read the element
+    finishTransfer();
+
+    CURFIL_DEBUG("removing " << getElementName(element) << " at pos " << it->second);
+    elementTimes.erase(it->second);
+    elementIdMap.erase(it);
+}
+
+void DeviceCache::setSchedule(const std::vector<std::set<const void*> >& schedule) {
+    this->schedule.clear();
+    for (size_t i = 0; i < schedule.size(); i++) {
+        if (!schedule[i].empty()) {
+            this->schedule.push_back(schedule[i]);
+        }
+    }
+    CURFIL_DEBUG("schedule of " << this->schedule.size() << " requests of " << getElementsName());
+}
+
+void DeviceCache::consumeSchedule(const std::set<const void*>& elements) {
+
+    std::set<const void*>::const_iterator it;
+    for (it = elements.begin(); it != elements.end(); it++) {
+        for (size_t i = 0; i < schedule.size(); i++) {
+            if (schedule[i].erase(*it) > 0) {
+                break;
+            }
+        }
+    }
+
+    std::vector<std::set<const void*> >::iterator entry = schedule.begin();
+    while (entry != schedule.end()) {
+        if (entry->empty()) {
+            entry = schedule.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+}
+
+std::map<const void*, size_t> DeviceCache::getNextUses() const {
+    std::map<const void*, size_t> nextUses;
+    for (size_t i = 0; i < schedule.size(); i++) {
+        std::set<const void*>::const_iterator it;
+        for (it = schedule[i].begin(); it != schedule[i].end(); it++) {
+            // does not overwrite an earlier use
+            nextUses.insert(std::make_pair(*it, i));
+        }
+    }
+    return nextUses;
+}
+
+bool DeviceCache::findReplacement(const std::set<const void*>& keep,
+        const std::map<const void*, size_t>& nextUses, size_t& elementPos, size_t& nextUse) const {
+
+    if (elementIdMap.size() < cacheSize) {
+        // the first free position. removeElement() leaves gaps
+        elementPos = 0;
+        std::map<size_t, size_t>::const_iterator time;
+        for (time = elementTimes.begin(); time != elementTimes.end() && time->first == elementPos; time++) {
+            elementPos++;
+        }
+        nextUse = std::numeric_limits<size_t>::max();
+        return true;
+    }
+
+    // the element that is used last in the schedule. the least recently used one if there are several
+    bool found = false;
+    size_t oldestTime = 0;
+    std::map<const void*, size_t>::const_iterator it;
+    for (it = elementIdMap.begin(); it != elementIdMap.end(); it++) {
+        if (keep.find(it->first) != keep.end()) {
+            continue;
+        }
+
+        std::map<const void*, size_t>::const_iterator use = nextUses.find(it->first);
+        const size_t elementNextUse = (use == nextUses.end()) ? std::numeric_limits<size_t>::max() : use->second;
+        const size_t elementTime = elementTimes.find(it->second)->second;
+
+        if (!found || elementNextUse > nextUse || (elementNextUse == nextUse && elementTime < oldestTime)) {
+            found = true;
+            elementPos = it->second;
+            nextUse = elementNextUse;
+            oldestTime = elementTime;
+        }
+    }
+
+    return found;
+}
+
+bool DeviceCache::replaceElement(size_t elementPos, const void* element) {
+
+    bool evicted = false;
+
+    std::map<const void*, size_t>::iterator it;
+    for (it = elementIdMap.begin(); it != elementIdMap.end(); it++) {
+        if (it->second == elementPos) {
+            CURFIL_DEBUG("removing " << getElementName(it->first) << " at pos " << elementPos
+                    << " (time: " << elementTimes[elementPos] << ", current: " << currentTime << ")");
+            elementIdMap.erase(it);
+            evicted = true;
+            break;
+        }
+    }
+
+    elementIdMap[element] = elementPos;
+    elementTimes[elementPos] = currentTime;
+
+    return evicted;
+}
+
 void DeviceCache::copyElements(size_t cacheSize, const std::set<const void*>& elements) {
 
     if (elements.empty())
@@ -588,23 +1029,37 @@ void DeviceCache::copyElements(size_t cacheSize, const std::set<const void*>& el
 
     currentTime++;
 
+    size_t numHits = 0;
     size_t numTransferred = 0;
+    size_t numEvicted = 0;
+    size_t bytesTransferred = 0;
+
+    finishTransfer();
+
+    if (transferStart == NULL) {
+        cudaSafeCall(cudaEventCreate(&transferStart));
+        cudaSafeCall(cudaEventCreate(&transferStop));
+    }
 
-    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::local_time();
+    consumeSchedule(elements);
+    const std::map<const void*, size_t> nextUses = getNextUses();
 
+    // elements that are already there must not be replaced by the other requested elements
     std::set<const void*>::const_iterator it;
     for (it = elements.begin(); it != elements.end(); it++) {
+        std::map<const void*, size_t>::const_iterator pos = elementIdMap.find(*it);
+        if (pos != elementIdMap.end()) {
+            elementTimes[pos->second] = currentTime;
+            numHits++;
+            CURFIL_DEBUG(getElementName(*it) << " already in device cache");
+        }
+    }
 
-        const void* element = *it;
+    for (it = elements.begin(); it != elements.end(); it++) {
 
-        size_t elementPos = 0;
+        const void* element = *it;
 
-        // check if image is already there
         if (elementIdMap.find(element) != elementIdMap.end()) {
-            elementPos = elementIdMap[element];
-            // update LRU vector time
-            elementTimes[elementPos] = currentTime;
-            CURFIL_DEBUG(getElementName(element) << " already in device cache");
             continue;
         }
 
@@ -612,40 +1067,16 @@ void DeviceCache::copyElements(size_t cacheSize, const std::set<const void*>& el
 
         CURFIL_DEBUG(getElementName(element) << " not yet on device. transferring");
 
-        if (elementIdMap.size() < cacheSize) {
-            elementPos = elementIdMap.size();
-        } else {
-
-            // find least recently used element
-            size_t oldestTime = currentTime;
-            std::map<size_t, size_t>::const_iterator it;
-            for (it = elementTimes.begin(); it != elementTimes.end(); it++) {
-                if (it->second < oldestTime) {
-                    oldestTime = it->second;
-                    elementPos = it->first;
-                }
-            }
-
-            assert(oldestTime < currentTime);
-
-            CURFIL_DEBUG("replacing " << getElementName(element)
-                    << " (time: " << oldestTime << ", current: " << currentTime << ")");
-
-            {
-                std::map<const void*, size_t>::iterator it;
-                for (it = elementIdMap.begin(); it != elementIdMap.end(); it++) {
-                    if (it->second == elementPos) {
-                        CURFIL_DEBUG("removing " << getElementName(it->first) << " at pos " << elementPos);
-                        elementIdMap.erase(it);
-                        break;
-                    }
-                }
-            }
-
+        size_t elementPos = 0;
+        size_t nextUse = 0;
+        if (!findReplacement(elements, nextUses, elementPos, nextUse)) {
+            // cannot happen: there are at most cacheSize requested elements
+            throw std::runtime_error("no position left for " + getElementName(element));
         }
 
-        elementIdMap[element] = elementPos;
-        elementTimes[elementPos] = currentTime;
+        if (replaceElement(elementPos, element)) {
+            numEvicted++;
+        }
 
         CURFIL_DEBUG("transfer " << getElementName(element) << " to pos " << elementPos);
 
@@ -653,7 +1084,11 @@ void DeviceCache::copyElements(size_t cacheSize, const std::set<const void*>& el
             unbind();
         }
 
-        transferElement(elementPos, element, streams[0]);
+        if (numTransferred == 0) {
+            cudaSafeCall(cudaEventRecord(transferStart, stream));
+        }
+
+        bytesTransferred += transferElement(elementPos, element, stream);
         numTransferred++;
     }
 
@@ -661,57 +1096,480 @@ void DeviceCache::copyElements(size_t cacheSize, const std::set<const void*>& el
         CURFIL_DEBUG("transferred " << numTransferred << "/" << elements.size() << " "
                 << getElementsName() << " from host to device");
 
-        cudaSafeCall(cudaStreamSynchronize(streams[0]));
-        const boost::posix_time::ptime stop = boost::posix_time::microsec_clock::local_time();
-        totalTransferTimeMicroseconds += (stop - start).total_microseconds();
+        // no synchronization here: kernels that read the cache must be launched on the same stream
+        cudaSafeCall(cudaEventRecord(transferStop, stream));
     }
 
-    if (!bound) {
-        bind();
+    {
+        tbb::mutex::scoped_lock lock(transferMutex);
+        transferPending = (numTransferred > 0);
+        transferThread = tbb::this_tbb_thread::get_id();
+        this->numHits += numHits;
+        this->numMisses += numTransferred;
+        this->numEvictions += numEvicted;
+        this->totalBytesTransferred += bytesTransferred;
     }
-}
 
-void DeviceCache::updateCacheSize(size_t cacheSize) {
-    if (cacheSize != this->cacheSize) {
-        clear();
-        this->cacheSize = cacheSize;
+    if (prefetchStream != NULL && !schedule.empty()) {
+        prefetchElements(elements, nextUses);
     }
-}
 
-ImageCache::~ImageCache() {
-    CURFIL_DEBUG("destroying image cache " << this);
-    clear();
+    if (!bound) {
+        bind();
+    }
 }
 
-void ImageCache::freeArray() {
+void DeviceCache::prefetchElements(const std::set<const void*>& elements,
+        const std::map<const void*, size_t>& nextUses) {
 
-    assert(!isBound());
+    // the requested elements are read by the kernels that follow. prefetched elements must not replace them
+    std::set<const void*> keep = elements;
 
-    if (colorTextureData != NULL) {
-        cudaFreeArray(colorTextureData);
-        colorTextureData = NULL;
-    }
+    size_t numPrefetched = 0;
+    size_t numEvicted = 0;
+    size_t bytesTransferred = 0;
 
-    if (depthTextureData != NULL) {
-        cudaFreeArray(depthTextureData);
-        depthTextureData = NULL;
-    }
-}
+    bool cacheFull = false;
+    for (size_t entry = 0; entry < schedule.size() && !cacheFull; entry++) {
+        std::set<const void*>::const_iterator it;
+        for (it = schedule[entry].begin(); it != schedule[entry].end() && !cacheFull; it++) {
 
-void ImageCache::allocArray() {
+            const void* element = *it;
 
-    assert(!isBound());
+            if (elementIdMap.find(element) != elementIdMap.end()) {
+                keep.insert(element);
+                continue;
+            }
 
-    unsigned int flags = cudaArrayLayered;
+            size_t elementPos = 0;
+            size_t victimNextUse = 0;
+            if (!findReplacement(keep, nextUses, elementPos, victimNextUse) || victimNextUse <= entry) {
+                // Belady: only replace elements that are needed later than the prefetched one
+                cacheFull = true;
+                continue;
+            }
 
-    assert(colorTextureData == NULL);
-    assert(depthTextureData == NULL);
+            if (replaceElement(elementPos, element)) {
+                numEvicted++;
+            }
+            keep.insert(element);
 
-    assert(this->width > 0);
-    assert(this->height > 0);
-    assert(getCacheSize() > 0);
+            if (bound) {
+                unbind();
+            }
 
-    {
+            if (numPrefetched == 0) {
+                if (prefetchReady == NULL) {
+                    cudaSafeCall(cudaEventCreate(&prefetchReady));
+                    cudaSafeCall(cudaEventCreate(&prefetchStart));
+                    cudaSafeCall(cudaEventCreate(&prefetchStop));
+                }
+
+                // kernels of earlier requests might still read the replaced elements
+                cudaSafeCall(cudaEventRecord(prefetchReady, stream));
+                cudaSafeCall(cudaStreamWaitEvent(prefetchStream, prefetchReady, 0));
+                cudaSafeCall(cudaEventRecord(prefetchStart, prefetchStream));
+            }
+
+            CURFIL_DEBUG("prefetch " << getElementName(element) << " to pos " << elementPos);
+
+            bytesTransferred += transferElement(elementPos, element, prefetchStream);
+            numPrefetched++;
+        }
+    }
+
+    if (numPrefetched == 0) {
+        return;
+    }
+
+    CURFIL_DEBUG("prefetching " << numPrefetched << " " << getElementsName());
+
+    // finishTransfer() waits for the prefetch before the next request is served
+    cudaSafeCall(cudaEventRecord(prefetchStop, prefetchStream));
+
+    tbb::mutex::scoped_lock lock(transferMutex);
+    prefetchPending = true;
+    prefetchThread = tbb::this_tbb_thread::get_id();
+    this->numPrefetches += numPrefetched;
+    this->numEvictions += numEvicted;
+    this->totalBytesTransferred += bytesTransferred;
+}
+
+CacheStatistics::CacheStatistics(const DeviceCache& cache) :
+        hits(cache.getNumHits()), misses(cache.getNumMisses()), evictions(cache.getNumEvictions()),
+                prefetches(cache.getNumPrefetches()), bytesTransferred(cache.getTotalBytesTransferred()) {
+}
+
+CacheStatistics CacheStatistics::operator-(const CacheStatistics& other) const {
+    return CacheStatistics(hits - other.hits, misses - other.misses, evictions - other.evictions,
+            prefetches - other.prefetches, bytesTransferred - other.bytesTransferred);
+}
+
+std::ostream& operator<<(std::ostream& os, const CacheStatistics& statistics) {
+    os << statistics.hits << " hits, " << statistics.misses << " misses, " << statistics.evictions << " evictions, "
+            << statistics.prefetches << " prefetches, "
+            << (boost::format("%.2f MB transferred") % (statistics.bytesTransferred / (1024.0 * 1024.0))).str();
+    return os;
+}
+
+void DeviceCache::updateCacheSize(size_t cacheSize) {
+    if (cacheSize != this->cacheSize) {
+        clear();
+        this->cacheSize = cacheSize;
+    }
+}
+
+// compact image format: the color channels in half precision followed by (depth << 1 | depthValid) per pixel
+static const int compactChannels = colorChannels + 1;
+
+// largest depth value in millimeter that fits into the compact format
+static const int MAX_COMPACT_DEPTH = (1 << 15) - 1;
+
+// largest finite value in half precision
+static const double MAX_COMPACT_COLOR = 65504.0;
+
+// the compact format stores the bits of the half precision values
+__device__
+static uint16_t toCompactColor(float value) {
+    return __half_as_ushort(__float2half_rn(value));
+}
+
+__device__
+static float fromCompactColor(uint16_t value) {
+    return __half2float(__ushort_as_half(value));
+}
+
+__global__
+void compactImageKernel(const float* colorIntegral, const int* depthIntegral, int width, int height,
+        uint16_t* compact) {
+
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int y = blockIdx.y;
+
+    if (x >= width) {
+        return;
+    }
+
+    const size_t pixels = width * height;
+    const size_t i = y * width + x;
+
+    for (int c = 0; c < colorChannels; c++) {
+        const float* channel = colorIntegral + c * pixels;
+        double value = channel[i];
+        if (x > 0)
+            value -= channel[i - 1];
+        if (y > 0)
+            value -= channel[i - width];
+        if (x > 0 && y > 0)
+            value += channel[i - width - 1];
+        compact[c * pixels + i] = toCompactColor(static_cast<float>(value));
+    }
+
+    int values[depthChannels];
+    for (int c = 0; c < depthChannels; c++) {
+        const int* channel = depthIntegral + c * pixels;
+        int value = channel[i];
+        if (x > 0)
+            value -= channel[i - 1];
+        if (y > 0)
+            value -= channel[i - width];
+        if (x > 0 && y > 0)
+            value += channel[i - width - 1];
+        values[c] = value;
+    }
+
+    compact[colorChannels * pixels + i] = (values[depthChannel] << 1) | values[depthValidChannel];
+}
+
+// first pass of the integration: one thread per row and channel
+__global__
+void integrateCompactImageRowsKernel(const uint16_t* compact, int width, int height,
+        double* colorRows, int* depthIntegral) {
+
+    const int y = blockIdx.x * blockDim.x + threadIdx.x;
+    const int channel = blockIdx.y;
+
+    if (y >= height) {
+        return;
+    }
+
+    const size_t pixels = width * height;
+    const uint16_t* row = compact + channel * pixels + y * width;
+
+    if (channel < colorChannels) {
+        double* colorRow = colorRows + channel * pixels + y * width;
+        double sum = 0.0;
+        for (int x = 0; x < width; x++) {
+            sum += fromCompactColor(row[x]);
+            colorRow[x] = sum;
+        }
+    } else {
+        int* depthRow = depthIntegral + depthChannel * pixels + y * width;
+        int* depthValidRow = depthIntegral + depthValidChannel * pixels + y * width;
+        int depthSum = 0;
+        int depthValidSum = 0;
+        for (int x = 0; x < width; x++) {
+            depthSum += row[x] >> 1;
+            depthValidSum += row[x] & 1;
+            depthRow[x] = depthSum;
+            depthValidRow[x] = depthValidSum;
+        }
+    }
+}
+
+// second pass of the integration: one thread per column and channel
+__global__
+void integrateCompactImageColumnsKernel(const double* colorRows, int width, int height,
+        float* colorIntegral, int* depthIntegral) {
+
+    const int x = blockIdx.x * blockDim.x + threadIdx.x;
+    const int channel = blockIdx.y;
+
+    if (x >= width) {
+        return;
+    }
+
+    const size_t pixels = width * height;
+
+    if (channel < colorChannels) {
+        double sum = 0.0;
+        for (int y = 0; y < height; y++) {
+            const size_t i = channel * pixels + y * width + x;
+            sum += colorRows[i];
+            colorIntegral[i] = static_cast<float>(sum);
+        }
+    } else {
+        int* data = depthIntegral + (channel - colorChannels) * pixels;
+        int sum = 0;
+        for (int y = 0; y < height; y++) {
+            sum += data[y * width + x];
+            data[y * width + x] = sum;
+        }
+    }
+}
+
+ImageCache::~ImageCache() {
+    CURFIL_DEBUG("destroying image cache " << this);
+    clear();
+}
+
+void ImageCache::freeArray() {
+
+    assert(!isBound());
+
+    if (colorTextureData != NULL) {
+        cudaFreeArray(colorTextureData);
+        colorTextureData = NULL;
+    }
+
+    if (depthTextureData != NULL) {
+        cudaFreeArray(depthTextureData);
+        depthTextureData = NULL;
+    }
+
+    arrayMemory.reset();
+
+    freeCompactImages();
+}
+
+void ImageCache::freeCompactImages() {
+
+    if (compactData != NULL) {
+        cudaFree(compactData);
+        compactData = NULL;
+    }
+
+    std::map<cudaStream_t, StagingBuffers>::const_iterator it;
+    for (it = stagingBuffers.begin(); it != stagingBuffers.end(); it++) {
+        cudaFree(it->second.color);
+        cudaFree(it->second.depth);
+        cudaFree(it->second.colorRows);
+    }
+
+    stagingBuffers.clear();
+    compactIdMap.clear();
+    compactTimes.clear();
+    compactableImages.clear();
+    compactTime = 0;
+}
+
+size_t ImageCache::getCompactImageSize(int width, int height) {
+    return static_cast<size_t>(width) * height * compactChannels * sizeof(uint16_t);
+}
+
+void ImageCache::restoreCompactImage(const RGBDImage& image, cuv::ndarray<float, cuv::host_memory_space>& color,
+        cuv::ndarray<int, cuv::host_memory_space>& depth) {
+
+    const int width = image.getWidth();
+    const int height = image.getHeight();
+    const size_t pixels = static_cast<size_t>(width) * height;
+
+    cuv::ndarray<float, cuv::dev_memory_space> colorIntegral(image.getColorImage());
+    cuv::ndarray<int, cuv::dev_memory_space> depthIntegral(image.getDepthImage());
+    cuv::ndarray<uint16_t, cuv::dev_memory_space> compact(compactChannels * pixels);
+    cuv::ndarray<double, cuv::dev_memory_space> colorRows(colorChannels * pixels);
+
+    const int threads = 128;
+    compactImageKernel<<<dim3(ceil(width / static_cast<float>(threads)), height), threads>>>(
+            colorIntegral.ptr(), depthIntegral.ptr(), width, height, compact.ptr());
+    integrateCompactImageRowsKernel<<<dim3(ceil(height / static_cast<float>(threads)), compactChannels),
+    threads>>>(compact.ptr(), width, height, colorRows.ptr(), depthIntegral.ptr());
+    integrateCompactImageColumnsKernel<<<dim3(ceil(width / static_cast<float>(threads)),
+    colorChannels + depthChannels), threads>>>(colorRows.ptr(), width, height, colorIntegral.ptr(),
+            depthIntegral.ptr());
+    cudaSafeCall(cudaDeviceSynchronize());
+
+    color = colorIntegral;
+    depth = depthIntegral;
+}
+
+void ImageCache::setCompactCacheSize(size_t compactCacheSize) {
+    if (compactCacheSize != this->compactCacheSize) {
+        // the positions in the compact store are invalid
+        clear();
+        this->compactCacheSize = compactCacheSize;
+    }
+}
+
+const ImageCache::StagingBuffers& ImageCache::getStagingBuffers(cudaStream_t stream) {
+
+    std::map<cudaStream_t, StagingBuffers>::const_iterator it = stagingBuffers.find(stream);
+    if (it != stagingBuffers.end()) {
+        return it->second;
+    }
+
+    const size_t pixels = static_cast<size_t>(width) * height;
+
+    StagingBuffers buffers;
+    cudaSafeCall(cudaMalloc(&buffers.color, colorChannels * pixels * sizeof(float)));
+    cudaSafeCall(cudaMalloc(&buffers.depth, depthChannels * pixels * sizeof(int)));
+    cudaSafeCall(cudaMalloc(&buffers.colorRows, colorChannels * pixels * sizeof(double)));
+
+    return (stagingBuffers[stream] = buffers);
+}
+
+bool ImageCache::isCompactable(const RGBDImage* image) {
+
+    std::map<const RGBDImage*, bool>::const_iterator it = compactableImages.find(image);
+    if (it != compactableImages.end()) {
+        return it->second;
+    }
+
+    utils::Profile profile("isCompactable");
+
+    const size_t pixels = static_cast<size_t>(width) * height;
+    const float* color = image->getColorImage().ptr();
+    const int* depth = image->getDepthImage().ptr();
+
+    bool compactable = true;
+    for (int y = 0; y < height && compactable; y++) {
+        for (int x = 0; x < width && compactable; x++) {
+            const size_t i = y * width + x;
+
+            for (int c = 0; c < colorChannels; c++) {
+                const float* channel = color + c * pixels;
+                double value = channel[i];
+                if (x > 0)
+                    value -= channel[i - 1];
+                if (y > 0)
+                    value -= channel[i - width];
+                if (x > 0 && y > 0)
+                    value += channel[i - width - 1];
+                if (!(fabs(value) <= MAX_COMPACT_COLOR)) {
+                    compactable = false;
+                }
+            }
+
+            int values[depthChannels];
+            for (int c = 0; c < depthChannels; c++) {
+                const int* channel = depth + c * pixels;
+                int value = channel[i];
+                if (x > 0)
+                    value -= channel[i - 1];
+                if (y > 0)
+                    value -= channel[i - width];
+                if (x > 0 && y > 0)
+                    value += channel[i - width - 1];
+                values[c] = value;
+            }
+
+            if (values[depthChannel] < 0 || values[depthChannel] > MAX_COMPACT_DEPTH
+                    || values[depthValidChannel] < 0 || values[depthValidChannel] > 1) {
+                compactable = false;
+            }
+        }
+    }
+
+    if (!compactable) {
+        CURFIL_DEBUG(getElementName(image) << " does not fit into the compact format");
+    }
+
+    compactableImages[image] = compactable;
+    return compactable;
+}
+
+void ImageCache::removeImage(const RGBDImage* image) {
+    removeElement(image);
+
+    std::map<const RGBDImage*, size_t>::iterator it = compactIdMap.find(image);
+    if (it != compactIdMap.end()) {
+        compactTimes.erase(it->second);
+        compactIdMap.erase(it);
+    }
+    compactableImages.erase(image);
+}
+
+size_t ImageCache::allocateCompactImage(const RGBDImage* image) {
+
+    assert(compactIdMap.find(image) == compactIdMap.end());
+
+    // the first free position. removeImage() leaves gaps
+    size_t compactPos = 0;
+    std::map<size_t, size_t>::const_iterator time;
+    for (time = compactTimes.begin(); time != compactTimes.end() && time->first == compactPos; time++) {
+        compactPos++;
+    }
+
+    if (compactIdMap.size() == compactCacheSize) {
+        size_t oldestTime = std::numeric_limits<size_t>::max();
+        std::map<size_t, size_t>::const_iterator it;
+        for (it = compactTimes.begin(); it != compactTimes.end(); it++) {
+            if (it->second < oldestTime) {
+                oldestTime = it->second;
+                compactPos = it->first;
+            }
+        }
+
+        std::map<const RGBDImage*, size_t>::iterator element;
+        for (element = compactIdMap.begin(); element != compactIdMap.end(); element++) {
+            if (element->second == compactPos) {
+                compactIdMap.erase(element);
+                break;
+            }
+        }
+    }
+
+    assert(compactPos < compactCacheSize);
+
+    compactIdMap[image] = compactPos;
+    compactTimes[compactPos] = ++compactTime;
+    return compactPos;
+}
+
+void ImageCache::allocArray() {
+
+    assert(!isBound());
+
+    unsigned int flags = cudaArrayLayered;
+
+    assert(colorTextureData == NULL);
+    assert(depthTextureData == NULL);
+
+    assert(this->width > 0);
+    assert(this->height > 0);
+    assert(getCacheSize() > 0);
+
+    {
         cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
         cudaExtent extent = make_cudaExtent(width, height, colorChannels * getCacheSize());
         cudaSafeCall(cudaMalloc3DArray(&colorTextureData, &channelDesc, extent, flags));
@@ -722,10 +1580,15 @@ void ImageCache::allocArray() {
         cudaExtent extent = make_cudaExtent(width, height, depthChannels * getCacheSize());
         cudaSafeCall(cudaMalloc3DArray(&depthTextureData, &channelDesc, extent, flags));
     }
+
+    arrayMemory.reset(new DeviceMemoryUsage::Scope("imageCache", static_cast<size_t>(width) * height
+            * getCacheSize() * (colorChannels * sizeof(float) + depthChannels * sizeof(int))));
 }
 
 ImageCache::ImageCache() :
-        DeviceCache(), width(0), height(0), colorTextureData(NULL), depthTextureData(NULL) {
+        DeviceCache(), width(0), height(0), colorTextureData(NULL), depthTextureData(NULL),
+                compactCacheSize(0), compactData(NULL), compactIdMap(), compactTimes(), compactTime(0),
+                numCompactHits(0), compactableImages(), stagingBuffers(), arrayMemory() {
 }
 
 void ImageCache::copyImages(size_t cacheSize, const std::vector<const PixelInstance*>& samples) {
@@ -739,6 +1602,14 @@ void ImageCache::copyImages(size_t cacheSize, const std::vector<const PixelInsta
     copyImages(cacheSize, images);
 }
 
+void ImageCache::setSchedule(const std::vector<std::set<const RGBDImage*> >& images) {
+    std::vector<std::set<const void*> > schedule(images.size());
+    for (size_t i = 0; i < images.size(); i++) {
+        schedule[i].insert(images[i].begin(), images[i].end());
+    }
+    DeviceCache::setSchedule(schedule);
+}
+
 void ImageCache::copyImages(size_t cacheSize, const std::set<const RGBDImage*>& images) {
 
     if (images.empty())
@@ -778,41 +1649,104 @@ void ImageCache::copyImages(size_t cacheSize, const std::set<const RGBDImage*>&
     copyElements(cacheSize, elements);
 }
 
-void ImageCache::transferElement(size_t imagePos, const void* imagePtr, cudaStream_t stream) {
-
-    const RGBDImage* image = reinterpret_cast<const RGBDImage*>(imagePtr);
+void ImageCache::copyToArray(size_t imagePos, const float* color, const int* depth, cudaMemcpyKind kind,
+        cudaStream_t stream) {
 
     struct cudaMemcpy3DParms colorCopyParams;
     memset(&colorCopyParams, 0, sizeof(colorCopyParams));
     colorCopyParams.extent = make_cudaExtent(width, height, colorChannels);
-    colorCopyParams.kind = cudaMemcpyHostToDevice;
+    colorCopyParams.kind = kind;
     colorCopyParams.dstArray = colorTextureData;
 
     struct cudaMemcpy3DParms depthCopyParams;
     memset(&depthCopyParams, 0, sizeof(depthCopyParams));
     depthCopyParams.extent = make_cudaExtent(width, height, depthChannels);
-    depthCopyParams.kind = cudaMemcpyHostToDevice;
+    depthCopyParams.kind = kind;
     depthCopyParams.dstArray = depthTextureData;
 
+    colorCopyParams.dstPos = make_cudaPos(0, 0, colorChannels * imagePos);
+    colorCopyParams.srcPtr = make_cudaPitchedPtr(const_cast<void*>(reinterpret_cast<const void*>(color)),
+            sizeof(float) * width, width, height);
+    cudaSafeCall(cudaMemcpy3DAsync(&colorCopyParams, stream));
+
+    depthCopyParams.dstPos = make_cudaPos(0, 0, depthChannels * imagePos);
+    depthCopyParams.srcPtr = make_cudaPitchedPtr(const_cast<void*>(reinterpret_cast<const void*>(depth)),
+            sizeof(int) * width, width, height);
+    cudaSafeCall(cudaMemcpy3DAsync(&depthCopyParams, stream));
+}
+
+size_t ImageCache::transferElement(size_t imagePos, const void* imagePtr, cudaStream_t stream) {
+
+    const RGBDImage* image = reinterpret_cast<const RGBDImage*>(imagePtr);
+
     assert(image->getColorImage().ndim() == 3);
     assert(image->getColorImage().shape(0) == static_cast<unsigned int>(colorChannels));
     assert(image->getColorImage().shape(1) == static_cast<unsigned int>(height));
     assert(image->getColorImage().shape(2) == static_cast<unsigned int>(width));
-    colorCopyParams.dstPos = make_cudaPos(0, 0, colorChannels * imagePos);
-    colorCopyParams.srcPtr = make_cudaPitchedPtr(
-            const_cast<void*>(reinterpret_cast<const void*>(image->getColorImage().ptr())),
-            sizeof(float) * width, width, height);
-    cudaSafeCall(cudaMemcpy3DAsync(&colorCopyParams, stream));
 
     assert(image->getDepthImage().ndim() == 3);
     assert(image->getDepthImage().shape(0) == static_cast<unsigned int>(depthChannels));
     assert(image->getDepthImage().shape(1) == static_cast<unsigned int>(height));
     assert(image->getDepthImage().shape(2) == static_cast<unsigned int>(width));
-    depthCopyParams.dstPos = make_cudaPos(0, 0, depthChannels * imagePos);
-    depthCopyParams.srcPtr = make_cudaPitchedPtr(
-            const_cast<void*>(reinterpret_cast<const void*>(image->getDepthImage().ptr())),
-            sizeof(int) * width, width, height);
-    cudaSafeCall(cudaMemcpy3DAsync(&depthCopyParams, stream));
+
+    const size_t pixels = static_cast<size_t>(width) * height;
+    const size_t colorSize = colorChannels * pixels * sizeof(float);
+    const size_t depthSize = depthChannels * pixels * sizeof(int);
+
+    if (compactCacheSize == 0) {
+        trace::GpuSpan span("transfer image", stream, trace::TRANSFER);
+        copyToArray(imagePos, image->getColorImage().ptr(), image->getDepthImage().ptr(),
+                cudaMemcpyHostToDevice, stream);
+        return colorSize + depthSize;
+    }
+
+    const StagingBuffers& staging = getStagingBuffers(stream);
+
+    std::map<const RGBDImage*, size_t>::const_iterator it = compactIdMap.find(image);
+    if (it != compactIdMap.end()) {
+        CURFIL_DEBUG("integrating " << getElementName(image) << " from compact pos " << it->second);
+
+        trace::GpuSpan span("integrate compact image", stream);
+
+        compactTimes[it->second] = ++compactTime;
+        const uint16_t* compact = compactData + it->second * compactChannels * pixels;
+
+        const int threads = 128;
+        integrateCompactImageRowsKernel<<<dim3(ceil(height / static_cast<float>(threads)), compactChannels),
+        threads, 0, stream>>>(compact, width, height, staging.colorRows, staging.depth);
+        integrateCompactImageColumnsKernel<<<dim3(ceil(width / static_cast<float>(threads)),
+        colorChannels + depthChannels), threads, 0, stream>>>(staging.colorRows, width, height,
+                staging.color, staging.depth);
+
+        copyToArray(imagePos, staging.color, staging.depth, cudaMemcpyDeviceToDevice, stream);
+
+        numCompactHits++;
+        return 0;
+    }
+
+    trace::GpuSpan span("transfer image", stream, trace::TRANSFER);
+    cudaSafeCall(cudaMemcpyAsync(staging.color, image->getColorImage().ptr(), colorSize,
+            cudaMemcpyHostToDevice, stream));
+    cudaSafeCall(cudaMemcpyAsync(staging.depth, image->getDepthImage().ptr(), depthSize,
+            cudaMemcpyHostToDevice, stream));
+
+    copyToArray(imagePos, staging.color, staging.depth, cudaMemcpyDeviceToDevice, stream);
+    span.stop();
+
+    if (isCompactable(image)) {
+        if (compactData == NULL) {
+            cudaSafeCall(cudaMalloc(&compactData, compactCacheSize * getCompactImageSize(width, height)));
+        }
+
+        const size_t compactPos = allocateCompactImage(image);
+        CURFIL_DEBUG("keeping " << getElementName(image) << " at compact pos " << compactPos);
+
+        const int threads = 128;
+        compactImageKernel<<<dim3(ceil(width / static_cast<float>(threads)), height), threads, 0, stream>>>(
+                staging.color, staging.depth, width, height, compactData + compactPos * compactChannels * pixels);
+    }
+
+    return colorSize + depthSize;
 }
 
 std::string ImageCache::getElementName(const void* imagePtr) const {
@@ -874,6 +1808,13 @@ void TreeCache::freeArray() {
         cudaFreeArray(treeTextureData);
         treeTextureData = NULL;
     }
+
+    if (histogramTextureData != NULL) {
+        cudaFreeArray(histogramTextureData);
+        histogramTextureData = NULL;
+    }
+
+    arrayMemory.reset();
 }
 
 void TreeCache::allocArray() {
@@ -881,25 +1822,37 @@ void TreeCache::allocArray() {
     assert(!isBound());
 
     assert(treeTextureData == NULL);
+    assert(histogramTextureData == NULL);
 
     assert(sizePerNode > 0);
     assert(numLabels > 0);
     assert(getCacheSize() > 0);
 
     CURFIL_INFO("tree cache: allocating " << getCacheSize() << " x " << LAYERS_PER_TREE << " x "
-            << NODES_PER_TREE_LAYER << " x " << sizePerNode << " bytes");
+            << NODES_PER_TREE_LAYER << " x " << sizePerNode << " bytes for nodes and "
+            << getCacheSize() << " x " << LEAF_LAYERS_PER_TREE << " x " << NODES_PER_TREE_LAYER << " x "
+            << numLabels * sizeof(float) << " bytes for leaf histograms");
+
+    cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
 
     {
-        cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(32, 0, 0, 0, cudaChannelFormatKindFloat);
         cudaExtent extent = make_cudaExtent(sizePerNode / sizeof(float), NODES_PER_TREE_LAYER,
                 LAYERS_PER_TREE * getCacheSize());
         cudaSafeCall(cudaMalloc3DArray(&treeTextureData, &channelDesc, extent, cudaArrayLayered));
     }
+
+    {
+        cudaExtent extent = make_cudaExtent(numLabels, NODES_PER_TREE_LAYER, LEAF_LAYERS_PER_TREE * getCacheSize());
+        cudaSafeCall(cudaMalloc3DArray(&histogramTextureData, &channelDesc, extent, cudaArrayLayered));
+    }
+
+    arrayMemory.reset(new DeviceMemoryUsage::Scope("treeCache", getCacheSize() * NODES_PER_TREE_LAYER
+            * (LAYERS_PER_TREE * sizePerNode + LEAF_LAYERS_PER_TREE * numLabels * sizeof(float))));
 }
 
 TreeCache::TreeCache() :
         DeviceCache(), sizePerNode(0), numLabels(0),
-                treeTextureData(NULL) {
+                treeTextureData(NULL), histogramTextureData(NULL), arrayMemory() {
 }
 
 void TreeCache::copyTree(size_t cacheSize, const TreeNodes* tree) {
@@ -944,7 +1897,7 @@ void TreeCache::copyTrees(size_t cacheSize, const std::set<const TreeNodes*>& tr
     copyElements(cacheSize, elements);
 }
 
-void TreeCache::transferElement(size_t elementPos, const void* element, cudaStream_t stream) {
+size_t TreeCache::transferElement(size_t elementPos, const void* element, cudaStream_t stream) {
 
     assert(!isBound());
 
@@ -971,10 +1924,31 @@ void TreeCache::transferElement(size_t elementPos, const void* element, cudaStre
             << " (layer " << elementPos * LAYERS_PER_TREE << ")"
             << " with " << tree->numNodes() << " nodes in " << layers << " layers");
 
-    assert(tree->data().size() == sizePerNode * NODES_PER_TREE_LAYER * LAYERS_PER_TREE);
+    // trees that refer to a forest file only hold the layers with nodes
+    assert(tree->data().size() >= sizePerNode * NODES_PER_TREE_LAYER * layers);
 
     copyParams.srcPtr = make_cudaPitchedPtr(ptr, sizePerNode, sizePerNode / sizeof(float), NODES_PER_TREE_LAYER);
     cudaSafeCall(cudaMemcpy3DAsync(&copyParams, stream));
+
+    // only the layers of the histogram table that hold leaves
+    const size_t leafLayers = tree->histograms().shape(0) / NODES_PER_TREE_LAYER;
+    assert(leafLayers >= 1);
+    assert(leafLayers <= LEAF_LAYERS_PER_TREE);
+    assert(tree->histograms().shape(1) == numLabels);
+
+    struct cudaMemcpy3DParms histogramParams;
+    memset(&histogramParams, 0, sizeof(histogramParams));
+    histogramParams.kind = cudaMemcpyHostToDevice;
+    histogramParams.dstArray = histogramTextureData;
+    histogramParams.dstPos = make_cudaPos(0, 0, elementPos * LEAF_LAYERS_PER_TREE);
+    histogramParams.extent = make_cudaExtent(numLabels, NODES_PER_TREE_LAYER, leafLayers);
+
+    const size_t histogramPitch = numLabels * sizeof(float);
+    void* histogramPtr = const_cast<void*>(reinterpret_cast<const void*>(tree->histograms().ptr()));
+    histogramParams.srcPtr = make_cudaPitchedPtr(histogramPtr, histogramPitch, numLabels, NODES_PER_TREE_LAYER);
+    cudaSafeCall(cudaMemcpy3DAsync(&histogramParams, stream));
+
+    return sizePerNode * NODES_PER_TREE_LAYER * layers + histogramPitch * NODES_PER_TREE_LAYER * leafLayers;
 }
 
 std::string TreeCache::getElementName(const void* element) const {
@@ -996,9 +1970,17 @@ void TreeCache::bind() {
     treeTexture.addressMode[1] = cudaAddressModeClamp;
     treeTexture.addressMode[2] = cudaAddressModeClamp;
 
+    histogramTexture.normalized = false;
+    histogramTexture.filterMode = cudaFilterModePoint;
+    histogramTexture.addressMode[0] = cudaAddressModeClamp;
+    histogramTexture.addressMode[1] = cudaAddressModeClamp;
+    histogramTexture.addressMode[2] = cudaAddressModeClamp;
+
     assert(treeTextureData != NULL);
+    assert(histogramTextureData != NULL);
 
     cudaSafeCall(cudaBindTextureToArray(treeTexture, treeTextureData));
+    cudaSafeCall(cudaBindTextureToArray(histogramTexture, histogramTextureData));
 
     setBound(true);
 }
@@ -1008,6 +1990,7 @@ void TreeCache::unbind() {
     assert(isBound());
 
     cudaUnbindTexture(treeTexture);
+    cudaUnbindTexture(histogramTexture);
 
     setBound(false);
 }
@@ -1038,6 +2021,44 @@ static unsigned int counterOffset(unsigned int label, unsigned int value, unsign
     return index;
 }
 
+// the binned counters of a node: features × (thresholds + 1) × labels.
+// the kernels count the samples per bin. after binPrefixScanKernel, the counter of a feature, a threshold and
+// a label holds the samples of the label that go left of the threshold and bin numThresholds all samples of the label
+__host__ __device__
+static size_t binOffset(unsigned int label, unsigned int bin, unsigned int feature, unsigned int numLabels,
+        unsigned int numThresholds) {
+    assert(label < numLabels);
+    assert(bin <= numThresholds);
+    return (static_cast<size_t>(feature) * (numThresholds + 1) + bin) * numLabels + label;
+}
+
+// features × thresholds × labels × 2, see counterOffset(), or the binned counters, see binOffset()
+__host__ __device__
+static size_t countersPerNode(unsigned int numFeatures, unsigned int numThresholds, unsigned int numLabels,
+        bool binned) {
+    if (binned) {
+        return static_cast<size_t>(numFeatures) * (numThresholds + 1) * numLabels;
+    }
+    return static_cast<size_t>(numFeatures) * numThresholds * numLabels * 2;
+}
+
+// the first of the sorted thresholds that the response does not go right of. NaN goes right of all thresholds
+template<class FeatureResponse>
+__device__
+static unsigned int findBin(const float* thresholds, unsigned int numThresholds, FeatureResponse featureResponse) {
+    unsigned int low = 0;
+    unsigned int high = numThresholds;
+    while (low < high) {
+        const unsigned int middle = (low + high) / 2;
+        if (featureResponse <= thresholds[middle]) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
 __device__
 int getNodeOffset(int node, int tree) {
     return node % NODES_PER_TREE_LAYER;
@@ -1084,8 +2105,9 @@ float getThreshold(int node, int tree) {
 }
 
 __device__
-float getHistogramValue(int label, int node, int tree) {
-    return tex2DLayered(treeTexture, 6 + label, getNodeOffset(node, tree), getLayer(node, tree));
+float getHistogramValue(int label, int leaf, int tree) {
+    return tex2DLayered(histogramTexture, label, leaf % NODES_PER_TREE_LAYER,
+            tree * LEAF_LAYERS_PER_TREE + leaf / NODES_PER_TREE_LAYER);
 }
 
 // for the unit test
@@ -1125,13 +2147,18 @@ __global__ void fetchTreeNodeData(
 
     *threshold = getThreshold(node, tree);
 
+    const int leftNode = getLeftNodeOffset(node, tree);
     for (int label = 0; label < numLabels; label++) {
-        histogram[label] = getHistogramValue(label, node, tree);
+        histogram[label] = (leftNode < 0) ? getHistogramValue(label, -leftNode - 1, tree) : 0.0f;
     }
 }
 
 // for the unit test
 TreeNodeData getTreeNode(const int nodeNr, const boost::shared_ptr<const TreeNodes>& treeData) {
+    DeviceContext& context = DeviceContext::getCurrent();
+    tbb::mutex::scoped_lock lock(context.getTextureMutex());
+
+    TreeCache& treeCache = context.getTreeCache();
     treeCache.copyTree(3, treeData.get());
 
     const size_t nodeOffset = nodeNr - treeData->getTreeId();
@@ -1188,40 +2215,21 @@ TreeNodeData getTreeNode(const int nodeNr, const boost::shared_ptr<const TreeNod
 
 }
 
-__global__ void classifyKernel(
-        float* output, int tree,
-        const int16_t imageWidth, const int16_t imageHeight,
-        const LabelType numLabels) {
+// traverses the tree for the given pixel and returns the index of the leaf in the histogram table
+template<class FeatureResponse>
+__device__
+static int traverseTree(int tree, int imageNr, const int16_t imageWidth, const int16_t imageHeight,
+        const unsigned int x, const unsigned int y, const float depth) {
 
-    const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
-    if (x >= imageWidth) {
-        return;
-    }
-
-    const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
-    if (y >= imageHeight) {
-        return;
-    }
-
-    float depth = averageRegionDepth(0, imageWidth, imageHeight, x, x + 1, y, y + 1);
-
-    // depth might be nan here
-
-    int currentNodeOffset = 0;
-    while (true) {
-        const int16_t leftNodeOffset = getLeftNodeOffset(currentNodeOffset, tree);
-        assert(leftNodeOffset == -1 || leftNodeOffset > 0);
-        if (leftNodeOffset < 0) {
-            assert(isnan(getThreshold(currentNodeOffset, tree)));
-            for (LabelType label = 0; label < numLabels; label++) {
-                float v = getHistogramValue(label, currentNodeOffset, tree);
-                assert(!isnan(v));
-                assert(v >= 0.0);
-                output[label * imageWidth * imageHeight + y * imageWidth + x] += v;
-            }
-            // leaf node
-            return;
-        }
+    int currentNodeOffset = 0;
+    while (true) {
+        const int leftNodeOffset = getLeftNodeOffset(currentNodeOffset, tree);
+        assert(leftNodeOffset != 0);
+        if (leftNodeOffset < 0) {
+            // leaf node
+            assert(isnan(getThreshold(currentNodeOffset, tree)));
+            return -leftNodeOffset - 1;
+        }
 
         char4 param1 = getParam1(currentNodeOffset, tree);
         int8_t offset1X = param1.x;
@@ -1235,11 +2243,11 @@ __global__ void classifyKernel(
         int8_t region2X = param2.z;
         int8_t region2Y = param2.w;
 
-        FeatureResponseType featureResponse;
+        FeatureResponse featureResponse;
         switch (getType(currentNodeOffset, tree)) {
             case COLOR: {
                 ushort2 channels = getChannels(currentNodeOffset, tree);
-                featureResponse = calculateColorFeature(0,
+                featureResponse = calculateColorFeature<FeatureResponse>(imageNr,
                         imageWidth, imageHeight,
                         offset1X, offset1Y,
                         offset2X, offset2Y,
@@ -1250,7 +2258,7 @@ __global__ void classifyKernel(
             }
                 break;
             case DEPTH:
-                featureResponse = calculateDepthFeature(0,
+                featureResponse = calculateDepthFeature<FeatureResponse>(imageNr,
                         imageWidth, imageHeight,
                         offset1X, offset1Y,
                         offset2X, offset2Y,
@@ -1266,7 +2274,145 @@ __global__ void classifyKernel(
 
         currentNodeOffset += leftNodeOffset + value;
     }
+}
+
+template<class FeatureResponse>
+__global__ void classifyKernel(
+        float* output, int tree,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const LabelType numLabels) {
+
+    const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
+    if (x >= imageWidth) {
+        return;
+    }
+
+    const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (y >= imageHeight) {
+        return;
+    }
+
+    float depth = averageRegionDepth<FeatureResponse>(0, imageWidth, imageHeight, x, x + 1, y, y + 1);
+
+    // depth might be nan here
+
+    const int leaf = traverseTree<FeatureResponse>(tree, 0, imageWidth, imageHeight, x, y, depth);
+
+    for (LabelType label = 0; label < numLabels; label++) {
+        float v = getHistogramValue(label, leaf, tree);
+        assert(!isnan(v));
+        assert(v >= 0.0);
+        output[label * imageWidth * imageHeight + y * imageWidth + x] += v;
+    }
+}
+
+// positions of the trees of the forest in the tree cache in the order of the forest
+__constant__ int forestTrees[MAX_FOREST_TREES];
+
+// positions of the images of a batch in the image cache
+__constant__ int batchImages[MAX_BATCH_IMAGES];
+
+// evaluates all trees of the forest for one pixel, normalizes the probabilities and returns the label with the
+// maximal probability. the trees are summed up in the same order as consecutive calls of classifyKernel do.
+// the probability of label l is stored at probabilities[l * stride]
+template<class FeatureResponse>
+__device__
+static LabelType classifyPixel(float* probabilities, const unsigned int stride, int numTrees, int imageNr,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const unsigned int x, const unsigned int y,
+        const LabelType numLabels) {
+
+    float depth = averageRegionDepth<FeatureResponse>(imageNr, imageWidth, imageHeight, x, x + 1, y, y + 1);
+
+    // depth might be nan here
+
+    for (int treeNr = 0; treeNr < numTrees; treeNr++) {
+        const int tree = forestTrees[treeNr];
+        const int leaf = traverseTree<FeatureResponse>(tree, imageNr, imageWidth, imageHeight, x, y, depth);
+
+        for (LabelType label = 0; label < numLabels; label++) {
+            float v = getHistogramValue(label, leaf, tree);
+            assert(!isnan(v));
+            assert(v >= 0.0);
+            if (treeNr == 0) {
+                probabilities[label * stride] = v;
+            } else {
+                probabilities[label * stride] += v;
+            }
+        }
+    }
+
+    float sum = 0.0;
+    for (LabelType label = 0; label < numLabels; label++) {
+        sum += probabilities[label * stride];
+    }
+
+    LabelType maxLabel = 0;
+    float max = 0.0;
+    for (LabelType label = 0; label < numLabels; label++) {
+        float probability = probabilities[label * stride];
+        if (sum != 0) {
+            probability /= sum;
+            probabilities[label * stride] = probability;
+        }
+        if (probability > max) {
+            max = probability;
+            maxLabel = label;
+        }
+    }
+
+    return maxLabel;
+}
+
+// evaluates all trees for one pixel of one image of the batch (blockIdx.z)
+template<class FeatureResponse>
+__global__ void classifyForestKernel(
+        float* output, LabelType* labels, int numTrees,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const LabelType numLabels) {
+
+    const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
+    if (x >= imageWidth) {
+        return;
+    }
+
+    const unsigned int y = blockIdx.y * blockDim.y + threadIdx.y;
+    if (y >= imageHeight) {
+        return;
+    }
 
+    const unsigned int batchImage = blockIdx.z;
+    const int imageNr = batchImages[batchImage];
+
+    // the probabilities of a pixel are only accessed by its own thread
+    const unsigned int numPixels = imageWidth * imageHeight;
+    float* probabilities = output + static_cast<size_t>(batchImage) * numLabels * numPixels + y * imageWidth + x;
+
+    labels[static_cast<size_t>(batchImage) * numPixels + y * imageWidth + x] = classifyPixel<FeatureResponse>(
+            probabilities, numPixels, numTrees, imageNr, imageWidth, imageHeight, x, y, numLabels);
+}
+
+// evaluates all trees for the pixels of a list in the first image of the batch. the probabilities are stored in a
+// C×N matrix for the N pixels of the list
+template<class FeatureResponse>
+__global__ void classifyPixelsKernel(
+        const int* pixelsX, const int* pixelsY, const unsigned int numPixels,
+        float* output, LabelType* labels, int numTrees,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const LabelType numLabels) {
+
+    const unsigned int pixel = blockIdx.x * blockDim.x + threadIdx.x;
+    if (pixel >= numPixels) {
+        return;
+    }
+
+    const unsigned int x = pixelsX[pixel];
+    const unsigned int y = pixelsY[pixel];
+    assert(x < imageWidth);
+    assert(y < imageHeight);
+
+    labels[pixel] = classifyPixel<FeatureResponse>(output + pixel, numPixels, numTrees, batchImages[0],
+            imageWidth, imageHeight, x, y, numLabels);
 }
 
 __global__ void normalizeProbabilitiesKernel(float* probabilities, int numLabels, int width, int height) {
@@ -1292,8 +2438,8 @@ __global__ void normalizeProbabilitiesKernel(float* probabilities, int numLabels
 
 }
 
-__global__ void maxProbabilitiesKernel(const float* probabilities, LabelType* output, int numLabels, int width,
-        int height) {
+__global__ void maxProbabilitiesKernel(const float* probabilities, LabelType* output, float* confidence,
+        int numLabels, int width, int height) {
     const unsigned int x = blockIdx.x * blockDim.x + threadIdx.x;
     if (x >= width) {
         return;
@@ -1312,13 +2458,23 @@ __global__ void maxProbabilitiesKernel(const float* probabilities, LabelType* ou
     }
 
     output[y * width + x] = maxLabel;
+    if (confidence) {
+        confidence[y * width + x] = max;
+    }
+}
+
+__global__ void convertToHalfKernel(const float* input, unsigned short* output, unsigned int size) {
+    const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i < size) {
+        output[i] = __half_as_ushort(__float2half_rn(input[i]));
+    }
 }
 
 void normalizeProbabilities(cuv::ndarray<float, cuv::dev_memory_space>& probabilities) {
 
     utils::Profile profileClassifyImage("normalizeProbabilities");
 
-    cudaStream_t stream = streams[0];
+    cudaStream_t stream = DeviceContext::getCurrent().getStream(0);
 
     const unsigned int numLabels = probabilities.shape(0);
     const unsigned int height = probabilities.shape(1);
@@ -1336,7 +2492,8 @@ void normalizeProbabilities(cuv::ndarray<float, cuv::dev_memory_space>& probabil
 }
 
 void determineMaxProbabilities(const cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
-        cuv::ndarray<LabelType, cuv::dev_memory_space>& output) {
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& output,
+        cuv::ndarray<float, cuv::dev_memory_space>* confidence) {
 
     utils::Profile profileClassifyImage("determineMaxProbabilities");
 
@@ -1347,7 +2504,12 @@ void determineMaxProbabilities(const cuv::ndarray<float, cuv::dev_memory_space>&
     assert(output.shape(0) == height);
     assert(output.shape(1) == width);
 
-    cudaStream_t stream = streams[0];
+    if (confidence) {
+        assert(confidence->shape(0) == height);
+        assert(confidence->shape(1) == width);
+    }
+
+    cudaStream_t stream = DeviceContext::getCurrent().getStream(0);
 
     unsigned int threadsPerBlock = std::min(width, 128u);
     int blocks = std::ceil(width / static_cast<float>(threadsPerBlock));
@@ -1355,24 +2517,59 @@ void determineMaxProbabilities(const cuv::ndarray<float, cuv::dev_memory_space>&
     dim3 threads(threadsPerBlock);
     dim3 blockSize(blocks, height);
 
-    maxProbabilitiesKernel<<<blockSize, threads, 0, stream>>>(probabilities.ptr(), output.ptr(), numLabels, width, height);
+    maxProbabilitiesKernel<<<blockSize, threads, 0, stream>>>(probabilities.ptr(), output.ptr(),
+            confidence ? confidence->ptr() : NULL, numLabels, width, height);
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+}
+
+void convertToHalf(const cuv::ndarray<float, cuv::dev_memory_space>& input,
+        cuv::ndarray<unsigned short, cuv::dev_memory_space>& output) {
+
+    utils::Profile profile("convertToHalf");
+
+    assert(input.size() == output.size());
+
+    cudaStream_t stream = DeviceContext::getCurrent().getStream(0);
+
+    const unsigned int size = input.size();
+    const unsigned int threadsPerBlock = 256;
+    const unsigned int blocks = (size + threadsPerBlock - 1) / threadsPerBlock;
+
+    convertToHalfKernel<<<blocks, threadsPerBlock, 0, stream>>>(input.ptr(), output.ptr(), size);
 
     cudaSafeCall(cudaStreamSynchronize(stream));
 }
 
+float halfToFloat(unsigned short half) {
+    const int exponent = (half >> 10) & 0x1F;
+    const int mantissa = half & 0x3FF;
+    float value;
+    if (exponent == 0x1F) {
+        value = (mantissa == 0) ? std::numeric_limits<float>::infinity() : std::numeric_limits<float>::quiet_NaN();
+    } else if (exponent == 0) {
+        value = std::ldexp(static_cast<float>(mantissa), -24);
+    } else {
+        value = std::ldexp(static_cast<float>(mantissa | 0x400), exponent - 25);
+    }
+    return (half & 0x8000) ? -value : value;
+}
+
 void classifyImage(int treeCacheSize, cuv::ndarray<float, cuv::dev_memory_space>& output, const RGBDImage& image,
-        LabelType numLabels, const boost::shared_ptr<const TreeNodes>& treeData) {
+        LabelType numLabels, const boost::shared_ptr<const TreeNodes>& treeData, bool singlePrecision) {
 
     std::set<const RGBDImage*> images;
     images.insert(&image);
 
-    tbb::mutex::scoped_lock lock(textureMutex);
+    DeviceContext& context = DeviceContext::getCurrent();
+
+    tbb::mutex::scoped_lock lock(context.getTextureMutex());
 
     utils::Profile profileClassifyImage("classifyImage");
 
-    imageCache.copyImages(1, images);
+    context.getImageCache().copyImages(1, images);
 
-    cudaStream_t stream = streams[0];
+    cudaStream_t stream = context.getStream(0);
 
     assert(output.shape(0) == numLabels);
     assert(output.shape(1) == static_cast<unsigned int>(image.getHeight()));
@@ -1386,23 +2583,327 @@ void classifyImage(int treeCacheSize, cuv::ndarray<float, cuv::dev_memory_space>
     dim3 threads(threadsPerRow, threadsPerColumn);
     dim3 blockSize(blocksX, blocksY);
 
+    TreeCache& treeCache = context.getTreeCache();
     treeCache.copyTree(treeCacheSize, treeData.get());
 
     size_t tree = treeCache.getElementPos(treeData.get());
 
     utils::Profile profileClassifyImageKernel("classifyImageKernel");
+    trace::GpuSpan span("classify kernel", stream);
+
+    if (singlePrecision) {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyKernel<float>, cudaFuncCachePreferL1));
+        classifyKernel<float><<<blockSize, threads, 0, stream>>>(output.ptr(), tree,
+                image.getWidth(), image.getHeight(),
+                numLabels);
+    } else {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyKernel<FeatureResponseType>, cudaFuncCachePreferL1));
+        classifyKernel<FeatureResponseType><<<blockSize, threads, 0, stream>>>(output.ptr(), tree,
+                image.getWidth(), image.getHeight(),
+                numLabels);
+    }
+    span.stop();
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+}
+
+// copies the trees and images to the caches and their cache positions to forestTrees and batchImages.
+// the texture mutex of the context must be locked
+static void copyForest(DeviceContext& context, const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        const std::vector<const RGBDImage*>& images, size_t imageCacheSize, cudaStream_t stream) {
+
+    std::set<const RGBDImage*> imageSet(images.begin(), images.end());
+
+    std::set<const TreeNodes*> treeSet;
+    for (const auto& tree : trees) {
+        treeSet.insert(tree.get());
+    }
+
+    ImageCache& imageCache = context.getImageCache();
+    imageCache.copyImages(imageCacheSize, imageSet);
+
+    TreeCache& treeCache = context.getTreeCache();
+    treeCache.copyTrees(trees.size(), treeSet);
+
+    // the positions only change if the cache evicted an element, so usually there is nothing to upload
+    std::vector<int> treePositions(trees.size());
+    for (size_t treeNr = 0; treeNr < trees.size(); treeNr++) {
+        treePositions[treeNr] = treeCache.getElementPos(trees[treeNr].get());
+    }
+    if (treePositions != context.getForestTreePositions()) {
+        cudaSafeCall(cudaMemcpyToSymbolAsync(forestTrees, &treePositions[0], trees.size() * sizeof(int), 0,
+                cudaMemcpyHostToDevice, stream));
+        context.getForestTreePositions().swap(treePositions);
+    }
+
+    std::vector<int> imagePositions(images.size());
+    for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+        imagePositions[imageNr] = imageCache.getElementPos(images[imageNr]);
+    }
+    if (imagePositions != context.getBatchImagePositions()) {
+        cudaSafeCall(cudaMemcpyToSymbolAsync(batchImages, &imagePositions[0], images.size() * sizeof(int), 0,
+                cudaMemcpyHostToDevice, stream));
+        context.getBatchImagePositions().swap(imagePositions);
+    }
+}
+
+static void classifyImagesWithForest(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        float* probabilities, LabelType* labels,
+        const std::vector<const RGBDImage*>& images, LabelType numLabels, size_t imageCacheSize,
+        bool singlePrecision) {
+
+    if (trees.empty() || trees.size() > MAX_FOREST_TREES) {
+        throw std::runtime_error(boost::str(boost::format("illegal number of trees: %d (maximum: %d)")
+                % trees.size() % MAX_FOREST_TREES));
+    }
+
+    if (images.empty() || images.size() > MAX_BATCH_IMAGES || images.size() > imageCacheSize) {
+        throw std::runtime_error(boost::str(boost::format("illegal number of images: %d (maximum: %d)")
+                % images.size() % MAX_BATCH_IMAGES));
+    }
+
+    const int width = images[0]->getWidth();
+    const int height = images[0]->getHeight();
+
+    for (const RGBDImage* image : images) {
+        if (image->getWidth() != width || image->getHeight() != height) {
+            throw std::runtime_error("all images of a batch must have the same size");
+        }
+    }
+
+    DeviceContext& context = DeviceContext::getCurrent();
+
+    tbb::mutex::scoped_lock lock(context.getTextureMutex());
+
+    utils::Profile profileClassifyImage("classifyForest");
+
+    cudaStream_t stream = context.getStream(0);
+
+    copyForest(context, trees, images, imageCacheSize, stream);
 
-    cudaSafeCall(cudaFuncSetCacheConfig(classifyKernel, cudaFuncCachePreferL1));
+    const int threadsPerRow = 8;
+    const int threadsPerColumn = 16;
+    int blocksX = std::ceil(width / static_cast<float>(threadsPerRow));
+    int blocksY = std::ceil(height / static_cast<float>(threadsPerColumn));
+
+    dim3 threads(threadsPerRow, threadsPerColumn);
+    dim3 blockSize(blocksX, blocksY, images.size());
 
-    classifyKernel<<<blockSize, threads, 0, stream>>>(output.ptr(), tree,
-            image.getWidth(), image.getHeight(),
-            numLabels);
+    utils::Profile profileClassifyForestKernel("classifyForestKernel");
+    trace::GpuSpan span("classify forest kernel", stream);
+
+    if (singlePrecision) {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyForestKernel<float>, cudaFuncCachePreferL1));
+        classifyForestKernel<float><<<blockSize, threads, 0, stream>>>(probabilities, labels, trees.size(),
+                width, height, numLabels);
+    } else {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyForestKernel<FeatureResponseType>, cudaFuncCachePreferL1));
+        classifyForestKernel<FeatureResponseType><<<blockSize, threads, 0, stream>>>(probabilities, labels,
+                trees.size(), width, height, numLabels);
+    }
+    span.stop();
 
     cudaSafeCall(cudaStreamSynchronize(stream));
 }
 
-__global__ void featureResponseKernel(
-        FeatureResponseType* featureResponses,
+void classifyImage(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const RGBDImage& image, LabelType numLabels, bool singlePrecision) {
+
+    assert(probabilities.shape(0) == numLabels);
+    assert(probabilities.shape(1) == static_cast<unsigned int>(image.getHeight()));
+    assert(probabilities.shape(2) == static_cast<unsigned int>(image.getWidth()));
+    assert(labels.shape(0) == static_cast<unsigned int>(image.getHeight()));
+    assert(labels.shape(1) == static_cast<unsigned int>(image.getWidth()));
+
+    classifyImagesWithForest(trees, probabilities.ptr(), labels.ptr(), std::vector<const RGBDImage*>(1, &image),
+            numLabels, 1, singlePrecision);
+}
+
+void classifyImages(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const std::vector<const RGBDImage*>& images, LabelType numLabels, size_t imageCacheSize,
+        bool singlePrecision) {
+
+    assert(!images.empty());
+    assert(probabilities.ndim() == 4);
+    assert(probabilities.shape(0) == images.size());
+    assert(probabilities.shape(1) == numLabels);
+    assert(probabilities.shape(2) == static_cast<unsigned int>(images[0]->getHeight()));
+    assert(probabilities.shape(3) == static_cast<unsigned int>(images[0]->getWidth()));
+    assert(labels.ndim() == 3);
+    assert(labels.shape(0) == images.size());
+    assert(labels.shape(1) == static_cast<unsigned int>(images[0]->getHeight()));
+    assert(labels.shape(2) == static_cast<unsigned int>(images[0]->getWidth()));
+
+    classifyImagesWithForest(trees, probabilities.ptr(), labels.ptr(), images, numLabels, imageCacheSize,
+            singlePrecision);
+}
+
+void classifyPixels(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        const cuv::ndarray<int, cuv::dev_memory_space>& pixels,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const RGBDImage& image, LabelType numLabels, bool singlePrecision) {
+
+    if (trees.empty() || trees.size() > MAX_FOREST_TREES) {
+        throw std::runtime_error(boost::str(boost::format("illegal number of trees: %d (maximum: %d)")
+                % trees.size() % MAX_FOREST_TREES));
+    }
+
+    assert(pixels.ndim() == 2);
+    assert(pixels.shape(0) == 2);
+
+    const unsigned int numPixels = pixels.shape(1);
+
+    assert(probabilities.shape(0) == numLabels);
+    assert(probabilities.shape(1) == numPixels);
+    assert(labels.size() == numPixels);
+
+    if (numPixels == 0) {
+        return;
+    }
+
+    DeviceContext& context = DeviceContext::getCurrent();
+
+    tbb::mutex::scoped_lock lock(context.getTextureMutex());
+
+    utils::Profile profileClassifyPixels("classifyPixels");
+
+    cudaStream_t stream = context.getStream(0);
+
+    copyForest(context, trees, std::vector<const RGBDImage*>(1, &image), 1, stream);
+
+    const unsigned int threadsPerBlock = 128;
+    const unsigned int blocks = (numPixels + threadsPerBlock - 1) / threadsPerBlock;
+
+    if (singlePrecision) {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyPixelsKernel<float>, cudaFuncCachePreferL1));
+        classifyPixelsKernel<float><<<blocks, threadsPerBlock, 0, stream>>>(pixels.ptr(), pixels.ptr() + numPixels,
+                numPixels, probabilities.ptr(), labels.ptr(), trees.size(), image.getWidth(), image.getHeight(),
+                numLabels);
+    } else {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyPixelsKernel<FeatureResponseType>, cudaFuncCachePreferL1));
+        classifyPixelsKernel<FeatureResponseType><<<blocks, threadsPerBlock, 0, stream>>>(pixels.ptr(),
+                pixels.ptr() + numPixels, numPixels, probabilities.ptr(), labels.ptr(), trees.size(),
+                image.getWidth(), image.getHeight(), numLabels);
+    }
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+}
+
+PredictionPlan::PredictionPlan(const std::vector<boost::shared_ptr<const TreeNodes> >& trees, int width, int height,
+        LabelType numLabels, bool singlePrecision) :
+        trees(trees), width(width), height(height), numLabels(numLabels), singlePrecision(singlePrecision),
+                deviceId(0), threads(), blocks(),
+                deviceProbabilities(cuv::extents[numLabels][height][width]),
+                deviceLabels(cuv::extents[height][width]),
+                deviceMemory("prediction", deviceProbabilities.size() * sizeof(float)
+                        + deviceLabels.size() * sizeof(LabelType)),
+                hostLabels(NULL), hostProbabilities(NULL) {
+
+    if (trees.empty() || trees.size() > MAX_FOREST_TREES) {
+        throw std::runtime_error(boost::str(boost::format("illegal number of trees: %d (maximum: %d)")
+                % trees.size() % MAX_FOREST_TREES));
+    }
+
+    cudaSafeCall(cudaGetDevice(&deviceId));
+
+    const int threadsPerRow = 8;
+    const int threadsPerColumn = 16;
+    threads = dim3(threadsPerRow, threadsPerColumn);
+    blocks = dim3(std::ceil(width / static_cast<float>(threadsPerRow)),
+            std::ceil(height / static_cast<float>(threadsPerColumn)));
+
+    cudaSafeCall(cudaHostAlloc(reinterpret_cast<void**>(&hostLabels), deviceLabels.size() * sizeof(LabelType),
+            cudaHostAllocDefault));
+
+    if (singlePrecision) {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyForestKernel<float>, cudaFuncCachePreferL1));
+    } else {
+        cudaSafeCall(cudaFuncSetCacheConfig(classifyForestKernel<FeatureResponseType>, cudaFuncCachePreferL1));
+    }
+
+    CURFIL_DEBUG("device " << deviceId << ": created prediction plan for " << trees.size() << " trees and "
+            << width << "x" << height << " images");
+}
+
+PredictionPlan::~PredictionPlan() {
+    // plans are destroyed on arbitrary threads. restore the device of the calling thread
+    int currentDeviceId = deviceId;
+    cudaGetDevice(&currentDeviceId);
+    if (currentDeviceId != deviceId) {
+        cudaSetDevice(deviceId);
+    }
+    if (hostLabels != NULL) {
+        cudaFreeHost(hostLabels);
+    }
+    if (hostProbabilities != NULL) {
+        cudaFreeHost(hostProbabilities);
+    }
+    if (currentDeviceId != deviceId) {
+        cudaSetDevice(currentDeviceId);
+    }
+}
+
+void PredictionPlan::execute(const RGBDImage& image, LabelType* labels, float* probabilities) {
+
+    if (image.getWidth() != width || image.getHeight() != height) {
+        throw std::runtime_error((boost::format("image size %dx%d does not match the prediction plan (%dx%d)")
+                % image.getWidth() % image.getHeight() % width % height).str());
+    }
+
+    int currentDeviceId;
+    cudaSafeCall(cudaGetDevice(&currentDeviceId));
+    if (currentDeviceId != deviceId) {
+        throw std::runtime_error((boost::format("prediction plan of device %d executed on device %d")
+                % deviceId % currentDeviceId).str());
+    }
+
+    DeviceContext& context = DeviceContext::get(deviceId);
+
+    // the output buffers of the plan are guarded by the texture mutex, too
+    tbb::mutex::scoped_lock lock(context.getTextureMutex());
+
+    utils::Profile profile("executePredictionPlan");
+
+    cudaStream_t stream = context.getStream(0);
+
+    copyForest(context, trees, std::vector<const RGBDImage*>(1, &image), 1, stream);
+
+    if (probabilities != NULL && hostProbabilities == NULL) {
+        cudaSafeCall(cudaHostAlloc(reinterpret_cast<void**>(&hostProbabilities),
+                deviceProbabilities.size() * sizeof(float), cudaHostAllocDefault));
+    }
+
+    if (singlePrecision) {
+        classifyForestKernel<float><<<blocks, threads, 0, stream>>>(deviceProbabilities.ptr(), deviceLabels.ptr(),
+                trees.size(), width, height, numLabels);
+    } else {
+        classifyForestKernel<FeatureResponseType><<<blocks, threads, 0, stream>>>(deviceProbabilities.ptr(),
+                deviceLabels.ptr(), trees.size(), width, height, numLabels);
+    }
+
+    cudaSafeCall(cudaMemcpyAsync(hostLabels, deviceLabels.ptr(), deviceLabels.size() * sizeof(LabelType),
+            cudaMemcpyDeviceToHost, stream));
+    if (probabilities != NULL) {
+        cudaSafeCall(cudaMemcpyAsync(hostProbabilities, deviceProbabilities.ptr(),
+                deviceProbabilities.size() * sizeof(float), cudaMemcpyDeviceToHost, stream));
+    }
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+
+    memcpy(labels, hostLabels, deviceLabels.size() * sizeof(LabelType));
+    if (probabilities != NULL) {
+        memcpy(probabilities, hostProbabilities, deviceProbabilities.size() * sizeof(float));
+    }
+}
+
+template<class FeatureResponse>
+__device__
+static FeatureResponse calculateFeatureResponse(unsigned int feature, unsigned int sample,
         const int8_t* types,
         const int16_t imageWidth, const int16_t imageHeight,
         const int8_t* offsets1X, const int8_t* offsets1Y,
@@ -1411,14 +2912,7 @@ __global__ void featureResponseKernel(
         const int8_t* regions2X, const int8_t* regions2Y,
         const int8_t* channels1, const int8_t* channels2,
         const int* samplesX, const int* samplesY, const float* depths,
-        const int* imageNumbers, unsigned int numFeatures, unsigned int numSamples) {
-
-    unsigned int feature = blockIdx.x * blockDim.y + threadIdx.y;
-    unsigned int sample = blockIdx.y * blockDim.x + threadIdx.x;
-
-    if (feature >= numFeatures || sample >= numSamples) {
-        return;
-    }
+        const int* imageNumbers) {
 
     int8_t type = types[feature];
     assert(type == COLOR || type == DEPTH);
@@ -1434,11 +2928,11 @@ __global__ void featureResponseKernel(
 
     int imageNr = imageNumbers[sample];
 
-    FeatureResponseType featureResponse;
+    FeatureResponse featureResponse;
 
     switch (type) {
         case COLOR:
-            featureResponse = calculateColorFeature(imageNr,
+            featureResponse = calculateColorFeature<FeatureResponse>(imageNr,
                     imageWidth, imageHeight,
                     offset1X, offset1Y,
                     offset2X, offset2Y,
@@ -1448,7 +2942,7 @@ __global__ void featureResponseKernel(
                     samplesX[sample], samplesY[sample], depths[sample]);
             break;
         case DEPTH:
-            featureResponse = calculateDepthFeature(imageNr,
+            featureResponse = calculateDepthFeature<FeatureResponse>(imageNr,
                     imageWidth, imageHeight,
                     offset1X, offset1Y,
                     offset2X, offset2Y,
@@ -1461,34 +2955,350 @@ __global__ void featureResponseKernel(
             break;
     }
 
-    featureResponses[featureResponseOffset(sample, feature, numSamples, numFeatures)] = featureResponse;
+    return featureResponse;
 }
 
-// http://stackoverflow.com/questions/600293/how-to-check-if-a-number-is-a-power-of-2
-#ifndef NDEBUG
-__device__
-static bool isPowerOfTwo(size_t x) {
-    return (x != 0) && ((x & (x - 1)) == 0);
-}
-#endif
+template<class FeatureResponse>
+__global__ void featureResponseKernel(
+        FeatureResponse* featureResponses,
+        const int8_t* types,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const int8_t* offsets1X, const int8_t* offsets1Y,
+        const int8_t* offsets2X, const int8_t* offsets2Y,
+        const int8_t* regions1X, const int8_t* regions1Y,
+        const int8_t* regions2X, const int8_t* regions2Y,
+        const int8_t* channels1, const int8_t* channels2,
+        const int* samplesX, const int* samplesY, const float* depths,
+        const int* imageNumbers, unsigned int numFeatures, unsigned int numSamples) {
 
-__global__ void scoreKernel(const WeightType* counters,
-        const float* thresholds,
-        unsigned int numThresholds,
-        unsigned int numLabels,
-        unsigned int numFeatures,
-        const WeightType* allClasses,
-        ScoreType* scores) {
+    unsigned int feature = blockIdx.x * blockDim.y + threadIdx.y;
+    unsigned int sample = blockIdx.y * blockDim.x + threadIdx.x;
 
-    unsigned int feature = blockIdx.x * blockDim.x + threadIdx.x;
+    if (feature >= numFeatures || sample >= numSamples) {
+        return;
+    }
+
+    featureResponses[featureResponseOffset(sample, feature, numSamples, numFeatures)] =
+            calculateFeatureResponse<FeatureResponse>(feature, sample, types, imageWidth, imageHeight,
+            offsets1X, offsets1Y, offsets2X, offsets2Y,
+            regions1X, regions1Y, regions2X, regions2Y,
+            channels1, channels2,
+            samplesX, samplesY, depths, imageNumbers);
+}
+
+// shared memory of featureResponseHistogramsKernel
+static size_t fusedSharedMemorySize(unsigned int numThresholds, unsigned int numLabels) {
+    return sizeof(unsigned int) * (numThresholds + 1) * numLabels + sizeof(float) * numThresholds;
+}
+
+// computes the feature responses of the samples [sampleBegin, sampleEnd) and aggregates them into the histogram
+// counters of one node in one pass. the responses never leave the registers.
+// if binned, the thresholds of the feature must be sorted. every response then increments the counter of its bin
+// between two thresholds, see binOffset()
+template<class FeatureResponse>
+__device__
+static void aggregateFeatureResponses(
+        WeightType* counters,
+        const float* thresholds,
+        const uint8_t* sampleLabel,
+        const int8_t* types,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const int8_t* offsets1X, const int8_t* offsets1Y,
+        const int8_t* offsets2X, const int8_t* offsets2Y,
+        const int8_t* regions1X, const int8_t* regions1Y,
+        const int8_t* regions2X, const int8_t* regions2Y,
+        const int8_t* channels1, const int8_t* channels2,
+        const int* samplesX, const int* samplesY, const float* depths,
+        const int* imageNumbers,
+        unsigned int feature,
+        unsigned int sampleBegin,
+        unsigned int sampleEnd,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures,
+        bool binned) {
+
+    // shape: (numThresholds + 1) × numLabels counters followed by numThresholds thresholds.
+    // the first numThresholds × numLabels counters count the samples that go right,
+    // the last numLabels counters count all samples. the left counters are the difference.
+    // if binned, the counters are the numThresholds + 1 bins per label. bin i holds the samples with a response in
+    // (threshold i-1, threshold i], the last bin the samples that go right of all thresholds.
+    // the bins are added to the counters without a prefix scan
+    extern __shared__ unsigned int fusedCountersShared[];
+
+    assert(feature < numFeatures);
+
+    const unsigned int numRightCounters = numThresholds * numLabels;
+    unsigned int* totalCounters = fusedCountersShared + numRightCounters;
+    float* thresholdsShared = reinterpret_cast<float*>(totalCounters + numLabels);
+
+    for (unsigned int i = threadIdx.x; i < numRightCounters + numLabels; i += blockDim.x) {
+        fusedCountersShared[i] = 0;
+    }
+    for (unsigned int thresh = threadIdx.x; thresh < numThresholds; thresh += blockDim.x) {
+        thresholdsShared[thresh] = thresholds[thresh * numFeatures + feature];
+    }
+
+    __syncthreads();
+
+#ifndef NDEBUG
+    for (unsigned int thresh = threadIdx.x + 1; binned && thresh < numThresholds; thresh += blockDim.x) {
+        assert(thresholdsShared[thresh - 1] <= thresholdsShared[thresh]);
+    }
+#endif
+
+    for (unsigned int sample = sampleBegin + threadIdx.x; sample < sampleEnd; sample += blockDim.x) {
+
+        const FeatureResponse featureResponse = calculateFeatureResponse<FeatureResponse>(
+                feature, sample, types, imageWidth, imageHeight,
+                offsets1X, offsets1Y, offsets2X, offsets2Y,
+                regions1X, regions1Y, regions2X, regions2Y,
+                channels1, channels2,
+                samplesX, samplesY, depths, imageNumbers);
+
+        const uint8_t label = sampleLabel[sample];
+        assert(label < numLabels);
+
+        if (binned) {
+            const unsigned int bin = findBin<FeatureResponse>(thresholdsShared, numThresholds, featureResponse);
+            atomicAdd(fusedCountersShared + bin * numLabels + label, 1);
+            continue;
+        }
+
+        atomicAdd(totalCounters + label, 1);
+
+        for (unsigned int thresh = 0; thresh < numThresholds; thresh++) {
+            // same comparison as in aggregateHistogramsKernel. NaN goes right
+            if (!(featureResponse <= thresholdsShared[thresh])) {
+                atomicAdd(fusedCountersShared + thresh * numLabels + label, 1);
+            }
+        }
+    }
+
+    __syncthreads();
+
+    if (binned) {
+        // other blocks might write to the same bins
+        for (unsigned int i = threadIdx.x; i < numRightCounters + numLabels; i += blockDim.x) {
+            const unsigned int count = fusedCountersShared[i];
+            if (count > 0) {
+                atomicAdd(counters + binOffset(i % numLabels, i / numLabels, feature, numLabels, numThresholds),
+                        count);
+            }
+        }
+        return;
+    }
+
+    for (unsigned int i = threadIdx.x; i < numRightCounters; i += blockDim.x) {
+        const unsigned int thresh = i / numLabels;
+        const unsigned int label = i % numLabels;
+
+        const unsigned int total = totalCounters[label];
+        if (total == 0) {
+            continue;
+        }
+
+        const unsigned int right = fusedCountersShared[i];
+        assert(right <= total);
+
+        // other blocks might write to the same counters
+        atomicAdd(counters + counterOffset(label, 0, thresh, feature, numLabels, numFeatures, numThresholds),
+                total - right);
+        atomicAdd(counters + counterOffset(label, 1, thresh, feature, numLabels, numFeatures, numThresholds),
+                right);
+    }
+}
+
+// every block handles one feature and a range of the samples
+template<class FeatureResponse>
+__global__ void featureResponseHistogramsKernel(
+        WeightType* counters,
+        const float* thresholds,
+        const uint8_t* sampleLabel,
+        const int8_t* types,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const int8_t* offsets1X, const int8_t* offsets1Y,
+        const int8_t* offsets2X, const int8_t* offsets2Y,
+        const int8_t* regions1X, const int8_t* regions1Y,
+        const int8_t* regions2X, const int8_t* regions2Y,
+        const int8_t* channels1, const int8_t* channels2,
+        const int* samplesX, const int* samplesY, const float* depths,
+        const int* imageNumbers,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures,
+        unsigned int numSamples,
+        bool binned) {
+
+    const unsigned int samplesPerBlock = (numSamples + gridDim.y - 1) / gridDim.y;
+    const unsigned int sampleBegin = blockIdx.y * samplesPerBlock;
+    const unsigned int sampleEnd = min(numSamples, sampleBegin + samplesPerBlock);
+
+    aggregateFeatureResponses<FeatureResponse>(counters, thresholds, sampleLabel, types, imageWidth, imageHeight,
+            offsets1X, offsets1Y, offsets2X, offsets2Y,
+            regions1X, regions1Y, regions2X, regions2Y,
+            channels1, channels2,
+            samplesX, samplesY, depths, imageNumbers,
+            blockIdx.x, sampleBegin, sampleEnd,
+            numThresholds, numLabels, numFeatures, binned);
+}
+
+// samples of many nodes. every block handles one feature and one segment of samples that belong to the same node.
+// the counters of all nodes are consecutive
+template<class FeatureResponse>
+__global__ void levelFeatureResponseHistogramsKernel(
+        WeightType* counters,
+        const unsigned int* segmentBegins,
+        const unsigned int* segmentNodes,
+        const float* thresholds,
+        const uint8_t* sampleLabel,
+        const int8_t* types,
+        const int16_t imageWidth, const int16_t imageHeight,
+        const int8_t* offsets1X, const int8_t* offsets1Y,
+        const int8_t* offsets2X, const int8_t* offsets2Y,
+        const int8_t* regions1X, const int8_t* regions1Y,
+        const int8_t* regions2X, const int8_t* regions2Y,
+        const int8_t* channels1, const int8_t* channels2,
+        const int* samplesX, const int* samplesY, const float* depths,
+        const int* imageNumbers,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures,
+        bool binned) {
+
+    const unsigned int segment = blockIdx.y;
+    const size_t nodeCounters = countersPerNode(numFeatures, numThresholds, numLabels, binned);
+
+    aggregateFeatureResponses<FeatureResponse>(counters + segmentNodes[segment] * nodeCounters, thresholds,
+            sampleLabel, types, imageWidth, imageHeight,
+            offsets1X, offsets1Y, offsets2X, offsets2Y,
+            regions1X, regions1Y, regions2X, regions2Y,
+            channels1, channels2,
+            samplesX, samplesY, depths, imageNumbers,
+            blockIdx.x, segmentBegins[segment], segmentBegins[segment + 1],
+            numThresholds, numLabels, numFeatures, binned);
+}
+
+// the binned variant of aggregateHistogramsKernel. every block handles one feature and a range of the samples
+template<class FeatureResponse>
+__global__ void aggregateBinsKernel(
+        const FeatureResponse* featureResponses,
+        WeightType* counters,
+        const float* thresholds,
+        const uint8_t* sampleLabel,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures,
+        unsigned int numSamples) {
+
+    // shape: numThresholds
+    extern __shared__ float binThresholdsShared[];
+
+    const unsigned int feature = blockIdx.x;
+    assert(feature < numFeatures);
+
+    for (unsigned int thresh = threadIdx.x; thresh < numThresholds; thresh += blockDim.x) {
+        binThresholdsShared[thresh] = thresholds[thresh * numFeatures + feature];
+    }
+
+    __syncthreads();
+
+    for (unsigned int sample = blockIdx.y * blockDim.x + threadIdx.x; sample < numSamples;
+            sample += gridDim.y * blockDim.x) {
+        const FeatureResponse featureResponse = featureResponses[featureResponseOffset(sample, feature, numSamples,
+                numFeatures)];
+        const uint8_t label = sampleLabel[sample];
+        assert(label < numLabels);
+
+        const unsigned int bin = findBin<FeatureResponse>(binThresholdsShared, numThresholds, featureResponse);
+        atomicAdd(counters + binOffset(label, bin, feature, numLabels, numThresholds), 1);
+    }
+}
+
+// in place: the counters left of every threshold from the bins of every node, feature and label, see binOffset()
+__global__ void binPrefixScanKernel(WeightType* counters,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures) {
+
+    const unsigned int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= numFeatures * numLabels) {
+        return;
+    }
+
+    const unsigned int feature = i / numLabels;
+    const unsigned int label = i % numLabels;
+
+    // consecutive nodes if evaluated by LevelFeatureEvaluation
+    counters += blockIdx.y * countersPerNode(numFeatures, numThresholds, numLabels, true);
+
+    WeightType count = 0;
+    for (unsigned int bin = 0; bin <= numThresholds; bin++) {
+        WeightType& counter = counters[binOffset(label, bin, feature, numLabels, numThresholds)];
+        count += counter;
+        counter = count;
+    }
+}
+
+static void scanBins(WeightType* counters, unsigned int numThresholds, unsigned int numLabels,
+        unsigned int numFeatures, unsigned int numNodes, cudaStream_t stream) {
+    const unsigned int threadsPerBlock = 128;
+    const unsigned int blocks = std::ceil(numFeatures * numLabels / static_cast<float>(threadsPerBlock));
+    dim3 blockSize(blocks, numNodes);
+
+    trace::GpuSpan span("bin prefix scan", stream, trace::KERNEL);
+    binPrefixScanKernel<<<blockSize, threadsPerBlock, 0, stream>>>(counters, numThresholds, numLabels, numFeatures);
+}
+
+// http://stackoverflow.com/questions/600293/how-to-check-if-a-number-is-a-power-of-2
+#ifndef NDEBUG
+__device__
+static bool isPowerOfTwo(size_t x) {
+    return (x != 0) && ((x & (x - 1)) == 0);
+}
+#endif
+
+// if binned, the counters must be prefix-scanned, see binPrefixScanKernel
+__global__ void scoreKernel(const WeightType* counters,
+        const float* thresholds,
+        unsigned int numThresholds,
+        unsigned int numLabels,
+        unsigned int numFeatures,
+        const WeightType* allClasses,
+        ScoreType* scores,
+        bool binned) {
+
+    unsigned int feature = blockIdx.x * blockDim.x + threadIdx.x;
     if (feature >= numFeatures) {
         return;
     }
 
     unsigned int thresh = blockIdx.y;
 
+    // consecutive nodes if evaluated by LevelFeatureEvaluation
+    const unsigned int node = blockIdx.z;
+    counters += node * countersPerNode(numFeatures, numThresholds, numLabels, binned);
+    allClasses += node * numLabels;
+    scores += static_cast<size_t>(node) * numThresholds * numFeatures;
+
     WeightType totals[2] = { 0, 0 };
 
+    if (binned) {
+        const WeightType* leftClasses = counters + binOffset(0, thresh, feature, numLabels, numThresholds);
+        const WeightType* totalClasses = counters + binOffset(0, numThresholds, feature, numLabels, numThresholds);
+        const RightCounters<WeightType> rightClasses(leftClasses, totalClasses);
+
+        for (unsigned int label = 0; label < numLabels; label++) {
+            totals[0] += leftClasses[label];
+            totals[1] += rightClasses[label];
+        }
+
+        scores[thresh * numFeatures + feature] = NormalizedInformationGainScore::calculateScore(numLabels,
+                leftClasses, rightClasses, 1, allClasses, static_cast<ScoreType>(totals[0]),
+                static_cast<ScoreType>(totals[1]));
+        return;
+    }
+
     for (unsigned int label = 0; label < numLabels; label++) {
         for (unsigned int value = 0; value < 2; value++) {
             unsigned int cidx = counterOffset(label, value, thresh, feature, numLabels, numFeatures,
@@ -1520,8 +3330,49 @@ __global__ void scoreKernel(const WeightType* counters,
     scores[thresh * numFeatures + feature] = score;
 }
 
+// same as detail::isScoreBetter()
+__device__
+static bool isScoreBetterOnDevice(const ScoreType bestScore, const ScoreType score) {
+    const ScoreType diff = fabs(score - bestScore);
+    if (diff < 1e-13) {
+        return false;
+    }
+    return (score > bestScore);
+}
+
+// one thread per node. scans the scores in the same order as ImageFeatureEvaluation::evaluateBestSplits()
+__global__ void bestSplitsKernel(const ScoreType* scores,
+        unsigned int numThresholds,
+        unsigned int numFeatures,
+        unsigned int numNodes,
+        unsigned int* bestSplits,
+        ScoreType* bestScores) {
+
+    const unsigned int node = blockIdx.x * blockDim.x + threadIdx.x;
+    if (node >= numNodes) {
+        return;
+    }
+
+    const unsigned int numScores = numThresholds * numFeatures;
+    const ScoreType* nodeScores = scores + static_cast<size_t>(node) * numScores;
+
+    ScoreType bestScore = -INFINITY;
+    unsigned int bestSplit = 0;
+    for (unsigned int i = 0; i < numScores; i++) {
+        const ScoreType score = nodeScores[i];
+        if (isScoreBetterOnDevice(bestScore, score)) {
+            bestSplit = i;
+            bestScore = score;
+        }
+    }
+
+    bestSplits[node] = bestSplit;
+    bestScores[node] = bestScore;
+}
+
+template<class FeatureResponse>
 __global__ void aggregateHistogramsKernel(
-        const FeatureResponseType* featureResponses,
+        const FeatureResponse* featureResponses,
         WeightType* counters,
         const float* thresholds,
         const uint8_t* sampleLabel,
@@ -1558,11 +3409,11 @@ __global__ void aggregateHistogramsKernel(
     unsigned int labelFlags = 0;
 
     // iterate over all samples and increment the according counter in shared memory
-    const FeatureResponseType* resultPtr = featureResponses
+    const FeatureResponse* resultPtr = featureResponses
             + featureResponseOffset(threadIdx.x, feature, numSamples, numFeatures);
     for (unsigned int sample = threadIdx.x; sample < numSamples; sample += blockDim.x) {
 
-        FeatureResponseType featureResponse = *resultPtr;
+        FeatureResponse featureResponse = *resultPtr;
         resultPtr += blockDim.x; // need to change if featureResponseOffset calculation changes
 
         uint8_t label = sampleLabel[sample];
@@ -1626,12 +3477,26 @@ __global__ void aggregateHistogramsKernel(
     }
 }
 
+const size_t ImageFeatureEvaluation::NUM_BATCH_BUFFERS;
+
+int ImageFeatureEvaluation::getDeviceId() const {
+    const std::vector<int>& deviceIds = configuration.getDeviceIds();
+    if (deviceIds.empty()) {
+        throw std::runtime_error("got no device IDs");
+    }
+    return deviceIds[treeId % deviceIds.size()];
+}
+
+DeviceContext& ImageFeatureEvaluation::getDeviceContext() {
+    selectDevice();
+    return DeviceContext::get(getDeviceId());
+}
+
 void ImageFeatureEvaluation::selectDevice() {
     int currentDeviceId;
     cudaSafeCall(cudaGetDevice(&currentDeviceId));
 
-    const std::vector<int> deviceIds = configuration.getDeviceIds();
-    const int targetDeviceId = deviceIds[treeId % deviceIds.size()];
+    const int targetDeviceId = getDeviceId();
 
     if (currentDeviceId != targetDeviceId) {
         CURFIL_DEBUG("tree " << treeId << ": switching from device " << currentDeviceId << " to " << targetDeviceId);
@@ -1651,18 +3516,10 @@ void ImageFeatureEvaluation::initDevice() {
     int currentDeviceId;
     cudaSafeCall(cudaGetDevice(&currentDeviceId));
     cudaSafeCall(cudaGetDeviceProperties(&prop, currentDeviceId));
-    CURFIL_INFO("GPU Device " << currentDeviceId << ": " << prop.name);
+    CURFIL_INFO("tree " << treeId << ": GPU Device " << currentDeviceId << ": " << prop.name);
 
-    {
-        tbb::mutex::scoped_lock initLock(initMutex);
-        if (!initialized) {
-            for (int i = 0; i < NUM_STREAMS; i++) {
-                cudaSafeCall(cudaStreamCreate(&streams[i]));
-            }
-            initialized = true;
-            CURFIL_DEBUG("created " << NUM_STREAMS << " streams");
-        }
-    }
+    // creates the streams and caches of the device
+    DeviceContext::get(currentDeviceId);
 }
 
 static void addBatch(RandomTree<PixelInstance, ImageFeatureFunction>& node,
@@ -1695,11 +3552,12 @@ std::vector<std::vector<const PixelInstance*> > ImageFeatureEvaluation::prepare(
         const std::vector<const PixelInstance*>& hostSamples,
         RandomTree<PixelInstance, ImageFeatureFunction>& node, cuv::dev_memory_space, bool keepMutexLocked) {
 
-    selectDevice();
+    DeviceContext& context = getDeviceContext();
+    const ImageCache& imageCache = context.getImageCache();
 
     assert(hostSamples.size() > 0);
 
-    textureMutex.lock();
+    context.getTextureMutex().lock();
 
     utils::Timer prepareTime;
 
@@ -1751,7 +3609,7 @@ std::vector<std::vector<const PixelInstance*> > ImageFeatureEvaluation::prepare(
     node.setTimerValue("prepareBatches", prepareTime);
 
     if (!keepMutexLocked) {
-        textureMutex.unlock();
+        context.getTextureMutex().unlock();
     }
 
     return batches;
@@ -1800,15 +3658,56 @@ void ImageFeatureEvaluation::sortFeatures(
     featuresAndThresholds = sortedFeaturesAndThresholds;
 }
 
+template<class FeatureResponse>
+static void launchGenerateRandomFeaturesKernel(int blocks, int threadsPerBlock, cudaStream_t stream, int seed,
+        const TrainingConfiguration& configuration,
+        cuv::ndarray<int, cuv::dev_memory_space>& keysIndices,
+        ImageFeaturesAndThresholds<cuv::dev_memory_space>& featuresAndThresholds,
+        const Samples<cuv::dev_memory_space>& samplesOnDevice,
+        unsigned int imageWidth, unsigned int imageHeight) {
+
+    const unsigned int numFeatures = configuration.getFeatureCount();
+    const unsigned int numThresholds = configuration.getThresholds();
+    const size_t numSamples = samplesOnDevice.data.shape(1);
+
+    cudaSafeCall(cudaFuncSetCacheConfig(generateRandomFeaturesKernel<FeatureResponse>, cudaFuncCachePreferL1));
+
+    generateRandomFeaturesKernel<FeatureResponse><<<blocks, threadsPerBlock, 0, stream>>>(seed,
+            numFeatures,
+            keysIndices[cuv::indices[0][cuv::index_range()]].ptr(),
+            keysIndices[cuv::indices[1][cuv::index_range()]].ptr(),
+            configuration.getBoxRadius(), configuration.getRegionSize(),
+            featuresAndThresholds.types().ptr(),
+            featuresAndThresholds.offset1X().ptr(), featuresAndThresholds.offset1Y().ptr(),
+            featuresAndThresholds.region1X().ptr(), featuresAndThresholds.region1Y().ptr(),
+            featuresAndThresholds.offset2X().ptr(), featuresAndThresholds.offset2Y().ptr(),
+            featuresAndThresholds.region2X().ptr(), featuresAndThresholds.region2Y().ptr(),
+            featuresAndThresholds.channel1().ptr(), featuresAndThresholds.channel2().ptr(),
+            featuresAndThresholds.thresholds().ptr(),
+            numThresholds,
+            configuration.isBinnedSplits(),
+            numSamples,
+            imageWidth, imageHeight,
+            samplesOnDevice.imageNumbers,
+            samplesOnDevice.depths,
+            samplesOnDevice.sampleX,
+            samplesOnDevice.sampleY,
+            samplesOnDevice.labels
+    );
+}
+
 ImageFeaturesAndThresholds<cuv::dev_memory_space> ImageFeatureEvaluation::generateRandomFeatures(
         const std::vector<const PixelInstance*>& samples, int seed, const bool sort, cuv::dev_memory_space) {
 
     unsigned int numFeatures = configuration.getFeatureCount();
     unsigned int numThresholds = configuration.getThresholds();
 
-    tbb::mutex::scoped_lock textureLock(textureMutex);
+    DeviceContext& context = getDeviceContext();
+    const cudaStream_t stream = context.getStream(0);
 
-    Samples<cuv::dev_memory_space> samplesOnDevice = copySamplesToDevice(samples, streams[0]);
+    tbb::mutex::scoped_lock textureLock(context.getTextureMutex());
+
+    Samples<cuv::dev_memory_space> samplesOnDevice = copySamplesToDevice(samples, stream);
 
     ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds(numFeatures, numThresholds,
             featuresAllocator);
@@ -1818,37 +3717,16 @@ ImageFeaturesAndThresholds<cuv::dev_memory_space> ImageFeatureEvaluation::genera
     int threadsPerBlock = std::min(numFeatures, 128u);
     int blocks = std::ceil(numFeatures / static_cast<float>(threadsPerBlock));
 
-    const size_t numSamples = samplesOnDevice.data.shape(1);
-    assert(numSamples == samples.size());
+    assert(samplesOnDevice.data.shape(1) == samples.size());
 
     {
-
-        cudaSafeCall(cudaFuncSetCacheConfig(generateRandomFeaturesKernel, cudaFuncCachePreferL1));
-
-        utils::Profile profile("generateRandomFeatures");
-        generateRandomFeaturesKernel<<<blocks, threadsPerBlock, 0, streams[0]>>>(seed,
-                numFeatures,
-                keysIndices[cuv::indices[0][cuv::index_range()]].ptr(),
-                keysIndices[cuv::indices[1][cuv::index_range()]].ptr(),
-                configuration.getBoxRadius(), configuration.getRegionSize(),
-                featuresAndThresholds.types().ptr(),
-                featuresAndThresholds.offset1X().ptr(), featuresAndThresholds.offset1Y().ptr(),
-                featuresAndThresholds.region1X().ptr(), featuresAndThresholds.region1Y().ptr(),
-                featuresAndThresholds.offset2X().ptr(), featuresAndThresholds.offset2Y().ptr(),
-                featuresAndThresholds.region2X().ptr(), featuresAndThresholds.region2Y().ptr(),
-                featuresAndThresholds.channel1().ptr(), featuresAndThresholds.channel2().ptr(),
-                featuresAndThresholds.thresholds().ptr(),
-                numThresholds,
-                numSamples,
-                imageWidth, imageHeight,
-                samplesOnDevice.imageNumbers,
-                samplesOnDevice.depths,
-                samplesOnDevice.sampleX,
-                samplesOnDevice.sampleY,
-                samplesOnDevice.labels
-        );
-        if (profile.isEnabled()) {
-            cudaSafeCall(cudaStreamSynchronize(streams[0]));
+        trace::GpuSpan span("generate random features", stream);
+        if (configuration.isSinglePrecisionFeatures()) {
+            launchGenerateRandomFeaturesKernel<float>(blocks, threadsPerBlock, stream, seed, configuration,
+                    keysIndices, featuresAndThresholds, samplesOnDevice, imageWidth, imageHeight);
+        } else {
+            launchGenerateRandomFeaturesKernel<FeatureResponseType>(blocks, threadsPerBlock, stream, seed,
+                    configuration, keysIndices, featuresAndThresholds, samplesOnDevice, imageWidth, imageHeight);
         }
     }
 
@@ -1856,11 +3734,98 @@ ImageFeaturesAndThresholds<cuv::dev_memory_space> ImageFeatureEvaluation::genera
         sortFeatures(featuresAndThresholds, keysIndices);
     }
 
-    cudaSafeCall(cudaStreamSynchronize(streams[0]));
+    cudaSafeCall(cudaStreamSynchronize(stream));
 
     return featuresAndThresholds;
 }
 
+// CUDA events that mark the begin and end of the kernels of every batch
+class BatchEvents {
+
+private:
+    BatchEvents(const BatchEvents& other);
+    BatchEvents& operator=(const BatchEvents& other);
+
+    static const size_t EVENTS_PER_BATCH = 5;
+
+    std::vector<cudaEvent_t> events;
+
+    cudaEvent_t get(size_t batch, size_t event) const {
+        assert(batch * EVENTS_PER_BATCH + event < events.size());
+        return events[batch * EVENTS_PER_BATCH + event];
+    }
+
+    static double elapsedSeconds(cudaEvent_t start, cudaEvent_t stop) {
+        float elapsedMilliseconds = 0.0;
+        cudaSafeCall(cudaEventElapsedTime(&elapsedMilliseconds, start, stop));
+        return elapsedMilliseconds / 1000.0;
+    }
+
+public:
+
+    explicit BatchEvents(size_t numBatches) :
+            events(numBatches * EVENTS_PER_BATCH, static_cast<cudaEvent_t>(NULL)) {
+        for (size_t i = 0; i < events.size(); i++) {
+            cudaSafeCall(cudaEventCreate(&events[i]));
+        }
+    }
+
+    ~BatchEvents() {
+        for (size_t i = 0; i < events.size(); i++) {
+            if (events[i] != NULL) {
+                cudaEventDestroy(events[i]);
+            }
+        }
+    }
+
+    cudaEvent_t featureResponseStart(size_t batch) const {
+        return get(batch, 0);
+    }
+
+    cudaEvent_t featureResponseStop(size_t batch) const {
+        return get(batch, 1);
+    }
+
+    cudaEvent_t aggregateHistogramsStart(size_t batch) const {
+        return get(batch, 2);
+    }
+
+    cudaEvent_t aggregateHistogramsStop(size_t batch) const {
+        return get(batch, 3);
+    }
+
+    // the samples of the batch are on the device and its pinned memory can be reused
+    cudaEvent_t uploadStop(size_t batch) const {
+        return get(batch, 4);
+    }
+
+    // must only be called when the batch is finished
+    double featureResponseSeconds(size_t batch) const {
+        return elapsedSeconds(featureResponseStart(batch), featureResponseStop(batch));
+    }
+
+    double aggregateHistogramsSeconds(size_t batch) const {
+        return elapsedSeconds(aggregateHistogramsStart(batch), aggregateHistogramsStop(batch));
+    }
+};
+
+// appends the feature responses of a batch to the feature responses on the host in double precision
+static void appendFeatureResponses(const cuv::ndarray<FeatureResponseType, cuv::dev_memory_space>& featureResponses,
+        cuv::ndarray<FeatureResponseType, cuv::host_memory_space>& featureResponsesHost, size_t samplesProcessed) {
+    featureResponsesHost[cuv::indices[cuv::index_range()][cuv::index_range(samplesProcessed,
+            samplesProcessed + featureResponses.shape(1))]] = featureResponses;
+}
+
+static void appendFeatureResponses(const cuv::ndarray<float, cuv::dev_memory_space>& featureResponses,
+        cuv::ndarray<FeatureResponseType, cuv::host_memory_space>& featureResponsesHost, size_t samplesProcessed) {
+    const cuv::ndarray<float, cuv::host_memory_space> responses(featureResponses);
+    for (unsigned int feature = 0; feature < responses.shape(0); feature++) {
+        for (unsigned int sample = 0; sample < responses.shape(1); sample++) {
+            featureResponsesHost(feature, samplesProcessed + sample) = responses(feature, sample);
+        }
+    }
+}
+
 template<>
 cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculateFeatureResponsesAndHistograms(
         RandomTree<PixelInstance, ImageFeatureFunction>& node,
@@ -1868,11 +3833,30 @@ cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculat
         const ImageFeaturesAndThresholds<cuv::dev_memory_space>& featuresAndThresholds,
         cuv::ndarray<FeatureResponseType, cuv::host_memory_space>* featureResponsesHost) {
 
+    if (configuration.isSinglePrecisionFeatures()) {
+        return calculateFeatureResponsesAndHistogramsOnDevice<float>(node, batches, featuresAndThresholds,
+                featureResponsesHost);
+    }
+    return calculateFeatureResponsesAndHistogramsOnDevice<FeatureResponseType>(node, batches, featuresAndThresholds,
+            featureResponsesHost);
+}
+
+template<class FeatureResponse>
+cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculateFeatureResponsesAndHistogramsOnDevice(
+        RandomTree<PixelInstance, ImageFeatureFunction>& node,
+        const std::vector<std::vector<const PixelInstance*> >& batches,
+        const ImageFeaturesAndThresholds<cuv::dev_memory_space>& featuresAndThresholds,
+        cuv::ndarray<FeatureResponseType, cuv::host_memory_space>* featureResponsesHost) {
+
     unsigned int numFeatures = configuration.getFeatureCount();
     unsigned int numThresholds = configuration.getThresholds();
 
     const size_t numLabels = node.getNumClasses();
 
+    DeviceContext& context = getDeviceContext();
+    tbb::mutex& textureMutex = context.getTextureMutex();
+    cudaStream_t streams[DeviceContext::NUM_STREAMS] = { context.getStream(0), context.getStream(1) };
+
 #ifndef NDEBUG
     {
         size_t numLabelsCheck = 0;
@@ -1890,21 +3874,60 @@ cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculat
     }
 #endif
 
-    // see function counterOffset()
-    // features × threshold × labels × 2
+    const bool binned = configuration.isBinnedSplits();
+
+    // see functions counterOffset() and binOffset()
+    // features × threshold × labels × 2 or features × (thresholds + 1) × labels if binned
     std::vector<unsigned int> shape;
     shape.push_back(numFeatures);
-    shape.push_back(numThresholds);
-    shape.push_back(numLabels);
-    shape.push_back(2);
+    if (binned) {
+        shape.push_back(numThresholds + 1);
+        shape.push_back(numLabels);
+    } else {
+        shape.push_back(numThresholds);
+        shape.push_back(numLabels);
+        shape.push_back(2);
+    }
 
     cuv::ndarray<WeightType, cuv::dev_memory_space> counters(shape, countersAllocator);
     cudaSafeCall(cudaMemsetAsync(counters.ptr(), 0,
             static_cast<size_t>(counters.size() * sizeof(WeightType)), streams[0]));
 
     assert(numFeatures == configuration.getFeatureCount());
-    cuv::ndarray<FeatureResponseType, cuv::dev_memory_space> featureResponsesDevice(numFeatures,
-            configuration.getMaxSamplesPerBatch(), featureResponsesAllocator);
+
+    // batch pipeline: the images and samples of the next batch are uploaded on streams[0] while the histograms of
+    // the current batch are aggregated on streams[1], see NUM_BATCH_BUFFERS.
+    // the buffers of the responses are not resized per batch since they might still be in use by an aggregation.
+
+    // the fused kernel never writes the feature responses to global memory. the separate kernels are still used if
+    // the caller wants to see the responses and when comparing with the CPU implementation
+    const size_t fusedSharedMemory = fusedSharedMemorySize(numThresholds, numLabels);
+    const AccelerationMode accelerationMode = configuration.getAccelerationMode();
+    const bool fused = (featureResponsesHost == NULL && (accelerationMode == GPU_ONLY || accelerationMode == HYBRID)
+            && fusedSharedMemory <= context.getSharedMemoryPerBlock());
+
+    if (binned && !fused && featureResponsesHost == NULL && accelerationMode != GPU_AND_CPU_COMPARE) {
+        static tbb::atomic<bool> warned;
+        if (!warned.fetch_and_store(true)) {
+            CURFIL_WARNING((boost::format("binned splits: the bins of %d thresholds and %d labels need %d bytes of "
+                    "shared memory but the device has %d bytes. the feature responses of every batch are "
+                    "written to global memory")
+                    % numThresholds % numLabels % fusedSharedMemory % context.getSharedMemoryPerBlock()).str());
+        }
+    }
+
+    std::vector<cuv::ndarray<FeatureResponse, cuv::dev_memory_space> > featureResponsesDevice;
+    std::vector<boost::shared_ptr<Samples<cuv::host_memory_space> > > sampleDataHost(NUM_BATCH_BUFFERS);
+    std::vector<boost::shared_ptr<Samples<cuv::dev_memory_space> > > sampleDataDevice(NUM_BATCH_BUFFERS);
+
+    for (size_t i = 0; !fused && i < std::min(NUM_BATCH_BUFFERS, batches.size()); i++) {
+        featureResponsesDevice.push_back(cuv::ndarray<FeatureResponse, cuv::dev_memory_space>(
+                numFeatures * configuration.getMaxSamplesPerBatch(), featureResponsesAllocator));
+    }
+    const DeviceMemoryUsage::Scope featureResponsesMemory("featureResponses", featureResponsesDevice.size()
+            * sizeof(FeatureResponse) * numFeatures * configuration.getMaxSamplesPerBatch());
+
+    BatchEvents events(batches.size());
 
     if (featureResponsesHost) {
         size_t totalSamples = 0;
@@ -1919,35 +3942,56 @@ cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculat
         for (size_t batch = 0; batch < batches.size(); batch++) {
             const std::vector<const PixelInstance*>& currentBatch = batches[batch];
             unsigned int batchSize = currentBatch.size();
+            assert(batchSize <= configuration.getMaxSamplesPerBatch());
+
+            const size_t buffer = batch % NUM_BATCH_BUFFERS;
+
+            if (batch >= NUM_BATCH_BUFFERS) {
+                // the host fills the pinned memory of the previous batch of the buffer. its upload was queued
+                // before the feature responses of that batch and is usually finished
+                cudaSafeCall(cudaEventSynchronize(events.uploadStop(batch - NUM_BATCH_BUFFERS)));
+            }
 
             if (batch > 0) {
+                trace::Scope wait("texture mutex", trace::WAIT, batch);
                 textureMutex.lock();
             }
 
-            Samples<cuv::dev_memory_space> sampleData = copySamplesToDevice(currentBatch, streams[0]);
-
-            featureResponsesDevice.resize(numFeatures, batchSize);
+            if (batch >= NUM_BATCH_BUFFERS) {
+                // the device buffers are in use until the aggregation of the previous batch of the buffer finished.
+                // the uploads wait on the device, the host queues the next batch meanwhile
+                cudaSafeCall(cudaStreamWaitEvent(streams[0], events.aggregateHistogramsStop(batch - NUM_BATCH_BUFFERS),
+                        0));
+            }
 
-            unsigned int featuresPerBlock = std::min(numFeatures, 32u);
-            unsigned int samplesPerBlock = std::min(batchSize, 4u);
-            int featureBlocks = std::ceil(numFeatures / static_cast<float>(featuresPerBlock));
-            int sampleBlocks = std::ceil(batchSize / static_cast<float>(samplesPerBlock));
+            // pinned memory for the asynchronous upload
+            sampleDataHost[buffer] = boost::make_shared<Samples<cuv::host_memory_space> >(batchSize,
+                    sampleDataAllocator);
+            sampleDataDevice[buffer] = boost::make_shared<Samples<cuv::dev_memory_space> >(
+                    copySamplesToDeviceAsync(currentBatch, *sampleDataHost[buffer], streams[0]));
+            cudaSafeCall(cudaEventRecord(events.uploadStop(batch), streams[0]));
 
-            dim3 blockSize(featureBlocks, sampleBlocks);
-            dim3 threads(samplesPerBlock, featuresPerBlock);
+            const Samples<cuv::dev_memory_space>& sampleData = *sampleDataDevice[buffer];
 
-            CURFIL_DEBUG("feature response kernel: launching " << blockSize.x << "x" <<blockSize.y
-                    << " blocks with " << threads.x << "x" << threads.y << " threads");
+            if (fused) {
+                const unsigned int threadsPerBlock = 128;
+                const unsigned int samplesPerThread = 16;
+                const int sampleBlocks = std::ceil(batchSize / static_cast<float>(samplesPerThread * threadsPerBlock));
 
-            cudaSafeCall(cudaStreamSynchronize(streams[0]));
+                dim3 blockSize(numFeatures, sampleBlocks);
+                dim3 threads(threadsPerBlock);
 
-            utils::Timer featureResponseTimer;
+                CURFIL_DEBUG("fused feature response kernel: launching " << blockSize.x << "x" << blockSize.y
+                        << " blocks with " << threads.x << " threads");
 
-            {
-                cudaSafeCall(cudaFuncSetCacheConfig(featureResponseKernel, cudaFuncCachePreferL1));
-                utils::Profile profile("calculate feature responses");
-                featureResponseKernel<<<blockSize, threads, 0, streams[0]>>>(
-                        featureResponsesDevice.ptr(),
+                cudaSafeCall(cudaFuncSetCacheConfig(featureResponseHistogramsKernel<FeatureResponse>,
+                        cudaFuncCachePreferL1));
+                trace::GpuSpan span("feature responses and histograms", streams[0], trace::KERNEL, batch);
+                cudaSafeCall(cudaEventRecord(events.featureResponseStart(batch), streams[0]));
+                featureResponseHistogramsKernel<FeatureResponse><<<blockSize, threads, fusedSharedMemory, streams[0]>>>(
+                        counters.ptr(),
+                        featuresAndThresholds.thresholds().ptr(),
+                        sampleData.labels,
                         featuresAndThresholds.types().ptr(),
                         imageWidth, imageHeight,
                         featuresAndThresholds.offset1X().ptr(), featuresAndThresholds.offset1Y().ptr(),
@@ -1956,73 +4000,174 @@ cuv::ndarray<WeightType, cuv::dev_memory_space> ImageFeatureEvaluation::calculat
                         featuresAndThresholds.region2X().ptr(), featuresAndThresholds.region2Y().ptr(),
                         featuresAndThresholds.channel1().ptr(), featuresAndThresholds.channel2().ptr(),
                         sampleData.sampleX, sampleData.sampleY, sampleData.depths, sampleData.imageNumbers,
+                        numThresholds,
+                        numLabels,
                         numFeatures,
-                        batchSize
+                        batchSize,
+                        binned
                 );
-                if (profile.isEnabled()) {
-                    cudaSafeCall(cudaStreamSynchronize(streams[0]));
+                cudaSafeCall(cudaEventRecord(events.featureResponseStop(batch), streams[0]));
+
+                // there is no separate aggregation. the events only guard the reuse of the sample buffers
+                cudaSafeCall(cudaEventRecord(events.aggregateHistogramsStart(batch), streams[0]));
+                cudaSafeCall(cudaEventRecord(events.aggregateHistogramsStop(batch), streams[0]));
+                span.stop();
+
+                textureMutex.unlock();
+            } else {
+                unsigned int featuresPerBlock = std::min(numFeatures, 32u);
+                unsigned int samplesPerBlock = std::min(batchSize, 4u);
+                int featureBlocks = std::ceil(numFeatures / static_cast<float>(featuresPerBlock));
+                int sampleBlocks = std::ceil(batchSize / static_cast<float>(samplesPerBlock));
+
+                dim3 blockSize(featureBlocks, sampleBlocks);
+                dim3 threads(samplesPerBlock, featuresPerBlock);
+
+                CURFIL_DEBUG("feature response kernel: launching " << blockSize.x << "x" <<blockSize.y
+                        << " blocks with " << threads.x << "x" << threads.y << " threads");
+
+                {
+                    cudaSafeCall(cudaFuncSetCacheConfig(featureResponseKernel<FeatureResponse>,
+                            cudaFuncCachePreferL1));
+                    trace::GpuSpan span("feature responses", streams[0], trace::KERNEL, batch);
+                    cudaSafeCall(cudaEventRecord(events.featureResponseStart(batch), streams[0]));
+                    featureResponseKernel<FeatureResponse><<<blockSize, threads, 0, streams[0]>>>(
+                            featureResponsesDevice[buffer].ptr(),
+                            featuresAndThresholds.types().ptr(),
+                            imageWidth, imageHeight,
+                            featuresAndThresholds.offset1X().ptr(), featuresAndThresholds.offset1Y().ptr(),
+                            featuresAndThresholds.offset2X().ptr(), featuresAndThresholds.offset2Y().ptr(),
+                            featuresAndThresholds.region1X().ptr(), featuresAndThresholds.region1Y().ptr(),
+                            featuresAndThresholds.region2X().ptr(), featuresAndThresholds.region2Y().ptr(),
+                            featuresAndThresholds.channel1().ptr(), featuresAndThresholds.channel2().ptr(),
+                            sampleData.sampleX, sampleData.sampleY, sampleData.depths, sampleData.imageNumbers,
+                            numFeatures,
+                            batchSize
+                    );
+                    cudaSafeCall(cudaEventRecord(events.featureResponseStop(batch), streams[0]));
                 }
-            }
-
-            cudaSafeCall(cudaStreamSynchronize(streams[0]));
 
-            if (featureResponsesHost) {
-                // append feature responses on device to the feature responses for our caller
-                (*featureResponsesHost)[cuv::indices[cuv::index_range()][cuv::index_range(samplesProcessed,
-                        samplesProcessed + batchSize)]] = featureResponsesDevice;
-            }
+                if (featureResponsesHost) {
+                    // append feature responses on device to the feature responses for our caller
+                    cudaSafeCall(cudaStreamSynchronize(streams[0]));
+                    cuv::ndarray<FeatureResponse, cuv::dev_memory_space> featureResponses =
+                            featureResponsesDevice[buffer][cuv::indices[cuv::index_range(0,
+                                    numFeatures * batchSize)]];
+                    featureResponses.reshape(numFeatures, batchSize);
+                    appendFeatureResponses(featureResponses, *featureResponsesHost, samplesProcessed);
+                }
 
-            node.addTimerValue("featureResponse", featureResponseTimer);
-            node.setTimerValue((boost::format("batch%d.featureResponse") % batch).str(), featureResponseTimer);
+                // kernels and transfers of other threads that modify the image cache are queued on the same stream
+                textureMutex.unlock();
 
-            textureMutex.unlock();
+                assert(numLabels > 0);
 
-            utils::Timer aggregateHistogramsTimer;
+                {
+                    int threadsPerBlock = 128;
 
-            assert(numLabels > 0);
+                    if (batchSize <= 3000) {
+                        threadsPerBlock = 64;
+                    }
 
-            {
-                int threadsPerBlock = 128;
+                    dim3 blockSize(numThresholds, numFeatures);
+                    dim3 threads(threadsPerBlock);
+
+                    unsigned int sharedMemory = sizeof(unsigned short) * 2 * numLabels * threadsPerBlock;
+
+                    cudaSafeCall(cudaFuncSetCacheConfig(aggregateHistogramsKernel<FeatureResponse>,
+                            cudaFuncCachePreferShared));
+
+                    cudaSafeCall(cudaStreamWaitEvent(streams[1], events.featureResponseStop(batch), 0));
+                    trace::GpuSpan span("aggregate histograms", streams[1], trace::KERNEL, batch);
+                    cudaSafeCall(cudaEventRecord(events.aggregateHistogramsStart(batch), streams[1]));
+
+                    if (binned) {
+                        const unsigned int binThreads = 128;
+                        const unsigned int binSampleBlocks = std::min(64u,
+                                static_cast<unsigned int>(std::ceil(batchSize / static_cast<float>(binThreads))));
+                        aggregateBinsKernel<FeatureResponse><<<dim3(numFeatures, binSampleBlocks), binThreads,
+                        sizeof(float) * numThresholds, streams[1]>>>(
+                                featureResponsesDevice[buffer].ptr(),
+                                counters.ptr(),
+                                featuresAndThresholds.thresholds().ptr(),
+                                sampleData.labels,
+                                numThresholds,
+                                numLabels,
+                                numFeatures,
+                                batchSize
+                        );
+                    } else {
+                        aggregateHistogramsKernel<FeatureResponse><<<blockSize, threads, sharedMemory, streams[1]>>>(
+                                featureResponsesDevice[buffer].ptr(),
+                                counters.ptr(),
+                                featuresAndThresholds.thresholds().ptr(),
+                                sampleData.labels,
+                                numThresholds,
+                                numLabels,
+                                numFeatures,
+                                batchSize
+                        );
+                    }
 
-                if (batchSize <= 3000) {
-                    threadsPerBlock = 64;
+                    cudaSafeCall(cudaEventRecord(events.aggregateHistogramsStop(batch), streams[1]));
                 }
+            }
 
-                dim3 blockSize(numThresholds, numFeatures);
-                dim3 threads(threadsPerBlock);
+            samplesProcessed += batchSize;
+        }
+    }
 
-                utils::Profile profile((boost::format("aggregate histograms (%d samples)") % batchSize).str());
-                unsigned int sharedMemory = sizeof(unsigned short) * 2 * numLabels * threadsPerBlock;
+    if (binned) {
+        scanBins(counters.ptr(), numThresholds, numLabels, numFeatures, 1, streams[fused ? 0 : 1]);
+    }
 
-                cudaSafeCall(cudaFuncSetCacheConfig(aggregateHistogramsKernel, cudaFuncCachePreferShared));
+    // the fused kernel runs on the same stream as the uploads
+    cudaSafeCall(cudaStreamSynchronize(streams[fused ? 0 : 1]));
 
-                aggregateHistogramsKernel<<<blockSize, threads, sharedMemory, streams[1]>>>(
-                        featureResponsesDevice.ptr(),
-                        counters.ptr(),
-                        featuresAndThresholds.thresholds().ptr(),
-                        sampleData.labels,
-                        numThresholds,
-                        numLabels,
-                        numFeatures,
-                        batchSize
-                );
+    for (size_t batch = 0; batch < batches.size(); batch++) {
+        const double featureResponseTime = events.featureResponseSeconds(batch);
+        const double aggregateHistogramsTime = events.aggregateHistogramsSeconds(batch);
 
-                if (profile.isEnabled()) {
-                    cudaSafeCall(cudaStreamSynchronize(streams[1]));
-                }
-            }
+        // the times of the individual batches are traced, see trace::GpuSpan
+        node.addTimerValue("featureResponse", featureResponseTime);
+        node.addTimerValue("aggregateHistograms", aggregateHistogramsTime);
+    }
 
-            cudaSafeCall(cudaStreamSynchronize(streams[1]));
-            node.addTimerValue("aggregateHistograms", aggregateHistogramsTimer);
+    return counters;
+}
 
-            node.setTimerValue((boost::format("batch%d.aggregateHistograms") % batch).str(),
-                    aggregateHistogramsTimer);
+void ImageFeatureEvaluation::copySplitHistograms(const WeightType* counters, unsigned int feature,
+        unsigned int threshold, std::vector<WeightType>& leftHistogram,
+        std::vector<WeightType>& rightHistogram) const {
 
-            samplesProcessed += batchSize;
+    const unsigned int numThresholds = configuration.getThresholds();
+    const size_t numLabels = leftHistogram.size();
+    assert(rightHistogram.size() == numLabels);
+    assert(feature < configuration.getFeatureCount());
+    assert(threshold < numThresholds);
+
+    if (configuration.isBinnedSplits()) {
+        // the samples left of the threshold and the totals, see binOffset()
+        std::vector<WeightType> totals(numLabels);
+        cudaSafeCall(cudaMemcpy(&leftHistogram[0], counters + binOffset(0, threshold, feature, numLabels,
+                numThresholds), numLabels * sizeof(WeightType), cudaMemcpyDeviceToHost));
+        cudaSafeCall(cudaMemcpy(&totals[0], counters + binOffset(0, numThresholds, feature, numLabels,
+                numThresholds), numLabels * sizeof(WeightType), cudaMemcpyDeviceToHost));
+        for (size_t label = 0; label < numLabels; label++) {
+            assert(leftHistogram[label] <= totals[label]);
+            rightHistogram[label] = totals[label] - leftHistogram[label];
+        }
+    } else {
+        // labels × 2 consecutive counters, see counterOffset()
+        std::vector<WeightType> labelCounters(2 * numLabels);
+        const size_t offset = (static_cast<size_t>(feature) * numThresholds + threshold) * numLabels * 2;
+        cudaSafeCall(cudaMemcpy(&labelCounters[0], counters + offset, labelCounters.size() * sizeof(WeightType),
+                cudaMemcpyDeviceToHost));
+        for (size_t label = 0; label < numLabels; label++) {
+            leftHistogram[label] = labelCounters[2 * label];
+            rightHistogram[label] = labelCounters[2 * label + 1];
         }
     }
-
-    return counters;
 }
 
 template<>
@@ -2034,7 +4179,10 @@ cuv::ndarray<ScoreType, cuv::host_memory_space> ImageFeatureEvaluation::calculat
     const unsigned int numFeatures = configuration.getFeatureCount();
     const unsigned int numThresholds = configuration.getThresholds();
 
+    const cudaStream_t stream = getDeviceContext().getStream(1);
+
     cuv::ndarray<ScoreType, cuv::dev_memory_space> scores(numThresholds, numFeatures, scoresAllocator);
+    const DeviceMemoryUsage::Scope scoresMemory("scores", scores.size() * sizeof(ScoreType));
 
     const size_t numLabels = histogram.size();
     assert(counters.shape(2) == numLabels);
@@ -2046,30 +4194,621 @@ cuv::ndarray<ScoreType, cuv::host_memory_space> ImageFeatureEvaluation::calculat
         dim3 threads(threadsPerBlock);
         dim3 blockSize(blocks, numThresholds);
 
-        utils::Profile profile("score kernel");
-
         cudaSafeCall(cudaFuncSetCacheConfig(scoreKernel, cudaFuncCachePreferL1));
 
-        scoreKernel<<<blockSize, threads, 0, streams[1]>>>(
+        trace::GpuSpan span("score kernel", stream);
+        scoreKernel<<<blockSize, threads, 0, stream>>>(
                 counters.ptr(),
                 featuresAndThresholds.thresholds().ptr(),
                 numThresholds,
                 numLabels,
                 numFeatures,
                 histogram.ptr(),
-                scores.ptr()
+                scores.ptr(),
+                configuration.isBinnedSplits()
         );
+    }
+
+    cuv::ndarray<ScoreType, cuv::host_memory_space> scoresCPU(scores, stream);
+    cudaSafeCall(cudaStreamSynchronize(stream));
+
+    return scoresCPU;
+}
+
+// maximal number of blocks in the y and z dimension of a grid
+static const size_t MAX_GRID_SIZE = 65535;
+
+const size_t LevelFeatureEvaluation::MAX_COUNTERS_MEMORY;
+const unsigned int LevelFeatureEvaluation::MAX_SEGMENT_SIZE;
+
+LevelFeatureEvaluation::LevelFeatureEvaluation(const size_t treeId, const TrainingConfiguration& configuration) :
+        configuration(configuration), nodeEvaluation(treeId, configuration),
+                segmentsAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("segments")),
+                histogramsAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("histograms")),
+                bestSplitsAllocator(boost::make_shared<cuv::pooled_cuda_allocator>("bestSplits")) {
+}
+
+bool LevelFeatureEvaluation::isApplicable(const SamplesPerNode& samplesPerNode) {
+
+    if (configuration.getAccelerationMode() != GPU_ONLY || samplesPerNode.empty()) {
+        return false;
+    }
+
+    const size_t numLabels = samplesPerNode[0].first->getNumClasses();
+    const size_t sharedMemory = fusedSharedMemorySize(configuration.getThresholds(), numLabels);
+    return (sharedMemory <= nodeEvaluation.getDeviceContext().getSharedMemoryPerBlock());
+}
+
+class LevelFeatureEvaluation::LevelNodes {
+
+public:
 
-        if (profile.isEnabled()) {
-            cudaSafeCall(cudaStreamSynchronize(streams[1]));
+    LevelFeatureEvaluation* evaluation;
+    const SamplesPerNode* samplesPerNode;
+
+    // the nodes [nodeBegin, nodeEnd) of the tree
+    size_t nodeBegin;
+    size_t nodeEnd;
+
+    const ImageFeaturesAndThresholds<cuv::dev_memory_space>* featuresAndThresholds;
+    const ImageFeaturesAndThresholds<cuv::host_memory_space>* featuresAndThresholdsHost;
+
+    std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> >* bestSplits;
+
+    size_t numNodes() const {
+        return nodeEnd - nodeBegin;
+    }
+
+    size_t numLabels() const {
+        return (*samplesPerNode)[nodeBegin].first->getNumClasses();
+    }
+
+    RandomTree<PixelInstance, ImageFeatureFunction>& getNode(size_t node) const {
+        return *(*samplesPerNode)[nodeBegin + node].first;
+    }
+
+    const std::vector<const PixelInstance*>& getSamples(size_t node) const {
+        return (*samplesPerNode)[nodeBegin + node].second;
+    }
+};
+
+std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > LevelFeatureEvaluation::evaluateBestSplits(
+        RandomSource& randomSource, const SamplesPerNode& samplesPerNode) {
+
+    const std::vector<LevelFeatureEvaluation*> evaluations(1, this);
+    const std::vector<RandomSource*> randomSources(1, &randomSource);
+    const std::vector<const SamplesPerNode*> levelSamplesPerNode(1, &samplesPerNode);
+
+    return evaluateBestSplits(evaluations, randomSources, levelSamplesPerNode)[0];
+}
+
+std::vector<std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > >
+LevelFeatureEvaluation::evaluateBestSplits(const std::vector<LevelFeatureEvaluation*>& evaluations,
+        const std::vector<RandomSource*>& randomSources,
+        const std::vector<const SamplesPerNode*>& samplesPerNode) {
+
+    assert(evaluations.size() == randomSources.size());
+    assert(evaluations.size() == samplesPerNode.size());
+
+    const size_t numTrees = evaluations.size();
+
+    std::vector<std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > > bestSplits(numTrees);
+
+    std::vector<size_t> levelTrees;
+    for (size_t tree = 0; tree < numTrees; tree++) {
+        if (evaluations[tree]->getDeviceId() != evaluations[0]->getDeviceId()) {
+            throw std::runtime_error(boost::str(boost::format("tree %d is trained on device %d instead of %d")
+                    % evaluations[tree]->nodeEvaluation.treeId % evaluations[tree]->getDeviceId()
+                    % evaluations[0]->getDeviceId()));
+        }
+        if (evaluations[tree]->isApplicable(*samplesPerNode[tree])) {
+            levelTrees.push_back(tree);
+        } else {
+            bestSplits[tree] = evaluations[tree]->nodeEvaluation.evaluateBestSplits(*randomSources[tree],
+                    *samplesPerNode[tree]);
         }
+    }
 
+    if (levelTrees.empty()) {
+        return bestSplits;
     }
 
-    cuv::ndarray<ScoreType, cuv::host_memory_space> scoresCPU(scores, streams[1]);
-    cudaSafeCall(cudaStreamSynchronize(streams[1]));
+    utils::Timer levelTimer;
 
-    return scoresCPU;
+    const TrainingConfiguration& configuration = evaluations[levelTrees[0]]->configuration;
+    const unsigned int numFeatures = configuration.getFeatureCount();
+    const unsigned int numThresholds = configuration.getThresholds();
+
+    ImageFeatureEvaluation& nodeEvaluation = evaluations[levelTrees[0]]->nodeEvaluation;
+    const ImageCache& imageCache = nodeEvaluation.getDeviceContext().getImageCache();
+    size_t totalTransferTimeMicrosecondsStart = imageCache.getTotalTransferTimeMircoseconds();
+    const CacheStatistics imageCacheStatisticsStart(imageCache);
+
+    std::vector<boost::shared_ptr<ImageFeaturesAndThresholds<cuv::dev_memory_space> > > featuresAndThresholds;
+    std::vector<boost::shared_ptr<ImageFeaturesAndThresholds<cuv::host_memory_space> > > featuresAndThresholdsHost;
+
+    for (size_t i = 0; i < levelTrees.size(); i++) {
+        const size_t tree = levelTrees[i];
+        LevelFeatureEvaluation& evaluation = *evaluations[tree];
+        const SamplesPerNode& treeSamplesPerNode = *samplesPerNode[tree];
+
+        assert(evaluation.configuration.getFeatureCount() == numFeatures);
+        assert(evaluation.configuration.getThresholds() == numThresholds);
+
+        // same features as ImageFeatureEvaluation::evaluateBestSplits() draws for this level
+        utils::Timer generatingRandomFeaturesTimer;
+
+        const std::vector<const PixelInstance*> allSamples =
+                evaluation.nodeEvaluation.getFeatureGenerationSamples(treeSamplesPerNode);
+        const int seed = randomSources[tree]->uniformSampler(0xFFFFFF).getNext();
+        featuresAndThresholds.push_back(boost::make_shared<ImageFeaturesAndThresholds<cuv::dev_memory_space> >(
+                evaluation.nodeEvaluation.generateRandomFeatures(allSamples, seed, true, cuv::dev_memory_space())));
+
+        CURFIL_INFO("generating random features: " << generatingRandomFeaturesTimer.format(2));
+
+        // to construct the split functions without element-wise transfers
+        featuresAndThresholdsHost.push_back(boost::make_shared<ImageFeaturesAndThresholds<cuv::host_memory_space> >(
+                *featuresAndThresholds.back()));
+
+        // ImageFeatureEvaluation::prepare() does the same
+        evaluation.nodeEvaluation.imageWidth = treeSamplesPerNode[0].second[0]->width();
+        evaluation.nodeEvaluation.imageHeight = treeSamplesPerNode[0].second[0]->height();
+
+        bestSplits[tree].resize(treeSamplesPerNode.size());
+    }
+
+    // the counters of the nodes of all trees that are evaluated together must fit into this memory.
+    // the budget of the device memory plan, if any, see DeviceMemoryPlan
+    size_t countersMemory = DeviceMemoryUsage::getBudget("counters");
+    if (countersMemory == 0) {
+        countersMemory = std::min(MAX_COUNTERS_MEMORY, utils::getFreeMemoryOnGPU(nodeEvaluation.getDeviceId()) / 4);
+    }
+
+    std::vector<LevelNodes> levelNodes;
+    size_t levelNodesMemory = 0;
+    size_t numNodes = 0;
+
+    for (size_t i = 0; i < levelTrees.size(); i++) {
+        const size_t tree = levelTrees[i];
+        const SamplesPerNode& treeSamplesPerNode = *samplesPerNode[tree];
+
+        const size_t numLabels = treeSamplesPerNode[0].first->getNumClasses();
+        const size_t countersMemoryPerNode = sizeof(WeightType)
+                * countersPerNode(numFeatures, numThresholds, numLabels, configuration.isBinnedSplits());
+        const size_t maxNodesPerLaunch = std::max(static_cast<size_t>(1),
+                std::min(MAX_GRID_SIZE, countersMemory / countersMemoryPerNode));
+
+        for (size_t nodeBegin = 0; nodeBegin < treeSamplesPerNode.size(); nodeBegin += maxNodesPerLaunch) {
+            LevelNodes nodes;
+            nodes.evaluation = evaluations[tree];
+            nodes.samplesPerNode = &treeSamplesPerNode;
+            nodes.nodeBegin = nodeBegin;
+            nodes.nodeEnd = std::min(treeSamplesPerNode.size(), nodeBegin + maxNodesPerLaunch);
+            nodes.featuresAndThresholds = featuresAndThresholds[i].get();
+            nodes.featuresAndThresholdsHost = featuresAndThresholdsHost[i].get();
+            nodes.bestSplits = &bestSplits[tree];
+
+            const size_t nodesMemory = nodes.numNodes() * countersMemoryPerNode;
+            if (!levelNodes.empty() && levelNodesMemory + nodesMemory > countersMemory) {
+                evaluateNodes(levelNodes);
+                levelNodes.clear();
+                levelNodesMemory = 0;
+            }
+
+            levelNodes.push_back(nodes);
+            levelNodesMemory += nodesMemory;
+            numNodes += nodes.numNodes();
+        }
+    }
+
+    evaluateNodes(levelNodes);
+
+    size_t totalTransferTimeMicrosecondsEnd = imageCache.getTotalTransferTimeMircoseconds();
+    assert(totalTransferTimeMicrosecondsEnd >= totalTransferTimeMicrosecondsStart);
+    double transferTime = (totalTransferTimeMicrosecondsEnd - totalTransferTimeMicrosecondsStart)
+            / static_cast<double>(1e6);
+
+    if (transferTime > 0) {
+        CURFIL_INFO((boost::format("image cache transfer time: %.3f s") % transferTime).str());
+        CURFIL_INFO("image cache: " << (CacheStatistics(imageCache) - imageCacheStatisticsStart));
+    }
+
+    CURFIL_INFO("evaluated " << numNodes << " nodes of " << levelTrees.size() << " trees in "
+            << levelTimer.format(3));
+
+    return bestSplits;
+}
+
+// samples of many nodes in one batch
+class LevelBatch {
+
+public:
+
+    std::vector<const PixelInstance*> samples;
+
+    // segment i contains the samples [segmentBegins[i], segmentBegins[i+1]) of node segmentNodes[i]
+    std::vector<unsigned int> segmentBegins;
+    std::vector<unsigned int> segmentNodes;
+
+    LevelBatch() :
+            samples(), segmentBegins(1, 0), segmentNodes() {
+    }
+
+    size_t numSegments() const {
+        return segmentNodes.size();
+    }
+
+    void addSample(const PixelInstance* sample, unsigned int node, unsigned int maxSegmentSize) {
+        if (segmentNodes.empty() || segmentNodes.back() != node
+                || samples.size() - segmentBegins.back() == maxSegmentSize) {
+            if (!segmentNodes.empty()) {
+                segmentBegins.push_back(samples.size());
+            }
+            segmentNodes.push_back(node);
+        }
+        samples.push_back(sample);
+    }
+
+    void finish() {
+        segmentBegins.push_back(samples.size());
+        assert(segmentBegins.size() == segmentNodes.size() + 1);
+    }
+};
+
+template<class FeatureResponse>
+static void launchLevelFeatureResponseHistogramsKernel(dim3 blockSize, dim3 threads, size_t sharedMemory,
+        cudaStream_t stream, WeightType* counters,
+        const unsigned int* segmentBegins, const unsigned int* segmentNodes,
+        const ImageFeaturesAndThresholds<cuv::dev_memory_space>& featuresAndThresholds,
+        const Samples<cuv::dev_memory_space>& sampleData,
+        unsigned int imageWidth, unsigned int imageHeight,
+        unsigned int numThresholds, unsigned int numLabels, unsigned int numFeatures, bool binned) {
+
+    levelFeatureResponseHistogramsKernel<FeatureResponse><<<blockSize, threads, sharedMemory, stream>>>(
+            counters,
+            segmentBegins,
+            segmentNodes,
+            featuresAndThresholds.thresholds().ptr(),
+            sampleData.labels,
+            featuresAndThresholds.types().ptr(),
+            imageWidth, imageHeight,
+            featuresAndThresholds.offset1X().ptr(), featuresAndThresholds.offset1Y().ptr(),
+            featuresAndThresholds.offset2X().ptr(), featuresAndThresholds.offset2Y().ptr(),
+            featuresAndThresholds.region1X().ptr(), featuresAndThresholds.region1Y().ptr(),
+            featuresAndThresholds.region2X().ptr(), featuresAndThresholds.region2Y().ptr(),
+            featuresAndThresholds.channel1().ptr(), featuresAndThresholds.channel2().ptr(),
+            sampleData.sampleX, sampleData.sampleY, sampleData.depths, sampleData.imageNumbers,
+            numThresholds,
+            numLabels,
+            numFeatures,
+            binned
+    );
+}
+
+void LevelFeatureEvaluation::evaluateNodes(const std::vector<LevelNodes>& levelNodes) {
+
+    assert(!levelNodes.empty());
+
+    utils::Timer evaluateNodesTimer;
+
+    trace::LevelScope levelScope(levelNodes[0].getNode(0).getLevel());
+
+    const TrainingConfiguration& configuration = levelNodes[0].evaluation->configuration;
+    const unsigned int numFeatures = configuration.getFeatureCount();
+    const unsigned int numThresholds = configuration.getThresholds();
+
+    DeviceContext& context = levelNodes[0].evaluation->nodeEvaluation.getDeviceContext();
+    tbb::mutex& textureMutex = context.getTextureMutex();
+    const cudaStream_t stream = context.getStream(0);
+
+    const size_t transferTimeStart = context.getImageCache().getTotalTransferTimeMircoseconds();
+
+    // the images are transferred in groups that fit into the image cache, in the order the nodes sample them.
+    // each group is transferred once for the nodes of all trees
+    const size_t imagesPerGroup = std::max(1, configuration.getImageCacheSize());
+    std::map<const RGBDImage*, size_t> imageGroups;
+    for (size_t i = 0; i < levelNodes.size(); i++) {
+        for (size_t node = 0; node < levelNodes[i].numNodes(); node++) {
+            const std::vector<const PixelInstance*>& samples = levelNodes[i].getSamples(node);
+            for (size_t sampleNr = 0; sampleNr < samples.size(); sampleNr++) {
+                const RGBDImage* image = samples[sampleNr]->getRGBDImage();
+                if (imageGroups.find(image) == imageGroups.end()) {
+                    const size_t group = imageGroups.size() / imagesPerGroup;
+                    imageGroups[image] = group;
+                }
+            }
+        }
+    }
+    const size_t numGroups = (imageGroups.size() + imagesPerGroup - 1) / imagesPerGroup;
+
+    // the batches of group g and nodes i are at g * levelNodes.size() + i.
+    // the samples of a batch are ordered by node. the same constraints as in ImageFeatureEvaluation::prepare() apply
+    std::vector<std::vector<LevelBatch> > groupBatches(numGroups * levelNodes.size());
+    for (size_t i = 0; i < levelNodes.size(); i++) {
+        const size_t numLabels = levelNodes[i].numLabels();
+        for (unsigned int node = 0; node < levelNodes[i].numNodes(); node++) {
+            const std::vector<const PixelInstance*>& samples = levelNodes[i].getSamples(node);
+            assert(!samples.empty());
+            assert(levelNodes[i].getNode(node).getNumClasses() == numLabels);
+
+            for (size_t sampleNr = 0; sampleNr < samples.size(); sampleNr++) {
+                const PixelInstance* sample = samples[sampleNr];
+                assert(sample->getDepth().isValid());
+
+                std::vector<LevelBatch>& batches = groupBatches[imageGroups[sample->getRGBDImage()]
+                        * levelNodes.size() + i];
+                if (batches.empty() || batches.back().samples.size() == configuration.getMaxSamplesPerBatch()
+                        || batches.back().numSegments() == MAX_GRID_SIZE) {
+                    if (!batches.empty()) {
+                        batches.back().finish();
+                    }
+                    batches.push_back(LevelBatch());
+                }
+
+                batches.back().addSample(sample, node, MAX_SEGMENT_SIZE);
+            }
+        }
+    }
+
+    // the batches in the order of the kernel launches together with the index of their nodes
+    std::vector<std::pair<size_t, const LevelBatch*> > launches;
+    for (size_t groupBatch = 0; groupBatch < groupBatches.size(); groupBatch++) {
+        std::vector<LevelBatch>& batches = groupBatches[groupBatch];
+        for (size_t batch = 0; batch < batches.size(); batch++) {
+            if (batch + 1 == batches.size()) {
+                batches[batch].finish();
+            }
+            launches.push_back(std::make_pair(groupBatch % levelNodes.size(), &batches[batch]));
+        }
+    }
+
+    {
+        std::vector<std::set<const RGBDImage*> > schedule(launches.size());
+        for (size_t launch = 0; launch < launches.size(); launch++) {
+            const std::vector<const PixelInstance*>& samples = launches[launch].second->samples;
+            for (size_t sample = 0; sample < samples.size(); sample++) {
+                schedule[launch].insert(samples[sample]->getRGBDImage());
+            }
+        }
+
+        tbb::mutex::scoped_lock textureLock;
+        {
+            trace::Scope wait("texture mutex", trace::WAIT);
+            textureLock.acquire(textureMutex);
+        }
+        context.getImageCache().setSchedule(schedule);
+    }
+
+    utils::Timer featureResponsesAndHistogramsTimer;
+
+    // the host buffers of asynchronous transfers must not be freed before the stream is synchronized
+    std::vector<boost::shared_ptr<cuv::ndarray<WeightType, cuv::dev_memory_space> > > counters;
+    std::vector<boost::shared_ptr<cuv::ndarray<WeightType, cuv::host_memory_space> > > histogramsHost;
+    DeviceMemoryUsage::Scope countersMemory("counters");
+    std::vector<boost::shared_ptr<cuv::ndarray<WeightType, cuv::dev_memory_space> > > histograms;
+
+    for (size_t i = 0; i < levelNodes.size(); i++) {
+        const unsigned int numNodes = levelNodes[i].numNodes();
+        const size_t numLabels = levelNodes[i].numLabels();
+        LevelFeatureEvaluation& evaluation = *levelNodes[i].evaluation;
+
+        // see functions counterOffset() and binOffset(). the counters of the nodes are consecutive
+        counters.push_back(boost::make_shared<cuv::ndarray<WeightType, cuv::dev_memory_space> >(
+                numNodes * countersPerNode(numFeatures, numThresholds, numLabels, configuration.isBinnedSplits()),
+                evaluation.nodeEvaluation.countersAllocator));
+        cudaSafeCall(cudaMemsetAsync(counters.back()->ptr(), 0,
+                static_cast<size_t>(counters.back()->size() * sizeof(WeightType)), stream));
+        countersMemory.add(counters.back()->size() * sizeof(WeightType));
+
+        histogramsHost.push_back(boost::make_shared<cuv::ndarray<WeightType, cuv::host_memory_space> >(
+                numNodes, numLabels, evaluation.histogramsAllocator));
+        for (unsigned int node = 0; node < numNodes; node++) {
+            const cuv::ndarray<WeightType, cuv::host_memory_space>& histogram =
+                    levelNodes[i].getNode(node).getHistogram();
+            assert(histogram.size() == numLabels);
+            for (size_t label = 0; label < numLabels; label++) {
+                (*histogramsHost.back())(node, label) = histogram[label];
+            }
+        }
+        histograms.push_back(boost::make_shared<cuv::ndarray<WeightType, cuv::dev_memory_space> >(
+                *histogramsHost.back(), stream));
+    }
+
+    std::vector<boost::shared_ptr<Samples<cuv::host_memory_space> > > sampleDataHost;
+    std::vector<boost::shared_ptr<Samples<cuv::dev_memory_space> > > sampleDataDevice;
+    std::vector<boost::shared_ptr<cuv::ndarray<unsigned int, cuv::host_memory_space> > > segmentsHost;
+    std::vector<boost::shared_ptr<cuv::ndarray<unsigned int, cuv::dev_memory_space> > > segmentsDevice;
+
+    cudaSafeCall(cudaFuncSetCacheConfig(levelFeatureResponseHistogramsKernel<float>, cudaFuncCachePreferL1));
+    cudaSafeCall(cudaFuncSetCacheConfig(levelFeatureResponseHistogramsKernel<FeatureResponseType>,
+            cudaFuncCachePreferL1));
+
+    for (size_t launch = 0; launch < launches.size(); launch++) {
+        const LevelNodes& nodes = levelNodes[launches[launch].first];
+        ImageFeatureEvaluation& nodeEvaluation = nodes.evaluation->nodeEvaluation;
+        const LevelBatch& currentBatch = *launches[launch].second;
+        const size_t numSegments = currentBatch.numSegments();
+        const size_t numLabels = nodes.numLabels();
+        assert(numSegments > 0);
+
+        const size_t sharedMemory = fusedSharedMemorySize(numThresholds, numLabels);
+        assert(sharedMemory <= context.getSharedMemoryPerBlock());
+
+        // segment begins followed by the segment nodes
+        segmentsHost.push_back(boost::make_shared<cuv::ndarray<unsigned int, cuv::host_memory_space> >(
+                2 * numSegments + 1, nodes.evaluation->segmentsAllocator));
+        cuv::ndarray<unsigned int, cuv::host_memory_space>& segments = *segmentsHost.back();
+        std::copy(currentBatch.segmentBegins.begin(), currentBatch.segmentBegins.end(), segments.ptr());
+        std::copy(currentBatch.segmentNodes.begin(), currentBatch.segmentNodes.end(),
+                segments.ptr() + numSegments + 1);
+
+        tbb::mutex::scoped_lock textureLock;
+        {
+            trace::Scope wait("texture mutex", trace::WAIT, launch);
+            textureLock.acquire(textureMutex);
+        }
+
+        sampleDataHost.push_back(boost::make_shared<Samples<cuv::host_memory_space> >(currentBatch.samples.size(),
+                nodeEvaluation.sampleDataAllocator));
+        sampleDataDevice.push_back(boost::make_shared<Samples<cuv::dev_memory_space> >(
+                nodeEvaluation.copySamplesToDeviceAsync(currentBatch.samples, *sampleDataHost.back(), stream)));
+        segmentsDevice.push_back(boost::make_shared<cuv::ndarray<unsigned int, cuv::dev_memory_space> >(
+                segments, stream));
+
+        const Samples<cuv::dev_memory_space>& sampleData = *sampleDataDevice.back();
+        const unsigned int* segmentBegins = segmentsDevice.back()->ptr();
+        const unsigned int* segmentNodes = segmentBegins + numSegments + 1;
+        WeightType* nodeCounters = counters[launches[launch].first]->ptr();
+
+        // most segments are small below the first levels
+        dim3 blockSize(numFeatures, numSegments);
+        dim3 threads(64);
+
+        CURFIL_DEBUG("level feature response kernel: launching " << blockSize.x << "x" << blockSize.y
+                << " blocks with " << threads.x << " threads");
+
+        trace::GpuSpan span("level feature responses and histograms", stream, trace::KERNEL, launch);
+        if (configuration.isSinglePrecisionFeatures()) {
+            launchLevelFeatureResponseHistogramsKernel<float>(blockSize, threads, sharedMemory, stream,
+                    nodeCounters, segmentBegins, segmentNodes, *nodes.featuresAndThresholds, sampleData,
+                    nodeEvaluation.imageWidth, nodeEvaluation.imageHeight, numThresholds, numLabels, numFeatures,
+                    configuration.isBinnedSplits());
+        } else {
+            launchLevelFeatureResponseHistogramsKernel<FeatureResponseType>(blockSize, threads, sharedMemory, stream,
+                    nodeCounters, segmentBegins, segmentNodes, *nodes.featuresAndThresholds, sampleData,
+                    nodeEvaluation.imageWidth, nodeEvaluation.imageHeight, numThresholds, numLabels, numFeatures,
+                    configuration.isBinnedSplits());
+        }
+    }
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+
+    const double featureResponsesAndHistogramsTime = featureResponsesAndHistogramsTimer.getSeconds();
+
+    // the image uploads of the kernel launches
+    const size_t transferTimeEnd = context.getImageCache().getTotalTransferTimeMircoseconds();
+    assert(transferTimeEnd >= transferTimeStart);
+    const double transferTime = (transferTimeEnd - transferTimeStart) / static_cast<double>(1e6);
+
+    utils::Timer calculateScoresTimer;
+
+    std::vector<boost::shared_ptr<cuv::ndarray<ScoreType, cuv::dev_memory_space> > > scores;
+    std::vector<boost::shared_ptr<cuv::ndarray<unsigned int, cuv::dev_memory_space> > > bestSplitIds;
+    std::vector<boost::shared_ptr<cuv::ndarray<ScoreType, cuv::dev_memory_space> > > bestScores;
+    std::vector<boost::shared_ptr<cuv::ndarray<unsigned int, cuv::host_memory_space> > > bestSplitIdsHost;
+    std::vector<boost::shared_ptr<cuv::ndarray<ScoreType, cuv::host_memory_space> > > bestScoresHost;
+    DeviceMemoryUsage::Scope scoresMemory("scores");
+
+    cudaSafeCall(cudaFuncSetCacheConfig(scoreKernel, cudaFuncCachePreferL1));
+
+    for (size_t i = 0; i < levelNodes.size(); i++) {
+        const unsigned int numNodes = levelNodes[i].numNodes();
+        const size_t numLabels = levelNodes[i].numLabels();
+        LevelFeatureEvaluation& evaluation = *levelNodes[i].evaluation;
+
+        scores.push_back(boost::make_shared<cuv::ndarray<ScoreType, cuv::dev_memory_space> >(
+                numNodes * numThresholds * numFeatures, evaluation.nodeEvaluation.scoresAllocator));
+        scoresMemory.add(scores.back()->size() * sizeof(ScoreType));
+
+        {
+            int threadsPerBlock = std::min(numFeatures, 128u);
+            int blocks = std::ceil(numFeatures / static_cast<float>(threadsPerBlock));
+            dim3 threads(threadsPerBlock);
+            dim3 blockSize(blocks, numThresholds, numNodes);
+
+            if (configuration.isBinnedSplits()) {
+                scanBins(counters[i]->ptr(), numThresholds, numLabels, numFeatures, numNodes, stream);
+            }
+
+            trace::GpuSpan span("level score kernel", stream);
+            scoreKernel<<<blockSize, threads, 0, stream>>>(
+                    counters[i]->ptr(),
+                    levelNodes[i].featuresAndThresholds->thresholds().ptr(),
+                    numThresholds,
+                    numLabels,
+                    numFeatures,
+                    histograms[i]->ptr(),
+                    scores.back()->ptr(),
+                    configuration.isBinnedSplits()
+            );
+        }
+
+        bestSplitIds.push_back(boost::make_shared<cuv::ndarray<unsigned int, cuv::dev_memory_space> >(
+                numNodes, evaluation.bestSplitsAllocator));
+        bestScores.push_back(boost::make_shared<cuv::ndarray<ScoreType, cuv::dev_memory_space> >(
+                numNodes, evaluation.bestSplitsAllocator));
+
+        {
+            int threadsPerBlock = std::min(numNodes, 128u);
+            int blocks = std::ceil(numNodes / static_cast<float>(threadsPerBlock));
+
+            trace::GpuSpan span("best splits kernel", stream);
+
+            bestSplitsKernel<<<blocks, threadsPerBlock, 0, stream>>>(
+                    scores.back()->ptr(),
+                    numThresholds,
+                    numFeatures,
+                    numNodes,
+                    bestSplitIds.back()->ptr(),
+                    bestScores.back()->ptr()
+            );
+        }
+
+        bestSplitIdsHost.push_back(boost::make_shared<cuv::ndarray<unsigned int, cuv::host_memory_space> >(
+                *bestSplitIds.back(), stream));
+        bestScoresHost.push_back(boost::make_shared<cuv::ndarray<ScoreType, cuv::host_memory_space> >(
+                *bestScores.back(), stream));
+    }
+
+    cudaSafeCall(cudaStreamSynchronize(stream));
+
+    const double calculateScoresTime = calculateScoresTimer.getSeconds();
+    const double evaluationTime = evaluateNodesTimer.getSeconds();
+
+    for (size_t i = 0; i < levelNodes.size(); i++) {
+        const ImageFeaturesAndThresholds<cuv::host_memory_space>& featuresAndThresholdsHost =
+                *levelNodes[i].featuresAndThresholdsHost;
+        const size_t numLabels = levelNodes[i].numLabels();
+        const size_t nodeCounters = countersPerNode(numFeatures, numThresholds, numLabels,
+                configuration.isBinnedSplits());
+
+        for (unsigned int node = 0; node < levelNodes[i].numNodes(); node++) {
+            RandomTree<PixelInstance, ImageFeatureFunction>& currentNode = levelNodes[i].getNode(node);
+
+            const unsigned int bestSplit = (*bestSplitIdsHost[i])[node];
+            const ScoreType bestScore = (*bestScoresHost[i])[node];
+
+            assert(bestScore > 0.0);
+
+            const uint16_t bestThresh = bestSplit / numFeatures;
+            const unsigned int bestFeat = bestSplit % numFeatures;
+            assert(bestThresh < numThresholds);
+
+            const ImageFeatureFunction feature = featuresAndThresholdsHost.getFeatureFunction(bestFeat);
+            const float threshold = featuresAndThresholdsHost.getThreshold(bestThresh, bestFeat);
+
+            CURFIL_DEBUG("tree " << currentNode.getTreeId() << ", node " << currentNode.getNodeId() <<
+                    ", best score: " << bestScore << ", " << feature);
+
+            // the times of all nodes that were evaluated together
+            currentNode.setTimerValue("transferImages", transferTime);
+            currentNode.setTimerValue("featureResponsesAndHistograms", featureResponsesAndHistogramsTime);
+            currentNode.setTimerValue("calculateScores", calculateScoresTime);
+            currentNode.setTimerValue("evaluateBestSplit", evaluationTime);
+
+            SplitFunction<PixelInstance, ImageFeatureFunction> split(bestFeat, feature, threshold, bestScore,
+                    configuration.isSinglePrecisionSplits());
+
+            // the histograms of the children, taken from the counters of the node
+            std::vector<WeightType> leftHistogram(numLabels);
+            std::vector<WeightType> rightHistogram(numLabels);
+            evaluation.nodeEvaluation.copySplitHistograms(
+                    counters[i]->ptr() + node * nodeCounters, bestFeat, bestThresh, leftHistogram, rightHistogram);
+            split.setHistograms(leftHistogram, rightHistogram);
+
+            (*levelNodes[i].bestSplits)[levelNodes[i].nodeBegin + node] = split;
+        }
+    }
 }
 
 boost::shared_ptr<const TreeNodes> convertTree(
@@ -1,13 +1,18 @@
 #ifndef CURFIL_RANDOM_TREE_IMAGE_GPU_H
 #define CURFIL_RANDOM_TREE_IMAGE_GPU_H
 
+#include <boost/scoped_ptr.hpp>
 #include <cuda_runtime_api.h>
 #include <limits.h>
 #include <map>
+#include <ostream>
 #include <set>
+#include <tbb/mutex.h>
+#include <tbb/tbb_thread.h>
 #include <vector_types.h>
 #include <vector>
 
+#include "device_memory.h"
 #include "image.h"
 #include "random_tree_image.h"
 
@@ -22,8 +27,19 @@ static const int depthValidChannel = 1;
 static const unsigned int NODES_PER_TREE_LAYER = 2048;
 static const unsigned int LAYERS_PER_TREE = 16;
 
+// a binary tree with LAYERS_PER_TREE * NODES_PER_TREE_LAYER nodes has at most half of them as leaves
+static const unsigned int LEAF_LAYERS_PER_TREE = LAYERS_PER_TREE / 2;
+
+// limited by the maximal number of layers (2048) of a layered texture
+static const unsigned int MAX_FOREST_TREES = 128;
+
+static const unsigned int MAX_BATCH_IMAGES = 256;
+
 /**
- * helper class to map random forest data to texture cache on GPU
+ * helper class to map random forest data to texture cache on GPU.
+ *
+ * Nodes only hold the split parameters. Leaf nodes hold the index of their normalized histogram in a separate
+ * histogram table, such that interior nodes do not waste one histogram each.
  */
 class TreeNodes {
 
@@ -34,20 +50,28 @@ private:
     static const size_t offsetFeatures = offsetTypes + 4;
     static const size_t offsetChannels = offsetFeatures + 8;
     static const size_t offsetThreshold = offsetChannels + 4;
-    static const size_t offsetHistograms = offsetThreshold + 4;
+    static const size_t nodeSize = offsetThreshold + 4;
 
     size_t m_treeId;
     size_t m_numNodes;
+    size_t m_numLeaves;
     size_t m_numLabels;
     size_t m_sizePerNode;
     cuv::ndarray<int8_t, cuv::host_memory_space> m_data;
+    cuv::ndarray<float, cuv::host_memory_space> m_histograms;
+
+    // keeps external memory alive that m_data and m_histograms refer to, e.g. a memory-mapped forest file
+    boost::shared_ptr<const void> m_storage;
 
     template<class T>
     void setValue(size_t node, size_t offset, const T& value);
 
+    template<class T>
+    T getValue(size_t node, size_t offset) const;
+
     void setLeftNodeOffset(size_t node, int offset);
     void setThreshold(size_t node, float threshold);
-    void setHistogramValue(size_t node, size_t label, float value);
+    void setHistogramValue(size_t leaf, size_t label, float value);
     void setType(size_t node, int8_t value);
     void setOffset1X(size_t node, int8_t value);
     void setOffset1Y(size_t node, int8_t value);
@@ -70,6 +94,22 @@ public:
 
     TreeNodes(const boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> >& tree);
 
+    /**
+     * Refers to nodes and leaf histograms in the layout of data() and histograms() without copying them.
+     *
+     * @param data nodeLayers × NODES_PER_TREE_LAYER nodes
+     * @param histograms leafLayers × NODES_PER_TREE_LAYER leaf histograms
+     * @param storage owns the memory of 'data' and 'histograms'. the memory is never written
+     */
+    TreeNodes(size_t treeId, size_t numNodes, size_t numLeaves, size_t numLabels,
+            size_t nodeLayers, const int8_t* data, size_t leafLayers, const float* histograms,
+            const boost::shared_ptr<const void>& storage);
+
+    // the number of bytes per node in data()
+    static size_t getNodeSize() {
+        return nodeSize;
+    }
+
     size_t getTreeId() const {
         return m_treeId;
     }
@@ -78,6 +118,10 @@ public:
         return m_numNodes;
     }
 
+    size_t numLeaves() const {
+        return m_numLeaves;
+    }
+
     size_t numLabels() const {
         return m_numLabels;
     }
@@ -94,6 +138,31 @@ public:
         return m_data;
     }
 
+    // numLeaves (rounded up to full layers) × numLabels
+    const cuv::ndarray<float, cuv::host_memory_space>& histograms() const {
+        return m_histograms;
+    }
+
+    // the number of layers of data() that hold nodes
+    size_t nodeLayers() const {
+        return (m_numNodes + NODES_PER_TREE_LAYER - 1) / NODES_PER_TREE_LAYER;
+    }
+
+    // -(leaf index + 1) for leaf nodes
+    int getLeftNodeOffset(size_t node) const;
+    float getThreshold(size_t node) const;
+    int getType(size_t node) const;
+    int8_t getOffset1X(size_t node) const;
+    int8_t getOffset1Y(size_t node) const;
+    int8_t getRegion1X(size_t node) const;
+    int8_t getRegion1Y(size_t node) const;
+    int8_t getOffset2X(size_t node) const;
+    int8_t getOffset2Y(size_t node) const;
+    int8_t getRegion2X(size_t node) const;
+    int8_t getRegion2Y(size_t node) const;
+    uint16_t getChannel1(size_t node) const;
+    uint16_t getChannel2(size_t node) const;
+
 };
 
 class DeviceCache {
@@ -116,14 +185,58 @@ public:
 
     void clear();
 
-    size_t getTotalTransferTimeMircoseconds() const {
-        return totalTransferTimeMicroseconds;
+    // removes the element because it is about to be freed. its position is reused first
+    void removeElement(const void* element);
+
+    // waits for pending asynchronous transfers
+    size_t getTotalTransferTimeMircoseconds() const;
+
+    // the transfer time of the elements that the calling thread requested or prefetched.
+    // waits for pending asynchronous transfers
+    size_t getThreadTransferTimeMicroseconds() const;
+
+    // stream that is used to transfer elements to the device
+    void setStream(cudaStream_t stream) {
+        this->stream = stream;
     }
 
+    // spare stream on which upcoming elements of the schedule are transferred. no prefetching if NULL
+    void setPrefetchStream(cudaStream_t prefetchStream) {
+        this->prefetchStream = prefetchStream;
+    }
+
+    /**
+     * Announces the element sets that the next calls of copyElements() will request, in this order.
+     *
+     * The schedule is a hint: the element whose next use lies furthest in the future is evicted first (least
+     * recently used if there is no schedule) and upcoming elements are prefetched on the prefetch stream if that
+     * does not evict an element that is needed earlier.
+     * Every requested element is removed from the first schedule entry that contains it.
+     */
+    void setSchedule(const std::vector<std::set<const void*> >& schedule);
+
+    // number of requested elements that were already on the device
+    size_t getNumHits() const;
+
+    // number of requested elements that had to be transferred
+    size_t getNumMisses() const;
+
+    size_t getNumEvictions() const;
+
+    size_t getNumPrefetches() const;
+
+    // requested and prefetched elements
+    size_t getTotalBytesTransferred() const;
+
 protected:
 
     DeviceCache() :
-            cacheSize(0), elementIdMap(), elementTimes(), currentTime(0), bound(false), totalTransferTimeMicroseconds(0) {
+            cacheSize(0), elementIdMap(), elementTimes(), currentTime(0), bound(false), schedule(),
+                    totalTransferTimeMicroseconds(0), threadTransferTimeMicroseconds(), numHits(0), numMisses(0),
+                    numEvictions(0), numPrefetches(0),
+                    totalBytesTransferred(0), stream(NULL), prefetchStream(NULL), transferStart(NULL),
+                    transferStop(NULL), transferPending(false), transferThread(), prefetchReady(NULL),
+                    prefetchStart(NULL), prefetchStop(NULL), prefetchPending(false), prefetchThread() {
     }
 
     bool isBound() const {
@@ -146,7 +259,8 @@ protected:
 
     void copyElements(size_t cacheSize, const std::set<const void*>& elements);
 
-    virtual void transferElement(size_t pos, const void* element, cudaStream_t stream) = 0;
+    // returns the number of transferred bytes
+    virtual size_t transferElement(size_t pos, const void* element, cudaStream_t stream) = 0;
 
     // for logging
     virtual std::string getElementName(const void* element) const = 0;
@@ -163,10 +277,79 @@ private:
 
     bool bound;
 
-    size_t totalTransferTimeMicroseconds;
+    std::vector<std::set<const void*> > schedule;
+
+    // removes the requested elements from the schedule
+    void consumeSchedule(const std::set<const void*>& elements);
+
+    // index of the first schedule entry that contains the element. max. value if the element is not scheduled
+    std::map<const void*, size_t> getNextUses() const;
+
+    // finds the position for a new element that does not replace an element in 'keep'.
+    // returns false if the cache is full with elements that must be kept
+    bool findReplacement(const std::set<const void*>& keep, const std::map<const void*, size_t>& nextUses,
+            size_t& elementPos, size_t& nextUse) const;
+
+    // returns true if an element was evicted
+    bool replaceElement(size_t elementPos, const void* element);
+
+    void prefetchElements(const std::set<const void*>& elements, const std::map<const void*, size_t>& nextUses);
+
+    // adds the time of the last transfer to the total transfer time
+    void finishTransfer() const;
+
+    mutable size_t totalTransferTimeMicroseconds;
+    mutable std::map<tbb::tbb_thread::id, size_t> threadTransferTimeMicroseconds;
+
+    size_t numHits;
+    size_t numMisses;
+    size_t numEvictions;
+    size_t numPrefetches;
+    size_t totalBytesTransferred;
+
+    cudaStream_t stream;
+    cudaStream_t prefetchStream;
+
+    // transfers are asynchronous. the events are used to measure the transfer time
+    cudaEvent_t transferStart;
+    cudaEvent_t transferStop;
+    mutable bool transferPending;
+    mutable tbb::mutex transferMutex;
+    tbb::tbb_thread::id transferThread;
+
+    // the prefetch stream waits for 'prefetchReady' on the stream of the cache
+    cudaEvent_t prefetchReady;
+    cudaEvent_t prefetchStart;
+    cudaEvent_t prefetchStop;
+    mutable bool prefetchPending;
+    tbb::tbb_thread::id prefetchThread;
 
 };
 
+// snapshot of the counters of a cache
+class CacheStatistics {
+
+public:
+
+    explicit CacheStatistics(const DeviceCache& cache);
+
+    CacheStatistics(size_t hits, size_t misses, size_t evictions, size_t prefetches, size_t bytesTransferred) :
+            hits(hits), misses(misses), evictions(evictions), prefetches(prefetches),
+                    bytesTransferred(bytesTransferred) {
+    }
+
+    // the counters between two snapshots
+    CacheStatistics operator-(const CacheStatistics& other) const;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t prefetches;
+    size_t bytesTransferred;
+};
+
+std::ostream& operator<<(std::ostream& os, const CacheStatistics& statistics);
+
 class ImageCache: public DeviceCache {
 
 private:
@@ -183,6 +366,39 @@ public:
 
     void copyImages(size_t imageCacheSize, const std::vector<const PixelInstance*>& samples);
 
+    // the images of the upcoming calls of copyImages(), see DeviceCache::setSchedule()
+    void setSchedule(const std::vector<std::set<const RGBDImage*> >& images);
+
+    // must be called before an image that might be in the cache is freed. its address may be reused
+    void removeImage(const RGBDImage* image);
+
+    /**
+     * Number of images that are additionally kept on the device in a compact format: half precision color values
+     * and 15 bit depth values (in millimeter) plus the depth valid bit, without integration.
+     * Such images need 8 instead of 20 bytes per pixel. When they are needed again, they are integrated on the device
+     * instead of being transferred from the host. 0 disables the compact format (default).
+     */
+    void setCompactCacheSize(size_t compactCacheSize);
+
+    size_t getCompactCacheSize() const {
+        return compactCacheSize;
+    }
+
+    // number of images that were restored from the compact format
+    size_t getNumCompactHits() const {
+        return numCompactHits;
+    }
+
+    // bytes per image in the compact format
+    static size_t getCompactImageSize(int width, int height);
+
+    /**
+     * Converts the integral images of the image into the compact format and integrates them again on the device,
+     * as the cache does for an evicted image. Meant for tests of the compact format.
+     */
+    static void restoreCompactImage(const RGBDImage& image, cuv::ndarray<float, cuv::host_memory_space>& color,
+            cuv::ndarray<int, cuv::host_memory_space>& depth);
+
 protected:
 
     virtual void bind();
@@ -191,18 +407,50 @@ protected:
     virtual void allocArray();
     virtual void freeArray();
 
-    virtual void transferElement(size_t pos, const void* element, cudaStream_t stream);
+    virtual size_t transferElement(size_t pos, const void* element, cudaStream_t stream);
     virtual std::string getElementName(const void* element) const;
     virtual std::string getElementsName() const;
 
 private:
 
+    // integral images in linear device memory. one set per stream
+    struct StagingBuffers {
+        float* color;
+        int* depth;
+        double* colorRows;
+    };
+
+    const StagingBuffers& getStagingBuffers(cudaStream_t stream);
+
+    void copyToArray(size_t imagePos, const float* color, const int* depth, cudaMemcpyKind kind,
+            cudaStream_t stream);
+
+    // true if the depth values of the image fit into the compact format
+    bool isCompactable(const RGBDImage* image);
+
+    // position in the compact store. replaces the least recently used image
+    size_t allocateCompactImage(const RGBDImage* image);
+
+    void freeCompactImages();
+
     int width;
     int height;
 
     cudaArray* colorTextureData;
     cudaArray* depthTextureData;
 
+    size_t compactCacheSize;
+    uint16_t* compactData;
+    std::map<const RGBDImage*, size_t> compactIdMap;
+    std::map<size_t, size_t> compactTimes;
+    size_t compactTime;
+    size_t numCompactHits;
+    std::map<const RGBDImage*, bool> compactableImages;
+    std::map<cudaStream_t, StagingBuffers> stagingBuffers;
+
+    // the texture arrays, see allocArray()
+    boost::scoped_ptr<DeviceMemoryUsage::Scope> arrayMemory;
+
 };
 
 class TreeCache: public DeviceCache {
@@ -223,7 +471,7 @@ public:
 
 protected:
 
-    virtual void transferElement(size_t elementPos, const void* element, cudaStream_t stream);
+    virtual size_t transferElement(size_t elementPos, const void* element, cudaStream_t stream);
     virtual std::string getElementName(const void* element) const;
     virtual std::string getElementsName() const;
 
@@ -239,6 +487,102 @@ private:
     LabelType numLabels;
 
     cudaArray* treeTextureData;
+    cudaArray* histogramTextureData;
+
+    // the texture arrays, see allocArray()
+    boost::scoped_ptr<DeviceMemoryUsage::Scope> arrayMemory;
+};
+
+/**
+ * State that exists once per GPU device: the streams, the image and tree cache and the mutex that guards the
+ * texture bindings of this device.
+ *
+ * Texture references are bound per device context, so trees that are trained on different devices never have to
+ * wait for each other.
+ */
+class DeviceContext {
+
+private:
+    DeviceContext(const DeviceContext& other);
+    DeviceContext& operator=(const DeviceContext& other);
+
+    explicit DeviceContext(int deviceId);
+
+public:
+
+    static const int NUM_STREAMS = 2;
+
+    ~DeviceContext();
+
+    /**
+     * @return the context of the given device. it is created on first use
+     */
+    static DeviceContext& get(int deviceId);
+
+    /**
+     * @return the context of the device that is currently selected for the calling host thread
+     */
+    static DeviceContext& getCurrent();
+
+    // clears the image caches of all devices
+    static void clearImageCaches();
+
+    // removes the image from the image caches of all devices, see ImageCache::removeImage()
+    static void removeFromImageCaches(const RGBDImage* image);
+
+    int getDeviceId() const {
+        return deviceId;
+    }
+
+    size_t getSharedMemoryPerBlock() const {
+        return sharedMemoryPerBlock;
+    }
+
+    cudaStream_t getStream(int stream) const {
+        assert(stream >= 0 && stream < NUM_STREAMS);
+        return streams[stream];
+    }
+
+    ImageCache& getImageCache() {
+        return imageCache;
+    }
+
+    TreeCache& getTreeCache() {
+        return treeCache;
+    }
+
+    tbb::mutex& getTextureMutex() {
+        return textureMutex;
+    }
+
+    // the cache positions that were last copied to forestTrees and batchImages on this device.
+    // guarded by the texture mutex
+    std::vector<int>& getForestTreePositions() {
+        return forestTreePositions;
+    }
+
+    std::vector<int>& getBatchImagePositions() {
+        return batchImagePositions;
+    }
+
+private:
+
+    const int deviceId;
+
+    size_t sharedMemoryPerBlock;
+
+    cudaStream_t streams[NUM_STREAMS];
+
+    // used by the image cache to prefetch images
+    cudaStream_t prefetchStream;
+
+    ImageCache imageCache;
+    TreeCache treeCache;
+
+    tbb::mutex textureMutex;
+
+    std::vector<int> forestTreePositions;
+    std::vector<int> batchImagePositions;
 };
 
 class RandomTreeImage;
@@ -247,6 +591,7 @@ class RandomTreeImage;
 class TreeNodeData {
 
 public:
+    // -(leaf index + 1) for leaf nodes
     int leftNodeOffset;
     int type;
     int8_t offset1X, offset1Y, region1X, region1Y;
@@ -263,15 +608,137 @@ boost::shared_ptr<const TreeNodes> convertTree(const boost::shared_ptr<const Ran
 
 void normalizeProbabilities(cuv::ndarray<float, cuv::dev_memory_space>& probabilities);
 
+/**
+ * @param confidence if not null, the maximal probability per pixel in a H×W matrix
+ */
 void determineMaxProbabilities(const cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
-        cuv::ndarray<LabelType, cuv::dev_memory_space>& output);
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& output,
+        cuv::ndarray<float, cuv::dev_memory_space>* confidence = 0);
 
+/**
+ * Converts the values to IEEE 754 half precision
+ */
+void convertToHalf(const cuv::ndarray<float, cuv::dev_memory_space>& input,
+        cuv::ndarray<unsigned short, cuv::dev_memory_space>& output);
+
+/**
+ * Decodes a value that was converted by convertToHalf() on the host
+ */
+float halfToFloat(unsigned short half);
+
+/**
+ * @param singlePrecision whether the feature responses are calculated in single precision.
+ *        should match TrainingConfiguration::isSinglePrecisionFeatures() of the forest
+ */
 void classifyImage(int treeCacheSize, cuv::ndarray<float, cuv::dev_memory_space>& output, const RGBDImage& image,
-        LabelType numLabels, const boost::shared_ptr<const TreeNodes>& treeData);
+        LabelType numLabels, const boost::shared_ptr<const TreeNodes>& treeData, bool singlePrecision = false);
+
+/**
+ * Classifies the image with all trees of the forest in a single kernel launch.
+ *
+ * @param probabilities normalized probabilities per class in a C×H×W matrix. need not be initialized
+ * @param labels the label with the maximal probability per pixel in a H×W matrix
+ */
+void classifyImage(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const RGBDImage& image, LabelType numLabels, bool singlePrecision = false);
+
+/**
+ * Classifies a batch of images of the same size with all trees of the forest in a single kernel launch.
+ *
+ * @param probabilities normalized probabilities in a N×C×H×W matrix for N images. need not be initialized
+ * @param labels the label with the maximal probability per pixel in a N×H×W matrix
+ * @param imageCacheSize at least N. keep it constant for consecutive batches to avoid a reallocation of the cache
+ */
+void classifyImages(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const std::vector<const RGBDImage*>& images, LabelType numLabels, size_t imageCacheSize,
+        bool singlePrecision = false);
+
+/**
+ * Classifies the pixels of a list with all trees of the forest in a single kernel launch.
+ *
+ * @param pixels x coordinates in the first and y coordinates in the second row of a 2×N matrix
+ * @param probabilities normalized probabilities per class in a C×N matrix
+ * @param labels the label with the maximal probability per pixel of the list
+ */
+void classifyPixels(const std::vector<boost::shared_ptr<const TreeNodes> >& trees,
+        const cuv::ndarray<int, cuv::dev_memory_space>& pixels,
+        cuv::ndarray<float, cuv::dev_memory_space>& probabilities,
+        cuv::ndarray<LabelType, cuv::dev_memory_space>& labels,
+        const RGBDImage& image, LabelType numLabels, bool singlePrecision = false);
+
+/**
+ * Pre-built launch sequence that classifies images of a fixed size with a fixed forest of at most
+ * MAX_FOREST_TREES trees.
+ *
+ * The output buffers on the device and the page-locked host buffers are allocated once. Per image, the plan copies
+ * the image, launches a single kernel and transfers the results asynchronously. It synchronizes with the host only
+ * once at the end.
+ */
+class PredictionPlan {
+
+public:
+
+    /**
+     * Must be created on the device it classifies the images on
+     */
+    PredictionPlan(const std::vector<boost::shared_ptr<const TreeNodes> >& trees, int width, int height,
+            LabelType numLabels, bool singlePrecision = false);
+
+    ~PredictionPlan();
+
+    /**
+     * @param labels host buffer for the label with the maximal probability per pixel in row-major order
+     * @param probabilities if not null, host buffer for the normalized probabilities in a C×H×W matrix.
+     *        they are only transferred if requested
+     */
+    void execute(const RGBDImage& image, LabelType* labels, float* probabilities = 0);
+
+    int getDeviceId() const {
+        return deviceId;
+    }
+
+    int getWidth() const {
+        return width;
+    }
+
+    int getHeight() const {
+        return height;
+    }
+
+private:
+
+    PredictionPlan(const PredictionPlan& other);
+    PredictionPlan& operator=(const PredictionPlan& other);
+
+    const std::vector<boost::shared_ptr<const TreeNodes> > trees;
+    const int width;
+    const int height;
+    const LabelType numLabels;
+    const bool singlePrecision;
+    int deviceId;
+
+    dim3 threads;
+    dim3 blocks;
+
+    cuv::ndarray<float, cuv::dev_memory_space> deviceProbabilities;
+    cuv::ndarray<LabelType, cuv::dev_memory_space> deviceLabels;
+    DeviceMemoryUsage::Scope deviceMemory;
+
+    // page-locked, so the transfers do not block the host. the probabilities are allocated on first use
+    LabelType* hostLabels;
+    float* hostProbabilities;
+};
 
 // for the unit test
 void clearImageCache();
 
+// see DeviceContext::removeFromImageCaches()
+void removeFromImageCache(const RGBDImage* image);
+
 }
 
 #endif
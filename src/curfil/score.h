@@ -11,6 +11,27 @@ namespace curfil
 
 typedef double ScoreType;
 
+// the counters right of a threshold if only the counters left of it and the totals per label are stored
+template<class W>
+class RightCounters {
+
+public:
+    __host__ __device__
+    RightCounters(const W* leftClasses, const W* totalClasses) :
+            leftClasses(leftClasses), totalClasses(totalClasses) {
+    }
+
+    __host__ __device__
+    W operator[](size_t offset) const {
+        assert(leftClasses[offset] <= totalClasses[offset]);
+        return totalClasses[offset] - leftClasses[offset];
+    }
+
+private:
+    const W* leftClasses;
+    const W* totalClasses;
+};
+
 // Normalized information gain score, see formula (11) in [Wehenkel1991] and
 // appendix A in [Geurts2006].
 class InformationGainScore {
@@ -45,9 +66,10 @@ protected:
 
 public:
 
-    template<class W>
+    // 'rightClasses' is a pointer or RightCounters. by value, so that arrays decay to pointers
+    template<class W, class R>
     __host__ __device__
-    static ScoreType calculateScore(const size_t numLabels, const W* leftClasses, const W* rightClasses,
+    static ScoreType calculateScore(const size_t numLabels, const W* leftClasses, const R rightClasses,
             const unsigned int leftRightStride, const W* allClasses, const ScoreType totalLeft,
             const ScoreType totalRight) {
 
@@ -66,7 +88,7 @@ public:
         for (size_t label = 0; label < numLabels; label++) {
             const size_t offset = label * leftRightStride;
             const W& leftValue = leftClasses[offset];
-            const W& rightValue = rightClasses[offset];
+            const W rightValue = rightClasses[offset];
 
 #ifndef NDEBUG
             assert(leftValue <= allClasses[label]);
@@ -140,9 +162,9 @@ protected:
 
 public:
 
-    template<class W>
+    template<class W, class R>
     __host__ __device__
-    static ScoreType calculateScore(const size_t numClasses, const W* leftClasses, const W* rightClasses,
+    static ScoreType calculateScore(const size_t numClasses, const W* leftClasses, const R rightClasses,
             const unsigned int leftRightStride, const W* allClasses, const ScoreType totalLeft,
             const ScoreType totalRight) {
 
@@ -0,0 +1,348 @@
+#include "server.h"
+
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tbb/tbb_thread.h>
+#include <unistd.h>
+
+#include "random_tree_image_gpu.h"
+#include "utils.h"
+
+namespace curfil {
+
+// returns false if the connection was closed before the first byte
+static bool readFully(int fd, void* buffer, size_t size) {
+    uint8_t* ptr = reinterpret_cast<uint8_t*>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = read(fd, ptr + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw std::runtime_error(std::string("failed to read from connection: ") + strerror(errno));
+        }
+        if (n == 0) {
+            if (done == 0) {
+                return false;
+            }
+            throw std::runtime_error("connection closed in the middle of a request");
+        }
+        done += n;
+    }
+    return true;
+}
+
+static void writeFully(int fd, const void* buffer, size_t size) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, ptr + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error(std::string("failed to write to connection: ") + strerror(errno));
+        }
+        done += n;
+    }
+}
+
+PredictionServer::PredictionServer(const RandomForestImage& randomForest, const std::string& socketPath,
+        bool useDepthFilling, size_t maxBatchSize, int deviceId) :
+        randomForest(randomForest), socketPath(socketPath), useDepthFilling(useDepthFilling),
+                maxBatchSize(maxBatchSize), deviceId(deviceId),
+                stopped(), connectionsMutex(), connections(), requests(),
+                statisticsMutex(), numRequests(0), numBatches(0),
+                averageQueueLatency(), averagePredictLatency(), averageTotalLatency() {
+
+    if (maxBatchSize < 1 || maxBatchSize > MAX_BATCH_IMAGES) {
+        throw std::runtime_error((boost::format("illegal batch size: %d (maximum: %d)")
+                % maxBatchSize % MAX_BATCH_IMAGES).str());
+    }
+
+    stopped = false;
+}
+
+void PredictionServer::run() {
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error(std::string("illegal socket path: '") + socketPath + "'");
+    }
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        throw std::runtime_error(std::string("failed to create socket: ") + strerror(errno));
+    }
+
+    unlink(socketPath.c_str());
+
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listenFd, 16) != 0) {
+        const std::string error = strerror(errno);
+        close(listenFd);
+        throw std::runtime_error((boost::format("failed to listen on '%s': %s") % socketPath % error).str());
+    }
+
+    CURFIL_INFO("prediction server listening on " << socketPath << " (max batch size: " << maxBatchSize << ")");
+
+    tbb::tbb_thread predictThread([this]() {
+        predictRequests();
+    });
+
+    while (!stopped) {
+        pollfd pollFd;
+        pollFd.fd = listenFd;
+        pollFd.events = POLLIN;
+        pollFd.revents = 0;
+
+        // wake up regularly to check whether the server was stopped
+        if (poll(&pollFd, 1, 500) <= 0) {
+            continue;
+        }
+
+        const int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) {
+            CURFIL_WARNING("failed to accept connection: " << strerror(errno));
+            continue;
+        }
+
+        {
+            tbb::mutex::scoped_lock lock(connectionsMutex);
+            connections.insert(fd);
+        }
+
+        tbb::tbb_thread connectionThread([this, fd]() {
+            handleConnection(fd);
+        });
+        connectionThread.detach();
+    }
+
+    close(listenFd);
+    unlink(socketPath.c_str());
+
+    // unblock the connections waiting for requests. requests in flight are still answered
+    {
+        tbb::mutex::scoped_lock lock(connectionsMutex);
+        for (const int fd : connections) {
+            shutdown(fd, SHUT_RD);
+        }
+    }
+
+    while (true) {
+        {
+            tbb::mutex::scoped_lock lock(connectionsMutex);
+            if (connections.empty()) {
+                break;
+            }
+        }
+        tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.01));
+    }
+
+    // an empty request terminates the prediction thread
+    requests.push(boost::shared_ptr<Request>());
+    predictThread.join();
+
+    tbb::mutex::scoped_lock lock(statisticsMutex);
+    CURFIL_INFO("prediction server stopped after " << numRequests << " requests in " << numBatches << " batches");
+}
+
+void PredictionServer::stop() {
+    stopped = true;
+}
+
+void PredictionServer::predictRequests() {
+
+    // the thread must classify on the device the forest was loaded on
+    cudaSafeCall(cudaSetDevice(deviceId));
+
+    std::deque<boost::shared_ptr<Request> > pending;
+    bool terminate = false;
+
+    while (!terminate || !pending.empty()) {
+
+        if (pending.empty()) {
+            boost::shared_ptr<Request> request;
+            requests.pop(request);
+            if (!request) {
+                terminate = true;
+                continue;
+            }
+            pending.push_back(request);
+        }
+
+        // collect the requests that arrived in the meantime without waiting for further ones
+        boost::shared_ptr<Request> request;
+        while (!terminate && pending.size() < maxBatchSize && requests.try_pop(request)) {
+            if (!request) {
+                terminate = true;
+            } else {
+                pending.push_back(request);
+            }
+        }
+
+        // the oldest request determines the image size of the batch
+        const int width = pending.front()->image->getWidth();
+        const int height = pending.front()->image->getHeight();
+
+        std::vector<boost::shared_ptr<Request> > batch;
+        std::deque<boost::shared_ptr<Request> > remaining;
+        for (const boost::shared_ptr<Request>& r : pending) {
+            if (batch.size() < maxBatchSize && r->image->getWidth() == width && r->image->getHeight() == height) {
+                batch.push_back(r);
+            } else {
+                remaining.push_back(r);
+            }
+        }
+        pending.swap(remaining);
+
+        predictBatch(batch);
+    }
+}
+
+void PredictionServer::predictBatch(const std::vector<boost::shared_ptr<Request> >& batch) {
+
+    assert(!batch.empty());
+
+    std::vector<const RGBDImage*> images;
+    std::vector<boost::shared_ptr<Response> > responses;
+    for (const boost::shared_ptr<Request>& request : batch) {
+        images.push_back(request->image.get());
+        boost::shared_ptr<Response> response = boost::make_shared<Response>();
+        response->queueMilliseconds = request->timer.getMilliseconds();
+        responses.push_back(response);
+    }
+
+    const AccelerationMode accelerationMode = randomForest.getConfiguration().getAccelerationMode();
+    const bool onGPU = (accelerationMode == GPU_ONLY || accelerationMode == HYBRID);
+
+    utils::Timer timer;
+    try {
+        std::vector<LabelImage> predictions;
+        if (onGPU) {
+            predictions = randomForest.predictBatch(images);
+        } else {
+            for (const RGBDImage* image : images) {
+                predictions.push_back(randomForest.predict(*image, 0, false));
+            }
+        }
+        assert(predictions.size() == batch.size());
+        for (size_t i = 0; i < batch.size(); i++) {
+            responses[i]->prediction = boost::make_shared<LabelImage>(predictions[i]);
+        }
+    } catch (const std::exception& e) {
+        CURFIL_ERROR("failed to classify batch of " << batch.size() << " images: " << e.what());
+        for (const boost::shared_ptr<Response>& response : responses) {
+            response->error = e.what();
+        }
+    }
+    const double predictMilliseconds = timer.getMilliseconds();
+
+    {
+        tbb::mutex::scoped_lock lock(statisticsMutex);
+        numBatches++;
+    }
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        responses[i]->predictMilliseconds = predictMilliseconds;
+        batch[i]->responses->push(responses[i]);
+    }
+}
+
+void PredictionServer::addStatistics(const Response& response, double totalMilliseconds) {
+    tbb::mutex::scoped_lock lock(statisticsMutex);
+
+    numRequests++;
+    averageQueueLatency.addValue(response.queueMilliseconds);
+    averagePredictLatency.addValue(response.predictMilliseconds);
+    averageTotalLatency.addValue(totalMilliseconds);
+
+    if (numRequests % 100 == 0) {
+        CURFIL_INFO("served " << numRequests << " requests in " << numBatches << " batches. average latency: "
+                << averageTotalLatency.getAverage() << " ms (queue: " << averageQueueLatency.getAverage()
+                << " ms, prediction: " << averagePredictLatency.getAverage() << " ms)");
+    }
+}
+
+void PredictionServer::handleConnection(int fd) {
+
+    const bool useCIELab = randomForest.getConfiguration().isUseCIELab();
+
+    tbb::concurrent_bounded_queue<boost::shared_ptr<Response> > responses;
+
+    try {
+        while (true) {
+            uint32_t header[3];
+            if (!readFully(fd, header, sizeof(header))) {
+                break;
+            }
+
+            if (header[0] != REQUEST_MAGIC) {
+                throw std::runtime_error((boost::format("illegal request magic: 0x%08x") % header[0]).str());
+            }
+
+            const uint32_t width = header[1];
+            const uint32_t height = header[2];
+            if (width == 0 || height == 0 || width > 0x7FFF || height > 0x7FFF) {
+                throw std::runtime_error((boost::format("illegal frame size: %dx%d") % width % height).str());
+            }
+
+            const size_t numPixels = static_cast<size_t>(width) * height;
+            std::vector<uint8_t> colors(3 * numPixels);
+            std::vector<uint16_t> depths(numPixels);
+            if (!readFully(fd, &colors[0], colors.size()) || !readFully(fd, &depths[0], depths.size() * 2)) {
+                throw std::runtime_error("connection closed in the middle of a request");
+            }
+
+            boost::shared_ptr<Request> request = boost::make_shared<Request>();
+            request->responses = &responses;
+
+            boost::shared_ptr<Response> response;
+            try {
+                request->image = boost::make_shared<RGBDImage>(width, height, &colors[0], &depths[0],
+                        useCIELab, useDepthFilling);
+            } catch (const std::exception& e) {
+                response = boost::make_shared<Response>();
+                response->error = e.what();
+            }
+
+            if (!response) {
+                requests.push(request);
+                responses.pop(response);
+                addStatistics(*response, request->timer.getMilliseconds());
+            }
+
+            const uint32_t latency = static_cast<uint32_t>(1000 * request->timer.getMilliseconds());
+            const uint32_t status = response->prediction ? 0 : 1;
+            const uint32_t responseHeader[] = { RESPONSE_MAGIC, status, width, height, latency };
+            writeFully(fd, responseHeader, sizeof(responseHeader));
+
+            if (response->prediction) {
+                writeFully(fd, response->prediction->getLabels(), numPixels * sizeof(LabelType));
+            } else {
+                const uint32_t length = response->error.size();
+                writeFully(fd, &length, sizeof(length));
+                writeFully(fd, response->error.data(), length);
+            }
+        }
+    } catch (const std::exception& e) {
+        CURFIL_WARNING("closing connection: " << e.what());
+    }
+
+    close(fd);
+
+    tbb::mutex::scoped_lock lock(connectionsMutex);
+    connections.erase(fd);
+}
+
+}
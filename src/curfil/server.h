@@ -0,0 +1,109 @@
+#ifndef CURFIL_SERVER_H
+#define CURFIL_SERVER_H
+
+#include <boost/shared_ptr.hpp>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <tbb/atomic.h>
+#include <tbb/concurrent_queue.h>
+#include <tbb/mutex.h>
+#include <vector>
+
+#include "random_forest_image.h"
+
+namespace curfil {
+
+/**
+ * Long-running prediction service that keeps a random forest warm on the GPU.
+ *
+ * Clients connect to a local (UNIX domain) stream socket and send frames. All values are in host byte order.
+ *
+ * Request:  uint32 magic (REQUEST_MAGIC), uint32 width, uint32 height,
+ *           width×height×3 uint8 RGB values (interleaved, row-major),
+ *           width×height uint16 depth values in millimeters (row-major)
+ *
+ * Response: uint32 magic (RESPONSE_MAGIC), uint32 status (0: ok), uint32 width, uint32 height,
+ *           uint32 latency in microseconds, followed by width×height uint8 labels (row-major) if the status is ok,
+ *           or by uint32 length and an error message otherwise
+ *
+ * Each connection has at most one request in flight. Requests of concurrent connections with the same image size
+ * are classified together in one batch.
+ */
+class PredictionServer {
+
+public:
+
+    static const uint32_t REQUEST_MAGIC = 0x43465251; // "CFRQ"
+    static const uint32_t RESPONSE_MAGIC = 0x43465250; // "CFRP"
+
+    /**
+     * @param maxBatchSize the maximal number of requests that are classified together
+     * @param deviceId the GPU device that classifies the requests
+     */
+    PredictionServer(const RandomForestImage& randomForest, const std::string& socketPath, bool useDepthFilling,
+            size_t maxBatchSize, int deviceId);
+
+    /**
+     * Accepts connections until stop() is called. Blocks the calling thread.
+     */
+    void run();
+
+    /**
+     * Stops accepting connections and finishes the pending requests
+     */
+    void stop();
+
+private:
+
+    struct Response;
+
+    struct Request {
+        boost::shared_ptr<RGBDImage> image;
+        utils::Timer timer;
+        tbb::concurrent_bounded_queue<boost::shared_ptr<Response> >* responses;
+    };
+
+    struct Response {
+        boost::shared_ptr<LabelImage> prediction;
+        std::string error;
+        double queueMilliseconds;
+        double predictMilliseconds;
+    };
+
+    const RandomForestImage& randomForest;
+    const std::string socketPath;
+    const bool useDepthFilling;
+    const size_t maxBatchSize;
+    const int deviceId;
+
+    tbb::atomic<bool> stopped;
+
+    // file descriptors of the open connections
+    tbb::mutex connectionsMutex;
+    std::set<int> connections;
+
+    tbb::concurrent_bounded_queue<boost::shared_ptr<Request> > requests;
+
+    tbb::mutex statisticsMutex;
+    size_t numRequests;
+    size_t numBatches;
+    utils::Average averageQueueLatency;
+    utils::Average averagePredictLatency;
+    utils::Average averageTotalLatency;
+
+    void predictRequests();
+
+    void predictBatch(const std::vector<boost::shared_ptr<Request> >& batch);
+
+    void handleConnection(int fd);
+
+    void addStatistics(const Response& response, double totalMilliseconds);
+
+    PredictionServer(const PredictionServer&);
+    PredictionServer& operator=(const PredictionServer&);
+};
+
+}
+
+#endif
@@ -0,0 +1,601 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <tbb/mutex.h>
+#include <time.h>
+
+#include "utils.h"
+
+namespace curfil {
+namespace trace {
+
+namespace detail {
+bool enabled = false;
+}
+
+namespace {
+
+// elapsed times of CUDA events are floats in milliseconds. a recent anchor keeps their resolution below 10 microseconds
+const int64_t ANCHOR_INTERVAL = 30 * 1000 * 1000;
+
+int64_t monotonicMicroseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// a CUDA event whose host time is known
+struct Anchor {
+    int device;
+    cudaEvent_t event;
+    int64_t time;
+};
+
+struct PendingSpan {
+    const char* name;
+    Category category;
+    int level;
+    int arg;
+    int device;
+    cudaStream_t stream;
+    size_t anchor;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+};
+
+class ThreadBuffer {
+
+public:
+
+    ThreadBuffer(unsigned int id, size_t capacity) :
+            mutex(), id(id), capacity(capacity), events(), next(0), dropped(0), pending(), anchors(), anchorStreams(),
+                    freeEvents() {
+    }
+
+    // all members are guarded by the mutex since collect() reads them from another thread
+    tbb::mutex mutex;
+
+    const unsigned int id;
+    size_t capacity;
+
+    std::vector<Event> events;
+    // the position of the oldest event once the ring buffer is full
+    size_t next;
+    size_t dropped;
+
+    std::deque<PendingSpan> pending;
+    std::vector<Anchor> anchors;
+    std::map<int, cudaStream_t> anchorStreams;
+    std::multimap<int, cudaEvent_t> freeEvents;
+
+    void push(const Event& event) {
+        if (event.begin < 0) {
+            // started before the trace was enabled
+            return;
+        }
+        if (events.size() < capacity) {
+            events.push_back(event);
+        } else {
+            events[next] = event;
+            next = (next + 1) % capacity;
+            dropped++;
+        }
+    }
+
+    void reset(size_t capacity) {
+        this->capacity = capacity;
+        events.clear();
+        next = 0;
+        dropped = 0;
+        for (size_t i = 0; i < pending.size(); i++) {
+            releaseEvent(pending[i].device, pending[i].start);
+            releaseEvent(pending[i].device, pending[i].stop);
+        }
+        pending.clear();
+    }
+
+    cudaEvent_t acquireEvent(int device) {
+        std::multimap<int, cudaEvent_t>::iterator it = freeEvents.find(device);
+        if (it != freeEvents.end()) {
+            const cudaEvent_t event = it->second;
+            freeEvents.erase(it);
+            return event;
+        }
+        cudaEvent_t event;
+        cudaSafeCall(cudaEventCreate(&event));
+        return event;
+    }
+
+    void releaseEvent(int device, cudaEvent_t event) {
+        freeEvents.insert(std::make_pair(device, event));
+    }
+
+    // the most recent anchor of the device. a new anchor is recorded on the private stream of the thread,
+    // which is idle, such that the synchronization returns immediately
+    size_t getAnchor(int device) {
+        const int64_t now = monotonicMicroseconds();
+        for (size_t i = anchors.size(); i > 0; i--) {
+            if (anchors[i - 1].device == device) {
+                if (now - anchors[i - 1].time < ANCHOR_INTERVAL) {
+                    return i - 1;
+                }
+                break;
+            }
+        }
+
+        if (anchorStreams.find(device) == anchorStreams.end()) {
+            // must not wait for the work of the legacy default stream
+            cudaStream_t stream;
+            cudaSafeCall(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+            anchorStreams[device] = stream;
+        }
+
+        Anchor anchor;
+        anchor.device = device;
+        cudaSafeCall(cudaEventCreate(&anchor.event));
+        cudaSafeCall(cudaEventRecord(anchor.event, anchorStreams[device]));
+        cudaSafeCall(cudaEventSynchronize(anchor.event));
+        anchor.time = monotonicMicroseconds();
+        anchors.push_back(anchor);
+        return anchors.size() - 1;
+    }
+
+    void resolvePending(bool wait, int64_t origin) {
+        while (!pending.empty()) {
+            const PendingSpan& span = pending.front();
+            if (wait) {
+                cudaSafeCall(cudaEventSynchronize(span.stop));
+            } else {
+                const cudaError_t status = cudaEventQuery(span.stop);
+                if (status == cudaErrorNotReady) {
+                    // not an error. it must not be reported by the next cudaSafeCall
+                    cudaGetLastError();
+                    return;
+                }
+                utils::checkCudaError("cudaEventQuery");
+            }
+
+            const Anchor& anchor = anchors[span.anchor];
+            float beginMilliseconds = 0;
+            float endMilliseconds = 0;
+            cudaSafeCall(cudaEventElapsedTime(&beginMilliseconds, anchor.event, span.start));
+            cudaSafeCall(cudaEventElapsedTime(&endMilliseconds, anchor.event, span.stop));
+
+            Event event;
+            event.name = span.name;
+            event.category = span.category;
+            event.begin = anchor.time + static_cast<int64_t>(beginMilliseconds * 1000) - origin;
+            event.end = anchor.time + static_cast<int64_t>(endMilliseconds * 1000) - origin;
+            event.level = span.level;
+            event.arg = span.arg;
+            event.thread = id;
+            event.device = span.device;
+            event.stream = span.stream;
+            push(event);
+
+            releaseEvent(span.device, span.start);
+            releaseEvent(span.device, span.stop);
+            pending.pop_front();
+        }
+    }
+
+private:
+    ThreadBuffer(const ThreadBuffer&);
+    ThreadBuffer& operator=(const ThreadBuffer&);
+};
+
+tbb::mutex registryMutex;
+std::vector<boost::shared_ptr<ThreadBuffer> > threadBuffers;
+size_t threadBufferCapacity = 1 << 16;
+int64_t origin = 0;
+
+__thread ThreadBuffer* currentThreadBuffer = NULL;
+__thread int currentLevel = -1;
+
+ThreadBuffer& getThreadBuffer() {
+    if (currentThreadBuffer == NULL) {
+        tbb::mutex::scoped_lock lock(registryMutex);
+        threadBuffers.push_back(boost::make_shared<ThreadBuffer>(threadBuffers.size(), threadBufferCapacity));
+        currentThreadBuffer = threadBuffers.back().get();
+    }
+    return *currentThreadBuffer;
+}
+
+std::vector<boost::shared_ptr<ThreadBuffer> > getThreadBuffers() {
+    tbb::mutex::scoped_lock lock(registryMutex);
+    return threadBuffers;
+}
+
+bool beginsBefore(const Event& a, const Event& b) {
+    if (a.begin != b.begin) {
+        return a.begin < b.begin;
+    }
+    return a.thread < b.thread;
+}
+
+const char* getCategoryName(Category category) {
+    switch (category) {
+        case HOST:
+            return "host";
+        case WAIT:
+            return "wait";
+        case TRANSFER:
+            return "transfer";
+        case KERNEL:
+            return "kernel";
+        default:
+            throw std::runtime_error((boost::format("unknown trace category: %d") % category).str());
+    }
+}
+
+std::string escapeJSON(const char* str) {
+    std::string escaped;
+    for (const char* c = str; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            escaped += '\\';
+            escaped += *c;
+        } else if (static_cast<unsigned char>(*c) < 0x20) {
+            escaped += (boost::format("\\u%04x") % static_cast<int>(*c)).str();
+        } else {
+            escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+typedef std::vector<std::pair<int64_t, int64_t> > Intervals;
+
+// sorts and merges overlapping intervals
+Intervals mergeIntervals(Intervals intervals) {
+    std::sort(intervals.begin(), intervals.end());
+    Intervals merged;
+    for (size_t i = 0; i < intervals.size(); i++) {
+        if (!merged.empty() && intervals[i].first <= merged.back().second) {
+            merged.back().second = std::max(merged.back().second, intervals[i].second);
+        } else {
+            merged.push_back(intervals[i]);
+        }
+    }
+    return merged;
+}
+
+int64_t totalLength(const Intervals& merged) {
+    int64_t length = 0;
+    for (size_t i = 0; i < merged.size(); i++) {
+        length += merged[i].second - merged[i].first;
+    }
+    return length;
+}
+
+int64_t intersectionLength(const Intervals& a, const Intervals& b) {
+    int64_t length = 0;
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.size() && j < b.size()) {
+        const int64_t begin = std::max(a[i].first, b[j].first);
+        const int64_t end = std::min(a[i].second, b[j].second);
+        if (end > begin) {
+            length += end - begin;
+        }
+        if (a[i].second < b[j].second) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+    return length;
+}
+
+std::string formatMilliseconds(int64_t microseconds) {
+    return (boost::format("%.3f ms") % (microseconds / 1000.0)).str();
+}
+
+struct Aggregate {
+    Aggregate() :
+            count(0), total(0), max(0) {
+    }
+
+    size_t count;
+    int64_t total;
+    int64_t max;
+};
+
+}
+
+void enable(size_t eventsPerThread) {
+    if (eventsPerThread == 0) {
+        throw std::runtime_error("the trace needs space for at least one event per thread");
+    }
+
+    tbb::mutex::scoped_lock lock(registryMutex);
+    threadBufferCapacity = eventsPerThread;
+    for (size_t i = 0; i < threadBuffers.size(); i++) {
+        tbb::mutex::scoped_lock bufferLock(threadBuffers[i]->mutex);
+        threadBuffers[i]->reset(eventsPerThread);
+    }
+    origin = monotonicMicroseconds();
+    detail::enabled = true;
+
+    CURFIL_INFO("tracing enabled (" << eventsPerThread << " events per thread)");
+}
+
+void disable() {
+    detail::enabled = false;
+}
+
+int64_t now() {
+    return monotonicMicroseconds() - origin;
+}
+
+const char* intern(const std::string& name) {
+    static tbb::mutex mutex;
+    static std::set<std::string> names;
+
+    tbb::mutex::scoped_lock lock(mutex);
+    return names.insert(name).first->c_str();
+}
+
+void record(const char* name, Category category, int64_t begin, int64_t end, int arg) {
+    if (!isEnabled()) {
+        return;
+    }
+
+    ThreadBuffer& buffer = getThreadBuffer();
+
+    Event event;
+    event.name = name;
+    event.category = category;
+    event.begin = begin;
+    event.end = end;
+    event.level = currentLevel;
+    event.arg = arg;
+    event.thread = buffer.id;
+    event.device = -1;
+    event.stream = NULL;
+
+    tbb::mutex::scoped_lock lock(buffer.mutex);
+    buffer.push(event);
+}
+
+std::vector<Event> collect() {
+    const std::vector<boost::shared_ptr<ThreadBuffer> > buffers = getThreadBuffers();
+
+    std::vector<Event> events;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        ThreadBuffer& buffer = *buffers[i];
+        tbb::mutex::scoped_lock lock(buffer.mutex);
+        buffer.resolvePending(true, origin);
+        // oldest first, such that events of a thread that begin at the same time keep their order
+        events.insert(events.end(), buffer.events.begin() + buffer.next, buffer.events.end());
+        events.insert(events.end(), buffer.events.begin(), buffer.events.begin() + buffer.next);
+    }
+
+    std::stable_sort(events.begin(), events.end(), beginsBefore);
+    return events;
+}
+
+size_t getNumDroppedEvents() {
+    const std::vector<boost::shared_ptr<ThreadBuffer> > buffers = getThreadBuffers();
+
+    size_t dropped = 0;
+    for (size_t i = 0; i < buffers.size(); i++) {
+        tbb::mutex::scoped_lock lock(buffers[i]->mutex);
+        dropped += buffers[i]->dropped;
+    }
+    return dropped;
+}
+
+void writeChromeTrace(std::ostream& os, const std::vector<Event>& events) {
+
+    // the host threads are shown in process 0, the streams of device d in process d + 1
+    std::set<int> devices;
+    std::map<std::pair<int, const void*>, size_t> streams;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].device >= 0) {
+            devices.insert(events[i].device);
+            const std::pair<int, const void*> stream(events[i].device, events[i].stream);
+            if (streams.find(stream) == streams.end()) {
+                const size_t streamNr = streams.size();
+                streams[stream] = streamNr;
+            }
+        }
+    }
+
+    os << "{\"traceEvents\":[" << std::endl;
+    os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"host\"}}";
+    for (std::set<int>::const_iterator it = devices.begin(); it != devices.end(); it++) {
+        os << "," << std::endl;
+        os << boost::format("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"GPU %d\"}}")
+                % (*it + 1) % *it;
+    }
+    std::map<std::pair<int, const void*>, size_t>::const_iterator it;
+    for (it = streams.begin(); it != streams.end(); it++) {
+        os << "," << std::endl;
+        os << boost::format("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"name\":\"stream %p\"}}") % (it->first.first + 1) % it->second % it->first.second;
+    }
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& event = events[i];
+        const bool gpu = event.device >= 0;
+        const int pid = gpu ? event.device + 1 : 0;
+        const size_t tid = gpu ? streams[std::make_pair(event.device, event.stream)] : event.thread;
+
+        os << "," << std::endl;
+        os << boost::format("{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%d,\"dur\":%d,\"pid\":%d,\"tid\":%d,"
+                "\"args\":{\"level\":%d,\"arg\":%d,\"thread\":%d}}")
+                % escapeJSON(event.name) % getCategoryName(event.category) % event.begin
+                % (event.end - event.begin) % pid % tid % event.level % event.arg % event.thread;
+    }
+
+    os << std::endl << "],\"displayTimeUnit\":\"ms\"}" << std::endl;
+}
+
+void writeChromeTrace(const std::string& filename) {
+    const std::vector<Event> events = collect();
+
+    std::ofstream os(filename.c_str());
+    if (!os.is_open()) {
+        throw std::runtime_error((boost::format("failed to open trace file '%s'") % filename).str());
+    }
+    writeChromeTrace(os, events);
+    os.close();
+    if (!os) {
+        throw std::runtime_error((boost::format("failed to write trace file '%s'") % filename).str());
+    }
+
+    CURFIL_INFO("wrote " << events.size() << " trace events to " << filename);
+}
+
+std::string summarize(const std::vector<Event>& events) {
+
+    // per level: (name, on GPU) to aggregate
+    std::map<int, std::map<std::pair<std::string, bool>, Aggregate> > aggregates;
+    // per level: device to intervals
+    std::map<int, std::map<int, Intervals> > transfers;
+    std::map<int, std::map<int, Intervals> > kernels;
+
+    for (size_t i = 0; i < events.size(); i++) {
+        const Event& event = events[i];
+        const int64_t duration = event.end - event.begin;
+        const bool gpu = event.device >= 0;
+
+        Aggregate& aggregate = aggregates[event.level][std::make_pair(std::string(event.name), gpu)];
+        aggregate.count++;
+        aggregate.total += duration;
+        aggregate.max = std::max(aggregate.max, duration);
+
+        if (event.category == TRANSFER) {
+            transfers[event.level][event.device].push_back(std::make_pair(event.begin, event.end));
+        } else if (gpu && event.category == KERNEL) {
+            kernels[event.level][event.device].push_back(std::make_pair(event.begin, event.end));
+        }
+    }
+
+    std::ostringstream o;
+    std::map<int, std::map<std::pair<std::string, bool>, Aggregate> >::const_iterator level;
+    for (level = aggregates.begin(); level != aggregates.end(); level++) {
+        int64_t transferTime = 0;
+        int64_t kernelTime = 0;
+        int64_t overlap = 0;
+
+        std::map<int, Intervals>::const_iterator device;
+        for (device = transfers[level->first].begin(); device != transfers[level->first].end(); device++) {
+            const Intervals mergedTransfers = mergeIntervals(device->second);
+            const Intervals mergedKernels = mergeIntervals(kernels[level->first][device->first]);
+            transferTime += totalLength(mergedTransfers);
+            overlap += intersectionLength(mergedTransfers, mergedKernels);
+        }
+        for (device = kernels[level->first].begin(); device != kernels[level->first].end(); device++) {
+            kernelTime += totalLength(mergeIntervals(device->second));
+        }
+
+        if (level->first < 0) {
+            o << "without level: ";
+        } else {
+            o << "level " << level->first << ": ";
+        }
+        o << formatMilliseconds(transferTime) << " transfers, " << formatMilliseconds(kernelTime) << " kernels, "
+                << formatMilliseconds(overlap) << " overlapping";
+        if (transferTime > 0) {
+            o << boost::format(" (%.1f%% of the transfers)") % (100.0 * overlap / transferTime);
+        }
+        o << std::endl;
+
+        std::map<std::pair<std::string, bool>, Aggregate>::const_iterator it;
+        for (it = level->second.begin(); it != level->second.end(); it++) {
+            const Aggregate& aggregate = it->second;
+            o << boost::format("    %-50s %4s %8d times, total %s, mean %s, max %s")
+                    % it->first.first % (it->first.second ? "GPU" : "host") % aggregate.count
+                    % formatMilliseconds(aggregate.total)
+                    % formatMilliseconds(aggregate.total / static_cast<int64_t>(aggregate.count))
+                    % formatMilliseconds(aggregate.max) << std::endl;
+        }
+    }
+
+    return o.str();
+}
+
+void logSummary() {
+    std::istringstream summary(summarize(collect()));
+    std::string line;
+    while (std::getline(summary, line)) {
+        CURFIL_INFO("TRACE " << line);
+    }
+
+    const size_t dropped = getNumDroppedEvents();
+    if (dropped > 0) {
+        CURFIL_WARNING("trace: " << dropped << " events were overwritten. the summary is incomplete");
+    }
+}
+
+LevelScope::LevelScope(int level) :
+        previousLevel(currentLevel) {
+    currentLevel = level;
+}
+
+LevelScope::~LevelScope() {
+    currentLevel = previousLevel;
+}
+
+GpuSpan::GpuSpan(const char* name, cudaStream_t stream, Category category, int arg) :
+        name(name), stream(stream), category(category), arg(arg), running(isEnabled()), device(-1), anchor(0),
+                start(NULL) {
+    if (!running) {
+        return;
+    }
+
+    cudaSafeCall(cudaGetDevice(&device));
+
+    ThreadBuffer& buffer = getThreadBuffer();
+    tbb::mutex::scoped_lock lock(buffer.mutex);
+    anchor = buffer.getAnchor(device);
+    start = buffer.acquireEvent(device);
+    cudaSafeCall(cudaEventRecord(start, stream));
+}
+
+GpuSpan::~GpuSpan() {
+    if (std::uncaught_exception()) {
+        // the events of the span are lost. this is not worth another exception
+        return;
+    }
+    stop();
+}
+
+void GpuSpan::stop() {
+    if (!running) {
+        return;
+    }
+    running = false;
+
+    ThreadBuffer& buffer = getThreadBuffer();
+    tbb::mutex::scoped_lock lock(buffer.mutex);
+
+    PendingSpan span;
+    span.name = name;
+    span.category = category;
+    span.level = currentLevel;
+    span.arg = arg;
+    span.device = device;
+    span.stream = stream;
+    span.anchor = anchor;
+    span.start = start;
+    span.stop = buffer.acquireEvent(device);
+    cudaSafeCall(cudaEventRecord(span.stop, stream));
+
+    buffer.pending.push_back(span);
+    buffer.resolvePending(false, origin);
+}
+
+}
+}
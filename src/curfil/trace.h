@@ -0,0 +1,176 @@
+#ifndef CURFIL_TRACE_H
+#define CURFIL_TRACE_H
+
+#include <cuda_runtime_api.h>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace curfil {
+
+/**
+ * Low-overhead tracing of host and GPU spans.
+ *
+ * Every thread records its events into its own ring buffer, so recording does not contend with other threads.
+ * GPU spans are a pair of CUDA events which are resolved once the GPU passed them. Recording a GPU span never
+ * synchronizes the stream of the span. The GPU and host clocks are correlated by an event on a private stream
+ * of the thread every 30 seconds.
+ *
+ * The events can be written in the Chrome trace format, which chrome://tracing and Perfetto can display,
+ * and summarized per tree level.
+ */
+namespace trace {
+
+enum Category {
+    HOST,
+    WAIT, // a thread waited for a lock
+    TRANSFER, // a transfer on a stream
+    KERNEL
+};
+
+struct Event {
+    // a string literal or a name returned by intern()
+    const char* name;
+    Category category;
+    // microseconds since the trace was enabled
+    int64_t begin;
+    int64_t end;
+    // the tree level, -1 if unknown
+    int level;
+    // a further argument such as the batch number, -1 if none
+    int arg;
+    unsigned int thread;
+    // -1 for host events
+    int device;
+    // NULL for host events
+    const void* stream;
+};
+
+namespace detail {
+extern bool enabled;
+}
+
+static inline bool isEnabled() {
+    return detail::enabled;
+}
+
+/**
+ * Discards the events that were recorded so far and starts recording.
+ *
+ * @param eventsPerThread the size of the ring buffer of each thread. older events are overwritten
+ */
+void enable(size_t eventsPerThread = 1 << 16);
+
+void disable();
+
+/**
+ * @return the microseconds since the trace was enabled
+ */
+int64_t now();
+
+/**
+ * @return a copy of the name that is valid as long as the process runs
+ */
+const char* intern(const std::string& name);
+
+/**
+ * Records a host event of the calling thread.
+ */
+void record(const char* name, Category category, int64_t begin, int64_t end, int arg = -1);
+
+/**
+ * Waits for the pending GPU spans and returns the events of all threads sorted by begin.
+ */
+std::vector<Event> collect();
+
+/**
+ * @return the number of events that were overwritten since the trace was enabled
+ */
+size_t getNumDroppedEvents();
+
+void writeChromeTrace(std::ostream& os, const std::vector<Event>& events);
+
+void writeChromeTrace(const std::string& filename);
+
+/**
+ * Aggregates the events per tree level and name. For every level, the time in which transfers and kernels
+ * overlapped on the GPU is reported as well.
+ */
+std::string summarize(const std::vector<Event>& events);
+
+/**
+ * Logs the summary of all collected events.
+ */
+void logSummary();
+
+/**
+ * Annotates the events of the calling thread with the tree level.
+ */
+class LevelScope {
+public:
+    explicit LevelScope(int level);
+    ~LevelScope();
+
+private:
+    int previousLevel;
+
+    LevelScope(const LevelScope&);
+    LevelScope& operator=(const LevelScope&);
+};
+
+/**
+ * Records the lifetime of the scope as host event.
+ */
+class Scope {
+public:
+    explicit Scope(const char* name, Category category = HOST, int arg = -1) :
+            name(name), category(category), arg(arg), begin(isEnabled() ? now() : -1) {
+    }
+
+    ~Scope() {
+        if (begin >= 0) {
+            record(name, category, begin, now(), arg);
+        }
+    }
+
+private:
+    const char* name;
+    Category category;
+    int arg;
+    int64_t begin;
+
+    Scope(const Scope&);
+    Scope& operator=(const Scope&);
+};
+
+/**
+ * Records the work that is queued on the stream between construction and stop() or destruction.
+ * The span must be stopped on the thread that created it.
+ */
+class GpuSpan {
+public:
+    GpuSpan(const char* name, cudaStream_t stream, Category category = KERNEL, int arg = -1);
+
+    ~GpuSpan();
+
+    void stop();
+
+private:
+    const char* name;
+    cudaStream_t stream;
+    Category category;
+    int arg;
+    bool running;
+    int device;
+    size_t anchor;
+    cudaEvent_t start;
+
+    GpuSpan(const GpuSpan&);
+    GpuSpan& operator=(const GpuSpan&);
+};
+
+}
+}
+
+#endif
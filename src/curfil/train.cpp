@@ -2,65 +2,79 @@
 
 #include <cuda.h>
 #include <iomanip>
+#include <tbb/blocked_range.h>
+#include <tbb/mutex.h>
+#include <tbb/parallel_for.h>
 
+#include "device_memory.h"
+#include "distributed.h"
+#include "export.h"
 #include "image.h"
+#include "image_dataset.h"
 #include "random_forest_image.h"
 #include "random_tree_image.h"
+#include "random_tree_image_gpu.h"
 #include "utils.h"
 
 namespace curfil
 {
 
-void determineImageCacheSizeAndSamplesPerBatch(const std::vector<LabeledRGBDImage>& images,
+void determineImageCacheSizeAndSamplesPerBatch(const ImageDataset& images,
         const std::vector<int>& deviceIds, const size_t featureCount, const size_t numThresholds,
-        size_t imageCacheSizeMB, unsigned int& imageCacheSize, unsigned int& maxSamplesPerBatch) {
+        size_t imageCacheSizeMB, unsigned int& imageCacheSize, unsigned int& maxSamplesPerBatch,
+        bool singlePrecisionFeatures, size_t numLabels, size_t numTrees) {
 
-    if (deviceIds.empty()) {
-        throw std::runtime_error("got no device IDs");
-    }
+    const DeviceMemoryPlan plan(images, deviceIds, featureCount, numThresholds, imageCacheSizeMB,
+            singlePrecisionFeatures, numLabels, numTrees);
+    plan.apply();
 
-    if (deviceIds.size() != 1) {
-        throw std::runtime_error("only one device ID supported currently");
-    }
+    CURFIL_INFO("device memory plan: " << plan);
 
-    size_t freeMemoryOnGPU = utils::getFreeMemoryOnGPU(deviceIds[0]);
+    maxSamplesPerBatch = plan.getMaxSamplesPerBatch();
+    imageCacheSize = plan.getImageCacheSize();
 
-    if (imageCacheSizeMB == 0) {
-        imageCacheSizeMB = freeMemoryOnGPU * 0.66 / 1024 / 1024;
-    }
+    CURFIL_INFO("max samples per batch: " << maxSamplesPerBatch);
+    CURFIL_INFO((boost::format("image cache size: %d images (%.1f MB)")
+            % imageCacheSize
+            % (plan.getImageCacheMemory() / 1024.0 / 1024.0)).str());
+}
 
-    // very defensive estimate to avoid out of memory errors
-    long remainingMemoryOnGPU = (freeMemoryOnGPU - imageCacheSizeMB * 1024lu * 1024lu) / 3;
-    // size for histogram counters
-    remainingMemoryOnGPU -= 10 * (2 * sizeof(WeightType) * featureCount * numThresholds);
-    size_t sizePerSample = 2 * sizeof(FeatureResponseType) * featureCount;
+void determineCompactImageCacheSize(const ImageDataset& images, unsigned int& imageCacheSize,
+        unsigned int& compactImageCacheSize) {
 
-    maxSamplesPerBatch = remainingMemoryOnGPU / sizePerSample;
-    maxSamplesPerBatch = std::min(maxSamplesPerBatch, 50000u);
+    compactImageCacheSize = 0;
 
-    if (maxSamplesPerBatch < 1000) {
-        throw std::runtime_error("memory headroom on GPU too low. try to decrease image cache size manually");
+    if (images.empty() || imageCacheSize >= images.size()) {
+        // all images fit into the image cache
+        return;
     }
 
-    CURFIL_INFO("max samples per batch: " << maxSamplesPerBatch);
+    const size_t pixels = static_cast<size_t>(images.getWidth()) * images.getHeight();
+    const size_t imageSize = images.getImageSizeInMemory() - pixels * sizeof(LabelType);
+    const size_t compactImageSize = ImageCache::getCompactImageSize(images.getWidth(), images.getHeight());
 
-    if (images.size() * images[0].getSizeInMemory() <= imageCacheSizeMB * 1024lu * 1024lu) {
-        imageCacheSize = images.size();
-    } else {
-        imageCacheSize = imageCacheSizeMB * 1024lu * 1024lu / images[0].getSizeInMemory();
+    // the image sets of the batches still need integral images. staging buffers for two streams
+    const size_t memory = imageCacheSize * images.getImageSizeInMemory();
+    const size_t stagingMemory = 2 * pixels * (imageSize / pixels + 3 * sizeof(double));
+
+    const unsigned int newImageCacheSize = std::max(1u, imageCacheSize / 4);
+    const size_t usedMemory = newImageCacheSize * imageSize + stagingMemory;
+    if (usedMemory >= memory) {
+        CURFIL_WARNING("image cache too small for the compact format");
+        return;
     }
 
-    CURFIL_INFO((boost::format("image cache size: %d images (%.1f MB)")
-            % imageCacheSize
-            % (imageCacheSize * images[0].getSizeInMemory() / 1024.0 / 1024.0)).str());
+    imageCacheSize = newImageCacheSize;
+    compactImageCacheSize = std::min((memory - usedMemory) / compactImageSize, images.size() - imageCacheSize);
 
-    if (imageCacheSizeMB * 1024lu * 1024lu >= freeMemoryOnGPU) {
-        throw std::runtime_error("image cache size too large");
-    }
+    CURFIL_INFO((boost::format("image cache size: %d images plus %d images in compact format (%.1f MB)")
+            % imageCacheSize
+            % compactImageCacheSize
+            % ((imageCacheSize * imageSize + compactImageCacheSize * compactImageSize) / 1024.0 / 1024.0)).str());
 }
 
-RandomForestImage train(std::vector<LabeledRGBDImage>& images, size_t trees,
-        const TrainingConfiguration& configuration, bool trainTreesInParallel) {
+RandomForestImage train(const ImageDataset& images, size_t trees,
+        const TrainingConfiguration& configuration, bool trainTreesInParallel, const std::string& checkpointFolder) {
 
     CURFIL_INFO("trees: " << trees);
     CURFIL_INFO("training trees in parallel: " << trainTreesInParallel);
@@ -71,7 +85,7 @@ RandomForestImage train(std::vector<LabeledRGBDImage>& images, size_t trees,
     RandomForestImage randomForest(trees, configuration);
 
     utils::Timer trainTimer;
-    randomForest.train(images, !trainTreesInParallel);
+    randomForest.train(images, !trainTreesInParallel, checkpointFolder);
     trainTimer.stop();
 
     CURFIL_INFO("training took " << trainTimer.format(2) <<
@@ -83,7 +97,81 @@ RandomForestImage train(std::vector<LabeledRGBDImage>& images, size_t trees,
         CURFIL_INFO("feature " << featureType << ": " << featureCount.second);
     }
 
+    DeviceMemoryUsage::log();
+
     return randomForest;
 }
 
+bool trainDistributed(const ImageDataset& images, size_t trees, const TrainingConfiguration& configuration,
+        const std::string& outputFolder, const std::string& trainingFolder, bool verboseTree,
+        const std::string& checkpointFolder) {
+
+    CURFIL_INFO("trees: " << trees);
+    CURFIL_INFO(configuration);
+
+    // the device ids, the number of threads and the batch and cache sizes may differ between the processes
+    boost::property_tree::ptree job = RandomTreeExport::getCheckpointConfiguration(configuration);
+    job.put("maxDepth", configuration.getMaxDepth());
+    job.put("trees", trees);
+    job.put("images", images.size());
+
+    const TreeQueue queue(outputFolder, trees);
+    queue.join(job);
+
+    const RandomTreeExport treeExport(configuration, outputFolder, trainingFolder, verboseTree);
+
+    // the label statistics of an image are computed only once for all trees of this process
+    TrainingSetIndex trainingSetIndex;
+
+    const std::vector<int>& deviceIds = configuration.getDeviceIds();
+    const size_t numDevices = (configuration.getAccelerationMode() == CPU_ONLY) ? 1 : deviceIds.size();
+
+    utils::Timer trainTimer;
+    size_t trainedTrees = 0;
+    tbb::mutex trainedTreesMutex;
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numDevices, 1),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t device = range.begin(); device != range.end(); device++) {
+                    TrainingConfiguration deviceConfiguration(configuration);
+                    if (configuration.getAccelerationMode() != CPU_ONLY) {
+                        deviceConfiguration.setDeviceIds(std::vector<int>(1, deviceIds[device]));
+                    }
+
+                    size_t treeId;
+                    while (queue.claim(treeId)) {
+                        try {
+                            utils::Timer timer;
+                            RandomForestImage forest(trees, deviceConfiguration);
+                            forest.train(images, trainingSetIndex, std::vector<size_t>(1, treeId), true,
+                                    checkpointFolder);
+                            treeExport.writeJSON(*forest.getTree(0), treeId);
+                            CURFIL_INFO("finished tree " << treeId << " in " << timer.format(3));
+                        } catch (...) {
+                            // another process may train the tree
+                            queue.release(treeId);
+                            throw;
+                        }
+                        queue.release(treeId);
+
+                        tbb::mutex::scoped_lock lock(trainedTreesMutex);
+                        trainedTrees++;
+                    }
+                }
+            });
+
+    trainTimer.stop();
+
+    CURFIL_INFO("trained " << trainedTrees << " of " << trees << " trees in " << trainTimer.format(2));
+    DeviceMemoryUsage::log();
+
+    if (!queue.isComplete()) {
+        CURFIL_INFO("the other trees are still trained by other processes");
+        return false;
+    }
+
+    RandomTreeExport::writeManifest(outputFolder + "/forest" + FOREST_MANIFEST_EXTENSION, queue.getTreeFiles());
+    return true;
+}
+
 }
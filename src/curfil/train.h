@@ -6,12 +6,36 @@
 namespace curfil
 {
 
-void determineImageCacheSizeAndSamplesPerBatch(const std::vector<LabeledRGBDImage>& images,
+/**
+ * Plans the device memory, see DeviceMemoryPlan.
+ *
+ * @param numLabels 0 if not known yet
+ * @param numTrees the trees that are predicted in the same process. 0 for no prediction
+ */
+void determineImageCacheSizeAndSamplesPerBatch(const ImageDataset& images,
         const std::vector<int>& deviceId, const size_t featureCount, const size_t numThresholds,
-        size_t imageCacheSizeMB, unsigned int& imageCacheSize, unsigned int& maxSamplesPerBatch);
+        size_t imageCacheSizeMB, unsigned int& imageCacheSize, unsigned int& maxSamplesPerBatch,
+        bool singlePrecisionFeatures = false, size_t numLabels = 0, size_t numTrees = 0);
 
-RandomForestImage train(std::vector<LabeledRGBDImage>& image, size_t trees,
-        const TrainingConfiguration& configuration, bool trainTreesInParallel);
+// moves most of the image cache memory to images in the compact format, see ImageCache::setCompactCacheSize()
+void determineCompactImageCacheSize(const ImageDataset& images, unsigned int& imageCacheSize,
+        unsigned int& compactImageCacheSize);
+
+RandomForestImage train(const ImageDataset& images, size_t trees,
+        const TrainingConfiguration& configuration, bool trainTreesInParallel,
+        const std::string& checkpointFolder = std::string());
+
+/**
+ * Trains the trees of a forest together with other processes that share the output folder, see TreeQueue.
+ * Each device of the configuration trains one claimed tree at a time and writes it to the output folder.
+ * The process that finds all trees written writes the manifest 'forest.manifest' to the output folder.
+ *
+ * @param checkpointFolder should be shared as well, such that a tree of a crashed process resumes from its checkpoint
+ * @return true if all trees of the forest are written
+ */
+bool trainDistributed(const ImageDataset& images, size_t trees, const TrainingConfiguration& configuration,
+        const std::string& outputFolder, const std::string& trainingFolder, bool verboseTree,
+        const std::string& checkpointFolder = std::string());
 
 }
 
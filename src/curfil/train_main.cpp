@@ -2,6 +2,8 @@
 #include <tbb/task_scheduler_init.h>
 
 #include "export.h"
+#include "preprocessing_cache.h"
+#include "trace.h"
 #include "train.h"
 #include "utils.h"
 #include "version.h"
@@ -26,15 +28,25 @@ int main(int argc, char **argv) {
     int numThreads;
     std::string subsamplingType;
     bool profiling;
+    std::string traceFile;
     bool useCIELab = true;
     bool useDepthFilling = false;
-    int deviceId = 0;
+    std::vector<int> deviceIds;
     int maxImages = 0;
     int randomSeed = 4711;
     std::vector<std::string> ignoredColors;
-    bool trainTreesInParallel = false; // parallel tree training on GPU is considered to be an experimental feature
+    bool trainTreesInParallel = false;
     bool verboseTree = false;
     int imageCacheSizeMB = 0;
+    unsigned int hybridSampleThreshold = TrainingConfiguration::DEFAULT_HYBRID_SAMPLE_THRESHOLD;
+    bool compactImageCache = false;
+    bool singlePrecision = false;
+    bool binnedSplits = false;
+    size_t pinnedMemoryMB = 0;
+    size_t hostMemoryMB = 0;
+    std::string checkpointFolder;
+    std::string cacheFolder;
+    bool distributed = false;
 
     // Declare the supported options.
     po::options_description options("options");
@@ -58,15 +70,44 @@ int main(int argc, char **argv) {
             "convert images to CIElab color space")
     ("useDepthFilling", po::value<bool>(&useDepthFilling)->implicit_value(true)->default_value(useDepthFilling),
             "whether to do simple depth filling")
-    ("deviceId", po::value<int>(&deviceId)->default_value(deviceId), "GPU device id")
+    ("deviceId", po::value<std::vector<int> >(&deviceIds)->multitoken(),
+            "GPU device id(s). trees are distributed over all given devices. default: 0")
     ("subsamplingType", po::value<std::string>(&subsamplingType)->default_value("classUniform"),
             "subsampling type: 'pixelUniform' or 'classUniform'")
     ("maxImages", po::value<int>(&maxImages)->default_value(maxImages),
             "maximum number of images to load for training. set to 0 if all images should be loaded")
     ("imageCacheSize", po::value<int>(&imageCacheSizeMB)->default_value(imageCacheSizeMB),
-            "image cache size on GPU in MB. 0 means automatic adjustment")
-    ("mode", po::value<std::string>(&modeString)->default_value("gpu"), "mode: 'gpu' (default), 'cpu' or 'compare'")
+            "image cache size on GPU in MB. 0 means automatic adjustment to the free memory of the GPUs")
+    ("compactImageCache",
+            po::value<bool>(&compactImageCache)->implicit_value(true)->default_value(compactImageCache),
+            "keep most images of the image cache in a compact format to fit about twice as many images")
+    ("pinnedMemory", po::value<size_t>(&pinnedMemoryMB)->default_value(pinnedMemoryMB),
+            "page-lock up to this many MB of training images in host memory for asynchronous transfers to the GPU")
+    ("hostMemory", po::value<size_t>(&hostMemoryMB)->default_value(hostMemoryMB),
+            "load the images when a tree samples them and keep at most this many MB of unused images in memory. "
+            "0 keeps all loaded images")
+    ("checkpointFolder", po::value<std::string>(&checkpointFolder)->default_value(checkpointFolder),
+            "write a checkpoint of every tree after each trained level to this folder and resume from it if present")
+    ("cacheFolder", po::value<std::string>(&cacheFolder)->default_value(cacheFolder),
+            "cache the preprocessed images in this folder and load them from there in subsequent runs")
+    ("distributed", po::value<bool>(&distributed)->implicit_value(true)->default_value(distributed),
+            "train the forest together with all processes that are started with the same parameters and output "
+            "folder, for example on other hosts. each process claims and writes one tree per device at a time. "
+            "the last process writes the manifest 'forest.manifest' that loads the forest")
+    ("mode", po::value<std::string>(&modeString)->default_value("gpu"),
+            "mode: 'gpu' (default), 'cpu', 'compare' or 'hybrid'")
+    ("hybridThreshold", po::value<unsigned int>(&hybridSampleThreshold)->default_value(hybridSampleThreshold),
+            "hybrid mode: evaluate nodes with at least this many samples on the GPU until the timings are calibrated")
+    ("singlePrecision", po::value<bool>(&singlePrecision)->implicit_value(true)->default_value(singlePrecision),
+            "calculate the feature responses in single instead of double precision. "
+            "in compare mode, the best splits of the GPU are checked against the CPU in double precision")
+    ("binnedSplits", po::value<bool>(&binnedSplits)->implicit_value(true)->default_value(binnedSplits),
+            "draw the thresholds of a feature as sorted quantiles of its responses and count the samples per bin "
+            "between them on the GPU. makes many more thresholds per feature (e.g. 255) affordable")
     ("profile", po::value<bool>(&profiling)->implicit_value(true)->default_value(false), "profiling")
+    ("trace", po::value<std::string>(&traceFile)->default_value(traceFile),
+            "record the host and GPU spans of the training, write them to this file in the Chrome trace format "
+            "and log a summary per tree level")
     ("randomSeed", po::value<int>(&randomSeed)->default_value(randomSeed), "random seed")
     ("ignoreColor", po::value<std::vector<std::string> >(&ignoredColors),
             "do not sample pixels of this color. format: R,G,B where 0 <= R,G,B <= 255")
@@ -74,7 +115,8 @@ int main(int argc, char **argv) {
             "whether to write verbose tree include profiling and debugging information")
     ("trainTreesInParallel",
             po::value<bool>(&trainTreesInParallel)->implicit_value(true)->default_value(trainTreesInParallel),
-            "whether to train multiple trees sequentially (default) or in parallel (experimental)");
+            "whether to train multiple trees sequentially (default) or in parallel. on the GPU, the trees are trained "
+            "together level by level and share the image transfers");
     ;
 
     po::positional_options_description pod;
@@ -116,29 +158,69 @@ int main(int argc, char **argv) {
     CURFIL_INFO("DepthFilling: " << useDepthFilling);
 
     utils::Profile::setEnabled(profiling);
+    if (!traceFile.empty()) {
+        trace::enable();
+    }
+    PreprocessingCache::setFolder(cacheFolder);
 
     tbb::task_scheduler_init init(numThreads);
 
-    std::vector<LabeledRGBDImage> images = loadImages(folderTraining, useCIELab, useDepthFilling);
+    const ImageDataset images(folderTraining, useCIELab, useDepthFilling, hostMemoryMB, pinnedMemoryMB);
     if (images.empty()) {
         throw std::runtime_error(std::string("found no files in ") + folderTraining);
     }
 
-    // currently training on only on GPU is tested
-    std::vector<int> deviceIds(1, deviceId);
+    if (deviceIds.empty()) {
+        deviceIds.push_back(0);
+    }
 
     unsigned int imageCacheSize = 0;
     unsigned int maxSamplesPerBatch = 0;
 
     determineImageCacheSizeAndSamplesPerBatch(images, deviceIds, featureCount, numThresholds, imageCacheSizeMB,
-            imageCacheSize, maxSamplesPerBatch);
+            imageCacheSize, maxSamplesPerBatch, singlePrecision);
+
+    unsigned int compactImageCacheSize = 0;
+    if (compactImageCache) {
+        determineCompactImageCacheSize(images, imageCacheSize, compactImageCacheSize);
+    }
 
     TrainingConfiguration configuration(randomSeed, samplesPerImage, featureCount, minSampleCount,
             maxDepth, boxRadius, regionSize, numThresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch,
             TrainingConfiguration::parseAccelerationModeString(modeString), useCIELab, useDepthFilling, deviceIds,
             subsamplingType, ignoredColors);
+    configuration.setHybridSampleThreshold(hybridSampleThreshold);
+    configuration.setCompactImageCacheSize(compactImageCacheSize);
+    configuration.setSinglePrecisionFeatures(singlePrecision);
+    configuration.setBinnedSplits(binnedSplits);
+
+    if (distributed) {
+        if (outputFolder.empty()) {
+            throw std::runtime_error("the distributed training requires an output folder");
+        }
+        if (checkpointFolder.empty()) {
+            // a tree that is claimed again after a crash resumes from its checkpoint
+            checkpointFolder = outputFolder + "/checkpoints";
+        }
+
+        trainDistributed(images, trees, configuration, outputFolder, folderTraining, verboseTree,
+                checkpointFolder);
+
+        if (!traceFile.empty()) {
+            trace::logSummary();
+            trace::writeChromeTrace(traceFile);
+        }
+
+        CURFIL_INFO("finished");
+        return EXIT_SUCCESS;
+    }
+
+    RandomForestImage forest = train(images, trees, configuration, trainTreesInParallel, checkpointFolder);
 
-    RandomForestImage forest = train(images, trees, configuration, trainTreesInParallel);
+    if (!traceFile.empty()) {
+        trace::logSummary();
+        trace::writeChromeTrace(traceFile);
+    }
 
     if (!outputFolder.empty()) {
         RandomTreeExport treeExport(configuration, outputFolder, folderTraining, verboseTree);
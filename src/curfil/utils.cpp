@@ -1,9 +1,22 @@
 #include "utils.h"
 
 #include <boost/algorithm/string.hpp>
+#include <algorithm>
 #include <boost/format.hpp>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <cuda_runtime_api.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_scheduler_init.h>
+#include <unistd.h>
+#include <zlib.h>
 
+#include "trace.h"
 #include "version.h"
 
 namespace curfil {
@@ -20,6 +33,20 @@ namespace utils {
 
 bool Profile::enabled = false;
 
+Profile::Profile(const std::string& name) :
+        name(name), timer(), traceBegin(trace::isEnabled() ? trace::now() : -1) {
+}
+
+Profile::~Profile() {
+    if (isEnabled()) {
+        timer.stop();
+        CURFIL_INFO("PROFILING('" << name << "'): " << timer.format(3));
+    }
+    if (traceBegin >= 0) {
+        trace::record(trace::intern(name), trace::HOST, traceBegin, trace::now());
+    }
+}
+
 void Timer::reset() {
     stop();
     start();
@@ -59,6 +86,203 @@ double Timer::getMilliseconds() {
     return duration.total_microseconds() / static_cast<double>(1e3);
 }
 
+MappedFile::MappedFile(const std::string& filename) :
+        data(MAP_FAILED), size(0) {
+
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error((boost::format("failed to open '%s': %s") % filename % strerror(errno)).str());
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+        close(fd);
+        throw std::runtime_error(std::string("failed to map empty or unreadable file: ") + filename);
+    }
+    size = fileStat.st_size;
+
+    data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    const int error = errno;
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        throw std::runtime_error((boost::format("failed to map '%s': %s") % filename % strerror(error)).str());
+    }
+}
+
+MappedFile::~MappedFile() {
+    munmap(data, size);
+}
+
+namespace {
+
+// the window size of deflate
+static const size_t GZIP_DICTIONARY_SIZE = 32 * 1024;
+
+static void writeLittleEndian(std::ofstream& ostream, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        ostream.put(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+// raw deflate of one block. all blocks except the last end at a byte boundary (sync flush),
+// hence their output can be concatenated
+static void deflateBlock(const std::string& input, const char* dictionary, size_t dictionarySize, bool last,
+        std::string& output) {
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("failed to initialize deflate");
+    }
+
+    if (dictionarySize > 0) {
+        deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(dictionary), dictionarySize);
+    }
+
+    output.resize(deflateBound(&stream, input.size()) + 16);
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream.avail_in = input.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+
+    int result;
+    while (true) {
+        result = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+        if (result == Z_STREAM_ERROR) {
+            break;
+        }
+        if (last ? (result == Z_STREAM_END) : (stream.avail_out > 0)) {
+            break;
+        }
+        // the output did not fit
+        const size_t used = output.size() - stream.avail_out;
+        output.resize(2 * output.size());
+        stream.next_out = reinterpret_cast<Bytef*>(&output[used]);
+        stream.avail_out = output.size() - used;
+    }
+
+    output.resize(output.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    if (result == Z_STREAM_ERROR || stream.avail_in > 0) {
+        throw std::runtime_error("failed to deflate block");
+    }
+}
+
+}
+
+ParallelGzipWriter::ParallelGzipWriter(const std::string& filename, size_t blockSize, size_t blocksPerBatch) :
+        filename(filename), blockSize(blockSize), blocksPerBatch(blocksPerBatch),
+                ostream(filename.c_str(), std::ios::binary | std::ios::trunc), blocks(), dictionary(),
+                crc(crc32(0L, Z_NULL, 0)), uncompressedSize(0), closed(false) {
+
+    assert(blockSize > 0);
+
+    if (this->blocksPerBatch == 0) {
+        this->blocksPerBatch = 2 * tbb::task_scheduler_init::default_num_threads();
+    }
+
+    if (!ostream) {
+        throw std::runtime_error(std::string("failed to open ") + filename + " for writing");
+    }
+
+    // gzip header without file name and modification time. OS: unix
+    const char header[] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, 0, 3 };
+    ostream.write(header, sizeof(header));
+}
+
+ParallelGzipWriter::~ParallelGzipWriter() {
+    if (!closed) {
+        try {
+            close();
+        } catch (const std::exception& e) {
+            CURFIL_ERROR("failed to close " << filename << ": " << e.what());
+        }
+    }
+}
+
+void ParallelGzipWriter::write(const char* data, size_t size) {
+    if (closed) {
+        throw std::runtime_error(std::string("write to closed file ") + filename);
+    }
+
+    while (size > 0) {
+        if (blocks.empty() || blocks.back().size() == blockSize) {
+            if (blocks.size() == blocksPerBatch) {
+                compressBatch(false);
+            }
+            blocks.push_back(std::string());
+            blocks.back().reserve(blockSize);
+        }
+
+        std::string& block = blocks.back();
+        const size_t length = std::min(size, blockSize - block.size());
+        block.append(data, length);
+        data += length;
+        size -= length;
+    }
+}
+
+void ParallelGzipWriter::close() {
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    if (blocks.empty()) {
+        // the last block terminates the deflate stream
+        blocks.push_back(std::string());
+    }
+    compressBatch(true);
+
+    writeLittleEndian(ostream, crc);
+    writeLittleEndian(ostream, static_cast<uint32_t>(uncompressedSize & 0xFFFFFFFF));
+
+    ostream.close();
+    if (!ostream) {
+        throw std::runtime_error(std::string("failed to write ") + filename);
+    }
+}
+
+void ParallelGzipWriter::compressBatch(bool last) {
+
+    const size_t numBlocks = blocks.size();
+    std::vector<std::string> outputs(numBlocks);
+    std::vector<unsigned long> crcs(numBlocks);
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, numBlocks, 1),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for(size_t blockNr = range.begin(); blockNr != range.end(); blockNr++) {
+                    const std::string& block = blocks[blockNr];
+                    const std::string& previous = (blockNr == 0) ? dictionary : blocks[blockNr - 1];
+                    const size_t dictionarySize = std::min(previous.size(), GZIP_DICTIONARY_SIZE);
+
+                    deflateBlock(block, previous.data() + previous.size() - dictionarySize, dictionarySize,
+                            last && blockNr == numBlocks - 1, outputs[blockNr]);
+
+                    crcs[blockNr] = crc32(crc32(0L, Z_NULL, 0),
+                            reinterpret_cast<const Bytef*>(block.data()), block.size());
+                }
+            });
+
+    for (size_t blockNr = 0; blockNr < numBlocks; blockNr++) {
+        crc = crc32_combine(crc, crcs[blockNr], blocks[blockNr].size());
+        uncompressedSize += blocks[blockNr].size();
+        ostream.write(outputs[blockNr].data(), outputs[blockNr].size());
+    }
+
+    if (!ostream) {
+        throw std::runtime_error(std::string("failed to write ") + filename);
+    }
+
+    const std::string& lastBlock = blocks.back();
+    const size_t dictionarySize = std::min(lastBlock.size(), GZIP_DICTIONARY_SIZE);
+    dictionary.assign(lastBlock, lastBlock.size() - dictionarySize, dictionarySize);
+
+    blocks.clear();
+}
+
 void logMessage(const std::string& msg, std::ostream& os) {
     boost::posix_time::ptime date_time = boost::posix_time::microsec_clock::local_time();
 
@@ -3,8 +3,11 @@
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/format.hpp>
+#include <fstream>
 #include <sstream>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 namespace curfil {
 
@@ -81,6 +84,81 @@ private:
     size_t count;
 };
 
+/**
+ * Read-only mapping of a whole file. The pages are shared with all processes that map the same file.
+ */
+class MappedFile {
+
+public:
+
+    explicit MappedFile(const std::string& filename);
+
+    ~MappedFile();
+
+    const int8_t* ptr() const {
+        return reinterpret_cast<const int8_t*>(data);
+    }
+
+    size_t getSize() const {
+        return size;
+    }
+
+private:
+    void* data;
+    size_t size;
+
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
+/**
+ * Writes a gzip file whose blocks are compressed in parallel, in the manner of pigz.
+ *
+ * The input is split into blocks that are deflated independently, each primed with the last 32 KB of the preceding
+ * block. The blocks form a single gzip member, hence any gzip decompressor can read the file.
+ * At most 'blocksPerBatch' blocks are buffered.
+ */
+class ParallelGzipWriter {
+
+public:
+
+    /**
+     * @param blocksPerBatch the number of blocks that are compressed in parallel. 0 uses two blocks per thread
+     */
+    explicit ParallelGzipWriter(const std::string& filename, size_t blockSize = 128 * 1024,
+            size_t blocksPerBatch = 0);
+
+    /**
+     * Closes the file if close() was not called. Errors are logged.
+     */
+    ~ParallelGzipWriter();
+
+    void write(const char* data, size_t size);
+
+    /**
+     * Compresses the remaining blocks and writes the gzip trailer.
+     */
+    void close();
+
+private:
+    const std::string filename;
+    const size_t blockSize;
+    size_t blocksPerBatch;
+
+    std::ofstream ostream;
+    std::vector<std::string> blocks;
+    // the end of the last block of the previous batch
+    std::string dictionary;
+    unsigned long crc;
+    uint64_t uncompressedSize;
+    bool closed;
+
+    void compressBatch(bool last);
+
+    ParallelGzipWriter(const ParallelGzipWriter&);
+    ParallelGzipWriter& operator=(const ParallelGzipWriter&);
+};
+
 void logMessage(const std::string& message, std::ostream& os);
 
 #define CURFIL_LOG(level, message, os) { \
@@ -106,18 +184,15 @@ void logMessage(const std::string& message, std::ostream& os);
 #define CURFIL_DEBUG(x) CURFIL_LOG("DEBUG", x, std::cout)
 #endif
 
+/**
+ * Logs the lifetime of the scope if profiling is enabled and records it as host event if tracing is enabled,
+ * see trace::enable(). GPU work should be recorded with trace::GpuSpan instead.
+ */
 class Profile {
 public:
-    Profile(const std::string& name) :
-            name(name), timer() {
-    }
+    Profile(const std::string& name);
 
-    ~Profile() {
-        if (isEnabled()) {
-            timer.stop();
-            CURFIL_INFO("PROFILING('" << name << "'): " << timer.format(3));
-        }
-    }
+    ~Profile();
 
     double getSeconds() {
         return timer.getSeconds();
@@ -138,6 +213,7 @@ private:
 
     std::string name;
     Timer timer;
+    int64_t traceBegin;
 };
 
 size_t getFreeMemoryOnGPU(int deviceId);
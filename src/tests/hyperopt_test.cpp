@@ -1,5 +1,6 @@
 #define BOOST_TEST_MODULE example
 
+#include <algorithm>
 #include <boost/test/included/unit_test.hpp>
 #include <vector>
 
@@ -139,4 +140,22 @@ BOOST_AUTO_TEST_CASE(testResultGetLoss) {
     BOOST_CHECK_EQUAL(result.getLoss(), 1.0 - pixelAccuracyWithoutVoid);
 
 }
+
+BOOST_AUTO_TEST_CASE(testGetLosses) {
+
+    const mongo::BSONObj task = BSON("result" << BSON(
+            "results" << BSON_ARRAY(BSON("loss" << 0.3) << BSON("loss" << 0.1) << BSON("loss" << 0.2))));
+
+    std::vector<double> losses = getLosses(task, "result.results.loss");
+    std::sort(losses.begin(), losses.end());
+
+    BOOST_REQUIRE_EQUAL(losses.size(), 3lu);
+    BOOST_CHECK_EQUAL(losses[0], 0.1);
+    BOOST_CHECK_EQUAL(losses[1], 0.2);
+    BOOST_CHECK_EQUAL(losses[2], 0.3);
+
+    // tasks that did not screen their parameters
+    BOOST_CHECK(getLosses(task, "result.screening_results.loss").empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
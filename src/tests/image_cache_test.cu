@@ -1,9 +1,12 @@
 #define BOOST_TEST_MODULE example
 
+#include <boost/make_shared.hpp>
 #include <boost/test/included/unit_test.hpp>
 #include <vector>
 
+#include "device_memory.h"
 #include "image.h"
+#include "image_dataset.h"
 #include "random_tree_image_gpu.h"
 #include "test_common.h"
 #include "utils.h"
@@ -92,4 +95,221 @@ BOOST_AUTO_TEST_CASE(testImageCacheSimple) {
 
     CURFIL_INFO("done");
 }
+
+BOOST_AUTO_TEST_CASE(testImageCacheSchedule) {
+
+    int width = 41;
+    int height = 33;
+    const int imageCacheSize = 3;
+
+    std::vector<RGBDImage> images(4, RGBDImage(width, height));
+
+    ImageCache imageCache;
+    std::map<const void*, size_t>& map = imageCache.getIdMap();
+
+    std::vector<std::set<const RGBDImage*> > schedule(6);
+    const int requests[] = { 0, 1, 2, 3, 0, 1 };
+    for (size_t i = 0; i < schedule.size(); i++) {
+        schedule[i].insert(&images[requests[i]]);
+    }
+    imageCache.setSchedule(schedule);
+
+    for (size_t i = 0; i < 4; i++) {
+        std::set<const RGBDImage*> request;
+        request.insert(&images[requests[i]]);
+        imageCache.copyImages(imageCacheSize, request);
+    }
+
+    // image 2 is not needed again. LRU would have evicted image 0
+    BOOST_CHECK_EQUAL(3lu, map.size());
+    BOOST_CHECK(map.find(&images[0]) != map.end());
+    BOOST_CHECK(map.find(&images[1]) != map.end());
+    BOOST_CHECK(map.find(&images[2]) == map.end());
+    BOOST_CHECK(map.find(&images[3]) != map.end());
+
+    for (size_t i = 4; i < 6; i++) {
+        std::set<const RGBDImage*> request;
+        request.insert(&images[requests[i]]);
+        imageCache.copyImages(imageCacheSize, request);
+    }
+
+    BOOST_CHECK_EQUAL(2lu, imageCache.getNumHits());
+    BOOST_CHECK_EQUAL(4lu, imageCache.getNumMisses());
+    BOOST_CHECK_EQUAL(1lu, imageCache.getNumEvictions());
+    BOOST_CHECK_EQUAL(0lu, imageCache.getNumPrefetches());
+
+    const size_t imageSize = width * height * (colorChannels * sizeof(float) + depthChannels * sizeof(int));
+    BOOST_CHECK_EQUAL(4 * imageSize, imageCache.getTotalBytesTransferred());
+}
+
+BOOST_AUTO_TEST_CASE(testImageCachePrefetch) {
+
+    int width = 41;
+    int height = 33;
+    const int imageCacheSize = 3;
+
+    std::vector<RGBDImage> images(3, RGBDImage(width, height));
+
+    cudaStream_t prefetchStream;
+    cudaSafeCall(cudaStreamCreate(&prefetchStream));
+
+    {
+        ImageCache imageCache;
+        imageCache.setPrefetchStream(prefetchStream);
+        std::map<const void*, size_t>& map = imageCache.getIdMap();
+
+        std::vector<std::set<const RGBDImage*> > schedule(3);
+        for (size_t i = 0; i < schedule.size(); i++) {
+            schedule[i].insert(&images[i]);
+        }
+        imageCache.setSchedule(schedule);
+
+        std::set<const RGBDImage*> request;
+        request.insert(&images[0]);
+        imageCache.copyImages(imageCacheSize, request);
+
+        // the images of the next two requests are prefetched into the empty slots
+        BOOST_CHECK_EQUAL(3lu, map.size());
+        BOOST_CHECK_EQUAL(2lu, imageCache.getNumPrefetches());
+        BOOST_CHECK_EQUAL(1lu, imageCache.getNumMisses());
+
+        for (size_t i = 1; i < 3; i++) {
+            request.clear();
+            request.insert(&images[i]);
+            imageCache.copyImages(imageCacheSize, request);
+        }
+
+        BOOST_CHECK_EQUAL(2lu, imageCache.getNumHits());
+        BOOST_CHECK_EQUAL(1lu, imageCache.getNumMisses());
+        BOOST_CHECK_EQUAL(0lu, imageCache.getNumEvictions());
+
+        const size_t imageSize = width * height * (colorChannels * sizeof(float) + depthChannels * sizeof(int));
+        BOOST_CHECK_EQUAL(3 * imageSize, imageCache.getTotalBytesTransferred());
+    }
+
+    cudaSafeCall(cudaStreamDestroy(prefetchStream));
+}
+
+BOOST_AUTO_TEST_CASE(testDeviceContext) {
+
+    int width = 41;
+    int height = 33;
+
+    std::vector<RGBDImage> images(2, RGBDImage(width, height));
+
+    int deviceCount = 0;
+    cudaSafeCall(cudaGetDeviceCount(&deviceCount));
+
+    BOOST_REQUIRE(deviceCount > 0);
+
+    DeviceContext& context = DeviceContext::get(0);
+    BOOST_CHECK_EQUAL(0, context.getDeviceId());
+    BOOST_CHECK_EQUAL(&context, &DeviceContext::get(0));
+
+    cudaSafeCall(cudaSetDevice(0));
+    BOOST_CHECK_EQUAL(&context, &DeviceContext::getCurrent());
+
+    std::map<const void*, size_t>& map = context.getImageCache().getIdMap();
+
+    std::vector<PixelInstance> samples;
+    samples.push_back(PixelInstance(&images[0], 0, Depth(1.0), 0, 0));
+    samples.push_back(PixelInstance(&images[1], 0, Depth(1.0), 0, 0));
+
+    context.getImageCache().copyImages(2, getPointers(samples));
+    BOOST_CHECK_EQUAL(2lu, map.size());
+
+    if (deviceCount > 1) {
+        // the image cache of another device must be independent
+        DeviceContext& otherContext = DeviceContext::get(1);
+        BOOST_CHECK_EQUAL(1, otherContext.getDeviceId());
+        BOOST_CHECK(otherContext.getImageCache().getIdMap().empty());
+
+        // must not switch the device of the calling thread
+        int currentDeviceId;
+        cudaSafeCall(cudaGetDevice(&currentDeviceId));
+        BOOST_CHECK_EQUAL(0, currentDeviceId);
+    }
+
+    clearImageCache();
+    BOOST_CHECK(map.empty());
+}
+
+BOOST_AUTO_TEST_CASE(testDeviceMemoryPlan) {
+
+    // twice the size of an image is less than 1 MB
+    int width = 200;
+    int height = 100;
+
+    std::vector<LabeledRGBDImage> images;
+    for (int i = 0; i < 10; i++) {
+        images.push_back(LabeledRGBDImage(boost::make_shared<RGBDImage>(width, height),
+                boost::make_shared<LabelImage>(width, height)));
+    }
+    ImageDataset dataset(images);
+
+    const std::vector<int> deviceIds(1, 0);
+    const size_t featureCount = 100;
+    const size_t numThresholds = 10;
+
+    // all images fit into the automatically sized cache
+    DeviceMemoryPlan plan(dataset, deviceIds, featureCount, numThresholds, 0, false, 3);
+    BOOST_CHECK_EQUAL(10u, plan.getImageCacheSize());
+    BOOST_CHECK_EQUAL(10 * images[0].getSizeInMemory(), plan.getImageCacheMemory());
+    BOOST_CHECK_EQUAL(static_cast<unsigned int>(DeviceMemoryPlan::MAX_SAMPLES_PER_BATCH),
+            plan.getMaxSamplesPerBatch());
+    BOOST_CHECK_EQUAL(0lu, plan.getTreeCacheMemory());
+    BOOST_CHECK_EQUAL(0lu, plan.getPredictionMemory());
+    BOOST_CHECK(plan.getReservedMemory() + plan.getImageCacheMemory() + plan.getFeatureResponsesMemory()
+            + plan.getCountersMemory() + plan.getScoresMemory() <= plan.getFreeMemory());
+
+    // the given cache size
+    DeviceMemoryPlan smallPlan(dataset, deviceIds, featureCount, numThresholds, 1, false, 3, 2);
+    BOOST_REQUIRE_EQUAL(2lu, 1024lu * 1024lu / images[0].getSizeInMemory());
+    BOOST_CHECK_EQUAL(2u, smallPlan.getImageCacheSize());
+    BOOST_CHECK(smallPlan.getTreeCacheMemory() > 0);
+    BOOST_CHECK_EQUAL(static_cast<size_t>(width) * height * (3 * sizeof(float) + sizeof(LabelType)),
+            smallPlan.getPredictionMemory());
+
+    DeviceMemoryUsage::reset();
+    smallPlan.apply();
+    BOOST_CHECK_EQUAL(smallPlan.getImageCacheMemory(), DeviceMemoryUsage::getBudget("imageCache"));
+    BOOST_CHECK_EQUAL(smallPlan.getTreeCacheMemory(), DeviceMemoryUsage::getBudget("treeCache"));
+    BOOST_CHECK_EQUAL(smallPlan.getPredictionMemory(), DeviceMemoryUsage::getBudget("prediction"));
+
+    // only the tree cache, the prediction buffers and a single image
+    DeviceMemoryPlan predictionPlan(dataset, deviceIds, 0, 0, 0, false, 3, 2);
+    BOOST_CHECK_EQUAL(1u, predictionPlan.getImageCacheSize());
+    BOOST_CHECK_EQUAL(0u, predictionPlan.getMaxSamplesPerBatch());
+    BOOST_CHECK_EQUAL(0lu, predictionPlan.getCountersMemory());
+    BOOST_CHECK_EQUAL(smallPlan.getPredictionMemory(), predictionPlan.getPredictionMemory());
+
+    // the peak is the largest sum of the buffers that are in use at the same time
+    DeviceMemoryUsage::reset();
+    {
+        DeviceMemoryUsage::Scope first("counters", 100);
+        {
+            DeviceMemoryUsage::Scope second("counters", 200);
+            second.add(50);
+            BOOST_CHECK_EQUAL(350lu, DeviceMemoryUsage::getUsage()["counters"]);
+        }
+        BOOST_CHECK_EQUAL(100lu, DeviceMemoryUsage::getUsage()["counters"]);
+        DeviceMemoryUsage::Scope third("counters", 200);
+        BOOST_CHECK_EQUAL(300lu, DeviceMemoryUsage::getUsage()["counters"]);
+    }
+    BOOST_CHECK_EQUAL(0lu, DeviceMemoryUsage::getUsage()["counters"]);
+    BOOST_CHECK_EQUAL(350lu, DeviceMemoryUsage::getPeakUsage()["counters"]);
+    BOOST_CHECK_EQUAL(1lu, DeviceMemoryUsage::getPeakUsage().size());
+
+    // the devices are accounted separately
+    DeviceMemoryUsage::allocate("scores", 0, 100);
+    DeviceMemoryUsage::allocate("scores", 1, 100);
+    BOOST_CHECK_EQUAL(100lu, DeviceMemoryUsage::getPeakUsage()["scores"]);
+    DeviceMemoryUsage::release("scores", 0, 100);
+    DeviceMemoryUsage::release("scores", 1, 100);
+
+    DeviceMemoryUsage::reset();
+    BOOST_CHECK(DeviceMemoryUsage::getBudgets().empty());
+    BOOST_CHECK(DeviceMemoryUsage::getPeakUsage().empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,8 @@
 #include <boost/test/included/unit_test.hpp>
 
 #include "image.h"
+#include "image_dataset.h"
+#include "preprocessing_cache.h"
 #include "random_tree_image.h"
 #include "utils.h"
 
@@ -395,6 +397,173 @@ BOOST_AUTO_TEST_CASE(testLabeledRGBDImage) {
     BOOST_CHECK_THROW(LabeledRGBDImage(rgbdImage, boost::make_shared<LabelImage>(200, 300)), std::runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(testPreprocessingCache) {
+
+    const fs::path folder = fs::unique_path("%%%%-%%%%-%%%%-%%%%");
+    fs::create_directories(folder);
+    const std::string prefix = (folder / "image").native();
+
+    RGBDImage image(80, 60);
+    LabelImage labelImage(80, 60);
+
+    const int COLOR_MAX = 64;
+    Sampler colorSampler(4711, 0, COLOR_MAX);
+    Sampler depthSampler(4712, 500, 5000);
+
+    for (int y = 0; y < image.getHeight(); y++) {
+        for (int x = 0; x < image.getWidth(); x++) {
+            image.setDepth(x, y, Depth(depthSampler.getNext() / 1000.0));
+            for (unsigned int c = 0; c < 3; c++) {
+                image.setColor(x, y, c, colorSampler.getNext() / static_cast<float>(COLOR_MAX));
+            }
+            RGBColor color(x % 4 * 50, y % 3 * 80, 7);
+            labelImage.setLabel(x, y, getOrAddColorId(color, static_cast<LabelType>(5 + (x % 4) * 3 + y % 3)));
+        }
+    }
+
+    image.saveColor(prefix + "_colors.png");
+    image.saveDepth(prefix + "_depth.png");
+    labelImage.save(prefix + "_ground_truth.png");
+
+    const LabeledRGBDImage expected = loadImagePair(prefix + "_colors.png", true, true);
+
+    PreprocessingCache::setFolder((folder / "cache").native());
+
+    // the first load fills the cache, the second one reads from it
+    for (int run = 0; run < 2; run++) {
+        const LabeledRGBDImage actual = loadImagePair(prefix + "_colors.png", true, true);
+
+        BOOST_REQUIRE_EQUAL(fs::is_empty(folder / "cache"), false);
+        BOOST_REQUIRE_EQUAL(actual.getWidth(), expected.getWidth());
+        BOOST_REQUIRE_EQUAL(actual.getHeight(), expected.getHeight());
+        BOOST_CHECK_EQUAL(actual.getRGBDImage().hasIntegratedDepth(), expected.getRGBDImage().hasIntegratedDepth());
+        BOOST_CHECK_EQUAL(actual.getRGBDImage().hasIntegratedColor(), expected.getRGBDImage().hasIntegratedColor());
+
+        for (int y = 0; y < expected.getHeight(); y++) {
+            for (int x = 0; x < expected.getWidth(); x++) {
+                BOOST_REQUIRE_EQUAL(actual.getRGBDImage().getDepth(x, y).getIntValue(),
+                        expected.getRGBDImage().getDepth(x, y).getIntValue());
+                for (unsigned int c = 0; c < 3; c++) {
+                    BOOST_REQUIRE_EQUAL(actual.getRGBDImage().getColor(x, y, c),
+                            expected.getRGBDImage().getColor(x, y, c));
+                }
+                BOOST_REQUIRE_EQUAL(static_cast<int>(actual.getLabelImage().getLabel(x, y)),
+                        static_cast<int>(expected.getLabelImage().getLabel(x, y)));
+            }
+        }
+    }
+
+    // different preprocessing flags must not hit the entry
+    const LabeledRGBDImage withoutCIELab = loadImagePair(prefix + "_colors.png", false, true);
+    BOOST_CHECK_EQUAL(withoutCIELab.getRGBDImage().getColor(1, 1, 0) == expected.getRGBDImage().getColor(1, 1, 0),
+            false);
+
+    PreprocessingCache::setFolder("");
+    fs::remove_all(folder);
+}
+
+BOOST_AUTO_TEST_CASE(testImageDataset) {
+
+    const fs::path folder = fs::unique_path("%%%%-%%%%-%%%%-%%%%");
+    fs::create_directories(folder);
+
+    // 1.5 MB per image
+    const int width = 320;
+    const int height = 240;
+
+    for (int imageNr = 0; imageNr < 3; imageNr++) {
+        RGBDImage image(width, height);
+        LabelImage labelImage(width, height);
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                image.setDepth(x, y, Depth(1.0 + imageNr));
+                for (unsigned int c = 0; c < 3; c++) {
+                    image.setColor(x, y, c, (imageNr + 1) / 4.0f);
+                }
+            }
+        }
+        const std::string prefix = (folder / (boost::format("image%d") % imageNr).str()).native();
+        image.saveColor(prefix + "_colors.png");
+        image.saveDepth(prefix + "_depth.png");
+        labelImage.save(prefix + "_ground_truth.png");
+    }
+
+    {
+        // room for one unused image
+        const ImageDataset dataset(folder.native(), false, false, 2);
+
+        BOOST_REQUIRE_EQUAL(dataset.size(), 3lu);
+        BOOST_CHECK_EQUAL(dataset.getWidth(), width);
+        BOOST_CHECK_EQUAL(dataset.getHeight(), height);
+        BOOST_CHECK_EQUAL(dataset.getNumLoads(), 1lu);
+
+        const LabeledRGBDImage image2 = dataset.getImage(2);
+        BOOST_CHECK_EQUAL(image2.getRGBDImage().getDepth(0, 0).getIntValue(), 3000);
+        BOOST_CHECK_EQUAL(dataset.getNumLoads(), 2lu);
+
+        dataset.getImage(1);
+        BOOST_CHECK_EQUAL(dataset.getNumLoads(), 3lu);
+
+        // image 2 is still referenced, image 0 was released
+        BOOST_CHECK_EQUAL(dataset.getImage(2).rgbdImage.get(), image2.rgbdImage.get());
+        BOOST_CHECK_EQUAL(dataset.getNumLoads(), 3lu);
+
+        const std::vector<size_t> imageNrs(1, 0);
+        const std::vector<LabeledRGBDImage> images = dataset.getImages(imageNrs);
+        BOOST_REQUIRE_EQUAL(images.size(), 1lu);
+        BOOST_CHECK_EQUAL(images[0].getRGBDImage().getDepth(0, 0).getIntValue(), 1000);
+        BOOST_CHECK_EQUAL(dataset.getNumLoads(), 4lu);
+
+        BOOST_CHECK_THROW(dataset.getImage(3), std::runtime_error);
+    }
+
+    fs::remove_all(folder);
+}
+
+BOOST_AUTO_TEST_CASE(testPinnedMemory) {
+
+    const size_t pinnedMemoryStart = RGBDImage::getTotalPinnedMemory();
+
+    RGBDImage image(300, 200);
+    const size_t size = image.getSizeInMemory();
+    const size_t maxPinnedMemory = pinnedMemoryStart + size + size / 2;
+
+    {
+        RGBDImage otherImage(300, 200);
+
+        BOOST_CHECK(!image.isPinned());
+        BOOST_CHECK(image.pinMemory(maxPinnedMemory));
+        BOOST_CHECK(image.isPinned());
+        BOOST_CHECK_EQUAL(pinnedMemoryStart + size, RGBDImage::getTotalPinnedMemory());
+
+        // exceeds the limit
+        BOOST_CHECK(!otherImage.pinMemory(maxPinnedMemory));
+        BOOST_CHECK(!otherImage.isPinned());
+
+        // copies are not pinned
+        RGBDImage copy(image);
+        BOOST_CHECK(!copy.isPinned());
+        otherImage = image;
+        BOOST_CHECK(!otherImage.isPinned());
+        BOOST_CHECK_EQUAL(pinnedMemoryStart + size, RGBDImage::getTotalPinnedMemory());
+
+        image.setColor(10, 20, 1, 0.5f);
+        BOOST_CHECK_EQUAL(0.5f, image.getColor(10, 20, 1));
+    }
+
+    image.unpinMemory();
+    BOOST_CHECK(!image.isPinned());
+    BOOST_CHECK_EQUAL(pinnedMemoryStart, RGBDImage::getTotalPinnedMemory());
+
+    {
+        RGBDImage pinnedImage(300, 200);
+        BOOST_CHECK(pinnedImage.pinMemory(maxPinnedMemory));
+    }
+
+    // the destructor releases the memory
+    BOOST_CHECK_EQUAL(pinnedMemoryStart, RGBDImage::getTotalPinnedMemory());
+}
+
 BOOST_AUTO_TEST_CASE(testDepthFilling) {
 
     RGBDImage image(200, 100);
@@ -2,7 +2,15 @@
 
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/file.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/test/included/unit_test.hpp>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <sstream>
 #include <math.h>
 #include <stdlib.h>
 #include <tbb/task_scheduler_init.h>
@@ -18,7 +26,9 @@
 #include "import.h"
 #include "random_forest_image.h"
 #include "random_tree_image.h"
+#include "random_tree_image_gpu.h"
 #include "test_common.h"
+#include "train.h"
 
 using namespace curfil;
 
@@ -137,4 +147,358 @@ BOOST_AUTO_TEST_CASE(testExportImport) {
     }
 
 }
+
+BOOST_AUTO_TEST_CASE(testParallelGzipWriter) {
+
+    boost::filesystem::create_directory(folderOutput);
+    const std::string filename = folderOutput + "/parallel.gz";
+
+    std::string data;
+    for (int i = 0; i < 100000; i++) {
+        data += boost::str(boost::format("%d,") % (i * 7919 % 1000));
+    }
+
+    {
+        // small blocks and batches such that the data spans several batches
+        utils::ParallelGzipWriter writer(filename, 4096, 3);
+        for (size_t pos = 0; pos < data.size(); pos += 1000) {
+            writer.write(data.data() + pos, std::min(static_cast<size_t>(1000), data.size() - pos));
+        }
+        writer.close();
+    }
+
+    BOOST_CHECK_LT(boost::filesystem::file_size(filename), data.size() / 10);
+
+    boost::iostreams::filtering_istream istream;
+    istream.push(boost::iostreams::gzip_decompressor());
+    istream.push(boost::iostreams::file_source(filename));
+
+    std::ostringstream decompressed;
+    boost::iostreams::copy(istream, decompressed);
+    BOOST_CHECK(data == decompressed.str());
+}
+
+BOOST_AUTO_TEST_CASE(testBinaryForest) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    const std::string folderTraining(boost::unit_test::framework::master_test_suite().argv[1]);
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(folderTraining + "/training1_colors.png", useCIELab, useDepthFilling));
+
+    std::vector<std::string> ignoredColors;
+    ignoredColors.push_back("50,205,50");
+
+    TrainingConfiguration configuration(4711, 500, 100, 32, 10, 50, 10, 10, NUM_THREADS, 10, 10, 5000,
+            AccelerationMode::GPU_ONLY, useCIELab, useDepthFilling, std::vector<int>(1, 0), "classUniform",
+            ignoredColors);
+
+    const double histogramBias = 0.1;
+
+    RandomForestImage randomForest(2, configuration);
+    randomForest.train(trainImages);
+    randomForest.normalizeHistograms(histogramBias);
+
+    boost::filesystem::create_directory(folderOutput);
+    const std::string filename = folderOutput + "/forest.bin";
+    RandomTreeExport::writeBinary(filename, randomForest, histogramBias);
+    BOOST_CHECK(RandomTreeImport::isBinary(filename));
+
+    std::vector<boost::shared_ptr<const TreeNodes> > trees;
+    std::vector<cuv::ndarray<WeightType, cuv::host_memory_space> > priorDistributions;
+    double readHistogramBias = 0.0;
+    const TrainingConfiguration readConfiguration = RandomTreeImport::readBinary(filename, trees,
+            priorDistributions, readHistogramBias);
+
+    BOOST_CHECK(readConfiguration == configuration);
+    BOOST_CHECK_EQUAL(histogramBias, readHistogramBias);
+    BOOST_REQUIRE_EQUAL(randomForest.getTreeData().size(), trees.size());
+    BOOST_REQUIRE_EQUAL(trees.size(), priorDistributions.size());
+
+    for (size_t treeNr = 0; treeNr < trees.size(); treeNr++) {
+        const TreeNodes& expected = *randomForest.getTreeData()[treeNr];
+        const TreeNodes& actual = *trees[treeNr];
+        BOOST_CHECK_EQUAL(expected.getTreeId(), actual.getTreeId());
+        BOOST_REQUIRE_EQUAL(expected.numNodes(), actual.numNodes());
+        BOOST_REQUIRE_EQUAL(expected.numLeaves(), actual.numLeaves());
+        BOOST_REQUIRE_EQUAL(expected.numLabels(), actual.numLabels());
+        BOOST_CHECK_EQUAL(0, memcmp(expected.data().ptr(), actual.data().ptr(),
+                expected.numNodes() * TreeNodes::getNodeSize()));
+        BOOST_CHECK_EQUAL(0, memcmp(expected.histograms().ptr(), actual.histograms().ptr(),
+                expected.numLeaves() * expected.numLabels() * sizeof(float)));
+        checkEquals(randomForest.getTree(treeNr)->getClassLabelPriorDistribution(), priorDistributions[treeNr]);
+    }
+
+    RandomForestImage binaryForest(std::vector<std::string>(1, filename), std::vector<int>(1, 0),
+            AccelerationMode::GPU_ONLY, histogramBias);
+    BOOST_CHECK(binaryForest.getTrees().empty());
+    BOOST_CHECK_EQUAL(randomForest.getNumClasses(), binaryForest.getNumClasses());
+
+    const RGBDImage& image = trainImages[0].getRGBDImage();
+    for (const bool onGPU : { true, false }) {
+        const LabelImage expected = randomForest.predict(image, 0, onGPU);
+        const LabelImage actual = binaryForest.predict(image, 0, onGPU);
+        for (int y = 0; y < image.getHeight(); y++) {
+            for (int x = 0; x < image.getWidth(); x++) {
+                BOOST_CHECK_EQUAL(static_cast<int>(expected.getLabel(x, y)), static_cast<int>(actual.getLabel(x, y)));
+            }
+        }
+    }
+}
+
+// a process that predicts with a binary forest has not seen the label images of the training
+BOOST_AUTO_TEST_CASE(testBinaryForestPalette) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    const std::string folderTraining(boost::unit_test::framework::master_test_suite().argv[1]);
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(folderTraining + "/training1_colors.png", useCIELab, useDepthFilling));
+
+    std::vector<std::string> ignoredColors;
+    ignoredColors.push_back("50,205,50");
+
+    TrainingConfiguration configuration(4711, 500, 100, 32, 10, 50, 10, 10, NUM_THREADS, 10, 10, 5000,
+            AccelerationMode::GPU_ONLY, useCIELab, useDepthFilling, std::vector<int>(1, 0), "classUniform",
+            ignoredColors);
+
+    const double histogramBias = 0.1;
+
+    RandomForestImage randomForest(1, configuration);
+    randomForest.train(trainImages);
+    randomForest.normalizeHistograms(histogramBias);
+
+    boost::filesystem::create_directory(folderOutput);
+    const std::string filename = folderOutput + "/forest_palette.bin";
+    RandomTreeExport::writeBinary(filename, randomForest, histogramBias);
+
+    const std::map<LabelType, RGBColor> expectedColors = randomForest.getLabelColorMap();
+    std::vector<bool> expectedIgnored;
+    for (LabelType label = 0; label < randomForest.getNumClasses(); label++) {
+        expectedIgnored.push_back(randomForest.shouldIgnoreLabel(label));
+    }
+
+    clearColorIds();
+
+    RandomForestImage binaryForest(std::vector<std::string>(1, filename), std::vector<int>(1, 0),
+            AccelerationMode::GPU_ONLY, histogramBias);
+    BOOST_CHECK(binaryForest.getTrees().empty());
+
+    const std::map<LabelType, RGBColor> actualColors = binaryForest.getLabelColorMap();
+    BOOST_REQUIRE_EQUAL(expectedColors.size(), actualColors.size());
+    for (const auto& it : expectedColors) {
+        BOOST_REQUIRE(actualColors.find(it.first) != actualColors.end());
+        BOOST_CHECK_EQUAL(it.second, actualColors.find(it.first)->second);
+        BOOST_CHECK_EQUAL(expectedIgnored[it.first], binaryForest.shouldIgnoreLabel(it.first));
+    }
+
+    // files of the first version do not have a palette
+    {
+        std::fstream file(filename.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        const uint32_t version = 1;
+        file.seekp(offsetof(BinaryForestHeader, version));
+        file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    std::vector<boost::shared_ptr<const TreeNodes> > trees;
+    std::vector<cuv::ndarray<WeightType, cuv::host_memory_space> > priorDistributions;
+    double readHistogramBias = 0.0;
+    BOOST_CHECK_THROW(RandomTreeImport::readBinary(filename, trees, priorDistributions, readHistogramBias),
+            std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(testCheckpointResume) {
+    std::vector<LabeledRGBDImage> trainImages;
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    const std::string folderTraining(boost::unit_test::framework::master_test_suite().argv[1]);
+
+    trainImages.push_back(loadImagePair(folderTraining + "/training1_colors.png", useCIELab, useDepthFilling));
+
+    size_t trees = 2;
+
+    unsigned int samplesPerImage = 500;
+    unsigned int featureCount = 500;
+    unsigned int minSampleCount = 32;
+    int maxDepth = 10;
+    uint16_t boxRadius = 50;
+    uint16_t regionSize = 10;
+    uint16_t thresholds = 10;
+    int numThreads = NUM_THREADS;
+    int maxImages = 10;
+    int imageCacheSize = 10;
+    unsigned int maxSamplesPerBatch = 5000;
+    AccelerationMode accelerationMode = AccelerationMode::GPU_ONLY;
+
+    const int SEED = 4711;
+
+    const std::string checkpointFolder = folderOutput + "/checkpoints";
+    boost::filesystem::remove_all(checkpointFolder);
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+
+    RandomForestImage reference(trees, configuration);
+    reference.train(trainImages);
+
+    // emulates an interruption of the training after the third level
+    TrainingConfiguration interruptedConfiguration(SEED, samplesPerImage, featureCount, minSampleCount, 4, boxRadius,
+            regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+
+    RandomForestImage interrupted(trees, interruptedConfiguration);
+    interrupted.train(trainImages, false, checkpointFolder);
+
+    for (size_t treeNr = 0; treeNr < trees; treeNr++) {
+        const std::string filename = boost::str(
+                boost::format("%s/tree%d.checkpoint.json.gz") % checkpointFolder % treeNr);
+        BOOST_REQUIRE(boost::filesystem::is_regular_file(filename));
+
+        const RandomTreeCheckpoint<PixelInstance, ImageFeatureFunction> checkpoint =
+                RandomTreeImport::readCheckpoint(filename, configuration);
+        BOOST_CHECK_EQUAL(3, checkpoint.getLevel());
+        BOOST_CHECK(!checkpoint.getSplits().empty());
+        BOOST_CHECK(!checkpoint.getFrontier().empty());
+    }
+
+    RandomForestImage resumed(trees, configuration);
+    resumed.train(trainImages, false, checkpointFolder);
+
+    // only replays the checkpoints of the completed trees
+    RandomForestImage replayed(trees, configuration);
+    replayed.train(trainImages, false, checkpointFolder);
+
+    for (size_t treeNr = 0; treeNr < trees; treeNr++) {
+        checkTrees(resumed.getTree(treeNr), reference.getTree(treeNr));
+        checkTrees(replayed.getTree(treeNr), reference.getTree(treeNr));
+    }
+
+    TrainingConfiguration otherConfiguration(configuration);
+    otherConfiguration.setRandomSeed(SEED + 1);
+
+    RandomForestImage other(trees, otherConfiguration);
+    BOOST_CHECK_THROW(other.train(trainImages, false, checkpointFolder), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(testTrainTreesTogether) {
+    std::vector<LabeledRGBDImage> trainImages;
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    const std::string folderTraining(boost::unit_test::framework::master_test_suite().argv[1]);
+
+    trainImages.push_back(loadImagePair(folderTraining + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(folderTraining + "/training2_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(folderTraining + "/training3_colors.png", useCIELab, useDepthFilling));
+
+    size_t trees = 3;
+
+    unsigned int samplesPerImage = 1000;
+    unsigned int featureCount = 200;
+    unsigned int minSampleCount = 32;
+    int maxDepth = 10;
+    uint16_t boxRadius = 50;
+    uint16_t regionSize = 10;
+    uint16_t thresholds = 10;
+    int numThreads = NUM_THREADS;
+    // the trees sample different images which do not fit into the image cache at once
+    int maxImages = 2;
+    int imageCacheSize = 1;
+    unsigned int maxSamplesPerBatch = 500;
+    AccelerationMode accelerationMode = AccelerationMode::GPU_ONLY;
+
+    const int SEED = 4711;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, numThreads, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+
+    const bool trainTreesSequentially = true;
+
+    RandomForestImage sequential(trees, configuration);
+    sequential.train(trainImages, trainTreesSequentially);
+
+    RandomForestImage together(trees, configuration);
+    together.train(trainImages, !trainTreesSequentially);
+
+    for (size_t treeNr = 0; treeNr < trees; treeNr++) {
+        checkTrees(together.getTree(treeNr), sequential.getTree(treeNr));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testTrainDistributed) {
+    std::vector<LabeledRGBDImage> trainImages;
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    const std::string folderTraining(boost::unit_test::framework::master_test_suite().argv[1]);
+
+    trainImages.push_back(loadImagePair(folderTraining + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(folderTraining + "/training2_colors.png", useCIELab, useDepthFilling));
+
+    size_t trees = 3;
+
+    const int SEED = 4711;
+
+    TrainingConfiguration configuration(SEED, 1000, 200, 32, 10, 50, 10, 10, NUM_THREADS, 10, 10, 5000,
+            AccelerationMode::GPU_ONLY);
+
+    RandomForestImage reference(trees, configuration);
+    reference.train(trainImages);
+
+    const std::string distributedFolder = folderOutput + "/distributed";
+    boost::filesystem::remove_all(distributedFolder);
+    boost::filesystem::create_directories(distributedFolder);
+
+    // emulates another process on a different host that trains the second tree
+    const std::string lockFile = distributedFolder + "/tree1.lock";
+    {
+        std::ofstream lock(lockFile.c_str());
+        lock << "otherhost:1";
+    }
+
+    const ImageDataset images(trainImages);
+    BOOST_CHECK(!trainDistributed(images, trees, configuration, distributedFolder, folderTraining, false));
+    BOOST_CHECK(boost::filesystem::exists(distributedFolder + "/tree0.json.gz"));
+    BOOST_CHECK(!boost::filesystem::exists(distributedFolder + "/tree1.json.gz"));
+    BOOST_CHECK(boost::filesystem::exists(distributedFolder + "/tree2.json.gz"));
+    BOOST_CHECK(!boost::filesystem::exists(distributedFolder + "/forest.manifest"));
+
+    TrainingConfiguration otherConfiguration(configuration);
+    otherConfiguration.setRandomSeed(SEED + 1);
+    BOOST_CHECK_THROW(trainDistributed(images, trees, otherConfiguration, distributedFolder, folderTraining, false),
+            std::runtime_error);
+
+    // the other process crashed and its lock was deleted
+    boost::filesystem::remove(lockFile);
+    BOOST_CHECK(trainDistributed(images, trees, configuration, distributedFolder, folderTraining, false));
+    BOOST_CHECK(!boost::filesystem::exists(lockFile));
+
+    const std::string manifest = distributedFolder + "/forest.manifest";
+    BOOST_REQUIRE(RandomTreeImport::isManifest(manifest));
+    BOOST_CHECK_EQUAL(trees, RandomTreeImport::readManifest(manifest).size());
+
+    RandomForestImage distributed(std::vector<std::string>(1, manifest));
+    BOOST_REQUIRE_EQUAL(trees, distributed.getTrees().size());
+
+    for (size_t treeNr = 0; treeNr < trees; treeNr++) {
+        checkTrees(distributed.getTree(treeNr), reference.getTree(treeNr));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -11,6 +11,7 @@
 #include "random_tree_image.h"
 #include "score.h"
 #include "test_common.h"
+#include "trace.h"
 #include "utils.h"
 
 using namespace curfil;
@@ -921,6 +922,696 @@ BOOST_AUTO_TEST_CASE(testColorFeatureManySamples) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(testBatchPipeline) {
+
+    const int NUM_FEAT = 500;
+    const int NUM_THRESH = 20;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 5;
+    AccelerationMode accelerationMode = GPU_ONLY;
+
+    // one batch
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 10, 100000, accelerationMode);
+
+    // many small batches which do not fit into the image cache at the same time
+    TrainingConfiguration pipelineConfiguration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 2, 97, accelerationMode);
+
+    ImageFeatureEvaluation featureFunction(0, configuration);
+    ImageFeatureEvaluation pipelineFeatureFunction(0, pipelineConfiguration);
+
+    std::vector<PixelInstance> samples;
+
+    const int width = 64;
+    const int height = 48;
+
+    std::vector<RGBDImage> images(10, RGBDImage(width, height));
+    for (size_t image = 0; image < images.size(); image++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = 10000 * image + 100 * c + y * width + x;
+                    images[image].setColor(x, y, c, v);
+                }
+                images[image].setDepth(x, y, Depth(1.0f + (x * y + image) % 7 / 3.0f));
+            }
+        }
+
+        images[image].calculateIntegral();
+    }
+
+    const size_t NUM_LABELS = 10;
+
+    const int NUM_SAMPLES = samplesPerImage * images.size();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        PixelInstance sample(
+                &images.at(i % images.size()),   // image
+                i / 100,   // label
+                Depth((i % 20) / 10.0 + 1.0),   // depth
+                i % width,   // x
+                i % height   // y
+                        );
+
+        samples.push_back(sample);
+    }
+
+    RandomTree<PixelInstance, ImageFeatureFunction> node(0, 0, getPointers(samples), NUM_LABELS);
+
+    std::vector<std::vector<const PixelInstance*> > batches = featureFunction.prepare(getPointers(samples),
+            node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_EQUAL(1lu, batches.size());
+
+    ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+            featureFunction.generateRandomFeatures(batches[0], configuration.getRandomSeed(),
+                    true, cuv::dev_memory_space());
+
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> featureResponses;
+    cuv::ndarray<WeightType, cuv::host_memory_space> counters(
+            featureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds,
+                    &featureResponses));
+
+    std::vector<std::vector<const PixelInstance*> > pipelineBatches = pipelineFeatureFunction.prepare(
+            getPointers(samples), node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_GT(pipelineBatches.size(), 5lu);
+
+    trace::enable();
+    cuv::ndarray<WeightType, cuv::host_memory_space> pipelineCounters(
+            pipelineFeatureFunction.calculateFeatureResponsesAndHistograms(node, pipelineBatches,
+                    featuresAndThresholds));
+    trace::disable();
+
+    BOOST_REQUIRE(counters.shape() == pipelineCounters.shape());
+    for (size_t i = 0; i < counters.size(); i++) {
+        BOOST_REQUIRE_EQUAL(static_cast<WeightType>(counters[i]), static_cast<WeightType>(pipelineCounters[i]));
+    }
+
+    BOOST_CHECK(node.getTimerValues().find("aggregateHistograms") != node.getTimerValues().end());
+
+    // every batch is traced
+    std::vector<int> tracedBatches;
+    const std::vector<trace::Event> events = trace::collect();
+    for (size_t i = 0; i < events.size(); i++) {
+        if (std::string(events[i].name) == "aggregate histograms") {
+            BOOST_CHECK_GE(events[i].device, 0);
+            tracedBatches.push_back(events[i].arg);
+        }
+    }
+    BOOST_REQUIRE_EQUAL(pipelineBatches.size(), tracedBatches.size());
+    for (size_t batch = 0; batch < pipelineBatches.size(); batch++) {
+        BOOST_CHECK_EQUAL(static_cast<int>(batch), tracedBatches[batch]);
+    }
+
+    // the responses must be the same if they are copied back to the host
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> pipelineFeatureResponses;
+    pipelineFeatureFunction.calculateFeatureResponsesAndHistograms(node, pipelineBatches, featuresAndThresholds,
+            &pipelineFeatureResponses);
+
+    BOOST_REQUIRE(featureResponses.shape() == pipelineFeatureResponses.shape());
+
+    std::map<const PixelInstance*, size_t> samplePositions;
+    for (size_t sample = 0; sample < batches[0].size(); sample++) {
+        samplePositions[batches[0][sample]] = sample;
+    }
+
+    size_t pipelineSample = 0;
+    for (size_t batch = 0; batch < pipelineBatches.size(); batch++) {
+        for (size_t sample = 0; sample < pipelineBatches[batch].size(); sample++, pipelineSample++) {
+            const size_t pos = samplePositions[pipelineBatches[batch][sample]];
+            for (size_t feat = 0; feat < NUM_FEAT; feat++) {
+                const FeatureResponseType expected = static_cast<FeatureResponseType>(featureResponses(feat, pos));
+                const FeatureResponseType actual = static_cast<FeatureResponseType>(
+                        pipelineFeatureResponses(feat, pipelineSample));
+                if (isnan(expected)) {
+                    BOOST_REQUIRE(isnan(actual));
+                } else {
+                    BOOST_REQUIRE_EQUAL(expected, actual);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testCompactImageCache) {
+
+    const int NUM_FEAT = 500;
+    const int NUM_THRESH = 20;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 10;
+    AccelerationMode accelerationMode = GPU_ONLY;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 10, 100000, accelerationMode);
+
+    // two integral images on the device. the others are restored from the compact format
+    TrainingConfiguration compactConfiguration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 2, 97, accelerationMode);
+    compactConfiguration.setCompactImageCacheSize(10);
+
+    ImageFeatureEvaluation featureFunction(0, configuration);
+    ImageFeatureEvaluation compactFeatureFunction(0, compactConfiguration);
+
+    std::vector<PixelInstance> samples;
+
+    const int width = 64;
+    const int height = 48;
+
+    // integral color values are exact in half precision
+    std::vector<RGBDImage> images(10, RGBDImage(width, height));
+    for (size_t image = 0; image < images.size(); image++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = 10 * image + c + (x + 3 * y) % 50;
+                    images[image].setColor(x, y, c, v);
+                }
+                images[image].setDepth(x, y, Depth(1.0f + (x * y + image) % 7 / 3.0f));
+            }
+        }
+
+        images[image].calculateIntegral();
+    }
+
+    const size_t NUM_LABELS = 10;
+
+    const int NUM_SAMPLES = samplesPerImage * images.size();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        PixelInstance sample(
+                &images.at(i % images.size()),   // image
+                i / 100,   // label
+                Depth((i % 20) / 10.0 + 1.0),   // depth
+                i % width,   // x
+                i % height   // y
+                        );
+
+        samples.push_back(sample);
+    }
+
+    RandomTree<PixelInstance, ImageFeatureFunction> node(0, 0, getPointers(samples), NUM_LABELS);
+
+    std::vector<std::vector<const PixelInstance*> > batches = featureFunction.prepare(getPointers(samples),
+            node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_EQUAL(1lu, batches.size());
+
+    ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+            featureFunction.generateRandomFeatures(batches[0], configuration.getRandomSeed(),
+                    true, cuv::dev_memory_space());
+
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> featureResponses;
+    featureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds, &featureResponses);
+
+    const ImageCache& imageCache = DeviceContext::getCurrent().getImageCache();
+
+    std::vector<std::vector<const PixelInstance*> > compactBatches = compactFeatureFunction.prepare(
+            getPointers(samples), node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_GT(compactBatches.size(), 5lu);
+
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> compactFeatureResponses;
+    compactFeatureFunction.calculateFeatureResponsesAndHistograms(node, compactBatches, featuresAndThresholds,
+            &compactFeatureResponses);
+
+    BOOST_CHECK_EQUAL(10lu, imageCache.getCompactCacheSize());
+    BOOST_CHECK_GT(imageCache.getNumCompactHits(), 0lu);
+
+    BOOST_REQUIRE(featureResponses.shape() == compactFeatureResponses.shape());
+
+    std::map<const PixelInstance*, size_t> samplePositions;
+    for (size_t sample = 0; sample < batches[0].size(); sample++) {
+        samplePositions[batches[0][sample]] = sample;
+    }
+
+    size_t compactSample = 0;
+    for (size_t batch = 0; batch < compactBatches.size(); batch++) {
+        for (size_t sample = 0; sample < compactBatches[batch].size(); sample++, compactSample++) {
+            const size_t pos = samplePositions[compactBatches[batch][sample]];
+            for (size_t feat = 0; feat < NUM_FEAT; feat++) {
+                const FeatureResponseType expected = static_cast<FeatureResponseType>(featureResponses(feat, pos));
+                const FeatureResponseType actual = static_cast<FeatureResponseType>(
+                        compactFeatureResponses(feat, compactSample));
+                if (isnan(expected)) {
+                    BOOST_REQUIRE(isnan(actual));
+                } else {
+                    BOOST_REQUIRE_EQUAL(expected, actual);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testConvertToHalf) {
+
+    const float values[] = { 0.0f, 1.0f, 0.5f, -2.0f, 0.1f, 65504.0f, 1e6f };
+    const unsigned short expected[] = { 0x0000, 0x3C00, 0x3800, 0xC000, 0x2E66, 0x7BFF, 0x7C00 };
+    const size_t size = sizeof(values) / sizeof(values[0]);
+
+    cuv::ndarray<float, cuv::host_memory_space> input(size);
+    for (size_t i = 0; i < size; i++) {
+        input[i] = values[i];
+    }
+
+    const cuv::ndarray<float, cuv::dev_memory_space> deviceInput(input);
+    cuv::ndarray<unsigned short, cuv::dev_memory_space> deviceOutput(size);
+    convertToHalf(deviceInput, deviceOutput);
+    const cuv::ndarray<unsigned short, cuv::host_memory_space> output(deviceOutput);
+
+    for (size_t i = 0; i < size; i++) {
+        BOOST_CHECK_EQUAL(expected[i], static_cast<unsigned short>(output[i]));
+    }
+
+    BOOST_CHECK_EQUAL(1.0f, halfToFloat(output[1]));
+    BOOST_CHECK_EQUAL(-2.0f, halfToFloat(output[3]));
+    BOOST_CHECK_CLOSE(0.1f, halfToFloat(output[4]), 0.1);
+    BOOST_CHECK(isinf(halfToFloat(output[6])));
+}
+
+BOOST_AUTO_TEST_CASE(testCompactImageRoundTrip) {
+
+    const int width = 64;
+    const int height = 48;
+
+    // color values that are exact in half precision, including 1.0 (0x3C00) and negative and fractional values
+    RGBDImage image(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < 3; c++) {
+                image.setColor(x, y, c, ((x + 5 * y + c) % 17 - 8) / 4.0f + ((x + y) % 3 == 0 ? 1.0f : 0.0f));
+            }
+            if ((x + y) % 11 != 0) {
+                image.setDepth(x, y, Depth(0.5f + (x * y) % 13 / 4.0f));
+            }
+        }
+    }
+    image.calculateIntegral();
+
+    cuv::ndarray<float, cuv::host_memory_space> color;
+    cuv::ndarray<int, cuv::host_memory_space> depth;
+    ImageCache::restoreCompactImage(image, color, depth);
+
+    BOOST_REQUIRE(color.shape() == image.getColorImage().shape());
+    BOOST_REQUIRE(depth.shape() == image.getDepthImage().shape());
+
+    for (size_t i = 0; i < color.size(); i++) {
+        BOOST_REQUIRE_EQUAL(image.getColorImage().ptr()[i], color.ptr()[i]);
+    }
+    for (size_t i = 0; i < depth.size(); i++) {
+        BOOST_REQUIRE_EQUAL(image.getDepthImage().ptr()[i], depth.ptr()[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testSinglePrecisionFeatures) {
+
+    const int NUM_FEAT = 500;
+    const int NUM_THRESH = 20;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 10;
+    AccelerationMode accelerationMode = GPU_ONLY;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 10, 100000, accelerationMode);
+
+    TrainingConfiguration singleConfiguration(configuration);
+    singleConfiguration.setSinglePrecisionFeatures(true);
+    BOOST_CHECK(configuration != singleConfiguration);
+
+    ImageFeatureEvaluation featureFunction(0, configuration);
+    ImageFeatureEvaluation singleFeatureFunction(0, singleConfiguration);
+
+    std::vector<PixelInstance> samples;
+
+    const int width = 64;
+    const int height = 48;
+
+    std::vector<RGBDImage> images(10, RGBDImage(width, height));
+    for (size_t image = 0; image < images.size(); image++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = 10 * image + c + (x + 3 * y) % 50;
+                    images[image].setColor(x, y, c, v);
+                }
+                images[image].setDepth(x, y, Depth(1.0f + (x * y + image) % 7 / 3.0f));
+            }
+        }
+
+        images[image].calculateIntegral();
+    }
+
+    const size_t NUM_LABELS = 10;
+
+    const int NUM_SAMPLES = samplesPerImage * images.size();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        PixelInstance sample(
+                &images.at(i % images.size()),   // image
+                i / 100,   // label
+                Depth((i % 20) / 10.0 + 1.0),   // depth
+                i % width,   // x
+                i % height   // y
+                        );
+
+        samples.push_back(sample);
+    }
+
+    RandomTree<PixelInstance, ImageFeatureFunction> node(0, 0, getPointers(samples), NUM_LABELS);
+
+    std::vector<std::vector<const PixelInstance*> > batches = featureFunction.prepare(getPointers(samples),
+            node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_EQUAL(1lu, batches.size());
+
+    ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+            featureFunction.generateRandomFeatures(batches[0], configuration.getRandomSeed(),
+                    true, cuv::dev_memory_space());
+
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> featureResponses;
+    featureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds, &featureResponses);
+
+    // the same features and thresholds are evaluated in single precision
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> singleFeatureResponses;
+    singleFeatureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds,
+            &singleFeatureResponses);
+
+    BOOST_REQUIRE(featureResponses.shape() == singleFeatureResponses.shape());
+
+    size_t numNaN = 0;
+    for (size_t feat = 0; feat < NUM_FEAT; feat++) {
+        for (size_t sample = 0; sample < batches[0].size(); sample++) {
+            const FeatureResponseType expected = static_cast<FeatureResponseType>(featureResponses(feat, sample));
+            const FeatureResponseType actual = static_cast<FeatureResponseType>(
+                    singleFeatureResponses(feat, sample));
+            if (isnan(expected)) {
+                BOOST_REQUIRE(isnan(actual));
+                numNaN++;
+            } else {
+                BOOST_REQUIRE(!isnan(actual));
+                BOOST_REQUIRE_SMALL(expected - actual, 1e-3);
+            }
+        }
+    }
+
+    BOOST_CHECK_LT(numNaN, NUM_FEAT * batches[0].size());
+}
+
+// the images and samples must stay alive together. the samples refer to the images
+static void createBinnedSplitSamples(std::vector<RGBDImage>& images, std::vector<PixelInstance>& samples,
+        unsigned int samplesPerImage) {
+
+    const int width = 64;
+    const int height = 48;
+
+    images.assign(10, RGBDImage(width, height));
+    for (size_t image = 0; image < images.size(); image++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = 10 * image + c + (x + 3 * y) % 50;
+                    images[image].setColor(x, y, c, v);
+                }
+                images[image].setDepth(x, y, Depth(1.0f + (x * y + image) % 7 / 3.0f));
+            }
+        }
+
+        images[image].calculateIntegral();
+    }
+
+    samples.clear();
+    const int NUM_SAMPLES = samplesPerImage * images.size();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        PixelInstance sample(
+                &images.at(i % images.size()),   // image
+                i / 100,   // label
+                Depth((i % 20) / 10.0 + 1.0),   // depth
+                i % width,   // x
+                i % height   // y
+                        );
+
+        samples.push_back(sample);
+    }
+}
+
+// the bins are prefix-scanned, the last bin holds the totals
+static void checkBinnedCounters(const cuv::ndarray<WeightType, cuv::host_memory_space>& binnedCounters,
+        const cuv::ndarray<WeightType, cuv::host_memory_space>& counters,
+        const cuv::ndarray<WeightType, cuv::host_memory_space>& histogram,
+        size_t numFeatures, size_t numThresholds, size_t numLabels) {
+
+    BOOST_REQUIRE_EQUAL(3, static_cast<int>(binnedCounters.ndim()));
+    BOOST_REQUIRE_EQUAL(numFeatures, static_cast<size_t>(binnedCounters.shape(0)));
+    BOOST_REQUIRE_EQUAL(numThresholds + 1, static_cast<size_t>(binnedCounters.shape(1)));
+    BOOST_REQUIRE_EQUAL(numLabels, static_cast<size_t>(binnedCounters.shape(2)));
+    BOOST_REQUIRE_EQUAL(2 * numFeatures * numThresholds * numLabels, static_cast<size_t>(counters.size()));
+
+    for (size_t feat = 0; feat < numFeatures; feat++) {
+        for (size_t label = 0; label < numLabels; label++) {
+            const WeightType total = binnedCounters(feat, numThresholds, label);
+            BOOST_REQUIRE_EQUAL(static_cast<WeightType>(histogram[label]), total);
+            for (size_t thresh = 0; thresh < numThresholds; thresh++) {
+                const WeightType left = binnedCounters(feat, thresh, label);
+                BOOST_REQUIRE_LE(left, total);
+                BOOST_REQUIRE_EQUAL(static_cast<WeightType>(counters(feat, thresh, label, 0)), left);
+                BOOST_REQUIRE_EQUAL(static_cast<WeightType>(counters(feat, thresh, label, 1)), total - left);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testBinnedSplits) {
+
+    const int NUM_FEAT = 500;
+    const int NUM_THRESH = 255;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 10;
+    AccelerationMode accelerationMode = GPU_ONLY;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 10, 100000, accelerationMode);
+
+    TrainingConfiguration binnedConfiguration(configuration);
+    binnedConfiguration.setBinnedSplits(true);
+    BOOST_CHECK(configuration != binnedConfiguration);
+
+    ImageFeatureEvaluation featureFunction(0, configuration);
+    ImageFeatureEvaluation binnedFeatureFunction(0, binnedConfiguration);
+
+    std::vector<RGBDImage> images;
+    std::vector<PixelInstance> samples;
+    createBinnedSplitSamples(images, samples, samplesPerImage);
+
+    const size_t NUM_LABELS = 10;
+
+    RandomTree<PixelInstance, ImageFeatureFunction> node(0, 0, getPointers(samples), NUM_LABELS);
+    cuv::ndarray<WeightType, cuv::dev_memory_space> histogram(node.getHistogram());
+
+    std::vector<std::vector<const PixelInstance*> > batches = binnedFeatureFunction.prepare(getPointers(samples),
+            node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_EQUAL(1lu, batches.size());
+
+    ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+            binnedFeatureFunction.generateRandomFeatures(batches[0], binnedConfiguration.getRandomSeed(),
+                    true, cuv::dev_memory_space());
+
+    const ImageFeaturesAndThresholds<cuv::host_memory_space> featuresAndThresholdsHost(featuresAndThresholds);
+    for (size_t feat = 0; feat < NUM_FEAT; feat++) {
+        for (size_t thresh = 1; thresh < NUM_THRESH; thresh++) {
+            BOOST_REQUIRE_LE(featuresAndThresholdsHost.getThreshold(thresh - 1, feat),
+                    featuresAndThresholdsHost.getThreshold(thresh, feat));
+        }
+    }
+
+    // counting per bin must yield the same counters as comparing with every threshold
+    cuv::ndarray<WeightType, cuv::dev_memory_space> counters =
+            featureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds);
+    cuv::ndarray<WeightType, cuv::dev_memory_space> binnedCounters =
+            binnedFeatureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds);
+
+    const cuv::ndarray<WeightType, cuv::host_memory_space> countersHost(counters);
+    const cuv::ndarray<WeightType, cuv::host_memory_space> binnedCountersHost(binnedCounters);
+
+    checkBinnedCounters(binnedCountersHost, countersHost, node.getHistogram(), NUM_FEAT, NUM_THRESH, NUM_LABELS);
+
+    // the responses for the caller disable the fused kernel. the bins are then counted in global memory
+    cuv::ndarray<FeatureResponseType, cuv::host_memory_space> featureResponses;
+    const cuv::ndarray<WeightType, cuv::host_memory_space> globalBinnedCountersHost(
+            binnedFeatureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds,
+                    &featureResponses));
+
+    BOOST_REQUIRE(globalBinnedCountersHost.shape() == binnedCountersHost.shape());
+    for (size_t i = 0; i < binnedCountersHost.size(); i++) {
+        BOOST_REQUIRE_EQUAL(static_cast<WeightType>(binnedCountersHost[i]),
+                static_cast<WeightType>(globalBinnedCountersHost[i]));
+    }
+
+    cuv::ndarray<ScoreType, cuv::host_memory_space> scores(
+            featureFunction.calculateScores(counters, featuresAndThresholds, histogram));
+    cuv::ndarray<ScoreType, cuv::host_memory_space> binnedScores(
+            binnedFeatureFunction.calculateScores(binnedCounters, featuresAndThresholds, histogram));
+
+    checkScores(binnedScores, NUM_FEAT, NUM_THRESH);
+    for (size_t i = 0; i < scores.size(); i++) {
+        BOOST_REQUIRE_EQUAL(static_cast<ScoreType>(scores[i]), static_cast<ScoreType>(binnedScores[i]));
+    }
+}
+
+// in compare mode, the GPU aggregates the feature responses in global memory. the bins of aggregateBinsKernel
+// must yield the same counters as aggregateHistogramsKernel, which compares them with every threshold
+BOOST_AUTO_TEST_CASE(testBinnedSplitsCompareMode) {
+
+    const int NUM_FEAT = 200;
+    const int NUM_THRESH = 100;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 10;
+    AccelerationMode accelerationMode = GPU_AND_CPU_COMPARE;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 10, 100000, accelerationMode);
+
+    TrainingConfiguration binnedConfiguration(configuration);
+    binnedConfiguration.setBinnedSplits(true);
+
+    ImageFeatureEvaluation featureFunction(0, configuration);
+    ImageFeatureEvaluation binnedFeatureFunction(0, binnedConfiguration);
+
+    std::vector<RGBDImage> images;
+    std::vector<PixelInstance> samples;
+    createBinnedSplitSamples(images, samples, samplesPerImage);
+
+    const size_t NUM_LABELS = 10;
+
+    RandomTree<PixelInstance, ImageFeatureFunction> node(0, 0, getPointers(samples), NUM_LABELS);
+
+    std::vector<std::vector<const PixelInstance*> > batches = binnedFeatureFunction.prepare(getPointers(samples),
+            node, cuv::dev_memory_space(), false);
+    BOOST_REQUIRE_EQUAL(1lu, batches.size());
+
+    // the bins need sorted thresholds. both evaluations use the same ones
+    ImageFeaturesAndThresholds<cuv::dev_memory_space> featuresAndThresholds =
+            binnedFeatureFunction.generateRandomFeatures(batches[0], binnedConfiguration.getRandomSeed(),
+                    true, cuv::dev_memory_space());
+
+    const cuv::ndarray<WeightType, cuv::host_memory_space> countersHost(
+            featureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds));
+    const cuv::ndarray<WeightType, cuv::host_memory_space> binnedCountersHost(
+            binnedFeatureFunction.calculateFeatureResponsesAndHistograms(node, batches, featuresAndThresholds));
+
+    checkBinnedCounters(binnedCountersHost, countersHost, node.getHistogram(), NUM_FEAT, NUM_THRESH, NUM_LABELS);
+}
+
+BOOST_AUTO_TEST_CASE(testLevelFeatureEvaluation) {
+
+    const int NUM_FEAT = 300;
+    const int NUM_THRESH = 20;
+    unsigned int samplesPerImage = 100;
+
+    unsigned int minSampleCount = 32;
+    int maxDepth = 15;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 50;
+    static const int NUM_THREADS = 1;
+    static const int maxImages = 10;
+    AccelerationMode accelerationMode = GPU_ONLY;
+
+    // small batches such that the nodes are split over several batches
+    TrainingConfiguration configuration(SEED, samplesPerImage, NUM_FEAT, minSampleCount, maxDepth, boxRadius,
+            regionSize, NUM_THRESH, NUM_THREADS, maxImages, 5, 211, accelerationMode);
+
+    const int width = 64;
+    const int height = 48;
+
+    std::vector<RGBDImage> images(10, RGBDImage(width, height));
+    for (size_t image = 0; image < images.size(); image++) {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                for (int c = 0; c < 3; c++) {
+                    float v = 10000 * image + 100 * c + y * width + x;
+                    images[image].setColor(x, y, c, v);
+                }
+                images[image].setDepth(x, y, Depth(1.0f + (x * y + image) % 7 / 3.0f));
+            }
+        }
+
+        images[image].calculateIntegral();
+    }
+
+    const size_t NUM_LABELS = 10;
+    const size_t NUM_NODES = 12;
+
+    std::vector<PixelInstance> samples;
+
+    const int NUM_SAMPLES = samplesPerImage * images.size();
+    for (int i = 0; i < NUM_SAMPLES; i++) {
+        PixelInstance sample(
+                &images.at(i % images.size()),   // image
+                i / 100,   // label
+                Depth((i % 20) / 10.0 + 1.0),   // depth
+                i % width,   // x
+                i % height   // y
+                        );
+
+        samples.push_back(sample);
+    }
+
+    // nodes of different sizes
+    std::vector<std::vector<const PixelInstance*> > nodeSamples(NUM_NODES);
+    for (size_t i = 0; i < samples.size(); i++) {
+        nodeSamples[(i % 37) % NUM_NODES].push_back(&samples[i]);
+    }
+
+    std::vector<std::pair<boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> >,
+            std::vector<const PixelInstance*> > > samplesPerNode;
+    for (size_t node = 0; node < NUM_NODES; node++) {
+        samplesPerNode.push_back(std::make_pair(
+                boost::make_shared<RandomTree<PixelInstance, ImageFeatureFunction> >(node, 5, nodeSamples[node],
+                        NUM_LABELS), nodeSamples[node]));
+    }
+    BOOST_REQUIRE_EQUAL(NUM_NODES, samplesPerNode.size());
+
+    RandomSource randomSource(SEED);
+    ImageFeatureEvaluation nodeEvaluation(0, configuration);
+    std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > expectedSplits =
+            nodeEvaluation.evaluateBestSplits(randomSource, samplesPerNode);
+
+    RandomSource levelRandomSource(SEED);
+    LevelFeatureEvaluation levelEvaluation(0, configuration);
+    std::vector<SplitFunction<PixelInstance, ImageFeatureFunction> > levelSplits =
+            levelEvaluation.evaluateBestSplits(levelRandomSource, samplesPerNode);
+
+    BOOST_REQUIRE_EQUAL(expectedSplits.size(), levelSplits.size());
+    for (size_t node = 0; node < expectedSplits.size(); node++) {
+        BOOST_CHECK_EQUAL(expectedSplits[node].getFeatureId(), levelSplits[node].getFeatureId());
+        BOOST_CHECK(expectedSplits[node].getFeature() == levelSplits[node].getFeature());
+        BOOST_CHECK_EQUAL(expectedSplits[node].getThreshold(), levelSplits[node].getThreshold());
+        BOOST_CHECK_EQUAL(expectedSplits[node].getScore(), levelSplits[node].getScore());
+    }
+}
+
 static void checkNode(boost::shared_ptr<const RandomTree<PixelInstance, ImageFeatureFunction> > node,
         const boost::shared_ptr<const TreeNodes>& treeData,
         const SplitFunction<PixelInstance, ImageFeatureFunction>* split = 0) {
@@ -932,7 +1623,8 @@ static void checkNode(boost::shared_ptr<const RandomTree<PixelInstance, ImageFea
     TreeNodeData data = getTreeNode(nodeNr, treeData);
 
     if (node->isLeaf()) {
-        BOOST_CHECK_EQUAL(-1, static_cast<int>(data.leftNodeOffset));
+        BOOST_CHECK_GT(0, static_cast<int>(data.leftNodeOffset));
+        BOOST_CHECK_LT(-data.leftNodeOffset - 1, static_cast<int>(treeData->numLeaves()));
         BOOST_CHECK(isnan(static_cast<float>(data.threshold)));
         for (size_t label = 0; label < numLabels; label++) {
             BOOST_CHECK_EQUAL(static_cast<float>(node->getNormalizedHistogram()[label]),
@@ -1169,6 +1861,8 @@ BOOST_AUTO_TEST_CASE(testRecallLargeForest) {
     Sampler offsetSampler(4711, -120, 120);
     Sampler regionSampler(4711, 0, 20);
 
+    std::vector<boost::shared_ptr<const TreeNodes> > forest;
+
     for (size_t treeId = 0; treeId < 3; treeId++) {
         boost::shared_ptr<RandomTree<PixelInstance, ImageFeatureFunction> > rootNode =
                 boost::make_shared<RandomTree<PixelInstance, ImageFeatureFunction> >(treeId, 0, getPointers(samples),
@@ -1272,7 +1966,56 @@ BOOST_AUTO_TEST_CASE(testRecallLargeForest) {
         }
 
         CURFIL_INFO("checked " << numNodes[treeId] << " nodes of tree " << treeId);
+
+        forest.push_back(treeData);
+    }
+
+    // the forest kernel must yield exactly the same result as classifying the image with one tree at a time
+    RGBDImage image(width, height);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            image.setDepth(x, y, Depth(((x + y) % 30) / 10.0 + 0.1));
+            for (unsigned int channel = 0; channel < 3; channel++) {
+                image.setColor(x, y, channel, ((x * (channel + 1) + y) % 256) / 255.0f);
+            }
+        }
+    }
+    image.calculateIntegral();
+
+    cuv::ndarray<float, cuv::dev_memory_space> expectedProbabilities(cuv::extents[NUM_LABELS][height][width]);
+    cudaSafeCall(cudaMemset(expectedProbabilities.ptr(), 0,
+            static_cast<size_t>(expectedProbabilities.size() * sizeof(float))));
+    for (const auto& treeData : forest) {
+        classifyImage(forest.size(), expectedProbabilities, image, NUM_LABELS, treeData);
+    }
+    normalizeProbabilities(expectedProbabilities);
+
+    cuv::ndarray<LabelType, cuv::dev_memory_space> expectedLabels(height, width);
+    determineMaxProbabilities(expectedProbabilities, expectedLabels);
+
+    cuv::ndarray<float, cuv::dev_memory_space> probabilities(cuv::extents[NUM_LABELS][height][width]);
+    cuv::ndarray<LabelType, cuv::dev_memory_space> labels(height, width);
+    classifyImage(forest, probabilities, labels, image, NUM_LABELS);
+
+    cuv::ndarray<float, cuv::host_memory_space> expectedProbabilitiesHost(expectedProbabilities);
+    cuv::ndarray<float, cuv::host_memory_space> probabilitiesHost(probabilities);
+    cuv::ndarray<LabelType, cuv::host_memory_space> expectedLabelsHost(expectedLabels);
+    cuv::ndarray<LabelType, cuv::host_memory_space> labelsHost(labels);
+
+    size_t differentProbabilities = 0;
+    for (size_t i = 0; i < probabilitiesHost.size(); i++) {
+        if (probabilitiesHost[i] != expectedProbabilitiesHost[i]) {
+            differentProbabilities++;
+        }
     }
+    BOOST_CHECK_EQUAL(0lu, differentProbabilities);
 
+    size_t differentLabels = 0;
+    for (size_t i = 0; i < labelsHost.size(); i++) {
+        if (labelsHost[i] != expectedLabelsHost[i]) {
+            differentLabels++;
+        }
+    }
+    BOOST_CHECK_EQUAL(0lu, differentLabels);
 }
 BOOST_AUTO_TEST_SUITE_END()
@@ -57,6 +57,53 @@ static double predict(RandomForestImage& randomForest) {
     return accuracy;
 }
 
+static std::vector<LabeledRGBDImage> loadTrainImages() {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training2_colors.png", useCIELab, useDepthFilling));
+    return trainImages;
+}
+
+static LabeledRGBDImage loadTestImage() {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+    return loadImagePair(getFolderTraining() + "/testing1_colors.png", useCIELab, useDepthFilling);
+}
+
+// the configuration of the small forests of the prediction tests
+static TrainingConfiguration smallForestConfiguration(AccelerationMode accelerationMode,
+        unsigned int minSampleCount = 100, uint16_t thresholds = 20) {
+
+    unsigned int samplesPerImage = 500;
+    unsigned int featureCount = 100;
+    int maxDepth = 8;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 16;
+    int maxImages = 10;
+    int imageCacheSize = 10;
+    unsigned int maxSamplesPerBatch = 5000;
+
+    const int SEED = 4711;
+
+    return TrainingConfiguration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, NUM_THREADS, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+}
+
+// trains a small forest and normalizes its histograms
+static RandomForestImage trainSmallForest(const std::vector<LabeledRGBDImage>& trainImages,
+        AccelerationMode accelerationMode, unsigned int treeCount = 2) {
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    RandomForestImage randomForest(treeCount, smallForestConfiguration(accelerationMode));
+    randomForest.train(trainImages);
+    randomForest.normalizeHistograms(0.0);
+    return randomForest;
+}
+
 BOOST_AUTO_TEST_CASE(trainTest) {
     const bool useCIELab = true;
     const bool useDepthFilling = false;
@@ -96,6 +143,47 @@ BOOST_AUTO_TEST_CASE(trainTest) {
     BOOST_CHECK_CLOSE_FRACTION(73, accuracy, 10.0);
 }
 
+// the CPU and the GPU count the samples per bin. in compare mode, the GPU aggregates the bins of the feature
+// responses in global memory (aggregateBinsKernel) and the scores are checked against the CPU
+BOOST_AUTO_TEST_CASE(trainTestBinned) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training2_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training3_colors.png", useCIELab, useDepthFilling));
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    // Train
+
+    unsigned int samplesPerImage = 500;
+    unsigned int featureCount = 500;
+    unsigned int minSampleCount = 100;
+    int maxDepth = 10;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 16;
+    uint16_t thresholds = 255;
+    int maxImages = 10;
+    int imageCacheSize = 10;
+    unsigned int maxSamplesPerBatch = 5000;
+    AccelerationMode accelerationMode = AccelerationMode::GPU_AND_CPU_COMPARE;
+
+    const int SEED = 4713;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, NUM_THREADS, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+    configuration.setBinnedSplits(true);
+
+    RandomForestImage randomForest(1, configuration);
+    randomForest.train(trainImages);
+
+    double accuracy = predict(randomForest);
+
+    BOOST_CHECK_CLOSE_FRACTION(73, accuracy, 10.0);
+}
+
 BOOST_AUTO_TEST_CASE(trainTestGPU) {
     const bool useCIELab = true;
     const bool useDepthFilling = false;
@@ -134,6 +222,458 @@ BOOST_AUTO_TEST_CASE(trainTestGPU) {
     BOOST_CHECK_CLOSE_FRACTION(73, accuracy, 10.0);
 }
 
+BOOST_AUTO_TEST_CASE(predictBatchTest) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+    const RandomForestImage randomForest = trainSmallForest(trainImages, GPU_ONLY);
+
+    const LabeledRGBDImage testing = loadTestImage();
+
+    std::vector<const RGBDImage*> images;
+    images.push_back(&testing.getRGBDImage());
+    for (const auto& image : trainImages) {
+        images.push_back(&image.getRGBDImage());
+    }
+
+    cuv::ndarray<float, cuv::host_memory_space> probabilities;
+    const std::vector<LabelImage> predictions = randomForest.predictBatch(images, &probabilities);
+
+    BOOST_REQUIRE_EQUAL(images.size(), predictions.size());
+    BOOST_REQUIRE_EQUAL(4, probabilities.ndim());
+    BOOST_REQUIRE_EQUAL(images.size(), probabilities.shape(0));
+
+    for (size_t imageNr = 0; imageNr < images.size(); imageNr++) {
+        cuv::ndarray<float, cuv::host_memory_space> imageProbabilities;
+        const LabelImage prediction = randomForest.predict(*images[imageNr], &imageProbabilities);
+
+        const size_t offset = imageNr * imageProbabilities.size();
+        size_t differentProbabilities = 0;
+        for (size_t i = 0; i < imageProbabilities.size(); i++) {
+            if (imageProbabilities[i] != probabilities.ptr()[offset + i]) {
+                differentProbabilities++;
+            }
+        }
+        BOOST_CHECK_EQUAL(0lu, differentProbabilities);
+
+        size_t differentLabels = 0;
+        for (int y = 0; y < prediction.getHeight(); y++) {
+            for (int x = 0; x < prediction.getWidth(); x++) {
+                if (prediction.getLabel(x, y) != predictions[imageNr].getLabel(x, y)) {
+                    differentLabels++;
+                }
+            }
+        }
+        BOOST_CHECK_EQUAL(0lu, differentLabels);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(predictFlatForestTest) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+    const RandomForestImage randomForest = trainSmallForest(trainImages, GPU_ONLY, 3);
+
+    const LabeledRGBDImage testing = loadTestImage();
+    const RGBDImage& image = testing.getRGBDImage();
+    const LabelType numClasses = randomForest.getNumClasses();
+
+    cuv::ndarray<float, cuv::host_memory_space> probabilities;
+    const LabelImage prediction = randomForest.predict(image, &probabilities, false);
+
+    BOOST_REQUIRE_EQUAL(numClasses, probabilities.shape(0));
+
+    // compare with the traversal of the tree nodes
+    size_t differentLabels = 0;
+    for (int y = 0; y < image.getHeight(); y++) {
+        for (int x = 0; x < image.getWidth(); x++) {
+            std::vector<double> expected(numClasses, 0.0);
+            for (const auto& tree : randomForest.getTrees()) {
+                const auto& hist = tree->getTree()->classifySoft(PixelInstance(&image, 0, x, y));
+                for (LabelType label = 0; label < numClasses; label++) {
+                    expected[label] += hist[label];
+                }
+            }
+
+            double sum = 0.0;
+            for (LabelType label = 0; label < numClasses; label++) {
+                sum += expected[label];
+            }
+
+            LabelType bestLabel = 0;
+            for (LabelType label = 0; label < numClasses; label++) {
+                expected[label] /= sum;
+                BOOST_REQUIRE_SMALL(expected[label] - probabilities(label, y, x), 1e-5);
+                if (expected[label] > expected[bestLabel]) {
+                    bestLabel = label;
+                }
+            }
+
+            if (bestLabel != prediction.getLabel(x, y)) {
+                differentLabels++;
+            }
+        }
+    }
+
+    // labels may only differ for ties within the float precision
+    BOOST_CHECK_LT(differentLabels, 10lu);
+}
+
+BOOST_AUTO_TEST_CASE(predictOutputModesTest) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+    const RandomForestImage randomForest = trainSmallForest(trainImages, GPU_ONLY);
+
+    const LabeledRGBDImage testing = loadTestImage();
+    const RGBDImage& image = testing.getRGBDImage();
+
+    cuv::ndarray<float, cuv::host_memory_space> probabilities;
+    const LabelImage prediction = randomForest.predict(image, &probabilities);
+    const LabelImage labelsOnly = randomForest.predict(image);
+
+    cuv::ndarray<float, cuv::host_memory_space> confidence;
+    const LabelImage predictionWithConfidence = randomForest.predictWithConfidence(image, confidence);
+
+    cuv::ndarray<unsigned short, cuv::host_memory_space> halfProbabilities;
+    const LabelImage predictionHalf = randomForest.predictHalf(image, halfProbabilities);
+
+    BOOST_REQUIRE_EQUAL(image.getHeight(), static_cast<int>(confidence.shape(0)));
+    BOOST_REQUIRE_EQUAL(image.getWidth(), static_cast<int>(confidence.shape(1)));
+    BOOST_REQUIRE_EQUAL(probabilities.size(), halfProbabilities.size());
+
+    for (int y = 0; y < image.getHeight(); y++) {
+        for (int x = 0; x < image.getWidth(); x++) {
+            const LabelType label = prediction.getLabel(x, y);
+            BOOST_CHECK_EQUAL(label, labelsOnly.getLabel(x, y));
+            BOOST_CHECK_EQUAL(label, predictionWithConfidence.getLabel(x, y));
+            BOOST_CHECK_EQUAL(label, predictionHalf.getLabel(x, y));
+            BOOST_CHECK_EQUAL(static_cast<float>(probabilities(label, y, x)), static_cast<float>(confidence(y, x)));
+        }
+    }
+
+    for (size_t i = 0; i < probabilities.size(); i++) {
+        BOOST_CHECK_SMALL(probabilities[i] - halfToFloat(halfProbabilities[i]), 1e-3f);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(predictionPlanTest) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+    const RandomForestImage randomForest = trainSmallForest(trainImages, GPU_ONLY);
+
+    // the reference does not use the prediction plan
+    std::vector<LabelImage> expected;
+    for (const auto& image : trainImages) {
+        cuv::ndarray<float, cuv::host_memory_space> confidence;
+        expected.push_back(randomForest.predictWithConfidence(image.getRGBDImage(), confidence));
+    }
+
+    // replay the plan for alternating frames
+    for (int frame = 0; frame < 6; frame++) {
+        const size_t imageNr = frame % trainImages.size();
+        const LabelImage prediction = randomForest.predict(trainImages[imageNr].getRGBDImage());
+
+        size_t differentLabels = 0;
+        for (int y = 0; y < prediction.getHeight(); y++) {
+            for (int x = 0; x < prediction.getWidth(); x++) {
+                if (prediction.getLabel(x, y) != expected[imageNr].getLabel(x, y)) {
+                    differentLabels++;
+                }
+            }
+        }
+        BOOST_CHECK_EQUAL(0lu, differentLabels);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(predictSparseTest) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+    const RandomForestImage randomForest = trainSmallForest(trainImages, GPU_ONLY);
+
+    const LabeledRGBDImage testing = loadTestImage();
+    const RGBDImage& image = testing.getRGBDImage();
+    const LabelType numClasses = randomForest.getNumClasses();
+
+    for (const bool onGPU : { true, false }) {
+        cuv::ndarray<float, cuv::host_memory_space> probabilities;
+        const LabelImage prediction = randomForest.predict(image, &probabilities, onGPU);
+
+        const std::vector<Point> pixels = selectPixels(RegionOfInterest(10, 20, 100, 50), 3);
+        BOOST_REQUIRE_EQUAL(34lu * 17lu, pixels.size());
+
+        cuv::ndarray<float, cuv::host_memory_space> sparseProbabilities;
+        const LabelImage sparsePrediction = randomForest.predictPixels(image, pixels, &sparseProbabilities, onGPU);
+
+        for (const Point& pixel : pixels) {
+            const int x = pixel.getX();
+            const int y = pixel.getY();
+            BOOST_CHECK_EQUAL(prediction.getLabel(x, y), sparsePrediction.getLabel(x, y));
+            for (LabelType label = 0; label < numClasses; label++) {
+                BOOST_CHECK_EQUAL(static_cast<float>(probabilities(label, y, x)),
+                        static_cast<float>(sparseProbabilities(label, y, x)));
+            }
+        }
+
+        // a threshold above one refines all pixels
+        const LabelImage refinedPrediction = randomForest.predictCoarseToFine(image, 4, 1.1f, 0, onGPU);
+
+        const LabelImage coarsePrediction = randomForest.predictCoarseToFine(image, 4, 0.5f, 0, onGPU);
+
+        size_t differentRefined = 0;
+        size_t differentCoarse = 0;
+        for (int y = 0; y < image.getHeight(); y++) {
+            for (int x = 0; x < image.getWidth(); x++) {
+                if (prediction.getLabel(x, y) != refinedPrediction.getLabel(x, y)) {
+                    differentRefined++;
+                }
+                if (prediction.getLabel(x, y) != coarsePrediction.getLabel(x, y)) {
+                    differentCoarse++;
+                }
+            }
+        }
+
+        BOOST_CHECK_EQUAL(0lu, differentRefined);
+        BOOST_CHECK_LT(differentCoarse, static_cast<size_t>(image.getWidth() * image.getHeight() / 10));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testHybridCostModel) {
+
+    HybridCostModel model(1000);
+
+    // not calibrated: decide by the sample threshold
+    BOOST_CHECK(!model.isCalibrated());
+    BOOST_CHECK(!model.evaluateOnGPU(999, 0));
+    BOOST_CHECK(model.evaluateOnGPU(1000, 0));
+
+    // GPU: 10 ms launch overhead + 1 µs per sample, 5 ms per uncached image
+    // CPU: 10 µs per sample
+    for (size_t i = 1; i <= 5; i++) {
+        const size_t numSamples = i * 1000;
+        model.addGPUMeasurement(numSamples, 10e-3 + numSamples * 1e-6);
+        model.addTransferMeasurement(i, i * 5e-3);
+        model.addCPUMeasurement(numSamples, numSamples * 10e-6);
+    }
+
+    BOOST_CHECK(model.isCalibrated());
+
+    // break-even without transfers at ~1111 samples
+    BOOST_CHECK(!model.evaluateOnGPU(500, 0));
+    BOOST_CHECK(model.evaluateOnGPU(2000, 0));
+
+    // the transfer of uncached images shifts the break-even point
+    BOOST_CHECK(!model.evaluateOnGPU(2000, 2));
+    BOOST_CHECK(model.evaluateOnGPU(10000, 2));
+}
+
+BOOST_AUTO_TEST_CASE(testImageLabelIndex) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training2_colors.png", useCIELab, useDepthFilling));
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    TrainingSetIndex trainingSetIndex;
+    const std::vector<boost::shared_ptr<const ImageLabelIndex> > indices = trainingSetIndex.getIndices(trainImages);
+    BOOST_REQUIRE_EQUAL(trainImages.size(), indices.size());
+
+    for (size_t imageNr = 0; imageNr < trainImages.size(); imageNr++) {
+        const RGBDImage& image = trainImages[imageNr].getRGBDImage();
+        const LabelImage& labelImage = trainImages[imageNr].getLabelImage();
+        const ImageLabelIndex& index = *indices[imageNr];
+
+        std::vector<size_t> labelCounts;
+        std::vector<std::vector<uint32_t> > validPixels;
+        for (int y = 0; y < labelImage.getHeight(); y++) {
+            for (int x = 0; x < labelImage.getWidth(); x++) {
+                const LabelType label = labelImage.getLabel(x, y);
+                if (label >= labelCounts.size()) {
+                    labelCounts.resize(label + 1, 0);
+                    validPixels.resize(label + 1);
+                }
+                labelCounts[label]++;
+                if (PixelInstance(&image, label, x, y).getDepth().isValid()) {
+                    validPixels[label].push_back(y * labelImage.getWidth() + x);
+                }
+            }
+        }
+
+        BOOST_REQUIRE_EQUAL(labelCounts.size(), index.getLabelCounts().size());
+        for (size_t label = 0; label < labelCounts.size(); label++) {
+            BOOST_CHECK_EQUAL(labelCounts[label], index.getLabelCounts()[label]);
+            BOOST_CHECK(validPixels[label] == index.getValidPixels(label));
+        }
+        BOOST_CHECK(index.getValidPixels(labelCounts.size()).empty());
+    }
+
+    // the indices are shared as long as the images are alive
+    const std::vector<boost::shared_ptr<const ImageLabelIndex> > sharedIndices =
+            trainingSetIndex.getIndices(trainImages);
+    for (size_t imageNr = 0; imageNr < trainImages.size(); imageNr++) {
+        BOOST_CHECK_EQUAL(indices[imageNr].get(), sharedIndices[imageNr].get());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testKeepTrainSamples) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+    const auto image = loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling);
+
+    std::vector<PixelInstance> samples;
+    for (int x = 0; x < 10; x++) {
+        samples.push_back(PixelInstance(&image.getRGBDImage(), image.getLabelImage().getLabel(x, 0), x, 0));
+    }
+    std::vector<const PixelInstance*> samplePointers;
+    for (const PixelInstance& sample : samples) {
+        samplePointers.push_back(&sample);
+    }
+
+    typedef RandomTree<PixelInstance, ImageFeatureFunction> Tree;
+    const size_t numClasses = 256;
+
+    // nodes only keep the number of their samples by default
+    BOOST_REQUIRE(!Tree::isKeepingTrainSamples());
+    const Tree node(0, 1, samplePointers, numClasses);
+    BOOST_CHECK_EQUAL(samples.size(), node.getNumTrainSamples());
+    BOOST_CHECK(node.getTrainSamples().empty());
+
+    Tree::setKeepTrainSamples(true);
+    const Tree debugNode(0, 1, samplePointers, numClasses);
+    Tree::setKeepTrainSamples(false);
+
+    BOOST_CHECK_EQUAL(samples.size(), debugNode.getNumTrainSamples());
+    BOOST_REQUIRE_EQUAL(samples.size(), debugNode.getTrainSamples().size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        BOOST_CHECK_EQUAL(samples[i].getX(), debugNode.getTrainSamples()[i].getX());
+        BOOST_CHECK_EQUAL(samples[i].getLabel(), debugNode.getTrainSamples()[i].getLabel());
+    }
+}
+
+typedef RandomTree<PixelInstance, ImageFeatureFunction> TrainedTree;
+
+// splits the samples of every inner node into copies, as the training did before it partitioned the samples in
+// place, and compares them with the samples and the histograms of the children
+static void checkPartitionedSamples(const TrainedTree& node) {
+    if (node.isLeaf()) {
+        return;
+    }
+
+    const std::vector<PixelInstance>& samples = node.getTrainSamples();
+    std::vector<PixelInstance> samplesLeft;
+    std::vector<PixelInstance> samplesRight;
+    for (const PixelInstance& sample : samples) {
+        if (node.getSplit().split(sample) == LEFT) {
+            samplesLeft.push_back(sample);
+        } else {
+            samplesRight.push_back(sample);
+        }
+    }
+
+    const std::vector<std::pair<const TrainedTree*, const std::vector<PixelInstance>*> > children = {
+            std::make_pair(node.getLeft().get(), &samplesLeft),
+            std::make_pair(node.getRight().get(), &samplesRight) };
+
+    for (const auto& child : children) {
+        const std::vector<PixelInstance>& expected = *child.second;
+        const std::vector<PixelInstance>& actual = child.first->getTrainSamples();
+
+        BOOST_CHECK_EQUAL(expected.size(), child.first->getNumTrainSamples());
+        BOOST_REQUIRE_EQUAL(expected.size(), actual.size());
+        for (size_t i = 0; i < expected.size(); i++) {
+            BOOST_CHECK_EQUAL(expected[i].getX(), actual[i].getX());
+            BOOST_CHECK_EQUAL(expected[i].getY(), actual[i].getY());
+            BOOST_CHECK_EQUAL(expected[i].getLabel(), actual[i].getLabel());
+        }
+
+        // the histograms of the children are taken from the counters of the split
+        std::vector<WeightType> histogram(node.getNumClasses(), 0);
+        for (const PixelInstance& sample : expected) {
+            histogram[sample.getLabel()] += sample.getWeight();
+        }
+        BOOST_REQUIRE_EQUAL(histogram.size(), child.first->getHistogram().size());
+        for (size_t label = 0; label < histogram.size(); label++) {
+            BOOST_CHECK_EQUAL(histogram[label], child.first->getHistogram()[label]);
+        }
+
+        // the evaluation counted the samples in the precision of the split
+        const SplitBranch branch = (child.first == node.getLeft().get()) ? LEFT : RIGHT;
+        BOOST_REQUIRE(node.getSplit().hasHistograms());
+        const std::vector<WeightType>& splitHistogram = node.getSplit().getHistogram(branch);
+        BOOST_REQUIRE_EQUAL(histogram.size(), splitHistogram.size());
+        for (size_t label = 0; label < histogram.size(); label++) {
+            BOOST_CHECK_EQUAL(histogram[label], splitHistogram[label]);
+        }
+
+        checkPartitionedSamples(*child.first);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testPartitionSamples) {
+    const std::vector<LabeledRGBDImage> trainImages = loadTrainImages();
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    unsigned int minSampleCount = 50;
+    uint16_t thresholds = 50;
+
+    const std::vector<AccelerationMode> accelerationModes = { CPU_ONLY, GPU_ONLY };
+    const std::vector<bool> modes = { false, true };
+    for (const AccelerationMode accelerationMode : accelerationModes) {
+        for (const bool binnedSplits : modes) {
+            for (const bool singlePrecision : modes) {
+                TrainingConfiguration configuration = smallForestConfiguration(accelerationMode, minSampleCount,
+                        thresholds);
+                configuration.setBinnedSplits(binnedSplits);
+                configuration.setSinglePrecisionFeatures(singlePrecision);
+
+                TrainedTree::setKeepTrainSamples(true);
+                RandomForestImage randomForest(1, configuration);
+                randomForest.train(trainImages);
+                TrainedTree::setKeepTrainSamples(false);
+
+                const TrainedTree& root = *randomForest.getTree(0)->getTree();
+                BOOST_REQUIRE(!root.isLeaf());
+                BOOST_CHECK_EQUAL(configuration.isSinglePrecisionSplits(), root.getSplit().isSinglePrecision());
+                checkPartitionedSamples(root);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(trainTestHybrid) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training2_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training3_colors.png", useCIELab, useDepthFilling));
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    unsigned int samplesPerImage = 500;
+    unsigned int featureCount = 500;
+    unsigned int minSampleCount = 100;
+    int maxDepth = 10;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 16;
+    uint16_t thresholds = 50;
+    int maxImages = 10;
+    int imageCacheSize = 10;
+    unsigned int maxSamplesPerBatch = 5000;
+    AccelerationMode accelerationMode = AccelerationMode::HYBRID;
+
+    const int SEED = 4711;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, NUM_THREADS, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+    // small enough that both the CPU and the GPU path are used
+    configuration.setHybridSampleThreshold(400);
+
+    RandomForestImage randomForest(1, configuration);
+    randomForest.train(trainImages);
+
+    double accuracy = predict(randomForest);
+
+    BOOST_CHECK_CLOSE_FRACTION(73, accuracy, 10.0);
+}
+
 BOOST_AUTO_TEST_CASE(trainTestEnsemble) {
 
     const bool useCIELab = true;
@@ -180,4 +180,41 @@ BOOST_AUTO_TEST_CASE(testReservoirSampler) {
     BOOST_REQUIRE_CLOSE(mean, 50000.0, 0.05);
     BOOST_REQUIRE_CLOSE(stddev, 28000.0, 2.0);
 }
+
+BOOST_AUTO_TEST_CASE(testIndexSampler) {
+
+    // more indices than an int can hold
+    const uint64_t BUCKET = 1lu << 31;
+    const uint64_t NUM_BUCKETS = 6;
+    const uint64_t N = NUM_BUCKETS * BUCKET;
+    const size_t DRAWS = 60000;
+
+    RandomSource randomSource(4711);
+    IndexSampler sampler = randomSource.indexSampler();
+    IndexSampler sameSeed(sampler.getSeed());
+
+    std::vector<size_t> buckets(NUM_BUCKETS, 0);
+    uint64_t max = 0;
+    for (size_t i = 0; i < DRAWS; i++) {
+        const uint64_t index = sampler.getNext(N);
+        BOOST_REQUIRE_LT(index, N);
+        BOOST_REQUIRE_EQUAL(index, sameSeed.getNext(N));
+        buckets[index / BUCKET]++;
+        max = std::max(max, index);
+    }
+
+    BOOST_CHECK_GT(max, 0.99 * N);
+    for (size_t bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        BOOST_CHECK_CLOSE(static_cast<double>(buckets[bucket]), static_cast<double>(DRAWS / NUM_BUCKETS), 5.0);
+    }
+
+    // a copy starts with the seed
+    IndexSampler copy(sampler);
+    IndexSampler restarted(sampler.getSeed());
+    for (size_t i = 0; i < 100; i++) {
+        BOOST_CHECK_EQUAL(restarted.getNext(N), copy.getNext(N));
+    }
+
+    BOOST_CHECK_EQUAL(0lu, sampler.getNext(1));
+}
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,176 @@
+#define BOOST_TEST_MODULE example
+
+#include <boost/filesystem.hpp>
+#include <boost/test/included/unit_test.hpp>
+#include <cstring>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <tbb/task_scheduler_init.h>
+#include <tbb/tbb_thread.h>
+#include <unistd.h>
+#include <vector>
+
+#include "image.h"
+#include "random_forest_image.h"
+#include "server.h"
+
+using namespace curfil;
+
+static const int NUM_THREADS = 4;
+static const std::string folderOutput("test.out");
+
+BOOST_AUTO_TEST_SUITE(ServerTest)
+
+static std::string getFolderTraining() {
+    if (boost::unit_test::framework::master_test_suite().argc < 2) {
+        throw std::runtime_error("please specify folder with testdata");
+    }
+    return boost::unit_test::framework::master_test_suite().argv[1];
+}
+
+static void readFully(int fd, void* buffer, size_t size) {
+    uint8_t* ptr = reinterpret_cast<uint8_t*>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = read(fd, ptr + done, size - done);
+        BOOST_REQUIRE(n > 0);
+        done += n;
+    }
+}
+
+static void writeFully(int fd, const void* buffer, size_t size) {
+    const uint8_t* ptr = reinterpret_cast<const uint8_t*>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, ptr + done, size - done);
+        BOOST_REQUIRE(n > 0);
+        done += n;
+    }
+}
+
+// the server creates the socket in its own thread
+static int connectToServer(const std::string& socketPath) {
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        BOOST_REQUIRE(fd >= 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        tbb::this_tbb_thread::sleep(tbb::tick_count::interval_t(0.01));
+    }
+
+    throw std::runtime_error("failed to connect to the prediction server on " + socketPath);
+}
+
+static void createFrame(int width, int height, std::vector<uint8_t>& colors, std::vector<uint16_t>& depths) {
+    colors.resize(3 * width * height);
+    depths.resize(width * height);
+    for (size_t i = 0; i < colors.size(); i++) {
+        colors[i] = rand() % 256;
+    }
+    for (size_t i = 0; i < depths.size(); i++) {
+        // some pixels without depth
+        depths[i] = (rand() % 10 == 0) ? 0 : 500 + rand() % 4000;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testPredictRequests) {
+    const bool useCIELab = true;
+    const bool useDepthFilling = false;
+
+    std::vector<LabeledRGBDImage> trainImages;
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training1_colors.png", useCIELab, useDepthFilling));
+    trainImages.push_back(loadImagePair(getFolderTraining() + "/training2_colors.png", useCIELab, useDepthFilling));
+
+    tbb::task_scheduler_init init(NUM_THREADS);
+
+    unsigned int samplesPerImage = 500;
+    unsigned int featureCount = 100;
+    unsigned int minSampleCount = 100;
+    int maxDepth = 8;
+    uint16_t boxRadius = 127;
+    uint16_t regionSize = 16;
+    uint16_t thresholds = 20;
+    int maxImages = 10;
+    int imageCacheSize = 10;
+    unsigned int maxSamplesPerBatch = 5000;
+    AccelerationMode accelerationMode = AccelerationMode::GPU_ONLY;
+
+    const int SEED = 4711;
+
+    TrainingConfiguration configuration(SEED, samplesPerImage, featureCount, minSampleCount, maxDepth, boxRadius,
+            regionSize, thresholds, NUM_THREADS, maxImages, imageCacheSize, maxSamplesPerBatch, accelerationMode);
+
+    RandomForestImage randomForest(2, configuration);
+    randomForest.train(trainImages);
+    randomForest.normalizeHistograms(0.0);
+
+    boost::filesystem::create_directory(folderOutput);
+    const std::string socketPath = folderOutput + "/server_test.sock";
+
+    const size_t maxBatchSize = 4;
+    const int deviceId = 0;
+    PredictionServer server(randomForest, socketPath, useDepthFilling, maxBatchSize, deviceId);
+
+    tbb::tbb_thread serverThread([&server]() {
+        server.run();
+    });
+
+    const int fd = connectToServer(socketPath);
+
+    srand(4711);
+
+    // the second request has a different size than the first one
+    const int sizes[][2] = { { 64, 48 }, { 40, 30 } };
+    for (const auto& size : sizes) {
+        const int width = size[0];
+        const int height = size[1];
+
+        std::vector<uint8_t> colors;
+        std::vector<uint16_t> depths;
+        createFrame(width, height, colors, depths);
+
+        const uint32_t header[] = { PredictionServer::REQUEST_MAGIC, static_cast<uint32_t>(width),
+                static_cast<uint32_t>(height) };
+        writeFully(fd, header, sizeof(header));
+        writeFully(fd, &colors[0], colors.size());
+        writeFully(fd, &depths[0], depths.size() * sizeof(uint16_t));
+
+        uint32_t responseHeader[5];
+        readFully(fd, responseHeader, sizeof(responseHeader));
+        BOOST_REQUIRE_EQUAL(PredictionServer::RESPONSE_MAGIC, responseHeader[0]);
+        BOOST_REQUIRE_EQUAL(0u, responseHeader[1]);
+        BOOST_REQUIRE_EQUAL(static_cast<uint32_t>(width), responseHeader[2]);
+        BOOST_REQUIRE_EQUAL(static_cast<uint32_t>(height), responseHeader[3]);
+
+        std::vector<LabelType> labels(width * height);
+        readFully(fd, &labels[0], labels.size() * sizeof(LabelType));
+
+        const RGBDImage image(width, height, &colors[0], &depths[0], useCIELab, useDepthFilling);
+        const LabelImage prediction = randomForest.predict(image);
+
+        size_t differentLabels = 0;
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                if (prediction.getLabel(x, y) != labels[y * width + x]) {
+                    differentLabels++;
+                }
+            }
+        }
+        BOOST_CHECK_EQUAL(0lu, differentLabels);
+    }
+
+    close(fd);
+
+    server.stop();
+    serverThread.join();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
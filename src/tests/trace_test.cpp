@@ -0,0 +1,203 @@
+#define BOOST_TEST_MODULE example
+
+#include <boost/foreach.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/test/included/unit_test.hpp>
+#include <cuda_runtime_api.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+#include "utils.h"
+
+BOOST_AUTO_TEST_SUITE(TraceTest)
+
+using namespace curfil;
+
+static std::vector<trace::Event> eventsNamed(const std::vector<trace::Event>& events, const std::string& name) {
+    std::vector<trace::Event> result;
+    for (size_t i = 0; i < events.size(); i++) {
+        if (name == events[i].name) {
+            result.push_back(events[i]);
+        }
+    }
+    return result;
+}
+
+static trace::Event makeEvent(const char* name, trace::Category category, int64_t begin, int64_t end, int level,
+        int device) {
+    trace::Event event;
+    event.name = name;
+    event.category = category;
+    event.begin = begin;
+    event.end = end;
+    event.level = level;
+    event.arg = -1;
+    event.thread = 0;
+    event.device = device;
+    event.stream = NULL;
+    return event;
+}
+
+BOOST_AUTO_TEST_CASE(testDisabled) {
+    trace::enable();
+    trace::disable();
+    {
+        trace::Scope scope("disabled scope");
+    }
+    BOOST_CHECK(eventsNamed(trace::collect(), "disabled scope").empty());
+}
+
+BOOST_AUTO_TEST_CASE(testScope) {
+    trace::enable();
+    {
+        trace::LevelScope level(3);
+        trace::Scope scope("outer", trace::HOST, 7);
+        {
+            trace::Scope wait("inner", trace::WAIT);
+        }
+    }
+    {
+        trace::Scope scope("outer");
+    }
+    trace::disable();
+
+    const std::vector<trace::Event> events = trace::collect();
+    BOOST_REQUIRE_EQUAL(3lu, events.size());
+
+    const std::vector<trace::Event> outer = eventsNamed(events, "outer");
+    BOOST_REQUIRE_EQUAL(2lu, outer.size());
+    BOOST_CHECK_EQUAL(3, outer[0].level);
+    BOOST_CHECK_EQUAL(7, outer[0].arg);
+    BOOST_CHECK_EQUAL(-1, outer[0].device);
+    BOOST_CHECK_EQUAL(-1, outer[1].level);
+    BOOST_CHECK_LE(outer[0].end, outer[1].begin);
+
+    const std::vector<trace::Event> inner = eventsNamed(events, "inner");
+    BOOST_REQUIRE_EQUAL(1lu, inner.size());
+    BOOST_CHECK_EQUAL(trace::WAIT, inner[0].category);
+    BOOST_CHECK_EQUAL(3, inner[0].level);
+    BOOST_CHECK_LE(outer[0].begin, inner[0].begin);
+    BOOST_CHECK_LE(inner[0].end, outer[0].end);
+}
+
+BOOST_AUTO_TEST_CASE(testRingBuffer) {
+    trace::enable(4);
+    for (int i = 0; i < 10; i++) {
+        trace::record("event", trace::HOST, i, i + 1, i);
+    }
+    trace::disable();
+
+    const std::vector<trace::Event> events = trace::collect();
+    BOOST_REQUIRE_EQUAL(4lu, events.size());
+    BOOST_CHECK_EQUAL(6lu, trace::getNumDroppedEvents());
+
+    // the oldest events are overwritten
+    for (size_t i = 0; i < events.size(); i++) {
+        BOOST_CHECK_EQUAL(static_cast<int>(6 + i), events[i].arg);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(testProfile) {
+    trace::enable();
+    {
+        utils::Profile profile("profiled scope");
+    }
+    trace::disable();
+
+    BOOST_CHECK_EQUAL(1lu, eventsNamed(trace::collect(), "profiled scope").size());
+    BOOST_CHECK(trace::intern("profiled scope") == trace::intern(std::string("profiled") + " scope"));
+}
+
+BOOST_AUTO_TEST_CASE(testSummary) {
+    std::vector<trace::Event> events;
+    events.push_back(makeEvent("transfer", trace::TRANSFER, 0, 100, 2, 0));
+    events.push_back(makeEvent("kernel", trace::KERNEL, 50, 150, 2, 0));
+    events.push_back(makeEvent("kernel", trace::KERNEL, 120, 200, 2, 0));
+    events.push_back(makeEvent("texture mutex", trace::WAIT, 10, 30, 2, -1));
+    events.push_back(makeEvent("load image", trace::HOST, 0, 1000, -1, -1));
+
+    const std::string summary = trace::summarize(events);
+    BOOST_TEST_MESSAGE(summary);
+
+    BOOST_CHECK(summary.find("level 2: 0.100 ms transfers, 0.150 ms kernels, 0.050 ms overlapping "
+            "(50.0% of the transfers)") != std::string::npos);
+    BOOST_CHECK(summary.find("without level: 0.000 ms transfers") != std::string::npos);
+    BOOST_CHECK(summary.find("2 times, total 0.180 ms, mean 0.090 ms, max 0.100 ms") != std::string::npos);
+    BOOST_CHECK(summary.find("texture mutex") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(testChromeTrace) {
+    std::vector<trace::Event> events;
+    events.push_back(makeEvent("transfer \"quoted\"", trace::TRANSFER, 0, 100, 1, 0));
+    events.push_back(makeEvent("kernel", trace::KERNEL, 50, 150, 1, 0));
+    events.push_back(makeEvent("host", trace::HOST, 0, 10, 1, -1));
+
+    std::stringstream json;
+    trace::writeChromeTrace(json, events);
+
+    boost::property_tree::ptree pt;
+    boost::property_tree::read_json(json, pt);
+
+    size_t numSpans = 0;
+    size_t numMetadata = 0;
+    BOOST_FOREACH(const boost::property_tree::ptree::value_type& v, pt.get_child("traceEvents")) {
+        const std::string phase = v.second.get<std::string>("ph");
+        if (phase == "X") {
+            numSpans++;
+            if (v.second.get<std::string>("name") == "kernel") {
+                BOOST_CHECK_EQUAL(50, v.second.get<int>("ts"));
+                BOOST_CHECK_EQUAL(100, v.second.get<int>("dur"));
+                BOOST_CHECK_EQUAL(1, v.second.get<int>("pid"));
+                BOOST_CHECK_EQUAL(1, v.second.get<int>("args.level"));
+            }
+        } else {
+            BOOST_CHECK_EQUAL("M", phase);
+            numMetadata++;
+        }
+    }
+    BOOST_CHECK_EQUAL(3lu, numSpans);
+    // host process, one GPU and its stream
+    BOOST_CHECK_EQUAL(3lu, numMetadata);
+}
+
+BOOST_AUTO_TEST_CASE(testGpuSpan) {
+    const size_t size = 16 * 1024 * 1024;
+    void* buffer;
+    cudaSafeCall(cudaMalloc(&buffer, size));
+
+    cudaStream_t stream;
+    cudaSafeCall(cudaStreamCreate(&stream));
+
+    trace::enable();
+    {
+        trace::LevelScope level(1);
+        for (int i = 0; i < 10; i++) {
+            trace::GpuSpan span("memset", stream, trace::KERNEL, i);
+            cudaSafeCall(cudaMemsetAsync(buffer, i, size, stream));
+        }
+    }
+    trace::disable();
+
+    const std::vector<trace::Event> events = eventsNamed(trace::collect(), "memset");
+    BOOST_REQUIRE_EQUAL(10lu, events.size());
+
+    for (size_t i = 0; i < events.size(); i++) {
+        BOOST_CHECK_EQUAL(static_cast<int>(i), events[i].arg);
+        BOOST_CHECK_EQUAL(1, events[i].level);
+        BOOST_CHECK_GE(events[i].device, 0);
+        BOOST_CHECK(events[i].stream == stream);
+        BOOST_CHECK_LE(events[i].begin, events[i].end);
+        if (i > 0) {
+            // the spans of a stream do not overlap
+            BOOST_CHECK_LE(events[i - 1].end, events[i].begin + 1);
+        }
+    }
+
+    cudaSafeCall(cudaStreamDestroy(stream));
+    cudaSafeCall(cudaFree(buffer));
+}
+
+BOOST_AUTO_TEST_SUITE_END()